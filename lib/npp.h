@@ -191,6 +191,9 @@ typedef char                            QSVAL_TEXT[NPP_QSBUF_TEXT];
         #define NPP_FD_MON_SELECT
     #elif defined NPP_FD_MON_LINUX_POLL
         #define NPP_FD_MON_POLL
+    #elif defined NPP_FD_MON_LINUX_IO_URING
+        #define NPP_FD_MON_EPOLL    /* fallback if io_uring isn't available at runtime */
+        #define NPP_FD_MON_IO_URING
     #else
         #define NPP_FD_MON_EPOLL /* default */
     #endif
@@ -303,7 +306,7 @@ typedef char                            QSVAL_TEXT[NPP_QSBUF_TEXT];
 #define NPP_UA_TYPE_MOB                 (char)2         /* phone (small screen) */
 
 
-#define NPP_PROTOCOL                    (NPP_CONN_IS_SECURE(G_connections[ci].flags)?"https":"http")
+#define NPP_PROTOCOL                    (NPP_CONN_IS_SECURE(G_conn_hot[ci].flags)?"https":"http")
 
 
 /* defaults */
@@ -346,64 +349,75 @@ typedef char                            QSVAL_TEXT[NPP_QSBUF_TEXT];
 /* response headers */
 
 /* HTTP header -- resets respbuf! */
-#define PRINT_HTTP_STATUS(val)              (sprintf(G_tmp, "HTTP/1.1 %d %s\r\n", val, get_http_descr(val)), HOUT(G_tmp))
+/* constant lines are prebuilt, only the variable parts are formatted */
+#define PRINT_HTTP_STATUS(val)              http_hdr_status(ci, val)
 #define PRINT_HTTP2_STATUS(val)             http2_hdr_status(ci, val)
 
 /* date */
-#define PRINT_HTTP_DATE                     (sprintf(G_tmp, "Date: %s\r\n", G_header_date), HOUT(G_tmp))
+#define PRINT_HTTP_DATE                     http_hdr_date(ci)
 #define PRINT_HTTP2_DATE                    http2_hdr_date(ci)
 
 /* redirection */
-#define PRINT_HTTP_LOCATION                 (sprintf(G_tmp, "Location: %s\r\n", G_connections[ci].location), HOUT(G_tmp))
+#define PRINT_HTTP_LOCATION                 (HOUT_CONST("Location: "), HOUT(G_connections[ci].cold->location), HOUT_CONST("\r\n"))
 #define PRINT_HTTP2_LOCATION                http2_hdr_location(ci)
 
 /* content type */
-#define PRINT_HTTP_CONTENT_TYPE(val)        (sprintf(G_tmp, "Content-Type: %s\r\n", val), HOUT(G_tmp))
+#define PRINT_HTTP_CONTENT_TYPE(val)        (HOUT_CONST("Content-Type: "), HOUT(val), HOUT_CONST("\r\n"))
 #define PRINT_HTTP2_CONTENT_TYPE(val)       http2_hdr_content_type(ci, val)
 
 /* content disposition */
-#define PRINT_HTTP_CONTENT_DISP(val)        (sprintf(G_tmp, "Content-Disposition: %s\r\n", val), HOUT(G_tmp))
+#define PRINT_HTTP_CONTENT_DISP(val)        (HOUT_CONST("Content-Disposition: "), HOUT(val), HOUT_CONST("\r\n"))
 #define PRINT_HTTP2_CONTENT_DISP(val)       http2_hdr_content_disp(ci, val)
 
 /* cache control */
-#define PRINT_HTTP_CACHE_PUBLIC             HOUT("Cache-Control: public, max-age=31536000\r\n")
+#define PRINT_HTTP_CACHE_PUBLIC             HOUT_CONST("Cache-Control: public, max-age=31536000\r\n")
 #define PRINT_HTTP2_CACHE_PUBLIC            http2_hdr_cache_ctrl_public(ci)
 
-#define PRINT_HTTP_NO_CACHE                 HOUT("Cache-Control: private, must-revalidate, no-store, no-cache, max-age=0\r\n")
+#define PRINT_HTTP_NO_CACHE                 HOUT_CONST("Cache-Control: private, must-revalidate, no-store, no-cache, max-age=0\r\n")
 #define PRINT_HTTP2_NO_CACHE                http2_hdr_cache_ctrl_private(ci)
 
-#define PRINT_HTTP_EXPIRES_STATICS          (sprintf(G_tmp, "Expires: %s\r\n", M_expires_stat), HOUT(G_tmp))
+#define PRINT_HTTP_EXPIRES_STATICS          (HOUT_CONST("Expires: "), HOUT(M_expires_stat), HOUT_CONST("\r\n"))
 #define PRINT_HTTP2_EXPIRES_STATICS         http2_hdr_expires_statics(ci)
 
-#define PRINT_HTTP_EXPIRES_GENERATED        (sprintf(G_tmp, "Expires: %s\r\n", M_expires_gen), HOUT(G_tmp))
+#define PRINT_HTTP_EXPIRES_GENERATED        (HOUT_CONST("Expires: "), HOUT(M_expires_gen), HOUT_CONST("\r\n"))
 #define PRINT_HTTP2_EXPIRES_GENERATED       http2_hdr_expires_gen(ci)
 
-#define PRINT_HTTP_LAST_MODIFIED(val)       (sprintf(G_tmp, "Last-Modified: %s\r\n", val), HOUT(G_tmp))
+#define PRINT_HTTP_LAST_MODIFIED(val)       (HOUT_CONST("Last-Modified: "), HOUT(val), HOUT_CONST("\r\n"))
 #define PRINT_HTTP2_LAST_MODIFIED(val)      http2_hdr_last_modified(ci, val)
 
+#define PRINT_HTTP_ETAG(val)                (HOUT_CONST("ETag: "), HOUT(val), HOUT_CONST("\r\n"))
+
+/* ranges */
+#define PRINT_HTTP_ACCEPT_RANGES            HOUT_CONST("Accept-Ranges: bytes\r\n")
+#define PRINT_HTTP_CONTENT_RANGE(first, last, len) (HOUT_CONST("Content-Range: bytes "), HOUT_UINT(first), HOUT_CONST("-"), HOUT_UINT(last), HOUT_CONST("/"), HOUT_UINT(len), HOUT_CONST("\r\n"))
+#define PRINT_HTTP_CONTENT_RANGE_UNSAT(len) (HOUT_CONST("Content-Range: bytes */"), HOUT_UINT(len), HOUT_CONST("\r\n"))
+#define PRINT_HTTP2_ETAG(val)               http2_hdr_etag(ci, val)
+
 /* connection */
-#define PRINT_HTTP_CONNECTION               (sprintf(G_tmp, "Connection: %s\r\n", NPP_CONN_IS_KEEP_ALIVE(G_connections[ci].flags)?"keep-alive":"close"), HOUT(G_tmp))
+#define PRINT_HTTP_CONNECTION               (NPP_CONN_IS_KEEP_ALIVE(G_conn_hot[ci].flags)?HOUT_CONST("Connection: keep-alive\r\n"):HOUT_CONST("Connection: close\r\n"))
 
 /* vary */
-#define PRINT_HTTP_VARY_DYN                 HOUT("Vary: Accept-Encoding, User-Agent\r\n")
+#define PRINT_HTTP_VARY_DYN                 HOUT_CONST("Vary: Accept-Encoding, User-Agent\r\n")
 #define PRINT_HTTP2_VARY_DYN                http2_hdr_vary(ci, "Accept-Encoding, User-Agent")
 
-#define PRINT_HTTP_VARY_STAT                HOUT("Vary: Accept-Encoding\r\n")
+#define PRINT_HTTP_VARY_STAT                HOUT_CONST("Vary: Accept-Encoding\r\n")
 #define PRINT_HTTP2_VARY_STAT               http2_hdr_vary(ci, "Accept-Encoding")
 
-#define PRINT_HTTP_VARY_UIR                 HOUT("Vary: Upgrade-Insecure-Requests\r\n")
+#define PRINT_HTTP_VARY_UIR                 HOUT_CONST("Vary: Upgrade-Insecure-Requests\r\n")
 #define PRINT_HTTP2_VARY_UIR                http2_hdr_vary(ci, "Upgrade-Insecure-Requests")
 
 /* content language */
-#define PRINT_HTTP_LANGUAGE(val)            (sprintf(G_tmp, "Content-Language: %s\r\n", val), HOUT(G_tmp))
+#define PRINT_HTTP_LANGUAGE(val)            (HOUT_CONST("Content-Language: "), HOUT(val), HOUT_CONST("\r\n"))
 #define PRINT_HTTP2_LANGUAGE(val)           http2_hdr_content_lang(ci, val)
 
 /* content length */
-#define PRINT_HTTP_CONTENT_LEN(len)         (sprintf(G_tmp, "Content-Length: %u\r\n", len), HOUT(G_tmp))
+#define PRINT_HTTP_CONTENT_LEN(len)         (HOUT_CONST("Content-Length: "), HOUT_UINT(len), HOUT_CONST("\r\n"))
 #define PRINT_HTTP2_CONTENT_LEN(len)        http2_hdr_content_len(ci, len)
+#define PRINT_HTTP_CHUNKED                  HOUT_CONST("Transfer-Encoding: chunked\r\n")
 
 /* content encoding */
-#define PRINT_HTTP_CONTENT_ENCODING_DEFLATE HOUT("Content-Encoding: deflate\r\n")
+#define PRINT_HTTP_CONTENT_ENCODING(enc)    (HOUT_CONST("Content-Encoding: "), HOUT(enc), HOUT_CONST("\r\n"))
+#define PRINT_HTTP_CONTENT_ENCODING_DEFLATE HOUT_CONST("Content-Encoding: deflate\r\n")
 #define PRINT_HTTP2_CONTENT_ENCODING_DEFLATE http2_hdr_content_enc_deflate(ci)
 
 /* Security ------------------------------------------------------------------ */
@@ -415,10 +429,10 @@ typedef char                            QSVAL_TEXT[NPP_QSBUF_TEXT];
 #endif
 
 #ifdef NPP_HSTS_INCLUDE_SUBDOMAINS
-#define PRINT_HTTP_HSTS                     (sprintf(G_tmp, "Strict-Transport-Security: max-age=%d; includesubdomains\r\n", NPP_HSTS_MAX_AGE), HOUT(G_tmp))
+#define PRINT_HTTP_HSTS                     (HOUT_CONST("Strict-Transport-Security: max-age="), HOUT_UINT(NPP_HSTS_MAX_AGE), HOUT_CONST("; includesubdomains\r\n"))
 #define PRINT_HTTP2_HSTS
 #else
-#define PRINT_HTTP_HSTS                     (sprintf(G_tmp, "Strict-Transport-Security: max-age=%d\r\n", NPP_HSTS_MAX_AGE), HOUT(G_tmp))
+#define PRINT_HTTP_HSTS                     (HOUT_CONST("Strict-Transport-Security: max-age="), HOUT_UINT(NPP_HSTS_MAX_AGE), HOUT_CONST("\r\n"))
 #define PRINT_HTTP2_HSTS
 #endif
 
@@ -434,51 +448,51 @@ typedef char                            QSVAL_TEXT[NPP_QSBUF_TEXT];
 
 #ifdef NPP_HSTS_ON
 
-#define PRINT_HTTP_COOKIE_A(ci)             (sprintf(G_tmp, "Set-Cookie: as=%s; %shttponly\r\n", G_connections[ci].cookie_out_a, G_test?"":"secure; "), HOUT(G_tmp))
+#define PRINT_HTTP_COOKIE_A(ci)             (HOUT_CONST("Set-Cookie: as="), HOUT(G_connections[ci].cookie_out_a), HOUT(G_test?"; httponly\r\n":"; secure; httponly\r\n"))
 #define PRINT_HTTP2_COOKIE_A(ci)            (sprintf(G_tmp, "as=%s; %shttponly", G_connections[ci].cookie_out_a, G_test?"":"secure; "), http2_hdr_set_cookie(ci, G_tmp))
 
-#define PRINT_HTTP_COOKIE_L(ci)             (sprintf(G_tmp, "Set-Cookie: ls=%s; %shttponly\r\n", G_connections[ci].cookie_out_l, G_test?"":"secure; "), HOUT(G_tmp))
+#define PRINT_HTTP_COOKIE_L(ci)             (HOUT_CONST("Set-Cookie: ls="), HOUT(G_connections[ci].cookie_out_l), HOUT(G_test?"; httponly\r\n":"; secure; httponly\r\n"))
 #define PRINT_HTTP2_COOKIE_L(ci)            (sprintf(G_tmp, "ls=%s; %shttponly", G_connections[ci].cookie_out_l, G_test?"":"secure; "), http2_hdr_set_cookie(ci, G_tmp))
 
-#define PRINT_HTTP_COOKIE_A_EXP(ci)         (sprintf(G_tmp, "Set-Cookie: as=%s; expires=%s; %shttponly\r\n", G_connections[ci].cookie_out_a, G_connections[ci].cookie_out_a_exp, G_test?"":"secure; "), HOUT(G_tmp))
+#define PRINT_HTTP_COOKIE_A_EXP(ci)         (HOUT_CONST("Set-Cookie: as="), HOUT(G_connections[ci].cookie_out_a), HOUT_CONST("; expires="), HOUT(G_connections[ci].cookie_out_a_exp), HOUT(G_test?"; httponly\r\n":"; secure; httponly\r\n"))
 #define PRINT_HTTP2_COOKIE_A_EXP(ci)        (sprintf(G_tmp, "as=%s; expires=%s; %shttponly", G_connections[ci].cookie_out_a, G_connections[ci].cookie_out_a_exp, G_test?"":"secure; "), http2_hdr_set_cookie(ci, G_tmp))
 
-#define PRINT_HTTP_COOKIE_L_EXP(ci)         (sprintf(G_tmp, "Set-Cookie: ls=%s; expires=%s; %shttponly\r\n", G_connections[ci].cookie_out_l, G_connections[ci].cookie_out_l_exp, G_test?"":"secure; "), HOUT(G_tmp))
+#define PRINT_HTTP_COOKIE_L_EXP(ci)         (HOUT_CONST("Set-Cookie: ls="), HOUT(G_connections[ci].cookie_out_l), HOUT_CONST("; expires="), HOUT(G_connections[ci].cookie_out_l_exp), HOUT(G_test?"; httponly\r\n":"; secure; httponly\r\n"))
 #define PRINT_HTTP2_COOKIE_L_EXP(ci)        (sprintf(G_tmp, "ls=%s; expires=%s; %shttponly", G_connections[ci].cookie_out_l, G_connections[ci].cookie_out_l_exp, G_test?"":"secure; "), http2_hdr_set_cookie(ci, G_tmp))
 
 #else   /* HSTS is off */
 
-#define PRINT_HTTP_COOKIE_A(ci)             (sprintf(G_tmp, "Set-Cookie: as=%s; httponly\r\n", G_connections[ci].cookie_out_a), HOUT(G_tmp))
+#define PRINT_HTTP_COOKIE_A(ci)             (HOUT_CONST("Set-Cookie: as="), HOUT(G_connections[ci].cookie_out_a), HOUT_CONST("; httponly\r\n"))
 #define PRINT_HTTP2_COOKIE_A(ci)            (sprintf(G_tmp, "as=%s; httponly", G_connections[ci].cookie_out_a), http2_hdr_set_cookie(ci, G_tmp))
 
-#define PRINT_HTTP_COOKIE_L(ci)             (sprintf(G_tmp, "Set-Cookie: ls=%s; httponly\r\n", G_connections[ci].cookie_out_l), HOUT(G_tmp))
+#define PRINT_HTTP_COOKIE_L(ci)             (HOUT_CONST("Set-Cookie: ls="), HOUT(G_connections[ci].cookie_out_l), HOUT_CONST("; httponly\r\n"))
 #define PRINT_HTTP2_COOKIE_L(ci)            (sprintf(G_tmp, "ls=%s; httponly", G_connections[ci].cookie_out_l), http2_hdr_set_cookie(ci, G_tmp))
 
-#define PRINT_HTTP_COOKIE_A_EXP(ci)         (sprintf(G_tmp, "Set-Cookie: as=%s; expires=%s; httponly\r\n", G_connections[ci].cookie_out_a, G_connections[ci].cookie_out_a_exp), HOUT(G_tmp))
+#define PRINT_HTTP_COOKIE_A_EXP(ci)         (HOUT_CONST("Set-Cookie: as="), HOUT(G_connections[ci].cookie_out_a), HOUT_CONST("; expires="), HOUT(G_connections[ci].cookie_out_a_exp), HOUT_CONST("; httponly\r\n"))
 #define PRINT_HTTP2_COOKIE_A_EXP(ci)        (sprintf(G_tmp, "as=%s; expires=%s; httponly", G_connections[ci].cookie_out_a, G_connections[ci].cookie_out_a_exp), http2_hdr_set_cookie(ci, G_tmp))
 
-#define PRINT_HTTP_COOKIE_L_EXP(ci)         (sprintf(G_tmp, "Set-Cookie: ls=%s; expires=%s; httponly\r\n", G_connections[ci].cookie_out_l, G_connections[ci].cookie_out_l_exp), HOUT(G_tmp))
+#define PRINT_HTTP_COOKIE_L_EXP(ci)         (HOUT_CONST("Set-Cookie: ls="), HOUT(G_connections[ci].cookie_out_l), HOUT_CONST("; expires="), HOUT(G_connections[ci].cookie_out_l_exp), HOUT_CONST("; httponly\r\n"))
 #define PRINT_HTTP2_COOKIE_L_EXP(ci)        (sprintf(G_tmp, "ls=%s; expires=%s; httponly", G_connections[ci].cookie_out_l, G_connections[ci].cookie_out_l_exp), http2_hdr_set_cookie(ci, G_tmp))
 
 #endif  /* NPP_HSTS_ON */
 
 /* framing */
-#define PRINT_HTTP_SAMEORIGIN               HOUT("X-Frame-Options: SAMEORIGIN\r\n")
+#define PRINT_HTTP_SAMEORIGIN               HOUT_CONST("X-Frame-Options: SAMEORIGIN\r\n")
 #define PRINT_HTTP2_SAMEORIGIN              //http2_hdr_sameorigin(ci)
 
 /* content type guessing */
-#define PRINT_HTTP_NOSNIFF                  HOUT("X-Content-Type-Options: nosniff\r\n")
+#define PRINT_HTTP_NOSNIFF                  HOUT_CONST("X-Content-Type-Options: nosniff\r\n")
 #define PRINT_HTTP2_NOSNIFF                 //http2_hdr_nosniff(ci)
 
 /* identity */
-#define PRINT_HTTP_SERVER                   HOUT("Server: Node++\r\n")
+#define PRINT_HTTP_SERVER                   HOUT_CONST("Server: Node++\r\n")
 #define PRINT_HTTP2_SERVER                  http2_hdr_server(ci)
 
 /* HTTP/2 */
 #define PRINT_HTTP2_UPGRADE_CLEAR           HOUT("Connection: Upgrade\r\nUpgrade: h2c\r\n")
 
 /* must be last! */
-#define PRINT_HTTP_END_OF_HEADER            HOUT("\r\n")
+#define PRINT_HTTP_END_OF_HEADER            HOUT_CONST("\r\n")
 
 
 #define NPP_HTTP2_ALPHA                     NPP_HTTP2
@@ -696,6 +710,18 @@ typedef char                            QSVAL_TEXT[NPP_QSBUF_TEXT];
 #define NPP_MAX_PAYLOAD_SIZE                16777216        /* max incoming payload data length (16 MiB) */
 #endif
 
+#ifndef NPP_PAYLOAD_SPOOL_THRESHOLD
+#define NPP_PAYLOAD_SPOOL_THRESHOLD         1048576         /* payloads above that are spooled to NPP_PAYLOAD_SPOOL_DIR (1 MiB) */
+#endif
+
+#ifndef NPP_MAX_SPOOLED_PAYLOAD_SIZE
+#define NPP_MAX_SPOOLED_PAYLOAD_SIZE        134217728       /* max incoming payload data length when spooled (128 MiB) */
+#endif
+
+#ifndef NPP_MAX_SPOOLED_TOTAL
+#define NPP_MAX_SPOOLED_TOTAL               1073741824      /* max payload data spooled at a time, per process (1 GiB) */
+#endif
+
 #ifndef NPP_MAX_LOG_STR_LEN
 #define NPP_MAX_LOG_STR_LEN                 4095            /* max log string length */
 #endif
@@ -728,6 +754,62 @@ typedef char                            QSVAL_TEXT[NPP_QSBUF_TEXT];
 #define NPP_SESSION_TIMEOUT                 600             /* anonymous session timeout in seconds */
 #endif
 
+#ifndef NPP_SSE_HEARTBEAT
+#define NPP_SSE_HEARTBEAT                   15              /* seconds of silence on event stream before sending a comment */
+#endif
+
+#ifndef NPP_WS_PING
+#define NPP_WS_PING                         30              /* seconds of silence on WebSocket before sending a ping */
+#endif
+
+#ifndef NPP_WS_MAX_MESSAGE
+#define NPP_WS_MAX_MESSAGE                  1048576         /* max incoming WebSocket message length */
+#endif
+
+#ifndef NPP_MAX_PUSH_QUEUED
+#define NPP_MAX_PUSH_QUEUED                 1048576         /* max events / frames bytes waiting for a slow client before it's closed */
+#endif
+
+#ifndef NPP_SSE_GROUPS
+#define NPP_SSE_GROUPS                      64              /* event stream group lists (group % NPP_SSE_GROUPS) */
+#endif
+
+#ifndef NPP_HOUSEKEEPING_BUDGET
+#define NPP_HOUSEKEEPING_BUDGET             10000           /* max connection / session slots checked per housekeeping tick */
+#endif
+
+#ifndef NPP_TEST_RESCAN_BUSY
+#define NPP_TEST_RESCAN_BUSY                10              /* seconds between test=1 resources rescans under load (no inotify) */
+#endif
+
+#ifndef NPP_ACCEPT_BUDGET
+#define NPP_ACCEPT_BUDGET                   64              /* max connections accepted per listening socket readiness */
+#endif
+
+#ifndef NPP_URING_BUFS
+#define NPP_URING_BUFS                      1024            /* io_uring provided receive buffers per worker (power of 2) */
+#endif
+
+#ifndef NPP_URING_BUF_SIZE
+#define NPP_URING_BUF_SIZE                  4096            /* io_uring provided receive buffer size */
+#endif
+
+#ifndef NPP_URING_CONN_BUFS
+#define NPP_URING_CONN_BUFS                 16              /* max received buffers held per connection before io_uring stops receiving */
+#endif
+
+#ifndef NPP_OUT_BUF_POOL
+#define NPP_OUT_BUF_POOL                    32              /* idle output buffers kept for reuse */
+#endif
+
+#ifndef NPP_CONN_COLD_POOL
+#define NPP_CONN_COLD_POOL                  32              /* idle npp_conn_cold_t kept for reuse */
+#endif
+
+#ifndef NPP_MAX_WORKERS
+#define NPP_MAX_WORKERS                     64              /* max npp_app worker processes (workers in npp.conf) */
+#endif
+
 #ifndef NPP_MAX_BLACKLIST
 #define NPP_MAX_BLACKLIST                   10000           /* IP blacklist length */
 #endif
@@ -769,7 +851,42 @@ typedef char                            QSVAL_TEXT[NPP_QSBUF_TEXT];
 #endif
 
 #ifndef NPP_COMPRESS_LEVEL
-#define NPP_COMPRESS_LEVEL                  Z_BEST_SPEED
+#define NPP_COMPRESS_LEVEL                  Z_BEST_SPEED    /* generated content, per request, starting level */
+#endif
+
+#ifndef NPP_COMPRESS_LEVEL_MAX
+#define NPP_COMPRESS_LEVEL_MAX              6               /* generated content, the most when the event loop is idle */
+#endif
+
+#ifndef NPP_COMPRESS_TRESHOLD_MAX
+#define NPP_COMPRESS_TRESHOLD_MAX           65536           /* bytes, generated content, the most when the event loop is saturated */
+#endif
+
+#ifndef NPP_COMPRESS_LOOP_BUSY
+#define NPP_COMPRESS_LOOP_BUSY              80              /* event loop utilisation % above which to compress cheaper */
+#endif
+
+#ifndef NPP_COMPRESS_LOOP_IDLE
+#define NPP_COMPRESS_LOOP_IDLE              30              /* event loop utilisation % below which to compress harder */
+#endif
+
+#ifndef NPP_COMPRESS_LEVEL_STATICS
+#define NPP_COMPRESS_LEVEL_STATICS          Z_BEST_COMPRESSION  /* statics, once at load time */
+#endif
+
+#ifndef NPP_BROTLI_QUALITY_STATICS
+#define NPP_BROTLI_QUALITY_STATICS          11              /* BROTLI_MAX_QUALITY */
+#endif
+
+/* content codecs -- index is the order of preference */
+
+#define NPP_CODEC_DEFLATE                   0
+#define NPP_CODEC_GZIP                      1
+#ifdef NPP_BROTLI
+#define NPP_CODEC_BR                        2
+#define NPP_CODECS                          3
+#else
+#define NPP_CODECS                          2
 #endif
 
 /* static resources */
@@ -778,6 +895,22 @@ typedef char                            QSVAL_TEXT[NPP_QSBUF_TEXT];
 #define NPP_MAX_STATICS                     1000            /* max static resources */
 #endif
 
+#ifndef NPP_LARGE_STATIC
+#define NPP_LARGE_STATIC                    1048576         /* bigger res files are served straight from disk (bytes) */
+#endif
+
+#ifndef NPP_STATICS_CACHE_DIR
+#define NPP_STATICS_CACHE_DIR               "cache"         /* minified and compressed statics, under NPP_DIR, empty = don't cache */
+#endif
+
+#ifndef NPP_PAYLOAD_SPOOL_DIR
+#define NPP_PAYLOAD_SPOOL_DIR               "tmp"           /* large payloads, under NPP_DIR, empty = keep all in memory */
+#endif
+
+#ifndef NPP_LOAD_PROCESSES
+#define NPP_LOAD_PROCESSES                  8               /* max processes building statics cache at startup */
+#endif
+
 #ifndef NPP_MAX_SNIPPETS
 #define NPP_MAX_SNIPPETS                    1000            /* max snippets */
 #endif
@@ -894,7 +1027,7 @@ typedef char                            QSVAL_TEXT[NPP_QSBUF_TEXT];
 #endif
 #endif  /* NPP_FD_MON_SELECT */
 
-#define NPP_CLOSING_SESSION_CI              NPP_MAX_CONNECTIONS+1
+#define NPP_CLOSING_SESSION_CI              (G_maxConnections+1)
 
 #define NPP_NOT_CONNECTED                   -1
 
@@ -928,6 +1061,8 @@ typedef char                            QSVAL_TEXT[NPP_QSBUF_TEXT];
 #define CONN_STATE_WAITING_FOR_ASYNC        'A'
 #define CONN_STATE_READY_TO_SEND_RESPONSE   'R'
 #define CONN_STATE_SENDING_CONTENT          'S'
+#define CONN_STATE_SSE                      'E'             /* event stream open, nothing to send */
+#define CONN_STATE_WEBSOCKET                'W'             /* WebSocket open, nothing to send */
 
 /* HTTP/2 */
 
@@ -986,6 +1121,17 @@ typedef char                            QSVAL_TEXT[NPP_QSBUF_TEXT];
 
 #define NPP_STATIC_PATH_LEN             1023
 
+#define NPP_ETAG_LEN                    47                      /* quoted, with encoding suffix */
+#define NPP_ETAG_CORE_LEN               25                      /* make_etag output: length in hex, '-', 16 hex digits */
+#define NPP_IF_NONE_MATCH_LEN           255
+#define NPP_RANGE_LEN                   255
+
+#define NPP_WS_KEY_LEN                  24                      /* Sec-WebSocket-Key, 16 bytes in base64 */
+
+#ifndef NPP_MAX_RANGES
+#define NPP_MAX_RANGES                  8                       /* more in one request and the whole resource is sent */
+#endif
+
 #define STATIC_SOURCE_INTERNAL          '0'
 #define STATIC_SOURCE_RES               '1'
 #define STATIC_SOURCE_RESMIN            '2'
@@ -1071,9 +1217,9 @@ typedef char                            QSVAL_TEXT[NPP_QSBUF_TEXT];
 #define REQ_DELETE                      (0==strcmp(G_connections[ci].method, "DELETE"))
 #define REQ_OPTIONS                     (0==strcmp(G_connections[ci].method, "OPTIONS"))
 
-#define REQ_URI                         G_connections[ci].uri
-#define REQ_CONTENT_TYPE                G_connections[ci].in_ctypestr
-#define REQ_BOT                         NPP_CONN_IS_BOT(G_connections[ci].flags)
+#define REQ_URI                         G_connections[ci].cold->uri
+#define REQ_CONTENT_TYPE                G_connections[ci].cold->in_ctypestr
+#define REQ_BOT                         NPP_CONN_IS_BOT(G_conn_hot[ci].flags)
 #define REQ_LANG                        G_connections[ci].lang
 
 #define REQ_DSK                         (G_connections[ci].ua_type==NPP_UA_TYPE_DSK)
@@ -1096,6 +1242,12 @@ typedef char                            QSVAL_TEXT[NPP_QSBUF_TEXT];
 
 #define REQ_DATA                        G_connections[ci].in_data
 
+#ifdef NPP_SVC
+#define REQ_WS                          (0==strcmp(G_connections[ci].method, "WS"))     /* message routed with WS_ROUTE */
+#else
+#define REQ_WS                          (G_connections[ci].ws_upgrade && G_connections[ci].ws_key[0])  /* WebSocket upgrade request */
+#endif
+
 #define CALL_HTTP_PASS_HEADER(header)   npp_eng_call_http_pass_header(ci, header)
 
 
@@ -1120,6 +1272,8 @@ typedef char                            QSVAL_TEXT[NPP_QSBUF_TEXT];
 
     #define HOUT(str)                   (G_connections[ci].p_header = stpcpy(G_connections[ci].p_header, str))
     #define HOUT_BIN(data, len)         (memcpy(G_connections[ci].p_header, data, len), G_connections[ci].p_header += len)
+    #define HOUT_CONST(str)             HOUT_BIN(str, sizeof(str)-1)
+    #define HOUT_UINT(val)              (G_connections[ci].p_header = hdr_uint(G_connections[ci].p_header, val))
 
     #ifdef NPP_OUT_FAST
         #define OUTSS(str)                  (G_connections[ci].p_content = stpcpy(G_connections[ci].p_content, str))
@@ -1136,13 +1290,29 @@ typedef char                            QSVAL_TEXT[NPP_QSBUF_TEXT];
 
 #endif  /* NPP_SVC */
 
+/* formatted output goes straight to the output buffer */
+
+#ifdef NPP_SVC
+    #define OUT_FMT(...)                    npp_svc_out_fmt(__VA_ARGS__)
+    #define OUT_INT(val)                    npp_svc_out_int(val)
+#else
+    #define OUT_FMT(...)                    npp_eng_out_fmt(ci, __VA_ARGS__)
+    #define OUT_INT(val)                    npp_eng_out_int(ci, val)
+#endif
+
+#ifdef __GNUC__
+    #define NPP_FORMAT_CHECK(fmt, args)     __attribute__((format(printf, fmt, args)))
+#else
+    #define NPP_FORMAT_CHECK(fmt, args)
+#endif
+
 #ifdef NPP_CPP_STRINGS
     #define OUT(str, ...)                   NPP_CPP_STRINGS_OUT(ci, str, ##__VA_ARGS__)
 #else
 #ifdef _MSC_VER /* Microsoft compiler */
-    #define OUT(...)                        (sprintf(G_tmp, EXPAND_VA(__VA_ARGS__)), OUTSS(G_tmp))
+    #define OUT(...)                        OUT_FMT(EXPAND_VA(__VA_ARGS__))
 #else   /* GCC */
-    #define OUTM(str, ...)                  (sprintf(G_tmp, str, __VA_ARGS__), OUTSS(G_tmp))   /* OUT with multiple args */
+    #define OUTM(str, ...)                  OUT_FMT(str, __VA_ARGS__)   /* OUT with multiple args */
     #define CHOOSE_OUT(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, NAME, ...) NAME          /* single or multiple? */
     #define OUT(...)                        CHOOSE_OUT(__VA_ARGS__, OUTM, OUTM, OUTM, OUTM, OUTM, OUTM, OUTM, OUTM, OUTM, OUTM, OUTM, OUTM, OUTM, OUTSS)(__VA_ARGS__)
 #endif  /* _MSC_VER */
@@ -1153,21 +1323,58 @@ typedef char                            QSVAL_TEXT[NPP_QSBUF_TEXT];
 #define RES_CONTENT_TYPE(str)           npp_lib_set_res_content_type(ci, str)
 #define RES_LOCATION(str, ...)          npp_lib_set_res_location(ci, str, ##__VA_ARGS__)
 #define RES_REDIRECT(str, ...)          RES_LOCATION(str, ##__VA_ARGS__)
-#define RES_KEEP_CONTENT                (G_connections[ci].flags |= NPP_CONN_FLAG_KEEP_CONTENT)
-#define RES_DONT_CACHE                  (G_connections[ci].flags |= NPP_CONN_FLAG_DONT_CACHE)
+#define RES_KEEP_CONTENT                (G_conn_hot[ci].flags |= NPP_CONN_FLAG_KEEP_CONTENT)
+#define RES_DONT_CACHE                  (G_conn_hot[ci].flags |= NPP_CONN_FLAG_DONT_CACHE)
+#ifdef NPP_SVC
+#define RES_ETAG_AUTO                   /* not in services (yet) */
+#define RES_STREAM(callback)            /* not in services */
+#else
+#define RES_ETAG_AUTO                   (G_connections[ci].etag_auto = TRUE)
+#define RES_STREAM(callback)            (G_connections[ci].stream = callback)
+#endif
+
+/* Server-Sent Events */
+
+#ifdef NPP_SVC
+#define SSE_START(group)                FALSE   /* not in services */
+#define SSE_SEND(dest_ci, event, data)  FALSE
+#define SSE_SEND_GROUP(group, event, data) 0
+#else
+#define SSE_START(group)                npp_eng_sse_start(ci, group)
+#define SSE_SEND(dest_ci, event, data)  npp_eng_sse_send(dest_ci, event, data)
+#define SSE_SEND_GROUP(group, event, data) npp_eng_sse_send_group(group, event, data)
+#endif
+
+/* WebSocket */
+
+#ifdef NPP_SVC
+#define WS_ACCEPT(callback)             FALSE   /* not in services -- reply with OUT */
+#define WS_ROUTE(service)               FALSE
+#define WS_SEND(dest_ci, data)          FALSE
+#define WS_SEND_BIN(dest_ci, data, len) FALSE
+#define WS_SEND_ALL(data)               0
+#define WS_CLOSE(dest_ci)               FALSE
+#else
+#define WS_ACCEPT(callback)             npp_eng_ws_accept(ci, callback)
+#define WS_ROUTE(service)               npp_eng_ws_route(ci, service)
+#define WS_SEND(dest_ci, data)          npp_eng_ws_send(dest_ci, data, strlen(data), FALSE)
+#define WS_SEND_BIN(dest_ci, data, len) npp_eng_ws_send(dest_ci, data, len, TRUE)
+#define WS_SEND_ALL(data)               npp_eng_ws_send_all(data, strlen(data), FALSE)
+#define WS_CLOSE(dest_ci)               npp_eng_ws_close(dest_ci, 1000)
+#endif
 #define RES_CONTENT_DISPOSITION(str, ...) npp_lib_set_res_content_disposition(ci, str, ##__VA_ARGS__)
 
 #define RES_CONTENT_TYPE_TEXT           (G_connections[ci].out_ctype = NPP_CONTENT_TYPE_TEXT)
 #define RES_CONTENT_TYPE_HTML           (G_connections[ci].out_ctype = NPP_CONTENT_TYPE_HTML)
 #define RES_CONTENT_TYPE_JSON           (G_connections[ci].out_ctype = NPP_CONTENT_TYPE_JSON)
 
-#define REDIRECT_TO_LANDING             sprintf(G_connections[ci].location, "%s://%s", NPP_PROTOCOL, G_connections[ci].host)
+#define REDIRECT_TO_LANDING             sprintf(G_connections[ci].cold->location, "%s://%s", NPP_PROTOCOL, G_connections[ci].host)
 
 #define APPEND_CSS(name, first)         npp_append_css(ci, name, first)
 #define APPEND_SCRIPT(name, first)      npp_append_script(ci, name, first)
 
 
-#define NPP_UA_IE                       (0==strncmp(G_connections[ci].uagent, "Mozilla/5.0 (Windows NT ", 24) && strstr(G_connections[ci].uagent, "; WOW64; Trident/7.0; rv:11.0) like Gecko"))
+#define NPP_UA_IE                       (0==strncmp(G_connections[ci].cold->uagent, "Mozilla/5.0 (Windows NT ", 24) && strstr(G_connections[ci].cold->uagent, "; WOW64; Trident/7.0; rv:11.0) like Gecko"))
 
 
 /* datetime strings (YYYY-MM-DD hh:mm:ss) */
@@ -1289,6 +1496,13 @@ typedef struct {
     unsigned visits_tab;     /* like visits -- tablets only */
     unsigned visits_mob;     /* like visits -- mobile only */
     unsigned blocked;        /* attempts from blocked IP */
+    unsigned accepted;       /* accepted connections */
+    unsigned accept_wakeups; /* listening socket readiness events */
+    unsigned listen_overflows; /* accept queue overflows (TcpExt ListenOverflows, system-wide) */
+    unsigned compressed;     /* generated responses compressed */
+    unsigned compress_skipped; /* generated responses sent uncompressed because of the raised threshold */
+    unsigned compress_cheaper; /* adaptive compression steps down (event loop saturated) */
+    unsigned compress_harder;  /* adaptive compression steps up (event loop idle) */
     double   elapsed;        /* sum of elapsed time of all requests for calculating average */
     double   average;        /* average request elapsed */
 } npp_counters_t;
@@ -1303,6 +1517,7 @@ typedef struct {
     unsigned call_id;
     int      ai;
     int      ci;
+    int      wi;            /* npp_app worker index */
     char     service[NPP_SVC_NAME_LEN+1];
     /* pass some request details over */
     char     ip[INET6_ADDRSTRLEN];
@@ -1477,13 +1692,69 @@ typedef struct {
 } http2_WINDOW_SIZE_pld_t;
 
 
+/* connection -- the part touched on every event and by the timeout scan */
+/* kept apart from the request details so that these stay in a few cache lines */
+
+typedef struct {
+#ifdef _WIN32   /* Windows */
+    SOCKET   fd;                                    /* file descriptor */
+#else
+    int      fd;                                    /* file descriptor */
+#endif  /* _WIN32 */
+    char     state;                                 /* connection state (STATE_XXX) */
+    char     flags;
+    unsigned was_read;                              /* request bytes read so far */
+    unsigned data_sent;                             /* how many content bytes have been sent */
+    unsigned out_len;                               /* outgoing length (all) */
+#ifdef NPP_FD_MON_POLL
+    int      pi;                                    /* M_pollfds array index */
+#endif
+#ifdef NPP_FD_MON_EPOLL
+    unsigned gen;                                   /* slot generation, goes with epoll events */
+#endif
+    time_t   last_activity;
+#ifdef NPP_HTTPS
+    SSL      *ssl;
+#endif
+} npp_conn_hot_t;
+
+
+/* requested byte range of a static resource */
+
+typedef struct {
+    unsigned start;
+    unsigned len;
+    unsigned hdr_off;                               /* multipart: part header offset in the content buffer */
+    unsigned hdr_len;
+} npp_range_t;
+
+
+/* connection's bulk -- taken from a pool on accept, given back on close */
+
+typedef struct {
+#ifndef NPP_SVC
+    char     in[NPP_IN_BUFSIZE];                    /* the whole incoming request */
+#endif
+    char     uri[NPP_MAX_URI_LEN+1];                /* requested URI string */
+    char     uagent[NPP_MAX_VALUE_LEN+1];           /* user agent string */
+    char     referer[NPP_MAX_VALUE_LEN+1];
+    char     in_cookie[NPP_MAX_VALUE_LEN+1];        /* request cookie */
+#ifndef NPP_SVC
+    char     in_ctypestr[NPP_MAX_VALUE_LEN+1];      /* content type as an original string */
+    char     authorization[NPP_MAX_VALUE_LEN+1];    /* Authorization header */
+#endif
+    char     cust_headers[NPP_CUST_HDR_LEN+1];
+    char     location[NPP_MAX_URI_LEN+1];           /* redirection */
+} npp_conn_cold_t;
+
+
 /* connection / request */
 
 #ifdef NPP_SVC
 typedef struct {                            /* request details for npp_svc */
     char     ip[INET6_ADDRSTRLEN];
     char     method[NPP_METHOD_LEN+1];
-    char     uri[NPP_MAX_URI_LEN+1];
+    npp_conn_cold_t *cold;
     char     resource[NPP_MAX_RESOURCE_LEN+1];
 #if NPP_RESOURCE_LEVELS > 1
     char     req1[NPP_MAX_RESOURCE_LEN+1];
@@ -1501,11 +1772,8 @@ typedef struct {                            /* request details for npp_svc */
 #endif  /* NPP_RESOURCE_LEVELS > 2 */
 #endif  /* NPP_RESOURCE_LEVELS > 1 */
     char     id[NPP_MAX_RESOURCE_LEN+1];
-    char     uagent[NPP_MAX_VALUE_LEN+1];
     char     ua_type;
-    char     referer[NPP_MAX_VALUE_LEN+1];
     unsigned clen;
-    char     in_cookie[NPP_MAX_VALUE_LEN+1];
     unsigned in_data_allocated;
     char     host[NPP_MAX_HOST_LEN+1];
 #ifdef NPP_MULTI_HOST
@@ -1519,7 +1787,6 @@ typedef struct {                            /* request details for npp_svc */
     char     boundary[NPP_MAX_BOUNDARY_LEN+1];
     char     *in_data;
     int      status;
-    char     cust_headers[NPP_CUST_HDR_LEN+1];
     int      cust_headers_len;
     char     out_ctype;
     char     ctypestr[NPP_CONTENT_TYPE_LEN+1];
@@ -1528,24 +1795,17 @@ typedef struct {                            /* request details for npp_svc */
     char     cookie_out_a_exp[32];
     char     cookie_out_l[NPP_SESSID_LEN+1];
     char     cookie_out_l_exp[32];
-    char     location[NPP_MAX_URI_LEN+1];
     int      si;
-    char     flags;
 } npp_connection_t;
 #else   /* NPP_APP */
 typedef struct {
     /* what comes in */
-#ifdef _WIN32   /* Windows */
-    SOCKET   fd;                                    /* file descriptor */
-#else
-    int      fd;                                    /* file descriptor */
-#endif  /* _WIN32 */
     char     ip[INET6_ADDRSTRLEN];                  /* client IP */
-    char     in[NPP_IN_BUFSIZE];                    /* the whole incoming request */
+    npp_conn_cold_t *cold;                          /* request buffer & long strings, only while connected */
+    unsigned pipe_off;                              /* pipelined request(s) start in in */
+    unsigned pipe_len;                              /* pipelined bytes received so far */
     char     method[NPP_METHOD_LEN+1];              /* HTTP method */
-    unsigned was_read;                              /* request bytes read so far */
     /* parsed HTTP request starts here */
-    char     uri[NPP_MAX_URI_LEN+1];                /* requested URI string */
     char     resource[NPP_MAX_RESOURCE_LEN+1];      /* from URI (REQ0) */
 #if NPP_RESOURCE_LEVELS > 1
     char     req1[NPP_MAX_RESOURCE_LEN+1];          /* from URI -- level 1 */
@@ -1578,11 +1838,8 @@ typedef struct {
 //    int32_t  http2_frame_len;
     unsigned http2_bytes_to_send;
 #endif  /* NPP_HTTP2 */
-    char     uagent[NPP_MAX_VALUE_LEN+1];           /* user agent string */
     char     ua_type;                               /* user agent type */
-    char     referer[NPP_MAX_VALUE_LEN+1];
     unsigned clen;                                  /* incoming & outgoing content length */
-    char     in_cookie[NPP_MAX_VALUE_LEN+1];        /* request cookie */
     char     cookie_in_a[NPP_SESSID_LEN+1];         /* anonymous sessid from cookie */
     char     cookie_in_l[NPP_SESSID_LEN+1];         /* logged in sessid from cookie */
     char     host[NPP_MAX_HOST_LEN+1];              /* request host */
@@ -1594,15 +1851,17 @@ typedef struct {
     char     lang[NPP_LANG_LEN+1];                  /* request language */
     char     formats;                               /* date & numbers format */
     time_t   if_mod_since;                          /* request If-Mod-Since */
-    char     in_ctypestr[NPP_MAX_VALUE_LEN+1];      /* content type as an original string */
+    char     if_none_match[NPP_IF_NONE_MATCH_LEN+1]; /* request If-None-Match */
+    char     range[NPP_RANGE_LEN+1];                /* request Range */
+    char     if_range[NPP_ETAG_LEN+1];              /* request If-Range */
+    char     accept_enc;                            /* accepted codecs (1<<NPP_CODEC_XXX) */
     char     in_ctype;                              /* content type */
     char     boundary[NPP_MAX_BOUNDARY_LEN+1];      /* for POST multipart/form-data type */
-    char     authorization[NPP_MAX_VALUE_LEN+1];    /* Authorization header */
     /* POST data */
     char     *in_data;                              /* POST data */
+    unsigned in_data_spooled;                       /* mapped length if mapped from NPP_PAYLOAD_SPOOL_DIR, else 0 */
     /* what goes out */
     unsigned out_hlen;                              /* outgoing header length */
-    unsigned out_len;                               /* outgoing length (all) */
     char     *out_start;
 #ifdef NPP_OUT_CHECK_REALLOC
     char     *out_data_alloc;                       /* allocated space for rendered content */
@@ -1611,10 +1870,33 @@ typedef struct {
 #endif
     unsigned out_data_allocated;                    /* number of allocated bytes */
     char     *out_data;                             /* pointer to the data to send */
+    char     *out_body;                             /* static content sent from where it is (not after the header) */
+    bool     (*stream)(int ci);                     /* RES_STREAM callback, producing the next chunk */
+    int      sse_group;                             /* SSE_START group, -1 = not an event stream */
+    int      sse_next;                              /* next in the group's list, -1 = last */
+    int      sse_prev;                              /* previous in the group's list, -1 = first */
+    bool     push_lagging;                          /* didn't keep up with events or frames, to be closed */
+    bool     ws_upgrade;                            /* Upgrade: websocket */
+    char     ws_key[NPP_WS_KEY_LEN+1];              /* Sec-WebSocket-Key */
+    bool     ws_v13;                                /* Sec-WebSocket-Version: 13 */
+    char     ws_state;                              /* WS_ACCEPT-ed: WS_STATE_XXX */
+    time_t   ws_last_in;                            /* last time anything came from the client */
+    void     (*ws_cb)(int ci, const char *data, unsigned len, bool binary);   /* WS_ACCEPT callback */
+    int      ws_reply;                              /* where WS_ROUTE reply starts in out_data, -1 = not yet */
+    char     *ws_msg;                               /* message assembled from fragments or too big for in */
+    unsigned ws_msg_len;
+    unsigned ws_msg_allocated;
+    char     ws_msg_op;                             /* its opcode, 0 = none in progress */
+    bool     ws_msg_fin;                            /* the frame being read is the last one */
+    unsigned ws_frame_left;                         /* payload bytes of the frame being read still to come */
+    unsigned char ws_mask[4];
+    unsigned ws_mask_phase;
     int      status;                                /* HTTP status */
-    char     cust_headers[NPP_CUST_HDR_LEN+1];
+    bool     etag_auto;                             /* RES_ETAG_AUTO */
+    npp_range_t ranges[NPP_MAX_RANGES+1];           /* 206 -- the last one is for the closing boundary */
+    int      ranges_cnt;
+    char     etag[NPP_ETAG_LEN+1];                  /* response ETag */
     int      cust_headers_len;
-    unsigned data_sent;                             /* how many content bytes have been sent */
     char     out_ctype;                             /* content type */
     char     ctypestr[NPP_CONTENT_TYPE_LEN+1];      /* user (custom) content type */
     char     cdisp[NPP_CONTENT_DISP_LEN+1];         /* content disposition */
@@ -1623,24 +1905,15 @@ typedef struct {
     char     cookie_out_a_exp[32];                  /* cookie expires */
     char     cookie_out_l[NPP_SESSID_LEN+1];
     char     cookie_out_l_exp[32];                  /* cookie expires */
-    char     location[NPP_MAX_URI_LEN+1];           /* redirection */
     /* internal stuff */
     unsigned req;                                   /* request count */
     struct timespec proc_start;                     /* start processing time */
     double   elapsed;                               /* processing time in ms */
-    char     state;                                 /* connection state (STATE_XXX) */
     char     *p_header;                             /* current header pointer */
     char     *p_content;                            /* current content pointer */
-#ifdef NPP_HTTPS
-    SSL      *ssl;
-#endif
     int      ssl_err;
     int      si;                                    /* session index */
     int      static_res;                            /* static resource index in M_stat */
-    time_t   last_activity;
-#ifdef NPP_FD_MON_POLL
-    int      pi;                                    /* M_pollfds array index */
-#endif
 #ifdef NPP_FD_MON_EPOLL
 //    bool     epoll_out_ready;
 #endif
@@ -1648,7 +1921,6 @@ typedef struct {
     char     service[NPP_SVC_NAME_LEN+1];
     int      async_err_code;
 #endif
-    char     flags;
     char     required_auth_level;                   /* required authorization level */
     bool     expect100;
 } npp_connection_t;
@@ -1660,17 +1932,43 @@ typedef struct {
 typedef struct {
     char     host[NPP_MAX_HOST_LEN+1];
     int      host_id;
-    char     name[NPP_STATIC_PATH_LEN+1];
+    char     name[NPP_STATIC_PATH_LEN+1];           /* empty = free slot */
+    int      name_len;
+    unsigned hash;                                  /* of host_id+name, for M_statics_hash */
     char     type;
     char     *data;
     unsigned len;
-    char     *data_deflated;
-    unsigned len_deflated;
+    char     *data_enc[NPP_CODECS];                 /* compressed once at load time, by NPP_CODEC_XXX */
+    unsigned len_enc[NPP_CODECS];
     time_t   modified;
+    char     etag[NPP_ETAG_LEN+1];                  /* content hash, without quotes and encoding */
     char     source;
+    char     *map;                                  /* mmap'd file for large ones (data is NULL then) */
+    unsigned map_len;                               /* len can change before it's unmapped */
+    int      map_fd;                                /* and its descriptor for sendfile() and pread() */
+    char     last_modified[32];                     /* formatted for Last-Modified */
+    char     *cache;                                /* mmap'd cache file (data and data_enc point into it) */
+    unsigned cache_len;
+    int      conns;                                 /* connections using it -- content is kept until 0 */
 } static_res_t;
 
 
+/* statics cache file header */
+/* followed by content at NPP_OUT_HEADER_BUFSIZE, EOS and compressed variants */
+
+typedef struct {
+    unsigned magic;
+    time_t   modified;                              /* source file's */
+    unsigned size;                                  /* source file's */
+    int      host_id;
+    char     source;
+    char     name[NPP_STATIC_PATH_LEN+1];
+    unsigned len;
+    unsigned len_enc[NPP_CODECS];
+    char     etag[NPP_ETAG_LEN+1];
+} statics_cache_hdr_t;
+
+
 /* authorization levels */
 
 typedef struct {
@@ -1728,6 +2026,10 @@ typedef struct {
     char visits_mob[64];
     char blocked[64];
     char average[64];
+    char compressed[64];
+    char compress_skipped[64];
+    char compress_cheaper[64];
+    char compress_harder[64];
 } counters_fmt_t;
 
 
@@ -1756,6 +2058,10 @@ extern int          G_logToStdout;
 extern int          G_logCombined;
 extern int          G_httpPort;
 extern int          G_httpsPort;
+extern int          G_workers;
+extern int          G_listenBacklog;
+extern int          G_maxConnections;
+extern int          G_maxSessions;
 extern char         G_cipherList[NPP_CIPHER_LIST_LEN+1];
 extern char         G_certFile[256];
 extern char         G_certChainFile[256];
@@ -1780,22 +2086,28 @@ extern bool         G_endianness;
 extern int          G_pid;                                      /* pid */
 extern char         G_appdir[256];                              /* application root dir */
 extern int          G_days_up;                                  /* web server's days up */
-extern npp_connection_t G_connections[NPP_MAX_CONNECTIONS+2];   /* HTTP connections & requests -- the main structure */
+extern npp_connection_t *G_connections;                     /* HTTP connections & requests -- the main structure, G_maxConnections+2 */
                                                                 /* The extra 2 slots are for 503 processing and for NPP_CLOSING_SESSION_CI */
+extern npp_conn_hot_t *G_conn_hot;                          /* per-event part of G_connections, same index (ci) */
 extern int          G_connections_cnt;                          /* number of open connections */
 extern int          G_connections_hwm;                          /* highest number of open connections (high water mark) */
 extern char         G_tmp[NPP_TMP_BUFSIZE];                     /* temporary string buffer */
-extern eng_session_data_t G_sessions[NPP_MAX_SESSIONS+1];       /* engine session data -- they start from 1 (session 0 is never used) */
-extern app_session_data_t G_app_session_data[NPP_MAX_SESSIONS+1]; /* app session data, using the same index (si) */
+extern eng_session_data_t *G_sessions;                      /* engine session data, G_maxSessions+1 -- they start from 1 (session 0 is never used) */
+extern app_session_data_t *G_app_session_data;              /* app session data, using the same index (si) */
 extern int          G_sessions_cnt;                             /* number of active user sessions */
 extern int          G_sessions_hwm;                             /* highest number of active user sessions (high water mark) */
-extern sessions_idx_t G_sessions_idx[NPP_MAX_SESSIONS];         /* G_sessions' index, this starts from 0 */
+extern sessions_idx_t *G_sessions_idx;                      /* G_sessions' index, this starts from 0 */
 
 extern time_t       G_now;                                      /* current GMT time (epoch) */
 extern struct tm    *G_ptm;                                     /* human readable current time */
 extern char         G_last_modified[32];                        /* response header field with server's start time */
 extern char         G_header_date[32];                          /* RFC 2822 datetime format */
 extern bool         G_initialized;                              /* is server initialization complete? */
+
+extern int          G_compress_level;                           /* current deflate level for generated content */
+extern unsigned     G_compress_treshold;                        /* current compression threshold for generated content */
+extern double       G_loop_busy;                                /* recent event loop utilisation (%) */
+extern double       G_compress_cost;                            /* recent deflate cost (ns per input byte) */
 extern char         *G_strm;                                    /* for STRM macro */
 
 /* hosts */
@@ -1930,12 +2242,24 @@ extern "C" {
     void npp_eng_out_check(int ci, const char *str);
     void npp_eng_out_check_realloc(int ci, const char *str);
     void npp_eng_out_check_realloc_bin(int ci, const char *data, int len);
+    void npp_eng_out_fmt(int ci, const char *fmt, ...) NPP_FORMAT_CHECK(2, 3);
+    void npp_eng_out_int(int ci, long long val);
     char *npp_eng_get_header(int ci, const char *header);
+    bool npp_eng_sse_start(int ci, int group);
+    bool npp_eng_sse_send(int ci, const char *event, const char *data);
+    int  npp_eng_sse_send_group(int group, const char *event, const char *data);
+    bool npp_eng_ws_accept(int ci, void (*callback)(int ci, const char *data, unsigned len, bool binary));
+    bool npp_eng_ws_route(int ci, const char *service);
+    bool npp_eng_ws_send(int ci, const char *data, unsigned len, bool binary);
+    int  npp_eng_ws_send_all(const char *data, unsigned len, bool binary);
+    bool npp_eng_ws_close(int ci, int code);
     void npp_eng_call_http_pass_header(int ci, const char *header);
 #ifdef NPP_SVC
     void npp_svc_out_check(const char *str);
     void npp_svc_out_check_realloc(const char *str);
     void npp_svc_out_check_realloc_bin(const char *data, int len);
+    void npp_svc_out_fmt(const char *fmt, ...) NPP_FORMAT_CHECK(1, 2);
+    void npp_svc_out_int(long long val);
 #endif  /* NPP_SVC */
 
     /* public app */
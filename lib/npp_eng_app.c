@@ -42,8 +42,31 @@
 #include <sys/epoll.h>
 #endif
 
+#ifdef NPP_FD_MON_IO_URING
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <linux/io_uring.h>
+#endif
+
 #ifndef _WIN32
 #include <zlib.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#endif
+
+#ifdef NPP_BROTLI
+#include <brotli/encode.h>
+#endif
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <linux/filter.h>
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
 #endif
 
 
@@ -53,6 +76,10 @@
 
 int         G_httpPort=80;
 int         G_httpsPort=443;
+int         G_workers=1;
+int         G_listenBacklog=SOMAXCONN;
+int         G_maxConnections=NPP_MAX_CONNECTIONS;
+int         G_maxSessions=NPP_MAX_SESSIONS;
 char        G_cipherList[NPP_CIPHER_LIST_LEN+1]="";
 char        G_certFile[256]="";
 char        G_certChainFile[256]="";
@@ -67,11 +94,12 @@ int         G_ASYNCDefTimeout=NPP_ASYNC_DEF_TIMEOUT;
 /* end of config params */
 
 int         G_days_up=0;
-npp_connection_t G_connections[NPP_MAX_CONNECTIONS+2]={0};
+npp_connection_t *G_connections=NULL;       /* G_maxConnections+2 */
+npp_conn_hot_t *G_conn_hot=NULL;            /* G_maxConnections+2 */
 int         G_connections_cnt=0;
 int         G_connections_hwm=0;
-eng_session_data_t G_sessions[NPP_MAX_SESSIONS+1]={0};
-app_session_data_t G_app_session_data[NPP_MAX_SESSIONS+1]={0};
+eng_session_data_t *G_sessions=NULL;        /* G_maxSessions+1 */
+app_session_data_t *G_app_session_data=NULL;
 int         G_sessions_cnt=0;
 int         G_sessions_hwm=0;
 char        G_last_modified[32]="";
@@ -99,6 +127,13 @@ npp_counters_t G_cnts_today={0};            /* today's counters */
 npp_counters_t G_cnts_yesterday={0};        /* yesterday's counters */
 npp_counters_t G_cnts_day_before={0};       /* day before's counters */
 
+/* adaptive compression */
+
+int         G_compress_level=NPP_COMPRESS_LEVEL;
+unsigned    G_compress_treshold=NPP_COMPRESS_TRESHOLD;
+double      G_loop_busy=0;
+double      G_compress_cost=0;
+
 
 /* locals */
 
@@ -120,9 +155,11 @@ http_status_t   M_http_status[]={
         {413, "Request Entity Too Large"},
         {414, "Request-URI Too Long"},
         {416, "Range Not Satisfiable"},
+        {426, "Upgrade Required\r\nSec-WebSocket-Version: 13"},
         {500, "Internal Server Error"},
         {501, "Not Implemented"},
         {503, "Service Unavailable"},
+        {507, "Insufficient Storage"},
         { -1, ""}
     };
 
@@ -158,29 +195,205 @@ static int          M_highsock=0;               /* Highest #'d file descriptor,
 #endif  /* NPP_FD_MON_SELECT */
 
 #ifdef NPP_FD_MON_POLL
-static struct pollfd M_pollfds[NPP_MAX_CONNECTIONS+NPP_LISTENING_FDS+1]={0};
+static struct pollfd *M_pollfds=NULL;          /* G_maxConnections+NPP_LISTENING_FDS+1 */
 static int          M_pollfds_cnt=0;
-static int          M_poll_ci[NPP_MAX_CONNECTIONS+NPP_LISTENING_FDS+1]={0}; /* connection indexes -- additional data for M_pollfds */
+static int          *M_poll_ci=NULL;                /* connection indexes -- additional data for M_pollfds */
 #endif  /* NPP_FD_MON_POLL */
 
 #ifdef NPP_FD_MON_EPOLL
 
-typedef struct {
-    int fd;
-    int ci;
-} epoll_idx_t;
+/* epoll_event.data.u64 carries ci in the lower half and the slot's
+   generation in the upper one, so that events still queued for a closed
+   connection don't go to the next one in the same slot;
+   listening sockets use the values below */
 
-static struct epoll_event M_epollevs[NPP_MAX_CONNECTIONS+NPP_LISTENING_FDS+1]={0};
+#define NPP_EPOLL_DATA(ci)              (((uint64_t)G_conn_hot[ci].gen << 32) | (unsigned)(ci))
+#define NPP_EPOLL_DATA_CI(data)         (int)((data) & 0xFFFFFFFF)
+#define NPP_EPOLL_DATA_GEN(data)        (unsigned)((data) >> 32)
+
+#define NPP_EPOLL_DATA_LISTENING        0xFFFFFFFF
+#define NPP_EPOLL_DATA_LISTENING_SEC    0xFFFFFFFE
+
+static struct epoll_event *M_epollevs=NULL;     /* G_maxConnections+NPP_LISTENING_FDS+1 */
 static int          M_epoll_fd=0;
 static int          M_epollfds_cnt=0;
-static epoll_idx_t  M_epoll_ci[NPP_MAX_CONNECTIONS+NPP_LISTENING_FDS+1]={0}; /* connection indexes */
 
 #endif  /* NPP_FD_MON_EPOLL */
 
+#ifdef NPP_FD_MON_IO_URING
+
+/* io_uring in place of epoll
+   - listening sockets: multishot accept, accepted fds wait in M_uring_accq
+     for accept_one()
+   - plain HTTP connections: multishot recv into provided buffers;
+     what arrives is stashed per slot and copied out by uring_recv(),
+     so reading costs no syscall; EPOLLIN is reported for slots that
+     have something stashed (level-triggered, as the data may have been
+     in the stash already when a state change made the engine wait for
+     more of it -- with epoll it'd be in the socket); EPOLLOUT is reported
+     straight away when asked for and a real poll is only armed if
+     it's still wanted after that
+   - TLS connections: multishot POLL_ADD, as OpenSSL reads the socket itself
+   All changes are queued and submitted with the single io_uring_enter
+   that also waits for completions */
+
+#define NPP_URING_ENTRIES               1024
+#define NPP_URING_CQ_ENTRIES            8192
+#define NPP_URING_SLOTS                 (G_maxConnections+1+NPP_LISTENING_FDS)
+#define NPP_URING_ACCQ_SIZE             256             /* accepted fds waiting per listening socket */
+#define NPP_URING_BGID                  0               /* provided buffers group */
+
+/* user_data = generation << 32 | kind << 30 | slot */
+
+#define NPP_URING_UD_IGNORE             0               /* for cancels */
+
+#define NPP_URING_UD_POLL               0
+#define NPP_URING_UD_RECV               1
+#define NPP_URING_UD_ACCEPT             2
+
+#define NPP_URING_UD_SLOT(ud)           (int)((ud) & 0x3FFFFFFF)
+#define NPP_URING_UD_KIND(ud)           (int)(((ud) >> 30) & 3)
+
+/* uring_slot_t.flags */
+
+#define NPP_URING_F_LISTED              0x01            /* in M_uring_todo */
+#define NPP_URING_F_READY               0x02            /* report in the next uring_wait */
+#define NPP_URING_F_OUT_TRIED           0x04            /* EPOLLOUT reported without a poll */
+#define NPP_URING_F_REARM               0x08            /* recv ran out of buffers */
+#define NPP_URING_F_PAUSED              0x10            /* recv or accept cancelled because too much is waiting */
+#define NPP_URING_F_PLAIN               0x20            /* recv instead of poll */
+#define NPP_URING_F_IN_TRIED            0x40            /* EPOLLIN reported */
+
+#define NPP_URING_EOF                   1               /* uring_slot_t.res */
+
+typedef struct {
+    int                 fd;
+    unsigned            *sq_head;
+    unsigned            *sq_tail;
+    unsigned            *sq_mask;
+    unsigned            *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned            *cq_head;
+    unsigned            *cq_tail;
+    unsigned            *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned            sq_entries;
+    unsigned            sq_pending;     /* SQEs not submitted yet */
+    unsigned            gen;            /* user_data generation */
+    struct io_uring_buf *br;            /* provided buffers ring, its tail overlays br[0] */
+    char                *bufs;          /* NPP_URING_BUFS * NPP_URING_BUF_SIZE */
+    unsigned short      br_tail;
+    unsigned            bufs_free;      /* in the kernel's hands */
+} uring_t;
+
+typedef struct {
+    uint64_t            data;           /* epoll_event.data */
+    uint64_t            poll_ud;        /* current poll */
+    uint64_t            recv_ud;        /* current multishot recv or accept */
+    unsigned            events;         /* what's been asked for */
+    int                 fd;
+    int                 head;           /* stashed buffers, oldest first, -1 = none */
+    int                 tail;
+    unsigned            off;            /* already read from head */
+    unsigned            cnt;            /* stashed buffers */
+    int                 res;            /* 0, NPP_URING_EOF or -errno once recv is over */
+    unsigned            flags;
+} uring_slot_t;
+
+typedef struct {
+    int                 fds[NPP_URING_ACCQ_SIZE];
+    unsigned            head;
+    unsigned            tail;
+} uring_accq_t;
+
+static uring_t      M_uring={0};                    /* fd == 0 means epoll is used */
+static uring_slot_t *M_uring_slots=NULL;            /* NPP_URING_SLOTS */
+static int          *M_uring_todo=NULL;             /* slots with flags for uring_wait */
+static int          M_uring_todo_cnt=0;
+static int          M_uring_buf_next[NPP_URING_BUFS];   /* stash chain */
+static unsigned     M_uring_buf_len[NPP_URING_BUFS];
+static uring_accq_t M_uring_accq[NPP_LISTENING_FDS];
+
+#endif  /* NPP_FD_MON_IO_URING */
+
+/* plain connections read through this */
+
+#ifdef NPP_FD_MON_IO_URING
+#define NPP_CONN_RECV(ci, buf, len)     (M_uring.fd ? uring_recv(ci, buf, len) : (int)recv(G_conn_hot[ci].fd, buf, len, 0))
+#else
+#define NPP_CONN_RECV(ci, buf, len)     recv(G_conn_hot[ci].fd, buf, len, 0)
+#endif
+
 static static_res_t M_statics[NPP_MAX_STATICS]={0}; /* static resources */
-static int          M_statics_cnt=0;                /* M_statics count */
+static int          M_statics_cnt=0;                /* M_statics count (including free slots) */
+
+#define STATICS_HASH_SIZE   (NPP_MAX_STATICS*2)     /* open addressing, at most half full */
+#define STATICS_CACHE_MAGIC (0x4e505000 | (NPP_CODECS<<4) | NPP_COMPRESS_LEVEL_STATICS)   /* changes with what's in it */
+
+#ifdef _WIN32
+#define MAX_PAYLOAD_ACCEPTED    NPP_MAX_PAYLOAD_SIZE
+#else
+#define MAX_PAYLOAD_ACCEPTED    (M_payload_spool ? NPP_MAX_SPOOLED_PAYLOAD_SIZE : NPP_MAX_PAYLOAD_SIZE)
+#endif
+
+static int          M_statics_hash[2][STATICS_HASH_SIZE]={0}; /* M_statics index+1, 0 = empty */
+static int          *M_statics_hash_cur=M_statics_hash[0];    /* the one in use, the other one is for rebuilding */
+
+/* request header fields we look at */
+
+#define REQ_HDR_UNKNOWN                     0
+#define REQ_HDR_HOST                        1
+#define REQ_HDR_USER_AGENT                  2
+#define REQ_HDR_CONNECTION                  3
+#define REQ_HDR_COOKIE                      4
+#define REQ_HDR_REFERER                     5
+#define REQ_HDR_CONTENT_TYPE                6
+#define REQ_HDR_AUTHORIZATION               7
+#define REQ_HDR_FROM                        8
+#define REQ_HDR_IF_MODIFIED_SINCE           9
+#define REQ_HDR_IF_NONE_MATCH               10
+#define REQ_HDR_RANGE                       11
+#define REQ_HDR_IF_RANGE                    12
+#define REQ_HDR_UPGRADE_INSECURE_REQUESTS   13
+#define REQ_HDR_CONTENT_LENGTH              14
+#define REQ_HDR_ACCEPT_ENCODING             15
+#define REQ_HDR_ACCEPT_LANGUAGE             16
+#define REQ_HDR_UPGRADE                     17
+#define REQ_HDR_HTTP2_SETTINGS              18
+#define REQ_HDR_EXPECT                      19
+#define REQ_HDR_SEC_WEBSOCKET_KEY           20
+#define REQ_HDR_SEC_WEBSOCKET_VERSION       21
+
+#define REQ_HDR_CNT                         22
+#define REQ_HDR_HASH_SIZE                   128     /* power of 2 */
+
+static const char   *M_req_hdr_names[REQ_HDR_CNT]={"", "HOST", "USER-AGENT", "CONNECTION", "COOKIE", "REFERER", "CONTENT-TYPE", "AUTHORIZATION", "FROM", "IF-MODIFIED-SINCE", "IF-NONE-MATCH", "RANGE", "IF-RANGE", "UPGRADE-INSECURE-REQUESTS", "CONTENT-LENGTH", "ACCEPT-ENCODING", "ACCEPT-LANGUAGE", "UPGRADE", "HTTP2-SETTINGS", "EXPECT", "SEC-WEBSOCKET-KEY", "SEC-WEBSOCKET-VERSION"};
+static unsigned char M_req_hdr_hash[REQ_HDR_HASH_SIZE]={0}; /* perfect hash of the above, REQ_HDR_UNKNOWN = empty */
+static unsigned     M_req_hdr_seed=2166136261U;     /* the one that makes it perfect */
+
+/* WebSocket */
+
+#define WS_STATE_NONE                       0
+#define WS_STATE_ACCEPTED                   1       /* handshake to be sent */
+#define WS_STATE_OPEN                       2
+#define WS_STATE_CLOSING                    3       /* close frame queued, connection goes when it's sent */
+
+#define WS_OP_CONT                          0x0
+#define WS_OP_TEXT                          0x1
+#define WS_OP_BIN                           0x2
+#define WS_OP_CLOSE                         0x8
+#define WS_OP_PING                          0x9
+#define WS_OP_PONG                          0xA
+
+#define WS_GUID                             "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
 static char         M_expires_stat[32];             /* response header for static resources */
 static char         M_expires_gen[32];              /* response header for generated resources */
+static char         *M_hdr_status[500]={NULL};      /* prebuilt status lines for 100-599 */
+static char         *M_hdr_ctype[128]={NULL};       /* prebuilt Content-Type lines by NPP_CONTENT_TYPE_* */
+static char         M_hdr_date[64]="";              /* Date line, rebuilt once a second */
+static int          M_hdr_date_len=0;
+static time_t       M_hdr_date_time=0;
 
 #ifdef _WIN32   /* Windows */
 static WSADATA      M_eng_wsa;
@@ -191,7 +404,16 @@ static bool         M_shutdown=FALSE;
 static int          M_prev_minute;
 static int          M_prev_day;
 static time_t       M_last_housekeeping=0;
+static time_t       M_last_test_rescan=0;
+#ifdef NPP_APP_EVERY_SPARE_SECOND
+static time_t       M_last_spare_second=0;
+#endif
+static int          M_hk_next_ci=0;                 /* close_old_conn cursor */
+static int          M_hk_next_si=1;                 /* uses_close_timeouted cursor */
 static int          M_first_free_ci=0;              /* connections start from 0 */
+static int          M_sse_groups[NPP_SSE_GROUPS];   /* event stream lists' heads, -1 = empty */
+static int          *M_lagging=NULL;                /* connections push_begin gave up on, closed from the main loop */
+static int          M_lagging_cnt=0;
 static int          M_highest_used_ci=-1;
 static int          M_first_free_si=1;              /* sessions start from 1 */
 static int          M_highest_used_si=0;
@@ -206,43 +428,177 @@ static char         *M_async_shm=NULL;              /* shared memory address */
 #endif  /* NPP_ASYNC */
 
 static int          M_index_present=-1;             /* index.html present in res? */
+#ifndef _WIN32
+static bool         M_statics_cache=FALSE;          /* NPP_STATICS_CACHE_DIR usable? */
+static unsigned     M_load_slices=0;                /* processes building the cache, 0 = not building */
+static unsigned     M_load_slice=0;                 /* this one's share */
+static bool         M_payload_spool=FALSE;          /* NPP_PAYLOAD_SPOOL_DIR usable? */
+static uint64_t     M_payload_spooled=0;            /* bytes spooled now, up to NPP_MAX_SPOOLED_TOTAL */
+#endif
+static bool         M_watching=FALSE;               /* resource directories watched for changes? */
+
+static const char   *M_codecs[NPP_CODECS]={"deflate", "gzip"    /* Content-Encoding names */
+#ifdef NPP_BROTLI
+                    , "br"
+#endif
+};
+
+static int          M_wi=0;                         /* worker index, 0 = the main process */
+static char         M_log_prefix[16]="";            /* log file prefix, empty for worker 0 */
+
+static int          M_accepts_hwm=0;                /* most connections accepted in one go */
+static unsigned     M_listen_overflows=0;           /* ListenOverflows at the last check */
+
+#ifndef _WIN32
+static struct timespec M_loop_start={0};            /* current utilisation window start */
+static double       M_loop_idle=0;                  /* ms spent waiting for events in the current window */
+static double       M_compress_ms=0;                /* ms spent compressing in the current window */
+static double       M_compress_bytes=0;             /* bytes compressed in the current window */
+#endif
+
+#ifdef NPP_OUT_CHECK_REALLOC
+static char         *M_out_buf_pool[NPP_OUT_BUF_POOL]; /* idle NPP_OUT_BUFSIZE output buffers */
+static int          M_out_buf_pool_cnt=0;
+#endif
+
+static npp_conn_cold_t *M_cold_pool[NPP_CONN_COLD_POOL]; /* idle connections' bulk */
+static int          M_cold_pool_cnt=0;
+
+#ifdef __linux__
+static pid_t        M_workers_pids[NPP_MAX_WORKERS]={0};
+static npp_counters_t *M_workers_cnts=NULL;         /* per-worker counters in shared memory */
+#endif
 
 
 
 /* prototypes */
 
-#ifdef NPP_FD_MON_EPOLL
-static int find_epoll_ci(int fd);
+static bool housekeeping(bool idle);
+static void make_etag(char *dest, const char *data, unsigned len);
+static bool etag_matches(int ci, const char *core);
+static void etag_add_codec(int ci, int codec);
+#ifndef _WIN32
+static bool if_range_ok(int ci);
+static int  parse_range(int ci, unsigned len);
+static void range_body(int ci);
+#endif
+#ifndef _WIN32
+static void compress_adapt(void);
 #endif
-static bool housekeeping(void);
 #ifdef NPP_HTTP2
 static void http2_check_client_preface(int ci);
 static void http2_parse_frame(int ci, int bytes);
 static void http2_add_frame(int ci, unsigned char type);
 #endif  /* NPP_HTTP2 */
 static void set_state(int ci, int bytes, bool secure);
+static void skip_empty_lines(int ci);
+#ifdef NPP_HTTPS
+static int  ssl_read_in(int ci);
+#endif
 static void respond_to_expect(int ci);
 static void log_proc_time(int ci);
 static void log_request(int ci);
 static void close_connection(int ci, bool update_first_free);
+#ifdef NPP_OUT_CHECK_REALLOC
+static bool out_buf_get(int ci);
+static void out_buf_release(int ci);
+#endif
+static bool cold_get(int ci);
+static void cold_release(int ci);
+static void conn_init(int ci);
+#ifdef NPP_ASYNC
+static bool async_res_wanted(const async_res_t *res);
+#endif
 static bool init(int argc, char **argv);
+static bool alloc_tables(void);
+static bool start_workers(void);
+static void stop_workers(void);
+static void workers_counters(npp_counters_t *total);
+#ifdef __linux__
+static void attach_reuseport_prog(int fd);
+#endif
+#ifdef NPP_FD_MON_EPOLL
+static int  fd_mon_ctl(int op, int fd, struct epoll_event *ev);
+static int  fd_mon_wait(int timeout);
+#endif
+#ifdef NPP_FD_MON_IO_URING
+static bool uring_init(void);
+static int  uring_recv(int ci, char *buf, unsigned len);
+static int  uring_accepted(bool secure);
+#endif
 #ifdef NPP_FD_MON_SELECT
 static void build_fd_sets(void);
 #endif
 static void accept_connection(bool secure);
+static bool accept_one(bool secure);
+static unsigned listen_overflows(void);
 static bool ip_blocked(const char *addr);
 static bool ip_allowed(const char *addr);
-static int  first_free_stat(void);
 static bool read_resources(bool first_scan);
+#ifndef _WIN32
+static void build_statics_cache(void);
+static void init_payload_spool(void);
+#endif
+#ifndef NPP_DONT_RESCAN_RES
+static void watch_resources(void);
+static void update_resources(void);
+#endif
+static void free_static_data(int i);
+#ifndef _WIN32
+static bool cache_path(char *dest, int host_id, char source, const char *resname, unsigned size);
+#endif
+static int  static_slot(void);
+static bool retire_static(int i);
+static void static_release(int ci);
+static void statics_hash_build(void);
+#ifndef _WIN32
+static bool compress_static(int i);
+#endif
+static char accept_encodings(const char *value);
+#ifndef _WIN32
+static bool map_static(int i, const char *path);
+static int  send_static(int ci, bool secure);
+#endif
 static int  is_static_res(int ci);
 static void process_req(int ci);
 static void gen_response_header(int ci);
+static void hdr_templates_build(void);
+static char *hdr_uint(char *dest, unsigned val);
+static char *hdr_hex(char *dest, unsigned val);
+static void stream_next(int ci);
+static bool response_continues(int ci);
+static void sse_idle(int ci);
+static void sse_unlink(int ci);
+static bool push_begin(int ci, unsigned len, int *off);
+static void close_lagging(void);
+static void push_end(int ci, int off);
+static void ws_idle(int ci);
+static void ws_handshake(int ci);
+static void ws_reply(int ci);
+static void ws_parse(int ci);
+static void ws_msg_done(int ci);
+static void ws_message(int ci, char *data, unsigned len, bool binary);
+static void ws_control(int ci, unsigned char op, const unsigned char *data, unsigned len);
+static int  ws_frame_hdr(unsigned char *hdr, unsigned char op, unsigned len);
+static bool ws_frame(int ci, unsigned char op, const char *data, unsigned len);
+static void ws_unmask(unsigned char *data, unsigned len, const unsigned char *mask, unsigned phase);
+static bool ws_utf8_valid(const unsigned char *data, unsigned len);
+static void ws_sha1(const unsigned char *src, unsigned len, unsigned char *digest);
+static void http_hdr_status(int ci, int status);
+static void http_hdr_date(int ci);
+static const char *content_type_str(char type);
 static void print_content_type(int ci, char type);
 static bool a_session_ok(int ci);
 static void close_old_conn(void);
 static void uses_close_timeouted(void);
 static void close_uses(int si, int ci);
+static int  payload_alloc(int ci);
+static void payload_free(int ci);
 static void reset_conn(int ci, char new_state);
+static const char *find_lf(const char *p, const char *end);
+static char *find_hend(char *in, int len);
+static void req_hdr_hash_build(void);
+static int  req_hdr(const char *label);
 static int  parse_req(int ci, int len);
 static int  set_http_req_val(int ci, const char *label, const char *value);
 static void dump_counters(void);
@@ -264,9 +620,13 @@ int main(int argc, char **argv)
     struct timeval timeout;         /* timeout for select */
 #endif
     int         sockets_ready;      /* number of sockets ready for I/O */
+    bool        idle;               /* nothing came in this wait */
     int         ci=0;
     int         bytes=0;
     int         failed_select_cnt=0;
+#ifndef _WIN32
+    struct timespec wait_start;     /* for measuring event loop utilisation */
+#endif
 #ifdef NPP_DEBUG
     time_t      dbg_last_time0=0;
     time_t      dbg_last_time1=0;
@@ -281,12 +641,16 @@ int main(int argc, char **argv)
         return EXIT_FAILURE;
     }
 
-#ifdef NPP_FD_MON_EPOLL
-    /* init index for sorting */
-    int i;
-    for ( i=0; i<NPP_MAX_CONNECTIONS+NPP_LISTENING_FDS+1; ++i )
-        M_epoll_ci[i].fd = INT_MAX;
-#endif  /* NPP_FD_MON_EPOLL */
+    if ( !start_workers() )
+    {
+        ERR("start_workers() failed, exiting");
+        clean_up();
+        return EXIT_FAILURE;
+    }
+
+#ifndef NPP_DONT_RESCAN_RES
+    watch_resources();  /* every worker needs its own watch */
+#endif
 
     /* setup the network socket */
 
@@ -320,6 +684,10 @@ int main(int argc, char **argv)
     setsockopt(M_listening_fd, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse_addr, sizeof(reuse_addr));
 #else
     setsockopt(M_listening_fd, SOL_SOCKET, SO_REUSEADDR, &reuse_addr, sizeof(reuse_addr));
+#ifdef __linux__
+    if ( G_workers > 1 )    /* every worker has its own listening socket on the same port */
+        setsockopt(M_listening_fd, SOL_SOCKET, SO_REUSEPORT, &reuse_addr, sizeof(reuse_addr));
+#endif
 #endif
 
     /* Set socket to non-blocking */
@@ -345,13 +713,18 @@ int main(int argc, char **argv)
 
     DBG("Trying listen...\n");
 
-    if ( listen(M_listening_fd, SOMAXCONN) < 0 )
+    if ( listen(M_listening_fd, G_listenBacklog) < 0 )
     {
         ERR("listen failed, errno = %d (%s)", errno, strerror(errno));
         clean_up();
         return EXIT_FAILURE;
     }
 
+#ifdef __linux__
+    if ( G_workers > 1 )
+        attach_reuseport_prog(M_listening_fd);
+#endif
+
     /* repeat everything for port 443 */
 
 #ifdef NPP_HTTPS
@@ -372,6 +745,10 @@ int main(int argc, char **argv)
     setsockopt(M_listening_sec_fd, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse_addr, sizeof(reuse_addr));
 #else
     setsockopt(M_listening_sec_fd, SOL_SOCKET, SO_REUSEADDR, &reuse_addr, sizeof(reuse_addr));
+#ifdef __linux__
+    if ( G_workers > 1 )    /* every worker has its own listening socket on the same port */
+        setsockopt(M_listening_sec_fd, SOL_SOCKET, SO_REUSEPORT, &reuse_addr, sizeof(reuse_addr));
+#endif
 #endif
 
     /* Set socket to non-blocking */
@@ -397,13 +774,18 @@ int main(int argc, char **argv)
 
     DBG("Trying listen...\n");
 
-    if ( listen(M_listening_sec_fd, SOMAXCONN) < 0 )
+    if ( listen(M_listening_sec_fd, G_listenBacklog) < 0 )
     {
         ERR("listen failed, errno = %d (%s)", errno, strerror(errno));
         clean_up();
         return EXIT_FAILURE;
     }
 
+#ifdef __linux__
+    if ( G_workers > 1 )
+        attach_reuseport_prog(M_listening_sec_fd);
+#endif
+
 #endif  /* NPP_HTTPS */
 
     /* log currently used memory */
@@ -417,6 +799,8 @@ int main(int argc, char **argv)
     M_prev_minute = G_ptm->tm_min;
     M_prev_day = G_ptm->tm_mday;
 
+    M_listen_overflows = listen_overflows();
+
     /* main server loop ------------------------------------------------------------------------- */
 
 #ifdef NPP_FD_MON_POLL
@@ -437,7 +821,7 @@ int main(int argc, char **argv)
 
 #ifdef NPP_FD_MON_EPOLL
 
-    M_epoll_fd = epoll_create(NPP_MAX_CONNECTIONS+NPP_LISTENING_FDS+1);
+    M_epoll_fd = epoll_create(G_maxConnections+NPP_LISTENING_FDS+1);
 
     if ( M_epoll_fd < 1 )
     {
@@ -446,30 +830,30 @@ int main(int argc, char **argv)
         return EXIT_FAILURE;
     }
 
+#ifdef NPP_FD_MON_IO_URING
+    if ( uring_init() )
+        ALWAYS("Using io_uring for socket monitoring");
+    else
+        WAR("io_uring not available, falling back to epoll");
+#endif
+
     struct epoll_event ev={0};
 
-    ev.data.fd = M_listening_fd;
+    ev.data.u64 = NPP_EPOLL_DATA_LISTENING;
     ev.events = EPOLLIN;
-    epoll_ctl(M_epoll_fd, EPOLL_CTL_ADD, ev.data.fd, &ev);
-
-    M_epoll_ci[0].fd = M_listening_fd;
-    M_epoll_ci[0].ci = -1;
+    fd_mon_ctl(EPOLL_CTL_ADD, M_listening_fd, &ev);
 
     M_epollfds_cnt = 1;
 
 #ifdef NPP_HTTPS
-    ev.data.fd = M_listening_sec_fd;
+    ev.data.u64 = NPP_EPOLL_DATA_LISTENING_SEC;
     ev.events = EPOLLIN;
-    epoll_ctl(M_epoll_fd, EPOLL_CTL_ADD, ev.data.fd, &ev);
-
-    M_epoll_ci[1].fd = M_listening_sec_fd;
-    M_epoll_ci[1].ci = -2;
+    fd_mon_ctl(EPOLL_CTL_ADD, M_listening_sec_fd, &ev);
 
     M_epollfds_cnt = 2;
 #endif
 
     int epi;        /* M_epollevs array index */
-    int epoll_idx;  /* M_epoll_ci array index */
 
 #endif  /* NPP_FD_MON_EPOLL */
 
@@ -488,9 +872,13 @@ int main(int argc, char **argv)
             if ( M_areqs[j].state==NPP_ASYNC_STATE_SENT && M_areqs[j].sent < G_now-M_areqs[j].timeout )
             {
                 DBG("Async request %d timeout-ed", j);
+                M_areqs[j].state = NPP_ASYNC_STATE_FREE;
+
+                if ( G_conn_hot[M_areqs[j].ci].state != CONN_STATE_WAITING_FOR_ASYNC )   /* closed meanwhile */
+                    continue;
+
                 G_connections[M_areqs[j].ci].async_err_code = ERR_ASYNC_TIMEOUT;
                 G_connections[M_areqs[j].ci].status = 500;
-                M_areqs[j].state = NPP_ASYNC_STATE_FREE;
                 gen_response_header(M_areqs[j].ci);
             }
         }
@@ -498,6 +886,10 @@ int main(int argc, char **argv)
 
         /* use your favourite fd monitoring */
 
+#ifndef _WIN32
+        clock_gettime(MONOTONIC_CLOCK_NAME, &wait_start);
+#endif
+
 #ifdef NPP_FD_MON_SELECT
         build_fd_sets();
 
@@ -512,11 +904,15 @@ int main(int argc, char **argv)
 #endif  /* NPP_FD_MON_POLL */
 
 #ifdef NPP_FD_MON_EPOLL
-        sockets_ready = epoll_wait(M_epoll_fd, M_epollevs, M_epollfds_cnt, 1000);
+        sockets_ready = fd_mon_wait(1000);
 #endif  /* NPP_FD_MON_EPOLL */
 
+        idle = (sockets_ready == 0);
+
 #ifdef _WIN32
         if ( M_shutdown ) break;
+#else
+        M_loop_idle += npp_elapsed(&wait_start);
 #endif
         if ( sockets_ready < 0 )
         {
@@ -535,8 +931,11 @@ int main(int argc, char **argv)
                 ERR("select failed for the 10-th time, entering emergency reset");
                 ALWAYS("Resetting all connections...");
                 int k;
-                for ( k=0; k<NPP_MAX_CONNECTIONS+1; ++k )
-                    close_connection(k, TRUE);
+                for ( k=0; k<G_maxConnections+1; ++k )
+                {
+                    if ( G_conn_hot[k].state != CONN_STATE_DISCONNECTED )
+                        close_connection(k, TRUE);
+                }
                 failed_select_cnt = 0;
                 ALWAYS("Waiting for 1 second...");
 #ifdef _WIN32
@@ -552,16 +951,7 @@ int main(int argc, char **argv)
                 continue;
             }
         }
-        else if ( sockets_ready == 0 )
-        {
-            /* we have some time now, let's do some housekeeping */
-
-//            DDBG("sockets_ready == 0");
-
-            if ( !housekeeping() )
-                return EXIT_FAILURE;
-        }
-        else    /* sockets_ready > 0 */
+        else if ( sockets_ready > 0 )
         {
 #ifdef NPP_DEBUG
             if ( G_now != dbg_last_time0 )   /* only once in a second */
@@ -634,7 +1024,7 @@ int main(int argc, char **argv)
                     DBG("ci = %d", ci);
                     DBG_LINE;
 #endif  /* NPP_DEBUG */
-                    if ( G_connections[ci].state == CONN_STATE_DISCONNECTED )
+                    if ( G_conn_hot[ci].state == CONN_STATE_DISCONNECTED )
                         continue;
 #endif  /* NPP_FD_MON_SELECT */
 
@@ -676,19 +1066,14 @@ int main(int argc, char **argv)
                         DBG_LINE;
                         for ( l=0; l<sockets_ready; ++l )
                         {
-                            int dbg_epoll_idx = find_epoll_ci(M_epollevs[l].data.fd);
-
-                            if ( dbg_epoll_idx != -1 )
-                            {
-                                if ( M_epollevs[l].data.fd == M_listening_fd )
-                                    DBG("M_epollevs[%d].events = %d, ...data.fd = %d (M_listening_fd)", l, M_epollevs[l].events, M_epollevs[l].data.fd);
+                            if ( M_epollevs[l].data.u64 == NPP_EPOLL_DATA_LISTENING )
+                                DBG("M_epollevs[%d].events = %d (M_listening_fd)", l, M_epollevs[l].events);
 #ifdef NPP_HTTPS
-                                else if ( M_epollevs[l].data.fd == M_listening_sec_fd )
-                                    DBG("M_epollevs[%d].events = %d, ...data.fd = %d (M_listening_sec_fd)", l, M_epollevs[l].events, M_epollevs[l].data.fd);
+                            else if ( M_epollevs[l].data.u64 == NPP_EPOLL_DATA_LISTENING_SEC )
+                                DBG("M_epollevs[%d].events = %d (M_listening_sec_fd)", l, M_epollevs[l].events);
 #endif
-                                else
-                                    DBG("ci=%d, M_epollevs[%d].events = %d, ...data.fd = %d", M_epoll_ci[dbg_epoll_idx].ci, l, M_epollevs[l].events, M_epollevs[l].data.fd);
-                            }
+                            else
+                                DBG("ci=%d, M_epollevs[%d].events = %d", NPP_EPOLL_DATA_CI(M_epollevs[l].data.u64), l, M_epollevs[l].events);
                         }
                         DBG_LINE;
                         dbg_last_time1 = G_now;
@@ -699,14 +1084,14 @@ int main(int argc, char **argv)
                     {
                         DDBG("EPOLLIN (new?)");
 
-                        if ( M_epollevs[epi].data.fd == M_listening_fd )    /* new HTTP connection */
+                        if ( M_epollevs[epi].data.u64 == NPP_EPOLL_DATA_LISTENING )    /* new HTTP connection */
                         {
                             accept_connection(FALSE);
                             sockets_ready--;
                             continue;
                         }
 #ifdef NPP_HTTPS
-                        else if ( M_epollevs[epi].data.fd == M_listening_sec_fd )   /* new HTTPS connection */
+                        else if ( M_epollevs[epi].data.u64 == NPP_EPOLL_DATA_LISTENING_SEC )   /* new HTTPS connection */
                         {
                             accept_connection(TRUE);
                             sockets_ready--;
@@ -717,23 +1102,20 @@ int main(int argc, char **argv)
 
                     /* existing connections */
 
-                    epoll_idx = find_epoll_ci(M_epollevs[epi].data.fd);
+                    ci = NPP_EPOLL_DATA_CI(M_epollevs[epi].data.u64);
 
-                    if ( epoll_idx == -1 )
+                    if ( ci < 0 || ci > G_maxConnections || G_conn_hot[ci].state == CONN_STATE_DISCONNECTED
+                            || NPP_EPOLL_DATA_GEN(M_epollevs[epi].data.u64) != G_conn_hot[ci].gen )
                     {
-#ifndef NPP_CPP_STRINGS
-                        DDBG("fd=%d not found in M_epoll_ci", M_epollevs[epi].data.fd);
-#endif
+                        DDBG("ci=%d is not connected (closed earlier in this batch?)", ci);
                         sockets_ready--;
                         continue;
                     }
-                    else
-                        ci = M_epoll_ci[epoll_idx].ci;
 
 #endif  /* NPP_FD_MON_EPOLL */
 
 #ifdef NPP_FD_MON_SELECT
-                    if ( FD_ISSET(G_connections[ci].fd, &M_readfds) )     /* incoming data ready */
+                    if ( FD_ISSET(G_conn_hot[ci].fd, &M_readfds) )     /* incoming data ready */
                     {
                         DDBG("FD_ISSET (existing) incoming data ready");
 #endif  /* NPP_FD_MON_SELECT */
@@ -755,48 +1137,69 @@ int main(int argc, char **argv)
 #ifdef NPP_DEBUG
                         if ( G_now != dbg_last_time2 )   /* only once in a second */
                         {
-                            DBG("ci=%d, fd=%d has incoming data, state = %c", ci, G_connections[ci].fd, G_connections[ci].state);
+                            DBG("ci=%d, fd=%d has incoming data, state = %c", ci, G_conn_hot[ci].fd, G_conn_hot[ci].state);
                             dbg_last_time2 = G_now;
                         }
 #endif  /* NPP_DEBUG */
 #ifdef NPP_HTTPS
-                        if ( NPP_CONN_IS_SECURE(G_connections[ci].flags) )   /* HTTPS */
+                        if ( NPP_CONN_IS_SECURE(G_conn_hot[ci].flags) )   /* HTTPS */
                         {
-                            if ( G_connections[ci].state == CONN_STATE_CONNECTED )
+                            if ( G_conn_hot[ci].state == CONN_STATE_CONNECTED )
                             {
-                                DDBG("ci=%d, trying SSL_read from fd=%d", ci, G_connections[ci].fd);
-
-                                bytes = SSL_read(G_connections[ci].ssl, G_connections[ci].in, NPP_IN_BUFSIZE-1);
+                                DDBG("ci=%d, trying SSL_read from fd=%d", ci, G_conn_hot[ci].fd);
 
-                                if ( bytes > 0 )
-                                {
-                                    DDBG("ci=%d, read %d bytes", ci, bytes);
-                                    G_connections[ci].was_read += bytes;
-                                }
+                                bytes = ssl_read_in(ci);
 
                                 set_state(ci, bytes, TRUE);
 #ifdef NPP_HTTP2
-                                if ( G_connections[ci].state != CONN_STATE_DISCONNECTED )
+                                if ( G_conn_hot[ci].state != CONN_STATE_DISCONNECTED )
                                 {
                                     if ( G_connections[ci].http_ver[0] == '2' )
-                                        http2_parse_frame(ci, G_connections[ci].was_read);
+                                        http2_parse_frame(ci, G_conn_hot[ci].was_read);
                                 }
 #endif  /* NPP_HTTP2 */
                             }
-                            else if ( G_connections[ci].state == CONN_STATE_READING_DATA )   /* payload */
+                            else if ( G_conn_hot[ci].state == CONN_STATE_SSE )   /* only closing is expected */
+                            {
+                                bytes = SSL_read(G_conn_hot[ci].ssl, G_connections[ci].cold->in, NPP_IN_BUFSIZE-1);
+
+                                if ( bytes <= 0 )
+                                    set_state(ci, bytes, TRUE);
+                            }
+                            else if ( G_conn_hot[ci].state == CONN_STATE_WEBSOCKET )   /* frames -- read them all, it's edge-triggered */
+                            {
+                                do
+                                {
+                                    bytes = SSL_read(G_conn_hot[ci].ssl, G_connections[ci].cold->in+G_conn_hot[ci].was_read, NPP_IN_BUFSIZE-1-G_conn_hot[ci].was_read);
+
+                                    if ( bytes > 0 )
+                                    {
+                                        G_conn_hot[ci].was_read += bytes;
+                                        G_conn_hot[ci].last_activity = G_now;
+                                        G_connections[ci].ws_last_in = G_now;
+                                        ws_parse(ci);
+                                    }
+                                    else
+                                    {
+                                        set_state(ci, bytes, TRUE);
+                                    }
+                                }
+                                while ( bytes > 0 && G_conn_hot[ci].state == CONN_STATE_WEBSOCKET );
+                            }
+                            else if ( G_conn_hot[ci].state == CONN_STATE_READING_DATA )   /* payload */
                             {
 #ifdef NPP_DEBUG
                                 DBG("ci=%d, state == CONN_STATE_READING_DATA", ci);
-                                DBG("ci=%d, trying SSL_read %u bytes of payload data from fd=%d", ci, G_connections[ci].clen-G_connections[ci].was_read, G_connections[ci].fd);
+                                DBG("ci=%d, trying SSL_read %u bytes of payload data from fd=%d", ci, G_connections[ci].clen-G_conn_hot[ci].was_read, G_conn_hot[ci].fd);
 #endif  /* NPP_DEBUG */
-                                while ( G_connections[ci].was_read < G_connections[ci].clen )
+                                while ( G_conn_hot[ci].was_read < G_connections[ci].clen )
                                 {
-                                    bytes = SSL_read(G_connections[ci].ssl, G_connections[ci].in_data+G_connections[ci].was_read, G_connections[ci].clen-G_connections[ci].was_read);
+                                    bytes = SSL_read(G_conn_hot[ci].ssl, G_connections[ci].in_data+G_conn_hot[ci].was_read, G_connections[ci].clen-G_conn_hot[ci].was_read);
 
                                     if ( bytes > 0 )
                                     {
                                         DDBG("ci=%d, read %d bytes", ci, bytes);
-                                        G_connections[ci].was_read += bytes;
+                                        G_conn_hot[ci].was_read += bytes;
                                     }
                                     else
                                         break;
@@ -804,10 +1207,10 @@ int main(int argc, char **argv)
 
                                 set_state(ci, bytes, TRUE);
 #ifdef NPP_HTTP2
-                                if ( G_connections[ci].state != CONN_STATE_DISCONNECTED )
+                                if ( G_conn_hot[ci].state != CONN_STATE_DISCONNECTED )
                                 {
                                     if ( G_connections[ci].http_ver[0] == '2' )
-                                        http2_parse_frame(ci, G_connections[ci].was_read);
+                                        http2_parse_frame(ci, G_conn_hot[ci].was_read);
                                 }
 #endif  /* NPP_HTTP2 */
                             }
@@ -815,37 +1218,37 @@ int main(int argc, char **argv)
                         else    /* plain HTTP */
 #endif  /* NPP_HTTPS */
                         {
-                            if ( G_connections[ci].state == CONN_STATE_CONNECTED )
+                            if ( G_conn_hot[ci].state == CONN_STATE_CONNECTED )
                             {
 #ifdef NPP_DEBUG
                                 DBG("ci=%d, state == CONN_STATE_CONNECTED", ci);
-                                DBG("ci=%d, trying read from fd=%d", ci, G_connections[ci].fd);
+                                DBG("ci=%d, trying read from fd=%d", ci, G_conn_hot[ci].fd);
 #endif  /* NPP_DEBUG */
-                                bytes = recv(G_connections[ci].fd, G_connections[ci].in, NPP_IN_BUFSIZE-1, 0);
+                                bytes = NPP_CONN_RECV(ci, G_connections[ci].cold->in+G_conn_hot[ci].was_read, NPP_IN_BUFSIZE-1-G_conn_hot[ci].was_read);
 
                                 if ( bytes > 0 )
                                 {
                                     DDBG("ci=%d, read %d bytes", ci, bytes);
-                                    G_connections[ci].was_read += bytes;
+                                    G_conn_hot[ci].was_read += bytes;
                                 }
 
                                 set_state(ci, bytes, FALSE);
 #ifdef NPP_HTTP2
-                                if ( G_connections[ci].state != CONN_STATE_DISCONNECTED )
+                                if ( G_conn_hot[ci].state != CONN_STATE_DISCONNECTED )
                                 {
                                     if ( G_connections[ci].http_ver[0] == '2' )
-                                        http2_parse_frame(ci, G_connections[ci].was_read);
+                                        http2_parse_frame(ci, G_conn_hot[ci].was_read);
                                 }
 #endif  /* NPP_HTTP2 */
                             }
 #ifdef NPP_HTTP2
-                            else if ( G_connections[ci].state == CONN_STATE_READY_FOR_CLIENT_PREFACE )
+                            else if ( G_conn_hot[ci].state == CONN_STATE_READY_FOR_CLIENT_PREFACE )
                             {
 #ifdef NPP_DEBUG
                                 DBG("ci=%d, state == CONN_STATE_READY_FOR_CLIENT_PREFACE", ci);
-                                DBG("ci=%d, trying read from fd=%d", ci, G_connections[ci].fd);
+                                DBG("ci=%d, trying read from fd=%d", ci, G_conn_hot[ci].fd);
 #endif  /* NPP_DEBUG */
-                                bytes = recv(G_connections[ci].fd, G_connections[ci].in, NPP_IN_BUFSIZE-1, 0);
+                                bytes = NPP_CONN_RECV(ci, G_connections[ci].cold->in, NPP_IN_BUFSIZE-1);
 
                                 if ( bytes > 0 )
                                     http2_check_client_preface(ci);   /* hopefully finish upgrade to HTTP/2 */
@@ -853,20 +1256,59 @@ int main(int argc, char **argv)
                                     set_state(ci, bytes, FALSE);    /* disconnected */
                             }
 #endif  /* NPP_HTTP2 */
-                            else if ( G_connections[ci].state == CONN_STATE_READING_DATA )   /* payload */
+                            else if ( G_conn_hot[ci].state == CONN_STATE_SSE )   /* only closing is expected */
+                            {
+                                bytes = NPP_CONN_RECV(ci, G_connections[ci].cold->in, NPP_IN_BUFSIZE-1);
+
+                                if ( bytes == 0 )
+                                {
+                                    DBG("ci=%d, event stream closed by client", ci);
+                                    close_connection(ci, TRUE);
+                                }
+                                else if ( bytes < 0 )
+                                {
+                                    set_state(ci, bytes, FALSE);
+                                }
+                            }
+                            else if ( G_conn_hot[ci].state == CONN_STATE_WEBSOCKET )   /* frames -- read them all, it's edge-triggered */
+                            {
+                                do
+                                {
+                                    bytes = NPP_CONN_RECV(ci, G_connections[ci].cold->in+G_conn_hot[ci].was_read, NPP_IN_BUFSIZE-1-G_conn_hot[ci].was_read);
+
+                                    if ( bytes > 0 )
+                                    {
+                                        G_conn_hot[ci].was_read += bytes;
+                                        G_conn_hot[ci].last_activity = G_now;
+                                        G_connections[ci].ws_last_in = G_now;
+                                        ws_parse(ci);
+                                    }
+                                    else if ( bytes == 0 )
+                                    {
+                                        DBG("ci=%d, WebSocket closed by client", ci);
+                                        close_connection(ci, TRUE);
+                                    }
+                                    else
+                                    {
+                                        set_state(ci, bytes, FALSE);
+                                    }
+                                }
+                                while ( bytes > 0 && G_conn_hot[ci].state == CONN_STATE_WEBSOCKET );
+                            }
+                            else if ( G_conn_hot[ci].state == CONN_STATE_READING_DATA )   /* payload */
                             {
 #ifdef NPP_DEBUG
                                 DBG("ci=%d, state == CONN_STATE_READING_DATA", ci);
-                                DBG("ci=%d, trying to read %u bytes of payload data from fd=%d", ci, G_connections[ci].clen-G_connections[ci].was_read, G_connections[ci].fd);
+                                DBG("ci=%d, trying to read %u bytes of payload data from fd=%d", ci, G_connections[ci].clen-G_conn_hot[ci].was_read, G_conn_hot[ci].fd);
 #endif  /* NPP_DEBUG */
-                                while ( G_connections[ci].was_read < G_connections[ci].clen )
+                                while ( G_conn_hot[ci].was_read < G_connections[ci].clen )
                                 {
-                                    bytes = recv(G_connections[ci].fd, G_connections[ci].in_data+G_connections[ci].was_read, G_connections[ci].clen-G_connections[ci].was_read, 0);
+                                    bytes = NPP_CONN_RECV(ci, G_connections[ci].in_data+G_conn_hot[ci].was_read, G_connections[ci].clen-G_conn_hot[ci].was_read);
 
                                     if ( bytes > 0 )
                                     {
                                         DDBG("ci=%d, read %d bytes", ci, bytes);
-                                        G_connections[ci].was_read += bytes;
+                                        G_conn_hot[ci].was_read += bytes;
                                     }
                                     else
                                         break;
@@ -874,10 +1316,10 @@ int main(int argc, char **argv)
 
                                 set_state(ci, bytes, FALSE);
 #ifdef NPP_HTTP2
-                                if ( G_connections[ci].state != CONN_STATE_DISCONNECTED )
+                                if ( G_conn_hot[ci].state != CONN_STATE_DISCONNECTED )
                                 {
                                     if ( G_connections[ci].http_ver[0] == '2' )
-                                        http2_parse_frame(ci, G_connections[ci].was_read);
+                                        http2_parse_frame(ci, G_conn_hot[ci].was_read);
                                 }
 #endif  /* NPP_HTTP2 */
                             }
@@ -887,7 +1329,7 @@ int main(int argc, char **argv)
                     }
                     /* --------------------------------------------------------------------------------------- */
 #ifdef NPP_FD_MON_SELECT
-                    else if ( FD_ISSET(G_connections[ci].fd, &M_writefds) )        /* ready for outgoing data */
+                    else if ( FD_ISSET(G_conn_hot[ci].fd, &M_writefds) )        /* ready for outgoing data */
                     {
                         DDBG("FD_ISSET ready for outgoing data");
 #endif  /* NPP_FD_MON_SELECT */
@@ -906,28 +1348,33 @@ int main(int argc, char **argv)
 #ifdef NPP_DEBUG
                         if ( G_now != dbg_last_time3 )   /* only once in a second */
                         {
-                            DBG("ci=%d, fd=%d is ready for outgoing data, state = %c", ci, G_connections[ci].fd, G_connections[ci].state);
+                            DBG("ci=%d, fd=%d is ready for outgoing data, state = %c", ci, G_conn_hot[ci].fd, G_conn_hot[ci].state);
                             dbg_last_time3 = G_now;
                         }
 #endif  /* NPP_DEBUG */
 
 #ifdef NPP_HTTPS
-                        if ( NPP_CONN_IS_SECURE(G_connections[ci].flags) )   /* HTTPS */
+                        if ( NPP_CONN_IS_SECURE(G_conn_hot[ci].flags) )   /* HTTPS */
                         {
-                            if ( G_connections[ci].state == CONN_STATE_READY_TO_SEND_RESPONSE )
+                            if ( G_conn_hot[ci].state == CONN_STATE_READY_TO_SEND_RESPONSE )
                             {
 #ifdef NPP_DEBUG
                                 DBG("ci=%d, state == CONN_STATE_READY_TO_SEND_RESPONSE", ci);
-                                DBG("ci=%d, trying SSL_write %u bytes to fd=%d", ci, G_connections[ci].out_len, G_connections[ci].fd);
+                                DBG("ci=%d, trying SSL_write %u bytes to fd=%d", ci, G_conn_hot[ci].out_len, G_conn_hot[ci].fd);
 #endif  /* NPP_DEBUG */
-                                while ( G_connections[ci].data_sent < G_connections[ci].out_len )
+#ifndef _WIN32
+                                if ( G_connections[ci].out_body )
+                                    bytes = send_static(ci, TRUE);
+                                else
+#endif
+                                while ( G_conn_hot[ci].data_sent < G_conn_hot[ci].out_len )
                                 {
-                                    bytes = SSL_write(G_connections[ci].ssl, G_connections[ci].out_start, G_connections[ci].out_len);
+                                    bytes = SSL_write(G_conn_hot[ci].ssl, G_connections[ci].out_start, G_conn_hot[ci].out_len);
 
                                     if ( bytes > 0 )
                                     {
                                         DDBG("ci=%d, sent %d bytes", ci, bytes);
-                                        G_connections[ci].data_sent += bytes;
+                                        G_conn_hot[ci].data_sent += bytes;
                                     }
                                     else
                                         break;
@@ -935,20 +1382,25 @@ int main(int argc, char **argv)
 
                                 set_state(ci, bytes, TRUE);
                             }
-                            else if ( G_connections[ci].state == CONN_STATE_SENDING_CONTENT )
+                            else if ( G_conn_hot[ci].state == CONN_STATE_SENDING_CONTENT )
                             {
 #ifdef NPP_DEBUG
                                 DBG("ci=%d, state == CONN_STATE_SENDING_CONTENT", ci);
-                                DBG("ci=%d, trying SSL_write %u bytes to fd=%d", ci, G_connections[ci].out_len-G_connections[ci].data_sent, G_connections[ci].fd);
+                                DBG("ci=%d, trying SSL_write %u bytes to fd=%d", ci, G_conn_hot[ci].out_len-G_conn_hot[ci].data_sent, G_conn_hot[ci].fd);
 #endif  /* NPP_DEBUG */
-                                while ( G_connections[ci].data_sent < G_connections[ci].out_len )
+#ifndef _WIN32
+                                if ( G_connections[ci].out_body )
+                                    bytes = send_static(ci, TRUE);
+                                else
+#endif
+                                while ( G_conn_hot[ci].data_sent < G_conn_hot[ci].out_len )
                                 {
-                                    bytes = SSL_write(G_connections[ci].ssl, G_connections[ci].out_start, G_connections[ci].out_len);
+                                    bytes = SSL_write(G_conn_hot[ci].ssl, G_connections[ci].out_start, G_conn_hot[ci].out_len);
 
                                     if ( bytes > 0 )
                                     {
                                         DDBG("ci=%d, sent %d bytes", ci, bytes);
-                                        G_connections[ci].data_sent += bytes;
+                                        G_conn_hot[ci].data_sent += bytes;
                                     }
                                     else
                                         break;
@@ -960,23 +1412,23 @@ int main(int argc, char **argv)
                         else    /* plain HTTP */
 #endif  /* NPP_HTTPS */
                         {
-                            if ( G_connections[ci].state == CONN_STATE_READY_TO_SEND_RESPONSE )
+                            if ( G_conn_hot[ci].state == CONN_STATE_READY_TO_SEND_RESPONSE )
                             {
                                 DDBG("ci=%d, state == CONN_STATE_READY_TO_SEND_RESPONSE", ci);
 #ifdef NPP_HTTP2
                                 if ( G_connections[ci].http2_upgrade_in_progress )    /* switching protocol in progress; send only 101 header, follow with settings frame */
                                 {
-                                    bytes = send(G_connections[ci].fd, G_connections[ci].out_start, G_connections[ci].out_hlen, 0);
+                                    bytes = send(G_conn_hot[ci].fd, G_connections[ci].out_start, G_connections[ci].out_hlen, 0);
 
                                     http2_add_frame(ci, HTTP2_FRAME_TYPE_SETTINGS);
 #ifdef NPP_DEBUG
                                     DBG("ci=%d, Sending SETTINGS frame", ci);
-                                    DBG("ci=%d, trying to write %u bytes to fd=%d", ci, G_connections[ci].http2_bytes_to_send, G_connections[ci].fd);
+                                    DBG("ci=%d, trying to write %u bytes to fd=%d", ci, G_connections[ci].http2_bytes_to_send, G_conn_hot[ci].fd);
 #endif  /* NPP_DEBUG */
-                                    bytes = send(G_connections[ci].fd, G_connections[ci].http2_frame_start, G_connections[ci].http2_bytes_to_send, 0);
+                                    bytes = send(G_conn_hot[ci].fd, G_connections[ci].http2_frame_start, G_connections[ci].http2_bytes_to_send, 0);
 
                                     DDBG("ci=%d, changing state to CONN_STATE_READY_FOR_CLIENT_PREFACE", ci);
-                                    G_connections[ci].state = CONN_STATE_READY_FOR_CLIENT_PREFACE;
+                                    G_conn_hot[ci].state = CONN_STATE_READY_FOR_CLIENT_PREFACE;
                                 }
                                 else    /* header to send */
                                 {
@@ -984,21 +1436,26 @@ int main(int argc, char **argv)
                                     {
                                         http2_add_frame(ci, HTTP2_FRAME_TYPE_HEADERS);
 
-                                        bytes = send(G_connections[ci].fd, G_connections[ci].http2_frame_start, G_connections[ci].http2_bytes_to_send, 0);
+                                        bytes = send(G_conn_hot[ci].fd, G_connections[ci].http2_frame_start, G_connections[ci].http2_bytes_to_send, 0);
                                     }
                                     else    /* HTTP/1 */
                                     {
 #endif  /* NPP_HTTP2 */
-                                        DDBG("ci=%d, trying to write %u bytes to fd=%d", ci, G_connections[ci].out_len, G_connections[ci].fd);
+                                        DDBG("ci=%d, trying to write %u bytes to fd=%d", ci, G_conn_hot[ci].out_len, G_conn_hot[ci].fd);
 
-                                        while ( G_connections[ci].data_sent < G_connections[ci].out_len )
+#ifndef _WIN32
+                                        if ( G_connections[ci].out_body )
+                                            bytes = send_static(ci, FALSE);
+                                        else
+#endif
+                                        while ( G_conn_hot[ci].data_sent < G_conn_hot[ci].out_len )
                                         {
-                                            bytes = send(G_connections[ci].fd, G_connections[ci].out_start+G_connections[ci].data_sent, G_connections[ci].out_len-G_connections[ci].data_sent, 0);
+                                            bytes = send(G_conn_hot[ci].fd, G_connections[ci].out_start+G_conn_hot[ci].data_sent, G_conn_hot[ci].out_len-G_conn_hot[ci].data_sent, 0);
 
                                             if ( bytes > 0 )
                                             {
                                                 DDBG("ci=%d, sent %d bytes", ci, bytes);
-                                                G_connections[ci].data_sent += bytes;
+                                                G_conn_hot[ci].data_sent += bytes;
                                             }
                                             else
                                                 break;
@@ -1010,7 +1467,7 @@ int main(int argc, char **argv)
                                 }
 #endif  /* NPP_HTTP2 */
                             }
-                            else if ( G_connections[ci].state == CONN_STATE_SENDING_CONTENT )
+                            else if ( G_conn_hot[ci].state == CONN_STATE_SENDING_CONTENT )
                             {
                                 DDBG("ci=%d, state == CONN_STATE_SENDING_CONTENT", ci);
 #ifdef NPP_HTTP2
@@ -1018,21 +1475,26 @@ int main(int argc, char **argv)
                                 {
                                     http2_add_frame(ci, HTTP2_FRAME_TYPE_DATA);
 
-                                    bytes = send(G_connections[ci].fd, G_connections[ci].http2_frame_start, G_connections[ci].http2_bytes_to_send, 0);
+                                    bytes = send(G_conn_hot[ci].fd, G_connections[ci].http2_frame_start, G_connections[ci].http2_bytes_to_send, 0);
                                 }
                                 else
                                 {
 #endif  /* NPP_HTTP2 */
-                                    DDBG("ci=%d, trying to write %u bytes to fd=%d", ci, G_connections[ci].out_len-G_connections[ci].data_sent, G_connections[ci].fd);
+                                    DDBG("ci=%d, trying to write %u bytes to fd=%d", ci, G_conn_hot[ci].out_len-G_conn_hot[ci].data_sent, G_conn_hot[ci].fd);
 
-                                    while ( G_connections[ci].data_sent < G_connections[ci].out_len )
+#ifndef _WIN32
+                                    if ( G_connections[ci].out_body )
+                                        bytes = send_static(ci, FALSE);
+                                    else
+#endif
+                                    while ( G_conn_hot[ci].data_sent < G_conn_hot[ci].out_len )
                                     {
-                                        bytes = send(G_connections[ci].fd, G_connections[ci].out_start+G_connections[ci].data_sent, G_connections[ci].out_len-G_connections[ci].data_sent, 0);
+                                        bytes = send(G_conn_hot[ci].fd, G_connections[ci].out_start+G_conn_hot[ci].data_sent, G_conn_hot[ci].out_len-G_conn_hot[ci].data_sent, 0);
 
                                         if ( bytes > 0 )
                                         {
                                             DDBG("ci=%d, sent %d bytes", ci, bytes);
-                                            G_connections[ci].data_sent += bytes;
+                                            G_conn_hot[ci].data_sent += bytes;
                                         }
                                         else
                                             break;
@@ -1050,7 +1512,7 @@ int main(int argc, char **argv)
                     else    /* not IN nor OUT */
                     {
 #ifdef NPP_DEBUG
-                        DBG("Not IN nor OUT, ci=%d, fd=%d, state = %c", ci, G_connections[ci].fd, G_connections[ci].state);
+                        DBG("Not IN nor OUT, ci=%d, fd=%d, state = %c", ci, G_conn_hot[ci].fd, G_conn_hot[ci].state);
 #ifndef NPP_CPP_STRINGS
 #ifdef NPP_FD_MON_POLL
                         DBG("revents=%d", M_pollfds[pi].revents);
@@ -1066,14 +1528,14 @@ int main(int argc, char **argv)
                     /* --------------------------------------------------------------------------------------- */
                     /* after reading / writing it may be ready for parsing and processing ... */
 
-                    if ( G_connections[ci].state == CONN_STATE_READY_FOR_PARSE )
+                    if ( G_conn_hot[ci].state == CONN_STATE_READY_FOR_PARSE )
                     {
-                        G_connections[ci].status = parse_req(ci, G_connections[ci].was_read);
+                        G_connections[ci].status = parse_req(ci, G_conn_hot[ci].was_read);
 
-                        if ( G_connections[ci].state != CONN_STATE_READING_DATA )
+                        if ( G_conn_hot[ci].state != CONN_STATE_READING_DATA )
                         {
                             DDBG("ci=%d, changing state to CONN_STATE_READY_FOR_PROCESS", ci);
-                            G_connections[ci].state = CONN_STATE_READY_FOR_PROCESS;
+                            G_conn_hot[ci].state = CONN_STATE_READY_FOR_PROCESS;
                         }
                     }
 
@@ -1084,7 +1546,7 @@ int main(int argc, char **argv)
 
                     /* ready for processing */
 
-                    if ( G_connections[ci].state == CONN_STATE_READY_FOR_PROCESS )
+                    if ( G_conn_hot[ci].state == CONN_STATE_READY_FOR_PROCESS )
                     {
 #ifdef _WIN32
                         clock_gettime_win(&G_connections[ci].proc_start);
@@ -1092,7 +1554,7 @@ int main(int argc, char **argv)
                         clock_gettime(MONOTONIC_CLOCK_NAME, &G_connections[ci].proc_start);
 #endif
                         /* update visits counter */
-                        if ( !G_connections[ci].resource[0] && G_connections[ci].status==200 && !NPP_CONN_IS_BOT(G_connections[ci].flags) && G_connections[ci].method[0]!='H' && 0==strcmp(G_connections[ci].host, NPP_APP_DOMAIN) )
+                        if ( !G_connections[ci].resource[0] && G_connections[ci].status==200 && !NPP_CONN_IS_BOT(G_conn_hot[ci].flags) && G_connections[ci].method[0]!='H' && 0==strcmp(G_connections[ci].host, NPP_APP_DOMAIN) )
                         {
                             ++G_cnts_today.visits;
 
@@ -1105,12 +1567,12 @@ int main(int argc, char **argv)
                         }
 #ifdef NPP_DEBUG
                         if ( G_connections[ci].static_res != NPP_NOT_STATIC )
-                            DBG("ci=%d, static resource [%s]", ci, G_connections[ci].uri);
+                            DBG("ci=%d, static resource [%s]", ci, G_connections[ci].cold->uri);
 #endif
-                        if ( !G_connections[ci].location[0] && G_connections[ci].static_res == NPP_NOT_STATIC )   /* process request */
+                        if ( !G_connections[ci].cold->location[0] && G_connections[ci].static_res == NPP_NOT_STATIC )   /* process request */
                             process_req(ci);
 #ifdef NPP_ASYNC
-                        if ( G_connections[ci].state != CONN_STATE_WAITING_FOR_ASYNC )
+                        if ( G_conn_hot[ci].state != CONN_STATE_WAITING_FOR_ASYNC )
 #endif
                         gen_response_header(ci);
                     }
@@ -1118,23 +1580,23 @@ int main(int argc, char **argv)
                     /* this should not ever happen */
 #ifdef NPP_DEBUG
 #ifdef NPP_FD_MON_SELECT
-                    if ( ci > NPP_MAX_CONNECTIONS )
+                    if ( ci > G_maxConnections )
                     {
-                        WAR("ci > NPP_MAX_CONNECTIONS, breaking");
+                        WAR("ci > G_maxConnections, breaking");
                         break;
                     }
 #endif
 #ifdef NPP_FD_MON_POLL
-                    if ( pi > NPP_MAX_CONNECTIONS+NPP_LISTENING_FDS )
+                    if ( pi > G_maxConnections+NPP_LISTENING_FDS )
                     {
-                        WAR("pi > NPP_MAX_CONNECTIONS+NPP_LISTENING_FDS, breaking");
+                        WAR("pi > G_maxConnections+NPP_LISTENING_FDS, breaking");
                         break;
                     }
 #endif
 #ifdef NPP_FD_MON_EPOLL
-                    if ( epi > NPP_MAX_CONNECTIONS+NPP_LISTENING_FDS )
+                    if ( epi > G_maxConnections+NPP_LISTENING_FDS )
                     {
-                        WAR("epi > NPP_MAX_CONNECTIONS+NPP_LISTENING_FDS, breaking");
+                        WAR("epi > G_maxConnections+NPP_LISTENING_FDS, breaking");
                         break;
                     }
 #endif
@@ -1161,9 +1623,9 @@ int main(int argc, char **argv)
         async_res_t res;
 #ifdef NPP_DEBUG
         int mq_ret;
-        if ( (mq_ret=mq_receive(G_queue_res, (char*)&res, NPP_ASYNC_RES_MSG_SIZE, NULL)) != -1 )    /* there's a response in the queue */
+        if ( (mq_ret=mq_receive(G_queue_res, (char*)&res, NPP_ASYNC_RES_MSG_SIZE, NULL)) != -1 && async_res_wanted(&res) )    /* there's a response in the queue */
 #else
-        if ( mq_receive(G_queue_res, (char*)&res, NPP_ASYNC_RES_MSG_SIZE, NULL) != -1 )    /* there's a response in the queue */
+        if ( mq_receive(G_queue_res, (char*)&res, NPP_ASYNC_RES_MSG_SIZE, NULL) != -1 && async_res_wanted(&res) )    /* there's a response in the queue */
 #endif  /* NPP_DEBUG */
         {
 #ifdef NPP_DEBUG
@@ -1254,7 +1716,7 @@ int main(int argc, char **argv)
 
                 /* update connection details */
 
-                strcpy(G_connections[res.ci].cust_headers, res.hdr.cust_headers);
+                strcpy(G_connections[res.ci].cold->cust_headers, res.hdr.cust_headers);
                 G_connections[res.ci].cust_headers_len = res.hdr.cust_headers_len;
                 G_connections[res.ci].out_ctype = res.hdr.out_ctype;
                 strcpy(G_connections[res.ci].ctypestr, res.hdr.ctypestr);
@@ -1263,9 +1725,9 @@ int main(int argc, char **argv)
                 strcpy(G_connections[res.ci].cookie_out_a_exp, res.hdr.cookie_out_a_exp);
                 strcpy(G_connections[res.ci].cookie_out_l, res.hdr.cookie_out_l);
                 strcpy(G_connections[res.ci].cookie_out_l_exp, res.hdr.cookie_out_l_exp);
-                strcpy(G_connections[res.ci].location, res.hdr.location);
+                strcpy(G_connections[res.ci].cold->location, res.hdr.location);
 
-                G_connections[res.ci].flags = res.hdr.flags;
+                G_conn_hot[res.ci].flags = res.hdr.flags;
 
                 /* update HTTP calls stats */
 
@@ -1294,6 +1756,11 @@ int main(int argc, char **argv)
                 res_data = resd->data;
             }
 
+            /* WebSocket reply goes after the frames sent to it meanwhile */
+
+            if ( ASYNC_CHUNK_IS_FIRST(res.chunk) && G_connections[res_ci].ws_state != WS_STATE_NONE )
+                G_connections[res_ci].ws_reply = G_connections[res_ci].p_content - G_connections[res_ci].out_data;
+
             /* out data */
 
             if ( res_len > 0 )    /* chunk length */
@@ -1314,14 +1781,14 @@ int main(int argc, char **argv)
 
                 M_areqs[res_ai].state = NPP_ASYNC_STATE_FREE;
 
-                if ( G_connections[res_ci].location[0] )
+                if ( G_connections[res_ci].cold->location[0] )
                     G_connections[res_ci].status = 303;
 
                 gen_response_header(res_ci);
             }
         }
 #ifdef NPP_DEBUG
-        else
+        else if ( mq_ret == -1 )
         {
             static time_t last_time=0;   /* prevent log overflow */
 
@@ -1337,24 +1804,115 @@ int main(int argc, char **argv)
 
 #endif  /* NPP_ASYNC */
 
+        /* slow clients marked during this pass */
+
+        if ( M_lagging_cnt )
+            close_lagging();
+
         /* under heavy load there might never be that sockets_ready==0 */
-        /* make sure it runs at least every 10 seconds */
-#ifdef NPP_DEBUG
-//        DBG("M_last_housekeeping = %ld", M_last_housekeeping);
-//        DBG("              G_now = %ld", G_now);
-#endif
-        if ( M_last_housekeeping < G_now-10 )
+        /* so check the clock on every iteration and run it once a second */
+        /* housekeeping work per tick is bounded by NPP_HOUSEKEEPING_BUDGET */
+
+        if ( M_last_housekeeping != G_now )
         {
-            INF_T("M_last_housekeeping < G_now-10 ==> run housekeeping");
-            if ( !housekeeping() )
+            if ( !housekeeping(idle) )
                 return EXIT_FAILURE;
         }
+
+#ifdef NPP_APP_EVERY_SPARE_SECOND
+        /* but the application's hook only when we have some time */
+
+        if ( idle && M_last_spare_second != G_now )
+        {
+            npp_app_every_spare_second();
+            M_last_spare_second = G_now;
+        }
+#endif  /* NPP_APP_EVERY_SPARE_SECOND */
     }
 
     return EXIT_SUCCESS;
 }
 
 
+#ifndef _WIN32
+/* --------------------------------------------------------------------------
+   Adaptive compression of generated content
+   Called once a second. Event loop utilisation is the time not spent
+   waiting for events. When the loop is saturated, lower the deflate
+   level and then raise the threshold. When it's idle, undo that and
+   raise the level, as long as twice the recent compression time
+   still fits in the idle time.
+-------------------------------------------------------------------------- */
+static void compress_adapt()
+{
+    if ( M_loop_start.tv_sec == 0 )     /* first call */
+    {
+        clock_gettime(MONOTONIC_CLOCK_NAME, &M_loop_start);
+        M_loop_idle = 0;
+        return;
+    }
+
+    double elapsed = npp_elapsed(&M_loop_start);
+
+    if ( elapsed <= 0 ) return;
+
+    double busy = 100.0 - M_loop_idle * 100.0 / elapsed;
+
+    if ( busy < 0 ) busy = 0;
+
+    G_loop_busy = (G_loop_busy + busy) / 2;     /* smooth out the spikes */
+
+    if ( M_compress_bytes > 0 )
+    {
+        double cost = M_compress_ms * 1000000.0 / M_compress_bytes;
+        G_compress_cost = G_compress_cost ? (G_compress_cost + cost) / 2 : cost;
+    }
+
+    if ( G_loop_busy > NPP_COMPRESS_LOOP_BUSY )     /* compress cheaper */
+    {
+        if ( G_compress_level > Z_BEST_SPEED )
+        {
+            --G_compress_level;
+            ++G_cnts_today.compress_cheaper;
+            DBG("Loop busy %.0lf%%, compression level down to %d", G_loop_busy, G_compress_level);
+        }
+        else if ( G_compress_treshold < NPP_COMPRESS_TRESHOLD_MAX )
+        {
+            G_compress_treshold *= 2;
+            if ( G_compress_treshold > NPP_COMPRESS_TRESHOLD_MAX )
+                G_compress_treshold = NPP_COMPRESS_TRESHOLD_MAX;
+            ++G_cnts_today.compress_cheaper;
+            DBG("Loop busy %.0lf%%, compression threshold up to %u", G_loop_busy, G_compress_treshold);
+        }
+    }
+    else if ( G_loop_busy < NPP_COMPRESS_LOOP_IDLE )    /* compress harder */
+    {
+        if ( G_compress_treshold > NPP_COMPRESS_TRESHOLD )
+        {
+            G_compress_treshold /= 2;
+            if ( G_compress_treshold < NPP_COMPRESS_TRESHOLD )
+                G_compress_treshold = NPP_COMPRESS_TRESHOLD;
+            ++G_cnts_today.compress_harder;
+            DBG("Loop busy %.0lf%%, compression threshold down to %u", G_loop_busy, G_compress_treshold);
+        }
+        else if ( G_compress_level < NPP_COMPRESS_LEVEL_MAX && M_compress_ms * 2 < M_loop_idle )
+        {
+            ++G_compress_level;
+            ++G_cnts_today.compress_harder;
+            DBG("Loop busy %.0lf%%, compression level up to %d", G_loop_busy, G_compress_level);
+        }
+    }
+
+    /* start a new window */
+
+    clock_gettime(MONOTONIC_CLOCK_NAME, &M_loop_start);
+    M_loop_idle = 0;
+    M_compress_ms = 0;
+    M_compress_bytes = 0;
+}
+#endif  /* _WIN32 */
+
+
 /* --------------------------------------------------------------------------
    Set values for Expires response headers
 -------------------------------------------------------------------------- */
@@ -1370,8 +1928,9 @@ static void set_expiry_dates()
 
 /* --------------------------------------------------------------------------
    Close expired sessions etc...
+   idle = the last wait returned nothing
 -------------------------------------------------------------------------- */
-static bool housekeeping()
+static bool housekeeping(bool idle)
 {
 //    DDBG("housekeeping");
 
@@ -1381,24 +1940,26 @@ static bool housekeeping()
     /* close expired anonymous user sessions */
     if ( G_sessions_cnt ) uses_close_timeouted();
 
-//#ifdef NPP_DEBUG
+#ifndef _WIN32
+    /* tune compression to the event loop utilisation */
+    compress_adapt();
+#endif
+
+#ifdef __linux__
+    /* publish this worker's counters for worker 0 */
+    if ( M_workers_cnts )
+        memcpy(&M_workers_cnts[M_wi], &G_cnts_today, sizeof(npp_counters_t));
+#endif
+
 #ifndef NPP_DONT_RESCAN_RES
-    if ( G_test )   /* kind of developer mode */
+    if ( M_watching )   /* only what's changed */
+        update_resources();
+    else if ( G_test && (idle || M_last_test_rescan <= G_now-NPP_TEST_RESCAN_BUSY) )  /* kind of developer mode -- not every second under load */
     {
         read_resources(FALSE);
+        M_last_test_rescan = G_now;
     }
 #endif  /* NPP_DONT_RESCAN_RES */
-//#endif  /* NPP_DEBUG */
-
-#ifdef NPP_APP_EVERY_SPARE_SECOND
-//static time_t every_spare_second_last_time=0;
-
-//    if ( G_now != every_spare_second_last_time )
-//    {
-        npp_app_every_spare_second();
-//        every_spare_second_last_time = G_now;
-//    }
-#endif  /* NPP_APP_EVERY_SPARE_SECOND */
 
     if ( G_ptm->tm_min != M_prev_minute )
     {
@@ -1416,13 +1977,36 @@ static bool housekeeping()
         /* say something sometimes ... */
         ALWAYS_T("%u request(s) | %d connection(s) | %d session(s)", G_cnts_today.req, G_connections_cnt, G_sessions_cnt);
 
-        npp_log_flush();
+        if ( G_workers > 1 && M_wi == 0 )
+        {
+            npp_counters_t total;
+            workers_counters(&total);
+            ALWAYS_T("%u request(s) in all %d workers", total.req, G_workers);
+        }
 
-#ifndef NPP_DONT_RESCAN_RES    /* refresh static resources */
-        read_resources(FALSE);
-#endif
+        /* accept queue overflows -- system-wide so only worker 0 checks */
 
-        /* start new log file every day */
+        if ( M_wi == 0 )
+        {
+            unsigned overflows = listen_overflows();
+
+            if ( overflows > M_listen_overflows )
+            {
+                WAR("%u listen queue overflow(s) in the last minute, consider increasing listenBacklog", overflows-M_listen_overflows);
+                G_cnts_today.listen_overflows += overflows - M_listen_overflows;
+            }
+
+            M_listen_overflows = overflows;
+        }
+
+        npp_log_flush();
+
+#ifndef NPP_DONT_RESCAN_RES    /* refresh static resources */
+        if ( !M_watching )
+            read_resources(FALSE);
+#endif
+
+        /* start new log file every day */
 
         if ( G_ptm->tm_mday != M_prev_day )
         {
@@ -1430,7 +2014,7 @@ static bool housekeeping()
 
             dump_counters();
             npp_log_finish();
-            if ( !npp_log_start("", G_test, FALSE) )
+            if ( !npp_log_start(M_log_prefix, G_test, FALSE) )
             {
                 clean_up();
                 return FALSE;
@@ -1479,7 +2063,7 @@ static void http2_check_client_preface(int ci)
 {
     DDBG("ci=%d, http2_check_client_preface", ci);
 
-    if ( strcmp(G_connections[ci].in, HTTP2_CLIENT_PREFACE) == 0 )
+    if ( strcmp(G_connections[ci].cold->in, HTTP2_CLIENT_PREFACE) == 0 )
     {
         DBG("HTTP/2 client preface OK");
 
@@ -1580,7 +2164,7 @@ static void http2_parse_frame(int ci, int bytes)
 //    http2_frame_hdr_t hdr;
     char hdr[HTTP2_FRAME_HDR_LEN]={0};
 
-    memcpy(&hdr, &G_connections[ci].in, HTTP2_FRAME_HDR_LEN);
+    memcpy(&hdr, &G_connections[ci].cold->in, HTTP2_FRAME_HDR_LEN);
 
     int32_t length=0;
 
@@ -1629,7 +2213,7 @@ static void http2_add_frame(int ci, unsigned char type)
 
     if ( type == HTTP2_FRAME_TYPE_DATA )
     {
-        frame_pld_len = G_connections[ci].out_len - G_connections[ci].out_hlen;
+        frame_pld_len = G_conn_hot[ci].out_len - G_connections[ci].out_hlen;
     }
     else if ( type == HTTP2_FRAME_TYPE_HEADERS )
     {
@@ -1865,8 +2449,8 @@ static void http2_hdr_location(int ci)
     DDBG("http2_hdr_location");
 
     *G_connections[ci].p_header++ = (0x80 | HTTP2_HDR_LOCATION);
-    *G_connections[ci].p_header++ = (char)strlen(G_connections[ci].location);
-    HOUT(G_connections[ci].location);
+    *G_connections[ci].p_header++ = (char)strlen(G_connections[ci].cold->location);
+    HOUT(G_connections[ci].cold->location);
 }
 
 
@@ -1979,6 +2563,19 @@ static void http2_hdr_last_modified(int ci, const char *val)
 }
 
 
+/* --------------------------------------------------------------------------
+   Add HTTP/2 header
+-------------------------------------------------------------------------- */
+static void http2_hdr_etag(int ci, const char *val)
+{
+    DDBG("http2_hdr_etag");
+
+    *G_connections[ci].p_header++ = (0x80 | HTTP2_HDR_ETAG);
+    *G_connections[ci].p_header++ = (char)strlen(val);
+    HOUT(val);
+}
+
+
 /* --------------------------------------------------------------------------
    Add HTTP/2 header
 -------------------------------------------------------------------------- */
@@ -2045,6 +2642,55 @@ static void http2_hdr_server(int ci)
 #endif  /* NPP_HTTP2 */
 
 
+/* --------------------------------------------------------------------------
+   Drop empty lines before the request line
+   RFC 7230 3.5 -- some clients send CRLF after the payload
+-------------------------------------------------------------------------- */
+static void skip_empty_lines(int ci)
+{
+    unsigned skip=0;
+
+    while ( skip < G_conn_hot[ci].was_read && (G_connections[ci].cold->in[skip]=='\r' || G_connections[ci].cold->in[skip]=='\n') )
+        ++skip;
+
+    if ( !skip ) return;
+
+    G_conn_hot[ci].was_read -= skip;
+    memmove(G_connections[ci].cold->in, G_connections[ci].cold->in+skip, G_conn_hot[ci].was_read);
+    G_connections[ci].cold->in[G_conn_hot[ci].was_read] = EOS;
+}
+
+
+#ifdef NPP_HTTPS
+/* --------------------------------------------------------------------------
+   SSL_read request to G_connections[ci].cold->in
+   OpenSSL can hold decrypted data that epoll doesn't know about,
+   so keep reading while there is some
+-------------------------------------------------------------------------- */
+static int ssl_read_in(int ci)
+{
+    int bytes, more;
+
+    bytes = SSL_read(G_conn_hot[ci].ssl, G_connections[ci].cold->in+G_conn_hot[ci].was_read, NPP_IN_BUFSIZE-1-G_conn_hot[ci].was_read);
+
+    if ( bytes <= 0 ) return bytes;
+
+    G_conn_hot[ci].was_read += bytes;
+
+    while ( G_conn_hot[ci].was_read < NPP_IN_BUFSIZE-1 && SSL_pending(G_conn_hot[ci].ssl) > 0
+            && (more=SSL_read(G_conn_hot[ci].ssl, G_connections[ci].cold->in+G_conn_hot[ci].was_read, NPP_IN_BUFSIZE-1-G_conn_hot[ci].was_read)) > 0 )
+    {
+        G_conn_hot[ci].was_read += more;
+        bytes += more;
+    }
+
+    DDBG("ci=%d, read %d bytes", ci, bytes);
+
+    return bytes;
+}
+#endif  /* NPP_HTTPS */
+
+
 /* --------------------------------------------------------------------------
    Set connection state after read or write
 -------------------------------------------------------------------------- */
@@ -2061,7 +2707,9 @@ static void set_state(int ci, int bytes, bool secure)
 #endif
         if ( !secure )
         {
-            if ( !NPP_SOCKET_WOULD_BLOCK(sockerr) )
+            /* 0 means the peer has closed, errno is left over from something else then */
+
+            if ( bytes == 0 || !NPP_SOCKET_WOULD_BLOCK(sockerr) )
             {
                 DBG("Closing connection\n");
                 close_connection(ci, TRUE);
@@ -2072,10 +2720,18 @@ static void set_state(int ci, int bytes, bool secure)
 #ifdef NPP_HTTPS
         if ( secure )
         {
+#ifndef _WIN32
+            if ( bytes < 0 && sockerr == EIO )  /* send_static() couldn't read the file */
+            {
+                DBG("Closing connection\n");
+                close_connection(ci, TRUE);
+                return;
+            }
+#endif
 #ifdef NPP_FD_MON_EPOLL
             int prev_ssl_err = G_connections[ci].ssl_err;
 #endif
-            G_connections[ci].ssl_err = SSL_get_error(G_connections[ci].ssl, bytes);
+            G_connections[ci].ssl_err = SSL_get_error(G_conn_hot[ci].ssl, bytes);
 
 #ifdef NPP_DEBUG
             if ( G_connections[ci].ssl_err == SSL_ERROR_SSL )                   /* 1 (A non-recoverable, fatal error in the SSL library occurred, usually a protocol error.) */
@@ -2107,9 +2763,9 @@ static void set_state(int ci, int bytes, bool secure)
 
 #ifdef NPP_FD_MON_POLL
             if ( G_connections[ci].ssl_err == SSL_ERROR_WANT_READ )
-                M_pollfds[G_connections[ci].pi].events = POLLIN;
+                M_pollfds[G_conn_hot[ci].pi].events = POLLIN;
             else if ( G_connections[ci].ssl_err == SSL_ERROR_WANT_WRITE )
-                M_pollfds[G_connections[ci].pi].events = POLLOUT;
+                M_pollfds[G_conn_hot[ci].pi].events = POLLOUT;
 #endif  /* NPP_FD_MON_POLL */
 
 #ifdef NPP_FD_MON_EPOLL
@@ -2119,14 +2775,14 @@ static void set_state(int ci, int bytes, bool secure)
 
                 struct epoll_event ev={0};
 
-                ev.data.fd = G_connections[ci].fd;
+                ev.data.u64 = NPP_EPOLL_DATA(ci);
 
                 if ( G_connections[ci].ssl_err == SSL_ERROR_WANT_READ )
                     ev.events = EPOLLIN | EPOLLET;
                 else if ( G_connections[ci].ssl_err == SSL_ERROR_WANT_WRITE )
                     ev.events = EPOLLOUT | EPOLLET;
 
-                epoll_ctl(M_epoll_fd, EPOLL_CTL_MOD, ev.data.fd, &ev);
+                fd_mon_ctl(EPOLL_CTL_MOD, G_conn_hot[ci].fd, &ev);
             }
 #endif  /* NPP_FD_MON_EPOLL */
         }
@@ -2137,35 +2793,53 @@ static void set_state(int ci, int bytes, bool secure)
 
     /* good to go */
 
-    if ( G_connections[ci].state == CONN_STATE_CONNECTED )
+    if ( G_conn_hot[ci].state == CONN_STATE_CONNECTED )
     {
-        if ( G_connections[ci].was_read > 0 )   /* assume at least the whole header has been read */
+#ifdef NPP_HTTP2
+        if ( G_connections[ci].http_ver[0] != '2' )
+#endif
+        skip_empty_lines(ci);
+
+        if ( G_conn_hot[ci].was_read > 0 )
         {
-            G_connections[ci].in[G_connections[ci].was_read] = EOS;
+            G_connections[ci].cold->in[G_conn_hot[ci].was_read] = EOS;
+
+            /* header may come in pieces, especially when pipelined */
 
-            DDBG("ci=%d, changing state to CONN_STATE_READY_FOR_PARSE", ci);
-            G_connections[ci].state = CONN_STATE_READY_FOR_PARSE;
+#ifdef NPP_HTTP2
+            if ( G_connections[ci].http_ver[0] != '2' && G_conn_hot[ci].was_read < NPP_IN_BUFSIZE-1 && !find_hend(G_connections[ci].cold->in, G_conn_hot[ci].was_read) )
+#else
+            if ( G_conn_hot[ci].was_read < NPP_IN_BUFSIZE-1 && !find_hend(G_connections[ci].cold->in, G_conn_hot[ci].was_read) )
+#endif
+            {
+                DBG("ci=%d, was_read=%u, header incomplete, continue receiving", ci, G_conn_hot[ci].was_read);
+            }
+            else
+            {
+                DDBG("ci=%d, changing state to CONN_STATE_READY_FOR_PARSE", ci);
+                G_conn_hot[ci].state = CONN_STATE_READY_FOR_PARSE;
+            }
         }
     }
-    else if ( G_connections[ci].state == CONN_STATE_READING_DATA )
+    else if ( G_conn_hot[ci].state == CONN_STATE_READING_DATA )
     {
-        if ( G_connections[ci].was_read < G_connections[ci].clen )
+        if ( G_conn_hot[ci].was_read < G_connections[ci].clen )
         {
-            DBG("ci=%d, was_read=%u, continue receiving", ci, G_connections[ci].was_read);
+            DBG("ci=%d, was_read=%u, continue receiving", ci, G_conn_hot[ci].was_read);
         }
         else    /* data received */
         {
-            G_connections[ci].in_data[G_connections[ci].was_read] = EOS;
+            G_connections[ci].in_data[G_conn_hot[ci].was_read] = EOS;
 
             DBG("ci=%d, payload received", ci);
 
             /* ready for processing */
 
             DDBG("ci=%d, changing state to CONN_STATE_READY_FOR_PROCESS", ci);
-            G_connections[ci].state = CONN_STATE_READY_FOR_PROCESS;
+            G_conn_hot[ci].state = CONN_STATE_READY_FOR_PROCESS;
         }
     }
-    else if ( G_connections[ci].state == CONN_STATE_READY_TO_SEND_RESPONSE )
+    else if ( G_conn_hot[ci].state == CONN_STATE_READY_TO_SEND_RESPONSE )
     {
         if ( G_connections[ci].clen == 0 )   /* no content to send */
         {
@@ -2173,12 +2847,15 @@ static void set_state(int ci, int bytes, bool secure)
 
             /* assume the whole header has been sent */
 
+            if ( response_continues(ci) )
+                return;
+
             log_request(ci);
 
 #ifdef NPP_HTTP2
-            if ( NPP_CONN_IS_KEEP_ALIVE(G_connections[ci].flags) || G_connections[ci].http_ver[0] == '2' )
+            if ( NPP_CONN_IS_KEEP_ALIVE(G_conn_hot[ci].flags) || G_connections[ci].http_ver[0] == '2' )
 #else
-            if ( NPP_CONN_IS_KEEP_ALIVE(G_connections[ci].flags) )
+            if ( NPP_CONN_IS_KEEP_ALIVE(G_conn_hot[ci].flags) )
 #endif
             {
                 DBG("End of processing, reset_conn\n");
@@ -2192,25 +2869,28 @@ static void set_state(int ci, int bytes, bool secure)
         }
         else    /* there was a content to send */
         {
-            DDBG("ci=%d, data_sent = %u", ci, G_connections[ci].data_sent);
+            DDBG("ci=%d, data_sent = %u", ci, G_conn_hot[ci].data_sent);
 
 #ifdef NPP_HTTP2
-            if ( G_connections[ci].data_sent < G_connections[ci].out_len && G_connections[ci].http_ver[0] != '2' )
+            if ( G_conn_hot[ci].data_sent < G_conn_hot[ci].out_len && G_connections[ci].http_ver[0] != '2' )
 #else
-            if ( G_connections[ci].data_sent < G_connections[ci].out_len )   /* not all have been sent yet */
+            if ( G_conn_hot[ci].data_sent < G_conn_hot[ci].out_len )   /* not all have been sent yet */
 #endif  /* NPP_HTTP2 */
             {
                 DDBG("ci=%d, changing state to CONN_STATE_SENDING_CONTENT", ci);
-                G_connections[ci].state = CONN_STATE_SENDING_CONTENT;
+                G_conn_hot[ci].state = CONN_STATE_SENDING_CONTENT;
             }
             else    /* the whole content has been sent at once */
             {
+                if ( response_continues(ci) )
+                    return;
+
                 log_request(ci);
 
 #ifdef NPP_HTTP2
-                if ( NPP_CONN_IS_KEEP_ALIVE(G_connections[ci].flags) || G_connections[ci].http_ver[0] == '2' )
+                if ( NPP_CONN_IS_KEEP_ALIVE(G_conn_hot[ci].flags) || G_connections[ci].http_ver[0] == '2' )
 #else
-                if ( NPP_CONN_IS_KEEP_ALIVE(G_connections[ci].flags) )
+                if ( NPP_CONN_IS_KEEP_ALIVE(G_conn_hot[ci].flags) )
 #endif
                 {
                     DBG("End of processing, reset_conn\n");
@@ -2224,20 +2904,23 @@ static void set_state(int ci, int bytes, bool secure)
             }
         }
     }
-    else if ( G_connections[ci].state == CONN_STATE_SENDING_CONTENT )
+    else if ( G_conn_hot[ci].state == CONN_STATE_SENDING_CONTENT )
     {
-        if ( G_connections[ci].data_sent < G_connections[ci].out_len )
+        if ( G_conn_hot[ci].data_sent < G_conn_hot[ci].out_len )
         {
-            DBG("ci=%d, data_sent=%u, continue sending", ci, G_connections[ci].data_sent);
+            DBG("ci=%d, data_sent=%u, continue sending", ci, G_conn_hot[ci].data_sent);
         }
         else    /* all sent */
         {
+            if ( response_continues(ci) )
+                return;
+
             log_request(ci);
 
 #ifdef NPP_HTTP2
-            if ( NPP_CONN_IS_KEEP_ALIVE(G_connections[ci].flags) || G_connections[ci].http_ver[0] == '2' )
+            if ( NPP_CONN_IS_KEEP_ALIVE(G_conn_hot[ci].flags) || G_connections[ci].http_ver[0] == '2' )
 #else
-            if ( NPP_CONN_IS_KEEP_ALIVE(G_connections[ci].flags) )
+            if ( NPP_CONN_IS_KEEP_ALIVE(G_conn_hot[ci].flags) )
 #endif
             {
                 DBG("End of processing, reset_conn\n");
@@ -2262,15 +2945,15 @@ static void respond_to_expect(int ci)
     static char reply_refuse[]="HTTP/1.1 413 Request Entity Too Large\r\n\r\n";
     int bytes;
 
-    if ( G_connections[ci].clen >= NPP_MAX_PAYLOAD_SIZE-1 )   /* refuse */
+    if ( G_connections[ci].clen >= MAX_PAYLOAD_ACCEPTED-1 )   /* refuse */
     {
         INF("Sending 413");
 #ifdef NPP_HTTPS
-        if ( NPP_CONN_IS_SECURE(G_connections[ci].flags) )
-            bytes = SSL_write(G_connections[ci].ssl, reply_refuse, 41);
+        if ( NPP_CONN_IS_SECURE(G_conn_hot[ci].flags) )
+            bytes = SSL_write(G_conn_hot[ci].ssl, reply_refuse, 41);
         else
 #endif
-            bytes = send(G_connections[ci].fd, reply_refuse, 41, 0);
+            bytes = send(G_conn_hot[ci].fd, reply_refuse, 41, 0);
 
         if ( bytes < 41 ) ERR("write error, bytes = %d", bytes);
     }
@@ -2279,11 +2962,11 @@ static void respond_to_expect(int ci)
         INF("Sending 100");
 
 #ifdef NPP_HTTPS
-        if ( NPP_CONN_IS_SECURE(G_connections[ci].flags) )
-            bytes = SSL_write(G_connections[ci].ssl, reply_accept, 25);
+        if ( NPP_CONN_IS_SECURE(G_conn_hot[ci].flags) )
+            bytes = SSL_write(G_conn_hot[ci].ssl, reply_accept, 25);
         else
 #endif
-            bytes = send(G_connections[ci].fd, reply_accept, 25, 0);
+            bytes = send(G_conn_hot[ci].fd, reply_accept, 25, 0);
 
         if ( bytes < 25 ) ERR("write error, bytes = %d", bytes);
     }
@@ -2317,58 +3000,10 @@ static void log_request(int ci)
     strftime(logtime, 64, "%d/%b/%Y:%H:%M:%S +0000", G_ptm);
 
     if ( G_logCombined )
-        INF("%s - - [%s] \"%s /%s HTTP/%s\" %d %u \"%s\" \"%s\"  #%u  %.3lf ms%s", G_connections[ci].ip, logtime, G_connections[ci].method, G_connections[ci].uri, G_connections[ci].http_ver, G_connections[ci].status, G_connections[ci].clen, G_connections[ci].referer, G_connections[ci].uagent, G_connections[ci].req, G_connections[ci].elapsed, REQ_BOT?"  [bot]":"");
+        INF("%s - - [%s] \"%s /%s HTTP/%s\" %d %u \"%s\" \"%s\"  #%u  %.3lf ms%s", G_connections[ci].ip, logtime, G_connections[ci].method, G_connections[ci].cold->uri, G_connections[ci].http_ver, G_connections[ci].status, G_connections[ci].clen, G_connections[ci].cold->referer, G_connections[ci].cold->uagent, G_connections[ci].req, G_connections[ci].elapsed, REQ_BOT?"  [bot]":"");
     else
-        INF("%s - - [%s] \"%s /%s HTTP/%s\" %d %u  #%u  %.3lf ms%s", G_connections[ci].ip, logtime, G_connections[ci].method, G_connections[ci].uri, G_connections[ci].http_ver, G_connections[ci].status, G_connections[ci].clen, G_connections[ci].req, G_connections[ci].elapsed, REQ_BOT?"  [bot]":"");
-}
-
-
-#ifdef NPP_FD_MON_EPOLL
-/* --------------------------------------------------------------------------
-   Compare
--------------------------------------------------------------------------- */
-static int compare_epoll_idx(const void *a, const void *b)
-{
-    const epoll_idx_t *p1 = (epoll_idx_t*)a;
-    const epoll_idx_t *p2 = (epoll_idx_t*)b;
-
-    if ( p1->fd < p2->fd )
-        return -1;
-    else if ( p1->fd > p2->fd )
-        return 1;
-
-    return 0;
-}
-
-
-/* --------------------------------------------------------------------------
-   Binary search
--------------------------------------------------------------------------- */
-static int find_epoll_ci(int fd)
-{
-    int first = 0;
-    int last = M_epollfds_cnt - 1;
-    int middle = (first+last) / 2;
-
-    while ( first <= last )
-    {
-        if ( M_epoll_ci[middle].fd < fd )
-            first = middle + 1;
-        else if ( M_epoll_ci[middle].fd == fd )
-            return middle;
-        else
-            last = middle - 1;
-
-        middle = (first+last) / 2;
-    }
-
-    /* not found -- this should never happen! */
-
-    ERR("epoll event with non-existent fd (%d)", fd);
-
-    return -1;
+        INF("%s - - [%s] \"%s /%s HTTP/%s\" %d %u  #%u  %.3lf ms%s", G_connections[ci].ip, logtime, G_connections[ci].method, G_connections[ci].cold->uri, G_connections[ci].http_ver, G_connections[ci].status, G_connections[ci].clen, G_connections[ci].req, G_connections[ci].elapsed, REQ_BOT?"  [bot]":"");
 }
-#endif  /* NPP_FD_MON_EPOLL */
 
 
 /* --------------------------------------------------------------------------
@@ -2376,13 +3011,13 @@ static int find_epoll_ci(int fd)
 -------------------------------------------------------------------------- */
 static void close_connection(int ci, bool update_first_free)
 {
-    DDBG("ci=%d, close_connection, fd=%d", ci, G_connections[ci].fd);
+    DDBG("ci=%d, close_connection, fd=%d", ci, G_conn_hot[ci].fd);
 
 #ifdef NPP_HTTPS
-    if ( G_connections[ci].ssl )
+    if ( G_conn_hot[ci].ssl )
     {
-        SSL_free(G_connections[ci].ssl);
-        G_connections[ci].ssl = NULL;
+        SSL_free(G_conn_hot[ci].ssl);
+        G_conn_hot[ci].ssl = NULL;
     }
 #endif  /* NPP_HTTPS */
 
@@ -2390,45 +3025,45 @@ static void close_connection(int ci, bool update_first_free)
 
     M_pollfds_cnt--;
 
-    if ( G_connections[ci].pi != M_pollfds_cnt )    /* move the last one to just freed spot */
+    if ( G_conn_hot[ci].pi != M_pollfds_cnt )    /* move the last one to just freed spot */
     {
-        memcpy(&M_pollfds[G_connections[ci].pi], &M_pollfds[M_pollfds_cnt], sizeof(struct pollfd));
+        memcpy(&M_pollfds[G_conn_hot[ci].pi], &M_pollfds[M_pollfds_cnt], sizeof(struct pollfd));
         /* update cross-references */
-        M_poll_ci[G_connections[ci].pi] = M_poll_ci[M_pollfds_cnt];
-        G_connections[M_poll_ci[M_pollfds_cnt]].pi = G_connections[ci].pi;
+        M_poll_ci[G_conn_hot[ci].pi] = M_poll_ci[M_pollfds_cnt];
+        G_conn_hot[M_poll_ci[M_pollfds_cnt]].pi = G_conn_hot[ci].pi;
     }
 
 #endif  /* NPP_FD_MON_POLL */
 
 #ifdef NPP_FD_MON_EPOLL  /* remove from monitored set */
 
-    int epoll_idx = find_epoll_ci(G_connections[ci].fd);
-
-    if ( epoll_idx != -1 )
-        M_epoll_ci[epoll_idx].fd = INT_MAX;
-
-    qsort(&M_epoll_ci, M_epollfds_cnt, sizeof(epoll_idx_t), compare_epoll_idx);
-
     M_epollfds_cnt--;
 
     struct epoll_event ev={0};
 
-    ev.data.fd = G_connections[ci].fd;
-    epoll_ctl(M_epoll_fd, EPOLL_CTL_DEL, ev.data.fd, &ev);
+    ev.data.u64 = NPP_EPOLL_DATA(ci);
+    fd_mon_ctl(EPOLL_CTL_DEL, G_conn_hot[ci].fd, &ev);
+
+    ++G_conn_hot[ci].gen;   /* whatever is still queued for it is stale now */
 
 #endif  /* NPP_FD_MON_EPOLL */
 
 #ifdef _WIN32   /* Windows */
-    closesocket(G_connections[ci].fd);
+    closesocket(G_conn_hot[ci].fd);
 #else
-    close(G_connections[ci].fd);
+    close(G_conn_hot[ci].fd);
 #endif  /* _WIN32 */
 
     reset_conn(ci, CONN_STATE_DISCONNECTED);
 
-    if ( ci == NPP_MAX_CONNECTIONS )
+    if ( ci == G_maxConnections )
         return;
 
+#ifdef NPP_OUT_CHECK_REALLOC
+    out_buf_release(ci);
+#endif
+    cold_release(ci);
+
     G_connections_cnt--;
 
     if ( !update_first_free )
@@ -2459,7 +3094,7 @@ static void close_connection(int ci, bool update_first_free)
         int i;
         for ( i=ci-1; i>=0; i-- )
         {
-            if ( G_connections[i].state != CONN_STATE_DISCONNECTED )    /* used */
+            if ( G_conn_hot[i].state != CONN_STATE_DISCONNECTED )    /* used */
             {
                 M_highest_used_ci = i;
                 DDBG("M_highest_used_ci set to %d", M_highest_used_ci);
@@ -2482,7 +3117,139 @@ static void close_connection(int ci, bool update_first_free)
 }
 
 
+#ifdef NPP_OUT_CHECK_REALLOC
+/* --------------------------------------------------------------------------
+   Give connection an output buffer
+   Reuse an idle one if possible
+-------------------------------------------------------------------------- */
+static bool out_buf_get(int ci)
+{
+    if ( M_out_buf_pool_cnt )
+    {
+        G_connections[ci].out_data_alloc = M_out_buf_pool[--M_out_buf_pool_cnt];
+    }
+    else if ( !(G_connections[ci].out_data_alloc = (char*)malloc(NPP_OUT_BUFSIZE)) )
+    {
+        ERR("malloc for G_connections[%d].out_data failed", ci);
+        return FALSE;
+    }
+
+    G_connections[ci].out_data_allocated = NPP_OUT_BUFSIZE;
+    G_connections[ci].out_data = G_connections[ci].out_data_alloc;
+
+    return TRUE;
+}
+
+
+/* --------------------------------------------------------------------------
+   Take output buffer back from the closed connection
+   Keep up to NPP_OUT_BUF_POOL default-sized ones for reuse
+-------------------------------------------------------------------------- */
+static void out_buf_release(int ci)
+{
+    if ( !G_connections[ci].out_data_alloc )
+        return;
+
+    if ( G_connections[ci].out_data_allocated == NPP_OUT_BUFSIZE && M_out_buf_pool_cnt < NPP_OUT_BUF_POOL )
+        M_out_buf_pool[M_out_buf_pool_cnt++] = G_connections[ci].out_data_alloc;
+    else
+        free(G_connections[ci].out_data_alloc);
+
+    G_connections[ci].out_data_alloc = NULL;
+    G_connections[ci].out_data = NULL;
+}
+#endif  /* NPP_OUT_CHECK_REALLOC */
+
+
+/* --------------------------------------------------------------------------
+   Give connection its request buffer & long strings
+   Reuse idle ones if possible
+-------------------------------------------------------------------------- */
+static bool cold_get(int ci)
+{
+    if ( M_cold_pool_cnt )
+    {
+        G_connections[ci].cold = M_cold_pool[--M_cold_pool_cnt];
+    }
+    else if ( !(G_connections[ci].cold = (npp_conn_cold_t*)malloc(sizeof(npp_conn_cold_t))) )
+    {
+        ERR("malloc for G_connections[%d].cold failed", ci);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+/* --------------------------------------------------------------------------
+   Take request buffer & long strings back from the closed connection
+   Keep up to NPP_CONN_COLD_POOL for reuse
+-------------------------------------------------------------------------- */
+static void cold_release(int ci)
+{
+    if ( !G_connections[ci].cold )
+        return;
+
+    if ( M_cold_pool_cnt < NPP_CONN_COLD_POOL )
+        M_cold_pool[M_cold_pool_cnt++] = G_connections[ci].cold;
+    else
+        free(G_connections[ci].cold);
+
+    G_connections[ci].cold = NULL;
+}
+
+
+/* --------------------------------------------------------------------------
+   Set up connection slot for a new client
+   Slots aren't touched before, so that their pages are only
+   committed as connections come
+-------------------------------------------------------------------------- */
+static void conn_init(int ci)
+{
+#ifndef NPP_OUT_CHECK_REALLOC
+    G_connections[ci].out_data_allocated = NPP_OUT_BUFSIZE;
+#endif
+    G_connections[ci].static_res = NPP_NOT_STATIC;  /* 0 would be M_statics[0] */
+    G_connections[ci].sse_group = -1;
+    reset_conn(ci, CONN_STATE_DISCONNECTED);
+}
+
+
+#ifdef NPP_ASYNC
+/* --------------------------------------------------------------------------
+   Is connection still waiting for this async response?
+   It may have been closed (and its buffers given back) or timed out meanwhile
+-------------------------------------------------------------------------- */
+static bool async_res_wanted(const async_res_t *res)
+{
+    int ai, ci;
+
+    if ( ASYNC_CHUNK_IS_FIRST(res->chunk) )
+    {
+        ai = res->ai;
+        ci = res->ci;
+    }
+    else    /* 'data' chunk */
+    {
+        ai = ((const async_res_data_t*)res)->ai;
+        ci = ((const async_res_data_t*)res)->ci;
+    }
+
+    if ( M_areqs[ai].state == NPP_ASYNC_STATE_SENT && M_areqs[ai].ci == ci && G_conn_hot[ci].state == CONN_STATE_WAITING_FOR_ASYNC )
+        return TRUE;
+
+    DBG("ci=%d isn't waiting for this response anymore, dropping it", ci);
+
+    if ( ASYNC_CHUNK_IS_LAST(res->chunk) && M_areqs[ai].state == NPP_ASYNC_STATE_SENT && M_areqs[ai].ci == ci )
+        M_areqs[ai].state = NPP_ASYNC_STATE_FREE;
+
+    return FALSE;
+}
+#endif  /* NPP_ASYNC */
+
+
 #ifdef NPP_HTTPS
+
 /* --------------------------------------------------------------------------
    Init SSL for a server
 -------------------------------------------------------------------------- */
@@ -2631,8 +3398,11 @@ static void static_res_update_host_id()
 
     for ( i=0; i<M_statics_cnt; ++i )
     {
-        M_statics[i].host_id = find_host_id(M_statics[i].host);
+        if ( M_statics[i].name[0] )
+            M_statics[i].host_id = find_host_id(M_statics[i].host);
     }
+
+    statics_hash_build();
 }
 #endif  /* NPP_MULTI_HOST */
 
@@ -2667,6 +3437,11 @@ static bool init(int argc, char **argv)
     if ( !npp_lib_init(TRUE, NULL) )
         return FALSE;
 
+    /* connections & sessions tables */
+
+    if ( !alloc_tables() )
+        return FALSE;
+
     /* command line arguments */
 
     if ( argc > 1 )
@@ -2706,6 +3481,22 @@ static bool init(int argc, char **argv)
 
     ALWAYS("                     FD_SETSIZE = %d", FD_SETSIZE);
     ALWAYS("                      SOMAXCONN = %d", SOMAXCONN);
+#ifdef __linux__
+    {
+        FILE *fd;
+        int  somaxconn=0;
+
+        if ( (fd=fopen("/proc/sys/net/core/somaxconn", "r")) )
+        {
+            if ( fscanf(fd, "%d", &somaxconn) == 1 )
+                ALWAYS("             net.core.somaxconn = %d", somaxconn);
+            fclose(fd);
+        }
+
+        if ( somaxconn && G_listenBacklog > somaxconn )
+            WAR("listenBacklog (%d) is capped by net.core.somaxconn (%d)", G_listenBacklog, somaxconn);
+    }
+#endif
     ALWAYS("");
     ALWAYS("Server:");
     ALWAYS("-------");
@@ -2732,8 +3523,10 @@ static bool init(int argc, char **argv)
 #else   /* NPP_MEM_SMALL -- default */
     ALWAYS("                   Memory model = NPP_MEM_SMALL");
 #endif
-    ALWAYS("            NPP_MAX_CONNECTIONS = %d", NPP_MAX_CONNECTIONS);
-    ALWAYS("               NPP_MAX_SESSIONS = %d", NPP_MAX_SESSIONS);
+    ALWAYS("            NPP_MAX_CONNECTIONS = %d (default maxConnections)", NPP_MAX_CONNECTIONS);
+    ALWAYS("               NPP_MAX_SESSIONS = %d (default maxSessions)", NPP_MAX_SESSIONS);
+    ALWAYS("                 maxConnections = %d", G_maxConnections);
+    ALWAYS("                    maxSessions = %d", G_maxSessions);
     ALWAYS("");
 #ifdef NPP_FD_MON_SELECT
     ALWAYS("                  FD monitoring = NPP_FD_MON_SELECT");
@@ -2741,7 +3534,9 @@ static bool init(int argc, char **argv)
 #ifdef NPP_FD_MON_POLL
     ALWAYS("                  FD monitoring = NPP_FD_MON_POLL");
 #endif
-#ifdef NPP_FD_MON_EPOLL
+#ifdef NPP_FD_MON_IO_URING
+    ALWAYS("                  FD monitoring = NPP_FD_MON_LINUX_IO_URING (NPP_FD_MON_EPOLL if unavailable)");
+#elif defined NPP_FD_MON_EPOLL
     ALWAYS("                  FD monitoring = NPP_FD_MON_EPOLL");
 #endif
     ALWAYS("");
@@ -2753,9 +3548,12 @@ static bool init(int argc, char **argv)
     ALWAYS("");
     ALWAYS("                NPP_OUT_BUFSIZE = %lu bytes (%lu KiB / %0.2lf MiB)", NPP_OUT_BUFSIZE, NPP_OUT_BUFSIZE/1024, (double)NPP_OUT_BUFSIZE/1024/1024);
     ALWAYS("");
-    ALWAYS("            G_connections' size = %lu bytes (%lu KiB / %0.2lf MiB)", sizeof(G_connections), sizeof(G_connections)/1024, (double)sizeof(G_connections)/1024/1024);
-    ALWAYS("               G_sessions' size = %lu bytes (%lu KiB / %0.2lf MiB)", sizeof(G_sessions), sizeof(G_sessions)/1024, (double)sizeof(G_sessions)/1024/1024);
-    ALWAYS("       G_app_session_data' size = %lu bytes (%lu KiB / %0.2lf MiB)", sizeof(G_app_session_data), sizeof(G_app_session_data)/1024, (double)sizeof(G_app_session_data)/1024/1024);
+    ALWAYS("       npp_connection_t's size = %lu bytes (%lu KiB)", sizeof(npp_connection_t), sizeof(npp_connection_t)/1024);
+    ALWAYS("         npp_conn_hot_t's size = %lu bytes", sizeof(npp_conn_hot_t));
+    ALWAYS("        npp_conn_cold_t's size = %lu bytes (%lu KiB) per open connection", sizeof(npp_conn_cold_t), sizeof(npp_conn_cold_t)/1024);
+    ALWAYS("            G_connections' size = %lu bytes (%lu KiB / %0.2lf MiB) reserved", sizeof(npp_connection_t)*(G_maxConnections+2), sizeof(npp_connection_t)*(G_maxConnections+2)/1024, (double)sizeof(npp_connection_t)*(G_maxConnections+2)/1024/1024);
+    ALWAYS("               G_sessions' size = %lu bytes (%lu KiB / %0.2lf MiB) reserved", sizeof(eng_session_data_t)*(G_maxSessions+1), sizeof(eng_session_data_t)*(G_maxSessions+1)/1024, (double)sizeof(eng_session_data_t)*(G_maxSessions+1)/1024/1024);
+    ALWAYS("       G_app_session_data' size = %lu bytes (%lu KiB / %0.2lf MiB) reserved", sizeof(app_session_data_t)*(G_maxSessions+1), sizeof(app_session_data_t)*(G_maxSessions+1)/1024, (double)sizeof(app_session_data_t)*(G_maxSessions+1)/1024/1024);
     ALWAYS("");
 #ifdef NPP_ASYNC
     ALWAYS("         NPP_ASYNC_REQ_MSG_SIZE = %d bytes", NPP_ASYNC_REQ_MSG_SIZE);
@@ -2824,6 +3622,10 @@ static bool init(int argc, char **argv)
 #ifndef _WIN32
     ALWAYS("          NPP_COMPRESS_TRESHOLD = %d bytes", NPP_COMPRESS_TRESHOLD);
     ALWAYS("             NPP_COMPRESS_LEVEL = %d", NPP_COMPRESS_LEVEL);
+    ALWAYS("         NPP_COMPRESS_LEVEL_MAX = %d", NPP_COMPRESS_LEVEL_MAX);
+    ALWAYS("      NPP_COMPRESS_TRESHOLD_MAX = %d bytes", NPP_COMPRESS_TRESHOLD_MAX);
+    ALWAYS("         NPP_COMPRESS_LOOP_BUSY = %d%%", NPP_COMPRESS_LOOP_BUSY);
+    ALWAYS("         NPP_COMPRESS_LOOP_IDLE = %d%%", NPP_COMPRESS_LOOP_IDLE);
 #endif
 
 #ifdef NPP_ADMIN_EMAIL
@@ -2865,6 +3667,8 @@ static bool init(int argc, char **argv)
         ALWAYS("httpPort = %d", G_httpPort);
 
     ALWAYS("httpsPort = %d", G_httpsPort);
+    ALWAYS("workers = %d", G_workers);
+    ALWAYS("listenBacklog = %d", G_listenBacklog);
     ALWAYS("cipherList [%s]", G_cipherList);
     ALWAYS("certFile [%s]", G_certFile);
     ALWAYS("certChainFile [%s]", G_certChainFile);
@@ -2943,10 +3747,23 @@ static bool init(int argc, char **argv)
     DBG("");
 #endif  /* NPP_MULTI_HOST */
 
+    /* request header fields dispatch */
+
+    req_hdr_hash_build();
+
+    /* constant response header lines */
+
+    hdr_templates_build();
+
     /* read static resources */
 
     ALWAYS("Reading static resources...");
 
+#ifndef _WIN32
+    build_statics_cache();
+    init_payload_spool();
+#endif
+
     if ( !read_resources(TRUE) )
     {
         ERR("read_resources() failed");
@@ -3001,32 +3818,27 @@ static bool init(int argc, char **argv)
 
     INF("Initializing connections...");
 
-    for ( i=0; i<NPP_MAX_CONNECTIONS+1; ++i )
-    {
-#ifdef NPP_OUT_CHECK_REALLOC
-        if ( !(G_connections[i].out_data_alloc = (char*)malloc(NPP_OUT_BUFSIZE)) )
-        {
-            ERR("malloc for G_connections[%d].out_data failed", i);
-            return FALSE;
-        }
-#endif  /* NPP_OUT_CHECK_REALLOC */
+    /* the rest is calloc'd and set up on accept (conn_init()) */
 
-        G_connections[i].out_data_allocated = NPP_OUT_BUFSIZE;
-        G_connections[i].in_data = NULL;
-        reset_conn(i, CONN_STATE_DISCONNECTED);
+    for ( i=0; i<G_maxConnections+2; ++i )
+        G_conn_hot[i].state = CONN_STATE_DISCONNECTED;
 
-#ifdef NPP_HTTPS
-        G_connections[i].ssl = NULL;
+    for ( i=0; i<NPP_SSE_GROUPS; ++i )
+        M_sse_groups[i] = -1;
+
+    /* 503 and NPP_CLOSING_SESSION_CI slots keep theirs */
+
+#ifdef NPP_OUT_CHECK_REALLOC
+    if ( !out_buf_get(G_maxConnections) )
+        return FALSE;
 #endif
-        G_connections[i].req = 0;
 
-#ifdef NPP_HTTP2
-/*        if ( !(G_connections[i].http2_frame = (char*)malloc(HTTP2_DEFAULT_FRAME_SIZE)) )
-        {
-            ERR("malloc for G_connections[%d].http2_frame failed", i);
+    for ( i=G_maxConnections; i<G_maxConnections+2; ++i )
+    {
+        if ( !cold_get(i) )
             return FALSE;
-        } */
-#endif  /* NPP_HTTP2 */
+
+        conn_init(i);
     }
 
     /* read blocked IPs list --------------------------------------------- */
@@ -3128,6 +3940,10 @@ static bool init(int argc, char **argv)
 
     /* ------------------------------------------------------------------- */
 
+    npp_lib_snippets_publish();     /* for npp_svc processes -- the store is named after the queue */
+
+    /* ------------------------------------------------------------------- */
+
     for ( i=0; i<NPP_ASYNC_MAX_REQUESTS; ++i )
         M_areqs[i].state = NPP_ASYNC_STATE_FREE;
 
@@ -3154,54 +3970,129 @@ static bool init(int argc, char **argv)
 }
 
 
-#ifdef NPP_FD_MON_SELECT
 /* --------------------------------------------------------------------------
-   Build select list
-   This is on the latency critical path
-   Try to minimize number of steps
+   Allocate connections & sessions tables
+   calloc'd pages are only committed when touched
 -------------------------------------------------------------------------- */
-static void build_fd_sets()
+static bool alloc_tables()
 {
-    FD_ZERO(&M_readfds);
-    FD_ZERO(&M_writefds);
+    if ( G_maxConnections < 1 ) G_maxConnections = 1;
+    if ( G_maxSessions < 1 ) G_maxSessions = 1;
 
-    FD_SET(M_listening_fd, &M_readfds);
-#ifdef NPP_HTTPS
-    FD_SET(M_listening_sec_fd, &M_readfds);
-    M_highsock = M_listening_sec_fd;
-#else
-    M_highsock = M_listening_fd;
-#endif  /* NPP_HTTPS */
+#ifdef NPP_FD_MON_SELECT
+    if ( G_maxConnections > FD_SETSIZE-2 )
+    {
+        WAR("maxConnections capped to FD_SETSIZE-2 = %d", FD_SETSIZE-2);
+        G_maxConnections = FD_SETSIZE-2;
+    }
+#endif
 
-    int i;
-    int remain = G_connections_cnt;
+    G_connections = (npp_connection_t*)calloc(G_maxConnections+2, sizeof(npp_connection_t));
+    G_conn_hot = (npp_conn_hot_t*)calloc(G_maxConnections+2, sizeof(npp_conn_hot_t));
+    G_sessions = (eng_session_data_t*)calloc(G_maxSessions+1, sizeof(eng_session_data_t));
+    G_app_session_data = (app_session_data_t*)calloc(G_maxSessions+1, sizeof(app_session_data_t));
+    G_sessions_idx = (sessions_idx_t*)calloc(G_maxSessions, sizeof(sessions_idx_t));
+    M_lagging = (int*)calloc(G_maxConnections+1, sizeof(int));
 
-    for ( i=0; remain>0 && i<NPP_MAX_CONNECTIONS+1; ++i )
+    if ( !G_connections || !G_conn_hot || !G_sessions || !G_app_session_data || !G_sessions_idx || !M_lagging )
     {
-        if ( G_connections[i].state == CONN_STATE_DISCONNECTED ) continue;
+        ERR("Couldn't allocate connections & sessions tables for maxConnections = %d, maxSessions = %d", G_maxConnections, G_maxSessions);
+        return FALSE;
+    }
+
+#ifdef NPP_FD_MON_POLL
+    M_pollfds = (struct pollfd*)calloc(G_maxConnections+NPP_LISTENING_FDS+1, sizeof(struct pollfd));
+    M_poll_ci = (int*)calloc(G_maxConnections+NPP_LISTENING_FDS+1, sizeof(int));
+
+    if ( !M_pollfds || !M_poll_ci )
+    {
+        ERR("Couldn't allocate poll tables");
+        return FALSE;
+    }
+#endif  /* NPP_FD_MON_POLL */
+
+#ifdef NPP_FD_MON_EPOLL
+    if ( !(M_epollevs=(struct epoll_event*)calloc(G_maxConnections+NPP_LISTENING_FDS+1, sizeof(struct epoll_event))) )
+    {
+        ERR("Couldn't allocate epoll events table");
+        return FALSE;
+    }
+#endif  /* NPP_FD_MON_EPOLL */
+
+#ifdef NPP_FD_MON_IO_URING
+    M_uring_slots = (uring_slot_t*)calloc(NPP_URING_SLOTS, sizeof(uring_slot_t));
+    M_uring_todo = (int*)calloc(NPP_URING_SLOTS, sizeof(int));
+
+    if ( !M_uring_slots || !M_uring_todo )
+    {
+        ERR("Couldn't allocate io_uring tables");
+        return FALSE;
+    }
+
+    int i;
+
+    for ( i=0; i<NPP_URING_SLOTS; ++i )
+    {
+        M_uring_slots[i].head = -1;
+        M_uring_slots[i].tail = -1;
+    }
+#endif  /* NPP_FD_MON_IO_URING */
+
+    return TRUE;
+}
+
+
+#ifdef NPP_FD_MON_SELECT
+
+/* --------------------------------------------------------------------------
+   Build select list
+   This is on the latency critical path
+   Try to minimize number of steps
+-------------------------------------------------------------------------- */
+static void build_fd_sets()
+{
+    FD_ZERO(&M_readfds);
+    FD_ZERO(&M_writefds);
+
+    FD_SET(M_listening_fd, &M_readfds);
+#ifdef NPP_HTTPS
+    FD_SET(M_listening_sec_fd, &M_readfds);
+    M_highsock = M_listening_sec_fd;
+#else
+    M_highsock = M_listening_fd;
+#endif  /* NPP_HTTPS */
+
+    int i;
+    int remain = G_connections_cnt;
+
+    for ( i=0; remain>0 && i<G_maxConnections+1; ++i )
+    {
+        if ( G_conn_hot[i].state == CONN_STATE_DISCONNECTED ) continue;
 
 #ifdef NPP_HTTPS
-        if ( NPP_CONN_IS_SECURE(G_connections[i].flags) )
+        if ( NPP_CONN_IS_SECURE(G_conn_hot[i].flags) )
         {
             /* reading */
 
-            if ( G_connections[i].state == CONN_STATE_CONNECTED
-                    || G_connections[i].state == CONN_STATE_READING_DATA
+            if ( G_conn_hot[i].state == CONN_STATE_CONNECTED
+                    || G_conn_hot[i].state == CONN_STATE_READING_DATA
+                    || G_conn_hot[i].state == CONN_STATE_SSE
+                    || G_conn_hot[i].state == CONN_STATE_WEBSOCKET
                     || G_connections[i].ssl_err == SSL_ERROR_WANT_READ )
             {
-                FD_SET(G_connections[i].fd, &M_readfds);
+                FD_SET(G_conn_hot[i].fd, &M_readfds);
             }
 
             /* writing */
 
-            else if ( G_connections[i].state == CONN_STATE_READY_TO_SEND_RESPONSE
-                    || G_connections[i].state == CONN_STATE_SENDING_CONTENT
+            else if ( G_conn_hot[i].state == CONN_STATE_READY_TO_SEND_RESPONSE
+                    || G_conn_hot[i].state == CONN_STATE_SENDING_CONTENT
 #ifdef NPP_ASYNC
-                    || G_connections[i].state == CONN_STATE_WAITING_FOR_ASYNC
+                    || G_conn_hot[i].state == CONN_STATE_WAITING_FOR_ASYNC
 #endif
                     || G_connections[i].ssl_err == SSL_ERROR_WANT_WRITE )
             {
-                FD_SET(G_connections[i].fd, &M_writefds);
+                FD_SET(G_conn_hot[i].fd, &M_writefds);
             }
         }
         else    /* HTTP */
@@ -3209,38 +4100,40 @@ static void build_fd_sets()
 #endif  /* NPP_HTTPS */
             /* reading */
 
-            if ( G_connections[i].state == CONN_STATE_CONNECTED
+            if ( G_conn_hot[i].state == CONN_STATE_CONNECTED
 #ifdef NPP_HTTP2
-                    || G_connections[i].state == CONN_STATE_READY_FOR_CLIENT_PREFACE
+                    || G_conn_hot[i].state == CONN_STATE_READY_FOR_CLIENT_PREFACE
 #endif
-                    || G_connections[i].state == CONN_STATE_READING_DATA )
+                    || G_conn_hot[i].state == CONN_STATE_SSE
+                    || G_conn_hot[i].state == CONN_STATE_WEBSOCKET
+                    || G_conn_hot[i].state == CONN_STATE_READING_DATA )
             {
-                FD_SET(G_connections[i].fd, &M_readfds);
+                FD_SET(G_conn_hot[i].fd, &M_readfds);
             }
 
             /* writing */
 
-            else if ( G_connections[i].state == CONN_STATE_READY_TO_SEND_RESPONSE
+            else if ( G_conn_hot[i].state == CONN_STATE_READY_TO_SEND_RESPONSE
 #ifdef NPP_HTTP2
-//                    || G_connections[i].state == CONN_STATE_READY_TO_SEND_SETTINGS
+//                    || G_conn_hot[i].state == CONN_STATE_READY_TO_SEND_SETTINGS
 #endif
 #ifdef NPP_ASYNC
-                    || G_connections[i].state == CONN_STATE_WAITING_FOR_ASYNC
+                    || G_conn_hot[i].state == CONN_STATE_WAITING_FOR_ASYNC
 #endif
-                    || G_connections[i].state == CONN_STATE_SENDING_CONTENT )
+                    || G_conn_hot[i].state == CONN_STATE_SENDING_CONTENT )
             {
-                FD_SET(G_connections[i].fd, &M_writefds);
+                FD_SET(G_conn_hot[i].fd, &M_writefds);
             }
 #ifdef NPP_HTTPS
         }
 #endif
 
 #ifdef _WIN32
-        if ( G_connections[i].fd > (SOCKET)M_highsock )
+        if ( G_conn_hot[i].fd > (SOCKET)M_highsock )
 #else
-        if ( G_connections[i].fd > M_highsock )
+        if ( G_conn_hot[i].fd > M_highsock )
 #endif
-            M_highsock = G_connections[i].fd;
+            M_highsock = G_conn_hot[i].fd;
 
         remain--;
     }
@@ -3259,9 +4152,9 @@ static void find_first_free_ci()
 {
     int i;
 
-    for ( i=0; i<NPP_MAX_CONNECTIONS; ++i )
+    for ( i=0; i<G_maxConnections; ++i )
     {
-        if ( G_connections[i].state == CONN_STATE_DISCONNECTED )
+        if ( G_conn_hot[i].state == CONN_STATE_DISCONNECTED )
         {
             M_first_free_ci = i;
             WAR("Sequential search through G_connections (checked %d record(s))", i+1);
@@ -3271,29 +4164,74 @@ static void find_first_free_ci()
 
     WAR("Sequential search through G_connections (checked %d record(s)), none was free", i);
 
-    M_first_free_ci = NPP_MAX_CONNECTIONS;
+    M_first_free_ci = G_maxConnections;
 }
 
 
 /* --------------------------------------------------------------------------
-   Handle a new connection
+   Handle new connections
+   Drain the accept queue, up to NPP_ACCEPT_BUDGET at a time
 -------------------------------------------------------------------------- */
 static void accept_connection(bool secure)
+{
+    int accepted=0;
+
+    while ( accepted < NPP_ACCEPT_BUDGET && accept_one(secure) )
+    {
+        ++accepted;
+
+        if ( M_first_free_ci == G_maxConnections )   /* leave the rest in the queue until there's room */
+            break;
+    }
+
+    ++G_cnts_today.accept_wakeups;
+    G_cnts_today.accepted += accepted;
+
+    if ( accepted > M_accepts_hwm )
+        M_accepts_hwm = accepted;
+}
+
+
+/* --------------------------------------------------------------------------
+   Accept one connection
+   Return FALSE when there's nothing more to accept
+-------------------------------------------------------------------------- */
+static bool accept_one(bool secure)
 {
     struct sockaddr_in6 cli_addr;
 
     socklen_t addr_len = sizeof(cli_addr);
 
 #ifdef NPP_HTTPS
-    int connection = accept(secure?M_listening_sec_fd:M_listening_fd, (struct sockaddr*)&cli_addr, &addr_len);
+    int listening_fd = secure?M_listening_sec_fd:M_listening_fd;
+#else
+    int listening_fd = M_listening_fd;
+#endif
+
+#ifdef NPP_FD_MON_IO_URING
+    int connection;
+
+    if ( M_uring.fd )   /* the ring has accepted it already */
+    {
+        if ( (connection=uring_accepted(secure)) >= 0 && getpeername(connection, (struct sockaddr*)&cli_addr, &addr_len) != 0 )
+        {
+            close(connection);
+            return TRUE;
+        }
+    }
+    else
+        connection = accept4(listening_fd, (struct sockaddr*)&cli_addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#elif defined __linux__
+    int connection = accept4(listening_fd, (struct sockaddr*)&cli_addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
 #else
-    int connection = accept(M_listening_fd, (struct sockaddr*)&cli_addr, &addr_len);
+    int connection = accept(listening_fd, (struct sockaddr*)&cli_addr, &addr_len);
 #endif
 
     if ( connection < 0 )
     {
-        ERR("accept failed, errno = %d (%s)", errno, strerror(errno));
-        return;
+        if ( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR )
+            ERR("accept failed, errno = %d (%s)", errno, strerror(errno));
+        return FALSE;
     }
 
     /* -------------------------------------------- */
@@ -3313,7 +4251,7 @@ static void accept_connection(bool secure)
 #else
         close(connection);
 #endif  /* _WIN32 */
-        return;
+        return TRUE;
     }
 
     /* -------------------------------------------- */
@@ -3325,21 +4263,47 @@ static void accept_connection(bool secure)
 #else
         close(connection);
 #endif  /* _WIN32 */
-        return;
+        return TRUE;
     }
 
     /* -------------------------------------------- */
 
+#ifndef __linux__
     npp_lib_setnonblocking(connection);
+#endif
+
+    /* -------------------------------------------- */
+
+#ifdef NPP_OUT_CHECK_REALLOC
+    if ( !G_connections[M_first_free_ci].out_data_alloc && !out_buf_get(M_first_free_ci) )
+    {
+#ifdef _WIN32   /* Windows */
+        closesocket(connection);
+#else
+        close(connection);
+#endif  /* _WIN32 */
+        return TRUE;
+    }
+#endif  /* NPP_OUT_CHECK_REALLOC */
+
+    if ( !G_connections[M_first_free_ci].cold && !cold_get(M_first_free_ci) )
+    {
+#ifdef _WIN32   /* Windows */
+        closesocket(connection);
+#else
+        close(connection);
+#endif  /* _WIN32 */
+        return TRUE;
+    }
 
     /* -------------------------------------------- */
 
-    if ( M_first_free_ci == NPP_MAX_CONNECTIONS )
+    if ( M_first_free_ci == G_maxConnections )
     {
-        if ( G_connections[NPP_MAX_CONNECTIONS].state != CONN_STATE_DISCONNECTED )
+        if ( G_conn_hot[G_maxConnections].state != CONN_STATE_DISCONNECTED )
         {
             DBG("Need to force-disconnect previous 503 client...");
-            close_connection(NPP_MAX_CONNECTIONS, FALSE);
+            close_connection(G_maxConnections, FALSE);
         }
 
         WAR("No room left for the new client, will return 503...");
@@ -3355,7 +4319,9 @@ static void accept_connection(bool secure)
     /* -------------------------------------------- */
     /* set up G_connection record */
 
-    G_connections[M_first_free_ci].fd = connection;
+    conn_init(M_first_free_ci);
+
+    G_conn_hot[M_first_free_ci].fd = connection;
 
 #ifdef NPP_HTTPS
 
@@ -3363,7 +4329,7 @@ static void accept_connection(bool secure)
     {
         DBG("\nSecure connection accepted: %s, ci=%d, fd=%d", remote_addr, M_first_free_ci, connection);
 
-        G_connections[M_first_free_ci].flags |= NPP_CONN_FLAG_SECURE;
+        G_conn_hot[M_first_free_ci].flags |= NPP_CONN_FLAG_SECURE;
 
         /* -------------------------------------------- */
         /* add connection to monitored set */
@@ -3371,7 +4337,7 @@ static void accept_connection(bool secure)
 #ifdef NPP_FD_MON_POLL
 
         /* reference ... */
-        G_connections[M_first_free_ci].pi = M_pollfds_cnt;
+        G_conn_hot[M_first_free_ci].pi = M_pollfds_cnt;
         /* ... each other to avoid unnecessary looping */
         M_poll_ci[M_pollfds_cnt] = M_first_free_ci;
         M_pollfds[M_pollfds_cnt].fd = connection;
@@ -3384,29 +4350,24 @@ static void accept_connection(bool secure)
 
 #ifdef NPP_FD_MON_EPOLL
 
-        M_epoll_ci[M_epollfds_cnt].fd = connection;
-        M_epoll_ci[M_epollfds_cnt].ci = M_first_free_ci;
-
         ++M_epollfds_cnt;
 
-        qsort(&M_epoll_ci, M_epollfds_cnt, sizeof(epoll_idx_t), compare_epoll_idx);
-
         struct epoll_event ev={0};
 
-        ev.data.fd = connection;
+        ev.data.u64 = NPP_EPOLL_DATA(M_first_free_ci);
         ev.events = EPOLLIN | EPOLLET;
-        epoll_ctl(M_epoll_fd, EPOLL_CTL_ADD, ev.data.fd, &ev);
+        fd_mon_ctl(EPOLL_CTL_ADD, connection, &ev);
 
 #endif  /* NPP_FD_MON_EPOLL */
 
 
-        G_connections[M_first_free_ci].ssl = SSL_new(M_ssl_server_ctx);
+        G_conn_hot[M_first_free_ci].ssl = SSL_new(M_ssl_server_ctx);
 
-        if ( !G_connections[M_first_free_ci].ssl )
+        if ( !G_conn_hot[M_first_free_ci].ssl )
         {
             ERR("SSL_new failed");
             close_connection(M_first_free_ci, FALSE);
-            return;
+            return TRUE;
         }
 
         /* SSL_set_fd() sets the file descriptor fd as the input/output facility
@@ -3418,26 +4379,26 @@ static void accept_connection(bool secure)
            If there was already a BIO connected to ssl, BIO_free() will be called
            (for both the reading and writing side, if different). */
 
-        int ret = SSL_set_fd(G_connections[M_first_free_ci].ssl, connection);
+        int ret = SSL_set_fd(G_conn_hot[M_first_free_ci].ssl, connection);
 
         if ( ret <= 0 )
         {
             ERR("SSL_set_fd failed, ret = %d", ret);
             close_connection(M_first_free_ci, FALSE);
-            return;
+            return TRUE;
         }
 
-        ret = SSL_accept(G_connections[M_first_free_ci].ssl);   /* handshake here */
+        ret = SSL_accept(G_conn_hot[M_first_free_ci].ssl);   /* handshake here */
 
         if ( ret <= 0 )
         {
-            G_connections[M_first_free_ci].ssl_err = SSL_get_error(G_connections[M_first_free_ci].ssl, ret);
+            G_connections[M_first_free_ci].ssl_err = SSL_get_error(G_conn_hot[M_first_free_ci].ssl, ret);
 
             if ( G_connections[M_first_free_ci].ssl_err != SSL_ERROR_WANT_READ && G_connections[M_first_free_ci].ssl_err != SSL_ERROR_WANT_WRITE )
             {
                 DBG("SSL_accept failed, ssl_err = %d, disconnecting", G_connections[M_first_free_ci].ssl_err);
                 close_connection(M_first_free_ci, FALSE);
-                return;
+                return TRUE;
             }
         }
 
@@ -3448,7 +4409,7 @@ static void accept_connection(bool secure)
 
 #ifdef NPP_FD_MON_POLL
         if ( G_connections[M_first_free_ci].ssl_err == SSL_ERROR_WANT_WRITE )
-            M_pollfds[G_connections[M_first_free_ci].pi].events = POLLOUT;
+            M_pollfds[G_conn_hot[M_first_free_ci].pi].events = POLLOUT;
 #endif
 
 #ifdef NPP_FD_MON_EPOLL
@@ -3456,9 +4417,9 @@ static void accept_connection(bool secure)
         {
             struct epoll_event ev={0};
 
-            ev.data.fd = G_connections[M_first_free_ci].fd;
+            ev.data.u64 = NPP_EPOLL_DATA(M_first_free_ci);
             ev.events = EPOLLOUT | EPOLLET;
-            epoll_ctl(M_epoll_fd, EPOLL_CTL_MOD, ev.data.fd, &ev);
+            fd_mon_ctl(EPOLL_CTL_MOD, G_conn_hot[M_first_free_ci].fd, &ev);
         }
 #endif
     }
@@ -3467,11 +4428,11 @@ static void accept_connection(bool secure)
     {
         DBG("\nConnection accepted: %s, ci=%d, fd=%d", remote_addr, M_first_free_ci, connection);
 
-        G_connections[M_first_free_ci].flags = G_connections[M_first_free_ci].flags & ~NPP_CONN_FLAG_SECURE;
+        G_conn_hot[M_first_free_ci].flags = G_conn_hot[M_first_free_ci].flags & ~NPP_CONN_FLAG_SECURE;
 
 #ifdef NPP_FD_MON_POLL  /* add connection to monitored set */
         /* reference ... */
-        G_connections[M_first_free_ci].pi = M_pollfds_cnt;
+        G_conn_hot[M_first_free_ci].pi = M_pollfds_cnt;
         /* ... each other to avoid unnecessary looping */
         M_poll_ci[M_pollfds_cnt] = M_first_free_ci;
         M_pollfds[M_pollfds_cnt].fd = connection;
@@ -3481,24 +4442,18 @@ static void accept_connection(bool secure)
 #endif  /* NPP_FD_MON_POLL */
 
 #ifdef NPP_FD_MON_EPOLL  /* add connection to monitored set */
-        /* add to index */
-        M_epoll_ci[M_epollfds_cnt].fd = connection;
-        M_epoll_ci[M_epollfds_cnt].ci = M_first_free_ci;
-
         ++M_epollfds_cnt;
 
-        qsort(&M_epoll_ci, M_epollfds_cnt, sizeof(epoll_idx_t), compare_epoll_idx);
-
         struct epoll_event ev={0};
 
-        ev.data.fd = connection;
+        ev.data.u64 = NPP_EPOLL_DATA(M_first_free_ci);
         ev.events = EPOLLIN | EPOLLET;
-        epoll_ctl(M_epoll_fd, EPOLL_CTL_ADD, ev.data.fd, &ev);
+        fd_mon_ctl(EPOLL_CTL_ADD, connection, &ev);
 #endif  /* NPP_FD_MON_EPOLL */
     }
 
     DDBG("ci=%d, changing state to CONN_STATE_CONNECTED", M_first_free_ci);
-    G_connections[M_first_free_ci].state = CONN_STATE_CONNECTED;
+    G_conn_hot[M_first_free_ci].state = CONN_STATE_CONNECTED;
 
     /* -------------------------------------------- */
 
@@ -3506,12 +4461,12 @@ static void accept_connection(bool secure)
 
     /* -------------------------------------------- */
 
-    G_connections[M_first_free_ci].last_activity = G_now;
+    G_conn_hot[M_first_free_ci].last_activity = G_now;
 
     /* -------------------------------------------- */
     /* update M_highest_used_ci */
 
-    if ( M_first_free_ci < NPP_MAX_CONNECTIONS && M_first_free_ci > M_highest_used_ci )
+    if ( M_first_free_ci < G_maxConnections && M_first_free_ci > M_highest_used_ci )
         M_highest_used_ci = M_first_free_ci;
 
     DDBG("After accept: M_highest_used_ci = %d", M_highest_used_ci);
@@ -3519,12 +4474,64 @@ static void accept_connection(bool secure)
     /* -------------------------------------------- */
     /* update M_first_free_ci */
 
-    if ( M_highest_used_ci < NPP_MAX_CONNECTIONS-1 )
+    if ( M_highest_used_ci < G_maxConnections-1 )
         M_first_free_ci = M_highest_used_ci + 1;
     else
         find_first_free_ci();
 
     DDBG("After accept:   M_first_free_ci = %d", M_first_free_ci);
+
+    return TRUE;
+}
+
+
+/* --------------------------------------------------------------------------
+   Return TcpExt ListenOverflows from /proc/net/netstat
+   It's a system-wide (network namespace) counter
+-------------------------------------------------------------------------- */
+static unsigned listen_overflows()
+{
+    unsigned ret=0;
+
+#ifdef __linux__
+
+    static char names[8192];
+    static char values[8192];
+
+    FILE *fd=fopen("/proc/net/netstat", "r");
+
+    if ( !fd ) return 0;
+
+    /* lines come in pairs: names and values */
+
+    while ( fgets(names, sizeof(names), fd) && fgets(values, sizeof(values), fd) )
+    {
+        if ( strncmp(names, "TcpExt:", 7) != 0 ) continue;
+
+        char *save_n, *save_v;
+        char *n=strtok_r(names, " \n", &save_n);
+        char *v=strtok_r(values, " \n", &save_v);
+
+        while ( n && v )
+        {
+            if ( strcmp(n, "ListenOverflows") == 0 )
+            {
+                ret = (unsigned)strtoul(v, NULL, 10);
+                break;
+            }
+
+            n = strtok_r(NULL, " \n", &save_n);
+            v = strtok_r(NULL, " \n", &save_v);
+        }
+
+        break;
+    }
+
+    fclose(fd);
+
+#endif  /* __linux__ */
+
+    return ret;
 }
 
 
@@ -3817,17 +4824,37 @@ static bool ip_allowed(const char *addr)
 
 #ifndef _WIN32
 /* --------------------------------------------------------------------------
-   Compress src into dest, return dest length
+   Compress src into dest using codec, return dest length
+   -1 if it failed or wouldn't be smaller than src
 -------------------------------------------------------------------------- */
-static int deflate_data(unsigned char *dest, const unsigned char *src, unsigned src_len)
+static int compress_data(int codec, unsigned char *dest, const unsigned char *src, unsigned src_len)
 {
-    DBG("src_len = %u", src_len);
+    DBG("codec = %s, src_len = %u", M_codecs[codec], src_len);
+
+#ifdef NPP_BROTLI
+    if ( codec == NPP_CODEC_BR )
+    {
+        size_t new_len = src_len;
+
+        if ( !BrotliEncoderCompress(NPP_BROTLI_QUALITY_STATICS, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_GENERIC, src_len, src, &new_len, dest) )
+        {
+            DBG("BrotliEncoderCompress failed");   /* also when it doesn't fit */
+            return -1;
+        }
+
+        DBG("new_len = %u", (unsigned)new_len);
+
+        return new_len;
+    }
+#endif  /* NPP_BROTLI */
 
     z_stream strm={0};
 
-    if ( deflateInit(&strm, Z_DEFAULT_COMPRESSION) != Z_OK )
+    /* windowBits 15 = zlib wrapper (HTTP deflate), +16 = gzip wrapper */
+
+    if ( deflateInit2(&strm, NPP_COMPRESS_LEVEL_STATICS, Z_DEFLATED, codec==NPP_CODEC_GZIP?31:15, 9, Z_DEFAULT_STRATEGY) != Z_OK )
     {
-        ERR("deflateInit failed");
+        ERR("deflateInit2 failed");
         return -1;
     }
 
@@ -3836,33 +4863,15 @@ static int deflate_data(unsigned char *dest, const unsigned char *src, unsigned
     strm.next_out = dest;
     strm.avail_out = src_len;
 
-    int ret=Z_OK;
-
-//    while ( ret == Z_OK )
-//    {
-//        strm.avail_out = strm.avail_in ? strm.next_in-strm.next_out : (dest+src_len) - strm.next_out;
-        ret = deflate(&strm, Z_FINISH);
-//    }
-
-    if ( ret != Z_STREAM_END )
-    {
-        ERR("ret != Z_STREAM_END");
-        return -1;
-    }
-
-    if ( strm.total_out > src_len )
-    {
-        ERR("strm.total_out > src_len");
-        return -1;
-    }
+    int ret = deflate(&strm, Z_FINISH);
 
     unsigned new_len = strm.total_out;
 
     deflateEnd(&strm);
 
-    if ( ret != Z_STREAM_END )
+    if ( ret != Z_STREAM_END )   /* including when it doesn't fit */
     {
-        ERR("ret != Z_STREAM_END");
+        DBG("ret != Z_STREAM_END");
         return -1;
     }
 
@@ -3970,3168 +4979,6936 @@ static int deflate_inplace(z_stream *strm, unsigned char *buf, unsigned len, uns
 
 
 /* --------------------------------------------------------------------------
-   Compare
+   Hash host_id+name (FNV-1a), return name length as well
 -------------------------------------------------------------------------- */
-static int compare_statics(const void *a, const void *b)
+static unsigned static_hash(int host_id, const char *name, int *len)
 {
-    const static_res_t *p1 = (static_res_t*)a;
-    const static_res_t *p2 = (static_res_t*)b;
-
-#ifdef NPP_MULTI_HOST
+    const unsigned char *p=(const unsigned char*)name;
+    unsigned h = 2166136261U ^ (unsigned)host_id;
 
-    if ( p1->host_id < p2->host_id )
-        return -1;
-    else if ( p1->host_id > p2->host_id )
-        return 1;
+    while ( *p )
+    {
+        h ^= *p++;
+        h *= 16777619U;
+    }
 
-#endif
+    *len = (const char*)p - name;
 
-    return strcmp(p1->name, p2->name);
+    return h;
 }
 
 
 /* --------------------------------------------------------------------------
-   Read static resources from disk
-   Read all the files from G_appdir/res or resmin directory
-   path is a relative path under `res` or `resmin`
-   Unlike snippets, these are only used by the main npp_app process
+   Rebuild M_statics hash table
+   Build the spare one and switch, so that the one in use
+   is never seen half-built
 -------------------------------------------------------------------------- */
-static bool read_files(const char *host, int host_id, const char *directory, char source, bool first_scan, const char *path)
+static void statics_hash_build()
 {
-    bool    minify=FALSE;
-    int     i;
-    char    resdir[NPP_STATIC_PATH_LEN+1];      /* full path to res */
-    char    ressubdir[NPP_STATIC_PATH_LEN*2+2]; /* full path to res/subdir */
-    char    namewpath[NPP_STATIC_PATH_LEN*2+2]; /* full path including file name */
-    char    resname[NPP_STATIC_PATH_LEN+1];     /* relative path including file name */
-    char    fullpath[NPP_STATIC_PATH_LEN*2];
-    DIR     *dir;
-    struct dirent *dirent;
-    FILE    *fd;
-    char    *data_tmp=NULL;
-    char    *data_tmp_min=NULL;
-    struct stat fstat;
+    int *table = (M_statics_hash_cur == M_statics_hash[0]) ? M_statics_hash[1] : M_statics_hash[0];
+    unsigned slot;
+    int i;
 
-    if ( directory == NULL || directory[0] == EOS ) return TRUE;
+    memset(table, 0, sizeof(M_statics_hash[0]));
 
-#ifndef _WIN32
-    if ( G_appdir[0] == EOS ) return TRUE;
-#endif
+    for ( i=0; i<M_statics_cnt; ++i )
+    {
+        if ( !M_statics[i].name[0] ) continue;   /* free slot */
 
-    if ( first_scan && !path ) DBG("");
+        M_statics[i].hash = static_hash(M_statics[i].host_id, M_statics[i].name, &M_statics[i].name_len);
 
-#ifdef NPP_DEBUG
-    if ( first_scan )
-    {
-        if ( !path ) DBG_LINE_LONG;
-        DBG("read_files, directory [%s]", directory);
-    }
-#endif  /* NPP_DEBUG */
+        slot = M_statics[i].hash % STATICS_HASH_SIZE;
 
-#ifdef _WIN32   /* be more forgiving */
+        while ( table[slot] )
+            slot = (slot + 1) % STATICS_HASH_SIZE;
 
-    if ( G_appdir[0] )
-    {
-        sprintf(resdir, "%s\\%s", G_appdir, directory);
+        table[slot] = i + 1;
     }
-    else    /* no NPP_DIR */
+
+    M_statics_hash_cur = table;
+}
+
+
+/* --------------------------------------------------------------------------
+   Find a free M_statics slot
+   Retired ones still in use by connections don't count
+   Return M_statics_cnt if there's none inside, -1 if full
+-------------------------------------------------------------------------- */
+static int static_slot()
+{
+    int i;
+
+    for ( i=0; i<M_statics_cnt; ++i )
     {
-        sprintf(resdir, "..\\%s", directory);
+        if ( !M_statics[i].name[0] && !M_statics[i].conns )
+            return i;
     }
 
-#else   /* Linux -- don't fool around */
+    if ( M_statics_cnt < NPP_MAX_STATICS )
+        return M_statics_cnt;
 
-    sprintf(resdir, "%s/%s", G_appdir, directory);
+    WAR("M_statics_cnt at max (%d)!", NPP_MAX_STATICS);
 
-#endif  /* _WIN32 */
+    return -1;
+}
 
-#ifdef NPP_DEBUG
-    if ( first_scan )
-        DBG("resdir [%s]", resdir);
-#endif
 
-    if ( !path )   /* highest level */
-    {
-        strcpy(ressubdir, resdir);
-    }
-    else    /* recursive call */
-    {
-        sprintf(ressubdir, "%s/%s", resdir, path);
-    }
+/* --------------------------------------------------------------------------
+   Remove static resource whose file is gone
+-------------------------------------------------------------------------- */
+static void remove_static(int i)
+{
+    INF("Removing %s from static resources", M_statics[i].name);
 
-#ifdef NPP_DEBUG
-    if ( first_scan )
-        DBG("ressubdir [%s]", ressubdir);
+#ifndef _WIN32
+    char cpath[NPP_STATIC_PATH_LEN*2+2];
+
+    if ( cache_path(cpath, M_statics[i].host_id, M_statics[i].source, M_statics[i].name, M_statics[i].len) )
+        unlink(cpath);
 #endif
 
-    if ( (dir=opendir(ressubdir)) == NULL )
+    if ( 0==strcmp(M_statics[i].name, "index.html") )
     {
-        if ( first_scan )
-            DBG("Couldn't open directory [%s], skipping", ressubdir);
-        return TRUE;    /* don't panic, just no external resources will be used */
+        if ( M_statics[i].host_id == 0 )
+            M_index_present = -1;
+#ifdef NPP_MULTI_HOST
+        else
+            G_hosts[M_statics[i].host_id].index_present = -1;
+#endif
     }
 
-    /* ------------------------------------------------------------------- */
-    /* check removed files */
+    M_statics[i].host[0] = EOS;
+    M_statics[i].name[0] = EOS;     /* free slot */
 
-    if ( !first_scan && !path )   /* on the highest level only */
-    {
-//        DDBG("Checking removed files...");
-
-        int removed = 0;
-
-        for ( i=0; i<M_statics_cnt; ++i )
-        {
-            if ( M_statics[i].host_id != host_id || M_statics[i].source != source ) continue;
-
-//            DDBG("Checking %s...", M_statics[i].name);
-
-            sprintf(fullpath, "%s/%s", resdir, M_statics[i].name);
-
-            if ( !npp_file_exists(fullpath) )
-            {
-                INF("Removing %s from static resources", M_statics[i].name);
+    if ( M_statics[i].conns )   /* still being sent -- static_release() will free it */
+        return;
 
-                if ( 0==strcmp(M_statics[i].name, "index.html") )
-                {
-                    if ( host_id == 0 )
-                        M_index_present = -1;
-#ifdef NPP_MULTI_HOST
-                    else
-                        G_hosts[host_id].index_present = -1;
-#endif
-                }
+    free_static_data(i);
+    M_statics[i].len = 0;
+}
 
-#ifdef NPP_MULTI_HOST
-                M_statics[i].host[0] = EOS;
-                M_statics[i].host_id = NPP_MAX_HOSTS;
-#endif  /* NPP_MULTI_HOST */
 
-                memset(M_statics[i].name, 'z', NPP_STATIC_PATH_LEN);
-                M_statics[i].name[NPP_STATIC_PATH_LEN] = EOS;
+/* --------------------------------------------------------------------------
+   Move static resource's content to a spare slot before re-reading it,
+   so that connections still sending the old version can finish
+   static_release() frees it after the last one
+-------------------------------------------------------------------------- */
+static bool retire_static(int i)
+{
+    int j, ci, cnt=0, c;
 
-                free(M_statics[i].data);
-                M_statics[i].data = NULL;
-                M_statics[i].len = 0;
+    if ( (j=static_slot()) == -1 )
+        return FALSE;
 
-                if ( M_statics[i].data_deflated )
-                {
-                    free(M_statics[i].data_deflated);
-                    M_statics[i].data_deflated = NULL;
-                    M_statics[i].len_deflated = 0;
-                }
+    M_statics[j] = M_statics[i];
+    M_statics[j].host[0] = EOS;
+    M_statics[j].name[0] = EOS;     /* never found again */
 
-                ++removed;
-            }
-        }
+    if ( j == M_statics_cnt )
+        ++M_statics_cnt;
 
-        if ( removed )
+    for ( ci=0; ci<G_maxConnections && cnt<M_statics[j].conns; ++ci )
+    {
+        if ( G_conn_hot[ci].state != CONN_STATE_DISCONNECTED && G_connections[ci].static_res == i )
         {
-            DBG("%d statics removed", removed);
-            qsort(&M_statics, M_statics_cnt, sizeof(M_statics[0]), compare_statics);
-            M_statics_cnt -= removed;
-            DDBG("M_statics_cnt after removing = %d", M_statics_cnt);
+            G_connections[ci].static_res = j;
+            ++cnt;
         }
     }
 
-    /* ------------------------------------------------------------------- */
-
-//    DDBG("Reading %sfiles", first_scan?"":"new ");
+    /* slot i doesn't own it anymore */
 
-    /* read files into memory */
+    M_statics[i].data = NULL;
+    M_statics[i].cache = NULL;
+    M_statics[i].map = NULL;
 
-    while ( (dirent=readdir(dir)) )
+    for ( c=0; c<NPP_CODECS; ++c )
     {
-        if ( dirent->d_name[0] == '.' )   /* skip ".", ".." and hidden files */
-            continue;
-
-        /* ------------------------------------------------------------------- */
-        /* resource name */
+        M_statics[i].data_enc[c] = NULL;
+        M_statics[i].len_enc[c] = 0;
+    }
 
-        if ( !path )
-            strcpy(resname, dirent->d_name);
-        else
-            sprintf(resname, "%s/%s", path, dirent->d_name);
+    M_statics[i].conns = 0;
 
-#ifdef NPP_DEBUG
-        if ( first_scan )
-            DBG("resname [%s]", resname);
-#endif
+    DBG("%s in use by %d connection(s), old version kept in slot %d", M_statics[i].name, cnt, j);
 
-        /* ------------------------------------------------------------------- */
-        /* additional file info */
+    return TRUE;
+}
 
-        sprintf(namewpath, "%s/%s", resdir, resname);
 
-#ifdef NPP_DEBUG
-        if ( first_scan )
-            DBG("namewpath [%s]", namewpath);
-#endif
+/* --------------------------------------------------------------------------
+   Connection is done with its static resource
+   Free retired one's content after the last user
+-------------------------------------------------------------------------- */
+static void static_release(int ci)
+{
+    int i = G_connections[ci].static_res;
 
-        if ( stat(namewpath, &fstat) != 0 )
-        {
-            ERR("stat for [%s] failed, errno = %d (%s)", namewpath, errno, strerror(errno));
-            closedir(dir);
-            return FALSE;
-        }
+    if ( i == NPP_NOT_STATIC )
+        return;
 
-        /* ------------------------------------------------------------------- */
+    G_connections[ci].static_res = NPP_NOT_STATIC;
 
-        if ( S_ISDIR(fstat.st_mode) )   /* directory */
-        {
-#ifdef NPP_DEBUG
-            if ( first_scan )
-                DBG("Reading subdirectory [%s]...", dirent->d_name);
-#endif
-            read_files(host, host_id, directory, source, first_scan, resname);
-            continue;
-        }
-        else if ( !S_ISREG(fstat.st_mode) )    /* skip if not a regular file nor directory */
-        {
-#ifdef NPP_DEBUG
-            if ( first_scan )
-                DBG("[%s] is not a regular file", resname);
-#endif
-            continue;
-        }
+    if ( --M_statics[i].conns == 0 && !M_statics[i].name[0] )   /* removed or re-read in the meantime */
+    {
+        free_static_data(i);
+        M_statics[i].len = 0;
+    }
+}
 
-        /* ------------------------------------------------------------------- */
-        /* already read? */
 
-        bool reread = FALSE;
+#ifndef _WIN32
+/* --------------------------------------------------------------------------
+   Statics cache file path
+   Return FALSE if the resource isn't worth caching (nothing to minify
+   nor compress) or the cache is off
+-------------------------------------------------------------------------- */
+static bool cache_path(char *dest, int host_id, char source, const char *resname, unsigned size)
+{
+    int len;
 
-        if ( !first_scan )
-        {
-            bool exists_not_changed = FALSE;
+    if ( !M_statics_cache ) return FALSE;
 
-            for ( i=0; i<M_statics_cnt; ++i )
-            {
-                if ( M_statics[i].host_id == host_id && 0==strcmp(M_statics[i].name, resname) && M_statics[i].source == source )
-                {
-//                    DDBG("%s already read", resname);
+    if ( source != STATIC_SOURCE_RESMIN && (size > NPP_LARGE_STATIC || !SHOULD_BE_COMPRESSED(size, npp_lib_get_res_type(resname))) )
+        return FALSE;
 
-                    if ( M_statics[i].modified == fstat.st_mtime )
-                    {
-//                        DDBG("Not modified");
-                        exists_not_changed = TRUE;
-                    }
-                    else
-                    {
-                        INF("%s has been modified", resname);
-                        reread = TRUE;
-                    }
+    sprintf(dest, "%s/%s/%c%08x", G_appdir, NPP_STATICS_CACHE_DIR, source, static_hash(host_id, resname, &len));
 
-                    break;
-                }
-            }
+    return TRUE;
+}
 
-            if ( exists_not_changed ) continue;   /* not modified */
-        }
 
-        if ( !reread )  /* first time on the list */
-        {
-            i = M_statics_cnt;
+/* --------------------------------------------------------------------------
+   Load static resource from the cache, if it's there and up to date
+   Map it privately, so that HTTP/2 header can still go before the content
+-------------------------------------------------------------------------- */
+static bool cache_load(int i, const char *path, const struct stat *src)
+{
+    int  fd, c;
+    struct stat cstat;
+    char *map;
+    unsigned off;
 
-            /* host -- already uppercase */
+    if ( (fd=open(path, O_RDONLY | O_CLOEXEC)) == -1 )
+        return FALSE;
 
-            strcpy(M_statics[i].host, host);
-            M_statics[i].host_id = host_id;
+    if ( fstat(fd, &cstat) != 0 || cstat.st_size < NPP_OUT_HEADER_BUFSIZE )
+    {
+        close(fd);
+        return FALSE;
+    }
 
-            /* file name */
+    map = (char*)mmap(NULL, cstat.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
 
-            strcpy(M_statics[i].name, resname);
-        }
+    close(fd);
 
-        /* source */
+    if ( map == MAP_FAILED )
+        return FALSE;
 
-        M_statics[i].source = source;
+    const statics_cache_hdr_t *hdr = (statics_cache_hdr_t*)map;
 
-        if ( source == STATIC_SOURCE_RESMIN )
-            minify = TRUE;
+    if ( hdr->magic != STATICS_CACHE_MAGIC || !memchr(hdr->name, EOS, sizeof(hdr->name)) || !memchr(hdr->etag, EOS, sizeof(hdr->etag))
+            || hdr->modified != src->st_mtime || hdr->size != (unsigned)src->st_size
+            || hdr->host_id != M_statics[i].host_id || hdr->source != M_statics[i].source || 0 != strcmp(hdr->name, M_statics[i].name) )
+    {
+        munmap(map, cstat.st_size);
+        return FALSE;
+    }
 
-        /* last modified */
+    /* lengths must fit in what's actually there (truncated or damaged file) */
 
-        M_statics[i].modified = fstat.st_mtime;
+    uint64_t end = (uint64_t)NPP_OUT_HEADER_BUFSIZE + hdr->len + 1;
 
-        /* size and content */
+    for ( c=0; c<NPP_CODECS; ++c )
+        end += hdr->len_enc[c];
 
-#ifdef _WIN32   /* Windows */
-        if ( NULL == (fd=fopen(namewpath, "rb")) )
-#else
-        if ( NULL == (fd=fopen(namewpath, "r")) )
-#endif  /* _WIN32 */
-            ERR("Couldn't open %s", namewpath);
-        else
-        {
-            fseek(fd, 0, SEEK_END);     /* determine the file size */
-            M_statics[i].len = ftell(fd);
-            rewind(fd);
+    if ( end > (uint64_t)cstat.st_size )
+    {
+        WAR("Statics cache file %s is damaged", path);
+        munmap(map, cstat.st_size);
+        return FALSE;
+    }
 
-            if ( minify )
-            {
-                /* we don't know the minified size yet -- read file into temp buffer */
+    free_static_data(i);    /* previous version */
 
-                if ( NULL == (data_tmp=(char*)malloc(M_statics[i].len+1)) )
-                {
-                    ERR("Couldn't allocate %u bytes for %s", M_statics[i].len, M_statics[i].name);
-                    fclose(fd);
-                    closedir(dir);
-                    return FALSE;
-                }
+    M_statics[i].cache = map;
+    M_statics[i].cache_len = cstat.st_size;
+    M_statics[i].data = map;
+    M_statics[i].len = hdr->len;
+    strcpy(M_statics[i].etag, hdr->etag);
 
-                if ( NULL == (data_tmp_min=(char*)malloc(M_statics[i].len+1)) )
-                {
-                    ERR("Couldn't allocate %u bytes for %s", M_statics[i].len, M_statics[i].name);
-                    fclose(fd);
-                    closedir(dir);
-                    return FALSE;
-                }
+    off = NPP_OUT_HEADER_BUFSIZE + hdr->len + 1;
 
-                if ( fread(data_tmp, M_statics[i].len, 1, fd) != 1 )
-                {
-                    ERR("Couldn't read from %s", M_statics[i].name);
-                    fclose(fd);
-                    closedir(dir);
-                    return FALSE;
-                }
+    for ( c=0; c<NPP_CODECS; ++c )
+    {
+        M_statics[i].len_enc[c] = hdr->len_enc[c];
+        M_statics[i].data_enc[c] = hdr->len_enc[c] ? map + off : NULL;
+        off += hdr->len_enc[c];
+    }
 
-                *(data_tmp+M_statics[i].len) = EOS;
+    return TRUE;
+}
 
-                M_statics[i].len = npp_minify(data_tmp_min, data_tmp);   /* new length */
-            }
 
-            /* allocate the final destination */
+/* --------------------------------------------------------------------------
+   Save minified and compressed static resource to the cache
+   Written aside and renamed, so that it's never seen half-written
+-------------------------------------------------------------------------- */
+static void cache_save(int i, const char *path, const struct stat *src)
+{
+    char tmp[NPP_STATIC_PATH_LEN*2+32];
+    FILE *fd;
+    statics_cache_hdr_t hdr={0};
+    int  c;
 
-            if ( reread )
-            {
-                free(M_statics[i].data);
-                M_statics[i].data = NULL;
+    hdr.magic = STATICS_CACHE_MAGIC;
+    hdr.modified = src->st_mtime;
+    hdr.size = src->st_size;
+    hdr.host_id = M_statics[i].host_id;
+    hdr.source = M_statics[i].source;
+    strcpy(hdr.name, M_statics[i].name);
+    hdr.len = M_statics[i].len;
+    strcpy(hdr.etag, M_statics[i].etag);
 
-                if ( M_statics[i].data_deflated )
-                {
-                    free(M_statics[i].data_deflated);
-                    M_statics[i].data_deflated = NULL;
-                }
-            }
+    for ( c=0; c<NPP_CODECS; ++c )
+        hdr.len_enc[c] = M_statics[i].len_enc[c];
 
-            M_statics[i].data = (char*)malloc(M_statics[i].len+1+NPP_OUT_HEADER_BUFSIZE);
+    sprintf(tmp, "%s.%d", path, G_pid);
 
-            if ( NULL == M_statics[i].data )
-            {
-                ERR("Couldn't allocate %u bytes for %s", M_statics[i].len+1+NPP_OUT_HEADER_BUFSIZE, M_statics[i].name);
-                fclose(fd);
-                closedir(dir);
-                return FALSE;
-            }
+    if ( NULL == (fd=fopen(tmp, "w")) )
+    {
+        WAR("Couldn't create %s, errno = %d (%s)", tmp, errno, strerror(errno));
+        return;
+    }
 
-            if ( minify )   /* STATIC_SOURCE_RESMIN */
-            {
-                memcpy(M_statics[i].data+NPP_OUT_HEADER_BUFSIZE, data_tmp_min, M_statics[i].len+1);
-                free(data_tmp);
-                data_tmp = NULL;
-                free(data_tmp_min);
-                data_tmp_min = NULL;
-            }
-            else if ( M_statics[i].source == STATIC_SOURCE_RES )
-            {
-                if ( fread(M_statics[i].data+NPP_OUT_HEADER_BUFSIZE, M_statics[i].len, 1, fd) != 1 )
-                {
-                    ERR("Couldn't read from %s", M_statics[i].name);
-                    fclose(fd);
-                    closedir(dir);
-                    return FALSE;
-                }
-            }
+    fwrite(&hdr, sizeof(hdr), 1, fd);
+    fseek(fd, NPP_OUT_HEADER_BUFSIZE, SEEK_SET);
+    fwrite(M_statics[i].data+NPP_OUT_HEADER_BUFSIZE, M_statics[i].len+1, 1, fd);
 
-            fclose(fd);
+    for ( c=0; c<NPP_CODECS; ++c )
+    {
+        if ( M_statics[i].len_enc[c] )
+            fwrite(M_statics[i].data_enc[c], M_statics[i].len_enc[c], 1, fd);
+    }
 
-            /* get the file type ------------------------------- */
+    if ( fclose(fd) != 0 || rename(tmp, path) != 0 )
+    {
+        WAR("Couldn't write %s, errno = %d (%s)", path, errno, strerror(errno));
+        unlink(tmp);
+    }
+}
+#endif  /* _WIN32 */
 
-            if ( !reread )
-            {
-                M_statics[i].type = npp_lib_get_res_type(M_statics[i].name);
 
-                if ( 0==strcmp(M_statics[i].name, "index.html") )
-                {
-                    if ( host_id == 0 )
-                        M_index_present = i;
-#ifdef NPP_MULTI_HOST
-                    else
-                        G_hosts[host_id].index_present = i;
+/* --------------------------------------------------------------------------
+   Read one static resource file
+   resname is a relative path, namewpath full one
+-------------------------------------------------------------------------- */
+static bool read_file(const char *host, int host_id, char source, bool first_scan, const char *resname, const char *namewpath, const struct stat *fstat)
+{
+    bool    minify=FALSE;
+    int     i;
+    FILE    *fd;
+    char    *data_tmp=NULL;
+    char    *data_tmp_min=NULL;
+    bool    large=FALSE;
+    bool    cached=FALSE;
+#ifndef _WIN32
+    char    cpath[NPP_STATIC_PATH_LEN*2+2];
+    bool    cache=FALSE;
 #endif
-                }
-            }
-
-            /* compress ---------------------------------------- */
 
 #ifndef _WIN32
+    if ( M_load_slices )    /* building the cache -- only this process's share */
+    {
+        int len;
 
-            if ( SHOULD_BE_COMPRESSED(M_statics[i].len, M_statics[i].type) )
-            {
-                if ( NULL == (data_tmp=(char*)malloc(M_statics[i].len)) )
-                {
-                    ERR("Couldn't allocate %u bytes for %s", M_statics[i].len, M_statics[i].name);
-                    closedir(dir);
-                    return FALSE;
-                }
+        if ( static_hash(host_id, resname, &len) % M_load_slices != M_load_slice || !cache_path(cpath, host_id, source, resname, fstat->st_size) )
+            return TRUE;
+    }
+#endif
 
-                int deflated_len = deflate_data((unsigned char*)data_tmp, (unsigned char*)M_statics[i].data+NPP_OUT_HEADER_BUFSIZE, M_statics[i].len);
+    /* already read? */
 
-                if ( deflated_len == -1 )
-                {
-                    WAR("Couldn't compress %s", M_statics[i].name);
+    bool reread = FALSE;
 
-                    if ( M_statics[i].data_deflated )
-                    {
-                        free(M_statics[i].data_deflated);
-                        M_statics[i].data_deflated = NULL;
-                    }
+    if ( !first_scan )
+    {
+        bool exists_not_changed = FALSE;
+
+        for ( i=0; i<M_statics_cnt; ++i )
+        {
+            if ( M_statics[i].host_id == host_id && 0==strcmp(M_statics[i].name, resname) && M_statics[i].source == source )
+            {
+//                DDBG("%s already read", resname);
 
-                    M_statics[i].len_deflated = 0;
+                if ( M_statics[i].modified == fstat->st_mtime )
+                {
+//                    DDBG("Not modified");
+                    exists_not_changed = TRUE;
                 }
                 else
                 {
-                    if ( NULL == (M_statics[i].data_deflated=(char*)malloc(deflated_len+NPP_OUT_HEADER_BUFSIZE)) )
-                    {
-                        ERR("Couldn't allocate %u bytes for deflated %s", deflated_len+NPP_OUT_HEADER_BUFSIZE, M_statics[i].name);
-                        fclose(fd);
-                        closedir(dir);
-                        free(data_tmp);
-                        return FALSE;
-                    }
-
-                    memcpy(M_statics[i].data_deflated+NPP_OUT_HEADER_BUFSIZE, data_tmp, deflated_len);
-                    M_statics[i].len_deflated = deflated_len;
+                    INF("%s has been modified", resname);
+                    reread = TRUE;
                 }
 
-                free(data_tmp);
-                data_tmp = NULL;
+                break;
             }
+        }
 
-#endif  /* _WIN32 */
+        if ( exists_not_changed ) return TRUE;    /* not modified */
+    }
 
-            /* log file info ----------------------------------- */
+    if ( !reread )  /* first time on the list */
+    {
+        if ( (i=static_slot()) == -1 )
+            return TRUE;
 
-            if ( G_logLevel > LOG_INF )
-            {
-                G_ptm = gmtime(&M_statics[i].modified);
-                char mod_time[128];
-                sprintf(mod_time, "%d-%02d-%02d %02d:%02d:%02d", G_ptm->tm_year+1900, G_ptm->tm_mon+1, G_ptm->tm_mday, G_ptm->tm_hour, G_ptm->tm_min, G_ptm->tm_sec);
-                G_ptm = gmtime(&G_now);     /* set it back */
-                DBG("%s %s\t\t%u bytes", npp_add_spaces(M_statics[i].name, 28), mod_time, M_statics[i].len);
-            }
+        /* host -- already uppercase */
 
-            if ( !reread )
-                ++M_statics_cnt;
-        }
-    }
+        strcpy(M_statics[i].host, host);
+        M_statics[i].host_id = host_id;
 
-    closedir(dir);
+        /* file name */
 
-    if ( first_scan && !path )
+        strcpy(M_statics[i].name, resname);
+
+        /* file type */
+
+        M_statics[i].type = npp_lib_get_res_type(M_statics[i].name);
+    }
+    else if ( M_statics[i].conns && !retire_static(i) )
     {
-        DBG("");
-        DBG("M_statics_cnt = %d", M_statics_cnt);
-        DBG("");
+        WAR("Couldn't keep the old version of %s aside, not re-reading it now", resname);
+        return TRUE;
     }
 
-    return TRUE;
-}
+    /* source */
 
+    M_statics[i].source = source;
 
-/* --------------------------------------------------------------------------
-   Read all static resources from disk
--------------------------------------------------------------------------- */
-static bool read_resources(bool first_scan)
-{
-    if ( !read_files("", 0, "res", STATIC_SOURCE_RES, first_scan, NULL) )
-    {
-        ERR("Reading res failed");
-        return FALSE;
-    }
+    if ( source == STATIC_SOURCE_RESMIN )
+        minify = TRUE;
 
-    if ( first_scan )
-        DBG("Reading res OK");
+    /* last modified */
 
-    if ( !read_files("", 0, "resmin", STATIC_SOURCE_RESMIN, first_scan, NULL) )
-    {
-        ERR("Reading resmin failed");
-        return FALSE;
-    }
-
-    if ( first_scan )
-        DBG("Reading resmin OK");
-
-    if ( !npp_lib_read_snippets("", 0, "snippets", first_scan, NULL) )
-    {
-        ERR("Reading snippets failed");
-        return FALSE;
-    }
-
-    if ( first_scan )
-        DBG("Reading snippets OK");
+    M_statics[i].modified = fstat->st_mtime;
+    strcpy(M_statics[i].last_modified, time_epoch2http(M_statics[i].modified));
 
+    /* already minified and compressed? */
 
-#ifdef NPP_MULTI_HOST   /* side gigs */
+#ifndef _WIN32
+    if ( (cache=cache_path(cpath, host_id, source, resname, fstat->st_size)) )
+        cached = cache_load(i, cpath, fstat);
+#endif
 
-    int i;
+    /* size and content */
 
-    for ( i=1; i<G_hosts_cnt; ++i )
+    if ( !cached )
     {
-        if ( G_hosts[i].res[0] && !read_files(G_hosts[i].host, i, G_hosts[i].res, STATIC_SOURCE_RES, first_scan, NULL) )
+#ifdef _WIN32   /* Windows */
+        if ( NULL == (fd=fopen(namewpath, "rb")) )
+#else
+        if ( NULL == (fd=fopen(namewpath, "r")) )
+#endif  /* _WIN32 */
         {
-            ERR("Reading %s's res failed", G_hosts[i].host);
-            return FALSE;
+            ERR("Couldn't open %s", namewpath);
+            if ( !reread )
+                M_statics[i].name[0] = EOS;
+            return TRUE;
         }
 
-        if ( first_scan )
-            DBG("Reading %s's res OK", G_hosts[i].host);
-
-        if ( G_hosts[i].resmin[0] && !read_files(G_hosts[i].host, i, G_hosts[i].resmin, STATIC_SOURCE_RESMIN, first_scan, NULL) )
-        {
-            ERR("Reading %s's resmin failed", G_hosts[i].host);
-            return FALSE;
-        }
+        fseek(fd, 0, SEEK_END);     /* determine the file size */
+        M_statics[i].len = ftell(fd);
+        rewind(fd);
 
-        if ( first_scan )
-            DBG("Reading %s's resmin OK", G_hosts[i].host);
+#ifndef _WIN32
+        large = (source == STATIC_SOURCE_RES && M_statics[i].len > NPP_LARGE_STATIC);
+#endif
 
-        if ( G_hosts[i].snippets[0] && !npp_lib_read_snippets(G_hosts[i].host, i, G_hosts[i].snippets, first_scan, NULL) )
+        if ( minify )
         {
-            ERR("Reading %s's snippets failed", G_hosts[i].host);
-            return FALSE;
-        }
+            /* we don't know the minified size yet -- read file into temp buffer */
 
-        if ( first_scan )
-            DBG("Reading %s's snippets OK", G_hosts[i].host);
-    }
-
-#endif  /* NPP_MULTI_HOST */
+            if ( NULL == (data_tmp=(char*)malloc(M_statics[i].len+1)) )
+            {
+                ERR("Couldn't allocate %u bytes for %s", M_statics[i].len, M_statics[i].name);
+                fclose(fd);
+                return FALSE;
+            }
 
-    qsort(&M_statics, M_statics_cnt, sizeof(M_statics[0]), compare_statics);
+            if ( NULL == (data_tmp_min=(char*)malloc(M_statics[i].len+1)) )
+            {
+                ERR("Couldn't allocate %u bytes for %s", M_statics[i].len, M_statics[i].name);
+                fclose(fd);
+                return FALSE;
+            }
 
-    qsort(&G_snippets, G_snippets_cnt, sizeof(G_snippets[0]), lib_compare_snippets);
+            if ( fread(data_tmp, M_statics[i].len, 1, fd) != 1 )
+            {
+                ERR("Couldn't read from %s", M_statics[i].name);
+                fclose(fd);
+                return FALSE;
+            }
 
-    return TRUE;
-}
+            *(data_tmp+M_statics[i].len) = EOS;
 
+            M_statics[i].len = npp_minify(data_tmp_min, data_tmp);   /* new length */
+        }
 
-/* --------------------------------------------------------------------------
-   Return M_statics array index if URI is on statics' list
--------------------------------------------------------------------------- */
-static int is_static_res(int ci)
-{
-    int first = 0;
-    int last = M_statics_cnt - 1;
-    int middle = (first+last) / 2;
-    int result;
+        /* allocate the final destination */
 
-#ifdef NPP_MULTI_HOST
+        if ( reread )
+            free_static_data(i);
 
-    while ( first <= last )
-    {
-        if ( M_statics[middle].host_id < G_connections[ci].host_id )
-        {
-            first = middle + 1;
-        }
-        else if ( M_statics[middle].host_id == G_connections[ci].host_id )
+#ifndef _WIN32
+        if ( large )    /* don't keep it in memory */
         {
-            result = strcmp(M_statics[middle].name, G_connections[ci].uri);
-
-            if ( result < 0 )
-                first = middle + 1;
-            else if ( result == 0 )
+            if ( !map_static(i, namewpath) )
             {
-                if ( G_connections[ci].if_mod_since >= M_statics[middle].modified )
-                    G_connections[ci].status = 304;  /* Not Modified */
-
-                return middle;
+                fclose(fd);
+                return FALSE;
             }
-            else    /* result > 0 */
-                last = middle - 1;
         }
-        else    /* M_statics[middle].host_id > G_connections[ci].host_id */
+        else
+#endif
+        if ( NULL == (M_statics[i].data=(char*)malloc(M_statics[i].len+1+NPP_OUT_HEADER_BUFSIZE)) )
         {
-            last = middle - 1;
+            ERR("Couldn't allocate %u bytes for %s", M_statics[i].len+1+NPP_OUT_HEADER_BUFSIZE, M_statics[i].name);
+            fclose(fd);
+            return FALSE;
         }
 
-        middle = (first+last) / 2;
-    }
-
-#else   /* NOT NPP_MULTI_HOST */
-
-    while ( first <= last )
-    {
-        result = strcmp(M_statics[middle].name, G_connections[ci].uri);
-
-        if ( result < 0 )
-            first = middle + 1;
-        else if ( result == 0 )
+        if ( minify )   /* STATIC_SOURCE_RESMIN */
         {
-            if ( G_connections[ci].if_mod_since >= M_statics[middle].modified )
-                G_connections[ci].status = 304;  /* Not Modified */
-
-            return middle;
+            memcpy(M_statics[i].data+NPP_OUT_HEADER_BUFSIZE, data_tmp_min, M_statics[i].len+1);
+            free(data_tmp);
+            data_tmp = NULL;
+            free(data_tmp_min);
+            data_tmp_min = NULL;
+        }
+        else if ( !large )  /* STATIC_SOURCE_RES */
+        {
+            if ( fread(M_statics[i].data+NPP_OUT_HEADER_BUFSIZE, M_statics[i].len, 1, fd) != 1 )
+            {
+                ERR("Couldn't read from %s", M_statics[i].name);
+                fclose(fd);
+                return FALSE;
+            }
         }
-        else    /* result > 0 */
-            last = middle - 1;
 
-        middle = (first+last) / 2;
-    }
+        fclose(fd);
 
-#endif  /* NPP_MULTI_HOST */
+        /* ETag ------------------------------------------- */
 
-    return -1;
-}
+#ifndef _WIN32
+        if ( large )
+            make_etag(M_statics[i].etag, M_statics[i].map, M_statics[i].len);
+        else
+#endif
+            make_etag(M_statics[i].etag, M_statics[i].data+NPP_OUT_HEADER_BUFSIZE, M_statics[i].len);
 
+        /* compress ---------------------------------------- */
 
-/* --------------------------------------------------------------------------
-   Main new request processing
-   Request received over current G_connections is already parsed
--------------------------------------------------------------------------- */
-static void process_req(int ci)
-{
-    int ret=OK;
+#ifndef _WIN32
 
-    DBG("ci=%d, process_req", ci);
+        if ( !large && SHOULD_BE_COMPRESSED(M_statics[i].len, M_statics[i].type) && !compress_static(i) )
+            return FALSE;
 
-    /* ------------------------------------------------------------------------ */
+        if ( cache )
+            cache_save(i, cpath, fstat);
 
-#ifdef NPP_DEBUG
-    if ( NPP_CONN_IS_PAYLOAD(G_connections[ci].flags)
-            && G_connections[ci].in_data
-            && G_connections[ci].in_ctype != NPP_CONTENT_TYPE_MULTIPART
-            && G_connections[ci].in_ctype != NPP_CONTENT_TYPE_OCTET_STREAM )
-        npp_log_long(G_connections[ci].in_data, G_connections[ci].was_read, "\nPayload");
-#endif
+#endif  /* _WIN32 */
+    }
 
-    /* ------------------------------------------------------------------------ */
-    /* make room for an outgoing header */
+    /* index ------------------------------------------- */
 
-    G_connections[ci].p_content = G_connections[ci].out_data + NPP_OUT_HEADER_BUFSIZE;
+    if ( !reread && 0==strcmp(M_statics[i].name, "index.html") )
+    {
+        if ( host_id == 0 )
+            M_index_present = i;
+#ifdef NPP_MULTI_HOST
+        else
+            G_hosts[host_id].index_present = i;
+#endif
+    }
 
-    /* ------------------------------------------------------------------------ */
+    /* log file info ----------------------------------- */
 
-    if ( ci == NPP_MAX_CONNECTIONS )    /* connections pool exhausted */
+    if ( G_logLevel > LOG_INF )
     {
-        RES_STATUS(503);
-        render_page_msg(ci, ERR_SERVER_TOOBUSY);
-        RES_DONT_CACHE;
+        G_ptm = gmtime(&M_statics[i].modified);
+        char mod_time[128];
+        sprintf(mod_time, "%d-%02d-%02d %02d:%02d:%02d", G_ptm->tm_year+1900, G_ptm->tm_mon+1, G_ptm->tm_mday, G_ptm->tm_hour, G_ptm->tm_min, G_ptm->tm_sec);
+        G_ptm = gmtime(&G_now);     /* set it back */
+        DBG("%s %s\t\t%u bytes%s", npp_add_spaces(M_statics[i].name, 28), mod_time, M_statics[i].len, large?" (from file)":cached?" (cached)":"");
     }
 
-    /* ------------------------------------------------------------------------ */
+    if ( !reread && i == M_statics_cnt )
+        ++M_statics_cnt;
 
-    if ( G_connections[ci].status != 200 )
-        return;
+    return TRUE;
+}
 
-    /* ------------------------------------------------------------------------ */
-    /* Generate HTML content before header -- to know its size & type --------- */
 
-    /* ------------------------------------------------------------------------ */
-    /* authorization check / log in from cookies ------------------------------ */
+/* --------------------------------------------------------------------------
+   Read static resources from disk
+   Read all the files from G_appdir/res or resmin directory
+   path is a relative path under `res` or `resmin`
+   Unlike snippets, these are only used by the main npp_app process
+-------------------------------------------------------------------------- */
+static bool read_files(const char *host, int host_id, const char *directory, char source, bool first_scan, const char *path)
+{
+    int     i;
+    char    resdir[NPP_STATIC_PATH_LEN+1];      /* full path to res */
+    char    ressubdir[NPP_STATIC_PATH_LEN*2+2]; /* full path to res/subdir */
+    char    namewpath[NPP_STATIC_PATH_LEN*2+2]; /* full path including file name */
+    char    resname[NPP_STATIC_PATH_LEN+1];     /* relative path including file name */
+    char    fullpath[NPP_STATIC_PATH_LEN*2];
+    DIR     *dir;
+    struct dirent *dirent;
+    struct stat fstat;
 
-    bool fresh_session=FALSE;
+    if ( directory == NULL || directory[0] == EOS ) return TRUE;
 
-#ifdef NPP_USERS
+#ifndef _WIN32
+    if ( G_appdir[0] == EOS ) return TRUE;
+#endif
 
-#ifdef NPP_ALLOW_BEARER_AUTH
-    /* copy bearer token to cookie_in_l */
+    if ( first_scan && !path ) DBG("");
 
-    if ( !G_connections[ci].cookie_in_l[0] && G_connections[ci].authorization[0] )
+#ifdef NPP_DEBUG
+    if ( first_scan )
     {
-        char type[8];
-        strncpy(type, npp_upper(G_connections[ci].authorization), 7);
-        type[7] = EOS;
-
-        if ( 0==strcmp(type, "BEARER ") )
-        {
-            strncpy(G_connections[ci].cookie_in_l, G_connections[ci].authorization+7, NPP_SESSID_LEN);
-            G_connections[ci].cookie_in_l[NPP_SESSID_LEN] = EOS;
-        }
+        if ( !path ) DBG_LINE_LONG;
+        DBG("read_files, directory [%s]", directory);
     }
-#endif  /* NPP_ALLOW_BEARER_AUTH */
+#endif  /* NPP_DEBUG */
 
-    /* authenticated requests' checks */
+#ifdef _WIN32   /* be more forgiving */
 
-    if ( LOGGED )
+    if ( G_appdir[0] )
     {
-        DBG("Connection already authenticated, si=%d", G_connections[ci].si);
+        sprintf(resdir, "%s\\%s", G_appdir, directory);
     }
-    else if ( G_connections[ci].cookie_in_l[0] )  /* logged in sessid cookie present */
+    else    /* no NPP_DIR */
     {
-        ret = libusr_luses_ok(ci);     /* is it valid? */
-
-        if ( ret == OK )    /* valid sessid -- user logged in */
-            DBG("User logged in from cookie");
-        else if ( ret != ERR_INT_SERVER_ERROR && ret != ERR_SERVER_TOOBUSY )   /* dodged sessid... or session expired */
-            WAR("Invalid ls cookie");
+        sprintf(resdir, "..\\%s", directory);
     }
 
-    /* authorization */
-
-    if ( LOGGED && G_connections[ci].required_auth_level > G_sessions[G_connections[ci].si].auth_level )
-    {
-        WAR("Insufficient user authorization level, returning 404");
-        ret = ERR_NOT_FOUND;
-        RES_DONT_CACHE;
-    }
-    else if ( !LOGGED && G_connections[ci].required_auth_level > AUTH_LEVEL_ANONYMOUS )   /* redirect to login page */
-    {
-        INF("auth_level > AUTH_LEVEL_ANONYMOUS required, redirecting to login");
+#else   /* Linux -- don't fool around */
 
-        ret = ERR_REDIRECTION;
+    sprintf(resdir, "%s/%s", G_appdir, directory);
 
-#ifndef NPP_DONT_PASS_QS_ON_LOGIN_REDIRECTION
-        char *qs = strchr(G_connections[ci].uri, '?');
+#endif  /* _WIN32 */
 
-        if ( !strlen(NPP_LOGIN_URI) )   /* login page = landing page */
-            sprintf(G_connections[ci].location, "/%s", qs?qs:"");
-        else
-            sprintf(G_connections[ci].location, "%s%s", NPP_LOGIN_URI, qs?qs:"");
-#else   /* don't pass the query string */
-        if ( !strlen(NPP_LOGIN_URI) )   /* login page = landing page */
-            strcpy(G_connections[ci].location, "/");
-        else
-            strcpy(G_connections[ci].location, NPP_LOGIN_URI);
-#endif  /* NPP_DONT_PASS_QS_ON_LOGIN_REDIRECTION */
+#ifdef NPP_DEBUG
+    if ( first_scan )
+        DBG("resdir [%s]", resdir);
+#endif
 
+    if ( !path )   /* highest level */
+    {
+        strcpy(ressubdir, resdir);
     }
-    else
+    else    /* recursive call */
     {
-        DDBG("Request authorized or authorization not required");
-        ret = OK;
+        sprintf(ressubdir, "%s/%s", resdir, path);
     }
 
-    /* anonymous session check */
+#ifdef NPP_DEBUG
+    if ( first_scan )
+        DBG("ressubdir [%s]", ressubdir);
+#endif
 
-    if ( G_connections[ci].required_auth_level==AUTH_LEVEL_ANONYMOUS && G_connections[ci].method[0]!='H' && !LOGGED )    /* anonymous session required */
-#else   /* NPP_USERS NOT defined */
-    if ( G_connections[ci].required_auth_level==AUTH_LEVEL_ANONYMOUS && G_connections[ci].method[0]!='H' )
-#endif  /* NPP_USERS */
+    if ( (dir=opendir(ressubdir)) == NULL )
     {
-        DDBG("At least anonymous session is required");
+        if ( first_scan )
+            DBG("Couldn't open directory [%s], skipping", ressubdir);
+        return TRUE;    /* don't panic, just no external resources will be used */
+    }
 
-#ifndef NPP_START_SESSIONS_FOR_BOTS
+    /* ------------------------------------------------------------------- */
+    /* check removed files */
 
-        DDBG("Don't start session if bot");
+    if ( !first_scan && !path )   /* on the highest level only */
+    {
+//        DDBG("Checking removed files...");
 
-        if ( !REQ_BOT )
+        int removed = 0;
+
+        for ( i=0; i<M_statics_cnt; ++i )
         {
-#endif
-            if ( !G_connections[ci].cookie_in_a[0] || !a_session_ok(ci) )       /* valid anonymous sessid cookie not present */
-            {
-                ret = npp_eng_session_start(ci, NULL);
+            if ( !M_statics[i].name[0] || M_statics[i].host_id != host_id || M_statics[i].source != source ) continue;
 
-                if ( ret == OK )
-                    fresh_session = TRUE;
+//            DDBG("Checking %s...", M_statics[i].name);
+
+            sprintf(fullpath, "%s/%s", resdir, M_statics[i].name);
+
+            if ( !npp_file_exists(fullpath) )
+            {
+                remove_static(i);
+                ++removed;
             }
-#ifndef NPP_START_SESSIONS_FOR_BOTS
         }
-#endif
+
+        if ( removed )
+        {
+            DBG("%d statics removed", removed);
+
+            while ( M_statics_cnt && !M_statics[M_statics_cnt-1].name[0] )
+                --M_statics_cnt;
+
+            DDBG("M_statics_cnt after removing = %d", M_statics_cnt);
+        }
     }
 
-    /* ------------------------------------------------------------------------ */
-    /* process request -------------------------------------------------------- */
+    /* ------------------------------------------------------------------- */
 
-    if ( ret == OK )
+//    DDBG("Reading %sfiles", first_scan?"":"new ");
+
+    /* read files into memory */
+
+    while ( (dirent=readdir(dir)) )
     {
-        if ( !G_connections[ci].location[0] )    /* if not redirection */
-        {
-#ifdef NPP_SET_TZ
-            if ( REQ("npp_set_tz") && REQ_POST )    /* set time zone for the session */
-            {
-                if ( IS_SESSION && !SESSION.tz_set )
-                    npp_set_tz(ci);
-            }
-            else
-            {
-#endif  /* NPP_SET_TZ */
-#ifdef NPP_ENABLE_RELOAD_CONF
-                if ( NPP_VALID_RELOAD_CONF_REQUEST )
-                {
-                    npp_lib_read_conf(FALSE);
-                }
-                else
-#endif  /* NPP_ENABLE_RELOAD_CONF */
-                {
-                    DBG("Calling npp_app_main...");
-                    npp_app_main(ci);         /* main application called here */
-                }
-#ifdef NPP_SET_TZ
-            }
+        if ( dirent->d_name[0] == '.' )   /* skip ".", ".." and hidden files */
+            continue;
+
+        /* ------------------------------------------------------------------- */
+        /* resource name */
+
+        if ( !path )
+            strcpy(resname, dirent->d_name);
+        else
+            sprintf(resname, "%s/%s", path, dirent->d_name);
+
+#ifdef NPP_DEBUG
+        if ( first_scan )
+            DBG("resname [%s]", resname);
 #endif
-        }
-    }
 
-    /* ------------------------------------------------------------------------ */
+        /* ------------------------------------------------------------------- */
+        /* additional file info */
 
-    G_connections[ci].last_activity = G_now;
-    if ( IS_SESSION ) SESSION.last_activity = G_now;
+        sprintf(namewpath, "%s/%s", resdir, resname);
 
-#ifdef NPP_ASYNC
-    if ( G_connections[ci].state == CONN_STATE_WAITING_FOR_ASYNC ) return;
+#ifdef NPP_DEBUG
+        if ( first_scan )
+            DBG("namewpath [%s]", namewpath);
 #endif
-    /* ------------------------------------------------------------------------ */
 
-    if ( G_connections[ci].location[0] || ret == ERR_REDIRECTION )    /* redirection has a priority */
-        G_connections[ci].status = 303;
-    else if ( ret == ERR_INVALID_REQUEST )
-        G_connections[ci].status = 400;
-    else if ( ret == ERR_UNAUTHORIZED )
-        G_connections[ci].status = 401;
-    else if ( ret == ERR_FORBIDDEN )
-        G_connections[ci].status = 403;
-    else if ( ret == ERR_NOT_FOUND )
-        G_connections[ci].status = 404;
-    else if ( ret == ERR_INT_SERVER_ERROR )
-        G_connections[ci].status = 500;
-    else if ( ret == ERR_SERVER_TOOBUSY )
-        G_connections[ci].status = 503;
+        if ( stat(namewpath, &fstat) != 0 )
+        {
+            ERR("stat for [%s] failed, errno = %d (%s)", namewpath, errno, strerror(errno));
+            closedir(dir);
+            return FALSE;
+        }
 
-    if ( ret==ERR_REDIRECTION || G_connections[ci].status==400 || G_connections[ci].status==401 || G_connections[ci].status==403 || G_connections[ci].status==404 || G_connections[ci].status==500 || G_connections[ci].status==503 )
-    {
-        if ( fresh_session )    /* prevent sessions' exhaustion by vulnerability testing bots */
+        /* ------------------------------------------------------------------- */
+
+        if ( S_ISDIR(fstat.st_mode) )   /* directory */
         {
-#ifdef NPP_USERS
-            if ( !LOGGED ) close_uses(G_connections[ci].si, ci);
-#else
-            close_uses(G_connections[ci].si, ci);
+#ifdef NPP_DEBUG
+            if ( first_scan )
+                DBG("Reading subdirectory [%s]...", dirent->d_name);
 #endif
+            read_files(host, host_id, directory, source, first_scan, resname);
+            continue;
         }
-
-        if ( !NPP_CONN_IS_KEEP_CONTENT(G_connections[ci].flags) )   /* reset out buffer pointer as it could have contained something already */
+        else if ( !S_ISREG(fstat.st_mode) )    /* skip if not a regular file nor directory */
         {
-            G_connections[ci].p_content = G_connections[ci].out_data + NPP_OUT_HEADER_BUFSIZE;
-
-            if ( ret == OK )   /* RES_STATUS could be used, show the proper message */
-            {
-                if ( G_connections[ci].status == 400 )
-                    ret = ERR_INVALID_REQUEST;
-                else if ( G_connections[ci].status == 401 )
-                    ret = ERR_UNAUTHORIZED;
-                else if ( G_connections[ci].status == 403 )
-                    ret = ERR_FORBIDDEN;
-                else if ( G_connections[ci].status == 404 )
-                    ret = ERR_NOT_FOUND;
-                else if ( G_connections[ci].status == 500 )
-                    ret = ERR_INT_SERVER_ERROR;
-                else if ( G_connections[ci].status == 503 )
-                    ret = ERR_SERVER_TOOBUSY;
-            }
+#ifdef NPP_DEBUG
+            if ( first_scan )
+                DBG("[%s] is not a regular file", resname);
+#endif
+            continue;
+        }
 
-            render_page_msg(ci, ret);
+        if ( !read_file(host, host_id, source, first_scan, resname, namewpath, &fstat) )
+        {
+            closedir(dir);
+            return FALSE;
         }
+    }
 
-        RES_DONT_CACHE;
+    closedir(dir);
+
+    if ( first_scan && !path )
+    {
+        DBG("");
+        DBG("M_statics_cnt = %d", M_statics_cnt);
+        DBG("");
     }
+
+    return TRUE;
 }
 
 
 /* --------------------------------------------------------------------------
-   Return HTTP status description
-   Sequentioal search as most popular codes are
-   in the beginning of the array
+   Release static resource's content
 -------------------------------------------------------------------------- */
-static const char *get_http_descr(int status_code)
+static void free_static_data(int i)
 {
-    int i;
+    int c;
 
-    for ( i=0; M_http_status[i].status != -1; ++i )
+#ifndef _WIN32
+    if ( M_statics[i].cache )   /* everything's in the mapping */
+    {
+        munmap(M_statics[i].cache, M_statics[i].cache_len);
+        M_statics[i].cache = NULL;
+        M_statics[i].data = NULL;
+
+        for ( c=0; c<NPP_CODECS; ++c )
+        {
+            M_statics[i].data_enc[c] = NULL;
+            M_statics[i].len_enc[c] = 0;
+        }
+
+        return;
+    }
+#endif
+
+    if ( M_statics[i].data )
+    {
+        free(M_statics[i].data);
+        M_statics[i].data = NULL;
+    }
+
+    for ( c=0; c<NPP_CODECS; ++c )
     {
-        if ( M_http_status[i].status == status_code )  /* found */
-            return (const char*)&(M_http_status[i].description);
+        if ( M_statics[i].data_enc[c] )
+        {
+            free(M_statics[i].data_enc[c]);
+            M_statics[i].data_enc[c] = NULL;
+            M_statics[i].len_enc[c] = 0;
+        }
     }
 
-static const char not_found[4]="";
-    return not_found;
+#ifndef _WIN32
+    if ( M_statics[i].map )
+    {
+        munmap(M_statics[i].map, M_statics[i].map_len);
+        close(M_statics[i].map_fd);
+        M_statics[i].map = NULL;
+    }
+#endif
 }
 
 
+#ifndef _WIN32
 /* --------------------------------------------------------------------------
-   Generate HTTP response header
+   Compress static resource with every codec, at the best ratio
+   Variants that wouldn't be smaller are skipped
 -------------------------------------------------------------------------- */
-static void gen_response_header(int ci)
+static bool compress_static(int i)
 {
-#ifdef NPP_DEBUG
-    bool compressed=FALSE;
-#endif
+    int  c;
+    char *data_tmp;
 
-    DBG("ci=%d, gen_response_header", ci);
+    if ( NULL == (data_tmp=(char*)malloc(M_statics[i].len)) )
+    {
+        ERR("Couldn't allocate %u bytes for %s", M_statics[i].len, M_statics[i].name);
+        return FALSE;
+    }
 
-    char out_header[NPP_OUT_HEADER_BUFSIZE];
-    G_connections[ci].p_header = out_header;
+    for ( c=0; c<NPP_CODECS; ++c )
+    {
+        if ( M_statics[i].data_enc[c] )
+        {
+            free(M_statics[i].data_enc[c]);
+            M_statics[i].data_enc[c] = NULL;
+        }
 
-#ifdef NPP_HTTP2
+        M_statics[i].len_enc[c] = 0;
 
-    if ( G_connections[ci].http2_upgrade_in_progress && G_connections[ci].status == 200 )   /* upgrade to HTTP/2 cleartext requested (rare) */
-    {
-        DDBG("Responding with 101");
+        int enc_len = compress_data(c, (unsigned char*)data_tmp, (unsigned char*)M_statics[i].data+NPP_OUT_HEADER_BUFSIZE, M_statics[i].len);
 
-        PRINT_HTTP_STATUS(101);
+        if ( enc_len == -1 )
+            continue;
 
-        PRINT_HTTP2_UPGRADE_CLEAR;
+        if ( NULL == (M_statics[i].data_enc[c]=(char*)malloc(enc_len)) )
+        {
+            ERR("Couldn't allocate %d bytes for %s %s", enc_len, M_codecs[c], M_statics[i].name);
+            free(data_tmp);
+            return FALSE;
+        }
+
+        memcpy(M_statics[i].data_enc[c], data_tmp, enc_len);
+        M_statics[i].len_enc[c] = enc_len;
     }
-    else    /* normal response */
-    {
-        G_connections[ci].http2_upgrade_in_progress = FALSE;
 
-        if ( G_connections[ci].http_ver[0] == '2' )
-            PRINT_HTTP2_STATUS(G_connections[ci].status);
-        else
+    free(data_tmp);
 
-#endif  /* NPP_HTTP2 */
+    return TRUE;
+}
+#endif  /* _WIN32 */
 
-            PRINT_HTTP_STATUS(G_connections[ci].status);
 
-        /* Date */
+#ifndef _WIN32
+/* --------------------------------------------------------------------------
+   Map large static resource instead of reading it into memory
+   Pages are shared with the page cache (and between workers)
+   The mapping only gives content its address -- responses read it
+   through map_fd, as touching pages past a truncated file's end
+   would raise SIGBUS
+-------------------------------------------------------------------------- */
+static bool map_static(int i, const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
 
-#ifdef NPP_HTTP2
-        if ( G_connections[ci].http_ver[0] == '2' )
-            PRINT_HTTP2_DATE;
-        else
-#endif  /* NPP_HTTP2 */
-            PRINT_HTTP_DATE;
+    if ( fd < 0 )
+    {
+        ERR("Couldn't open %s, errno = %d (%s)", path, errno, strerror(errno));
+        return FALSE;
+    }
 
-        if ( G_connections[ci].status == 301 || G_connections[ci].status == 303 )     /* redirection */
-        {
-            DDBG("Redirecting");
+    void *map = mmap(NULL, M_statics[i].len, PROT_READ, MAP_SHARED, fd, 0);
 
-#ifdef NPP_HTTPS
-            if ( NPP_CONN_IS_UPGRADE_TO_HTTPS(G_connections[ci].flags) )    /* Upgrade-Insecure-Requests */
-            {
-#ifdef NPP_HTTP2
-                if ( G_connections[ci].http_ver[0] == '2' )
-                    PRINT_HTTP2_VARY_UIR;
-                else
-#endif  /* NPP_HTTP2 */
-                    PRINT_HTTP_VARY_UIR;
-            }
-#endif  /* NPP_HTTPS */
-
-            if ( G_connections[ci].location[0] )    /* redirection */
-            {
-#ifdef NPP_HTTP2
-                if ( G_connections[ci].http_ver[0] == '2' )
-                    PRINT_HTTP2_LOCATION;
-                else
-#endif  /* NPP_HTTP2 */
-                    PRINT_HTTP_LOCATION;
-            }
-
-            G_connections[ci].clen = 0;
-        }
-        else if ( G_connections[ci].status == 304 )   /* not modified since */
-        {
-            DDBG("Not Modified");
-
-            /*
-               Since the goal of a 304 response is to minimize information transfer
-               when the recipient already has one or more cached representations,
-               a sender SHOULD NOT generate representation metadata other than
-               the above listed fields unless said metadata exists for the purpose
-               of guiding cache updates (e.g., Last-Modified might be useful if
-               the response does not have an ETag field).
-            */
+    if ( map == MAP_FAILED )
+    {
+        ERR("Couldn't mmap %u bytes of %s, errno = %d (%s)", M_statics[i].len, path, errno, strerror(errno));
+        close(fd);
+        return FALSE;
+    }
 
-            if ( G_connections[ci].static_res == NPP_NOT_STATIC )    /* generated */
-            {
-                if ( G_connections[ci].modified )
-                {
-#ifdef NPP_HTTP2
-                    if ( G_connections[ci].http_ver[0] == '2' )
-                        PRINT_HTTP2_LAST_MODIFIED(time_epoch2http(G_connections[ci].modified));
-                    else
-#endif  /* NPP_HTTP2 */
-                        PRINT_HTTP_LAST_MODIFIED(time_epoch2http(G_connections[ci].modified));
-                }
-                else
-                {
-#ifdef NPP_HTTP2
-                    if ( G_connections[ci].http_ver[0] == '2' )
-                        PRINT_HTTP2_LAST_MODIFIED(G_last_modified);
-                    else
-#endif  /* NPP_HTTP2 */
-                        PRINT_HTTP_LAST_MODIFIED(G_last_modified);
-                }
+    madvise(map, M_statics[i].len, MADV_SEQUENTIAL);
 
-                if ( NPP_EXPIRES_GENERATED > 0 )
-                {
-#ifdef NPP_HTTP2
-                    if ( G_connections[ci].http_ver[0] == '2' )
-                        PRINT_HTTP2_EXPIRES_GENERATED;
-                    else
-#endif  /* NPP_HTTP2 */
-                        PRINT_HTTP_EXPIRES_GENERATED;
-                }
-            }
-            else    /* static resource */
-            {
-#ifdef NPP_HTTP2
-                if ( G_connections[ci].http_ver[0] == '2' )
-                    PRINT_HTTP2_LAST_MODIFIED(time_epoch2http(M_statics[G_connections[ci].static_res].modified));
-                else
-#endif  /* NPP_HTTP2 */
-                    PRINT_HTTP_LAST_MODIFIED(time_epoch2http(M_statics[G_connections[ci].static_res].modified));
+    M_statics[i].map = (char*)map;
+    M_statics[i].map_len = M_statics[i].len;
+    M_statics[i].map_fd = fd;
 
-                if ( NPP_EXPIRES_STATICS > 0 )
-                {
-#ifdef NPP_HTTP2
-                    if ( G_connections[ci].http_ver[0] == '2' )
-                        PRINT_HTTP2_EXPIRES_STATICS;
-                    else
-#endif  /* NPP_HTTP2 */
-                        PRINT_HTTP_EXPIRES_STATICS;
-                }
-            }
+    return TRUE;
+}
+#endif  /* _WIN32 */
 
-            G_connections[ci].clen = 0;
-        }
-        else    /* normal response with content: 2xx, 4xx, 5xx */
-        {
-            DDBG("Normal response");
 
-            if ( NPP_CONN_IS_DONT_CACHE(G_connections[ci].flags) )    /* dynamic content */
-            {
-#ifdef NPP_HTTP2
-                if ( G_connections[ci].http_ver[0] == '2' )
-                {
-                    PRINT_HTTP2_VARY_DYN;
-                    PRINT_HTTP2_NO_CACHE;
-                }
-                else
-#endif  /* NPP_HTTP2 */
-                {
-                    PRINT_HTTP_VARY_DYN;
-                    PRINT_HTTP_NO_CACHE;
-                }
-            }
-            else    /* static content */
-            {
-#ifdef NPP_HTTP2
-                if ( G_connections[ci].http_ver[0] == '2' )
-                    PRINT_HTTP2_VARY_STAT;
-                else
-#endif  /* NPP_HTTP2 */
-                    PRINT_HTTP_VARY_STAT;
+#ifndef _WIN32
+/* --------------------------------------------------------------------------
+   List response pieces: header, then content or 206 parts
+-------------------------------------------------------------------------- */
+static int out_pieces(int ci, struct iovec *iov)
+{
+    int cnt=0;
 
-                if ( G_connections[ci].static_res == NPP_NOT_STATIC )   /* generated -- moderate caching */
-                {
-                    if ( G_connections[ci].modified )
-                    {
-#ifdef NPP_HTTP2
-                        if ( G_connections[ci].http_ver[0] == '2' )
-                            PRINT_HTTP2_LAST_MODIFIED(time_epoch2http(G_connections[ci].modified));
-                        else
-#endif  /* NPP_HTTP2 */
-                            PRINT_HTTP_LAST_MODIFIED(time_epoch2http(G_connections[ci].modified));
-                    }
-                    else
-                    {
-#ifdef NPP_HTTP2
-                        if ( G_connections[ci].http_ver[0] == '2' )
-                            PRINT_HTTP2_LAST_MODIFIED(G_last_modified);
-                        else
-#endif  /* NPP_HTTP2 */
-                            PRINT_HTTP_LAST_MODIFIED(G_last_modified);
-                    }
+    iov[cnt].iov_base = G_connections[ci].out_start;
+    iov[cnt].iov_len = G_connections[ci].out_hlen;
+    ++cnt;
 
-                    if ( NPP_EXPIRES_GENERATED > 0 )
-                    {
-#ifdef NPP_HTTP2
-                        if ( G_connections[ci].http_ver[0] == '2' )
-                            PRINT_HTTP2_EXPIRES_GENERATED;
-                        else
-#endif  /* NPP_HTTP2 */
-                            PRINT_HTTP_EXPIRES_GENERATED;
-                    }
-                }
-                else    /* static resource -- aggressive caching */
-                {
-#ifdef NPP_HTTP2
-                    if ( G_connections[ci].http_ver[0] == '2' )
-                        PRINT_HTTP2_LAST_MODIFIED(time_epoch2http(M_statics[G_connections[ci].static_res].modified));
-                    else
-#endif  /* NPP_HTTP2 */
-                        PRINT_HTTP_LAST_MODIFIED(time_epoch2http(M_statics[G_connections[ci].static_res].modified));
+    if ( G_connections[ci].ranges_cnt > 1 )   /* multipart/byteranges */
+    {
+        char *parts = G_connections[ci].out_data + NPP_OUT_HEADER_BUFSIZE;
+        const npp_range_t *r = G_connections[ci].ranges;
+        int i;
 
-                    if ( NPP_EXPIRES_STATICS > 0 )
-                    {
-#ifdef NPP_HTTP2
-                        if ( G_connections[ci].http_ver[0] == '2' )
-                            PRINT_HTTP2_EXPIRES_STATICS;
-                        else
-#endif  /* NPP_HTTP2 */
-                            PRINT_HTTP_EXPIRES_STATICS;
-                    }
-                }
-            }
+        for ( i=0; i<G_connections[ci].ranges_cnt; ++i )
+        {
+            iov[cnt].iov_base = parts + r[i].hdr_off;
+            iov[cnt].iov_len = r[i].hdr_len;
+            ++cnt;
+            iov[cnt].iov_base = G_connections[ci].out_body + r[i].start;
+            iov[cnt].iov_len = r[i].len;
+            ++cnt;
+        }
 
-            /* content length and type */
+        iov[cnt].iov_base = parts + r[i].hdr_off;     /* closing boundary */
+        iov[cnt].iov_len = r[i].hdr_len;
+        ++cnt;
+    }
+    else
+    {
+        iov[cnt].iov_base = G_connections[ci].out_body;
+        iov[cnt].iov_len = G_connections[ci].clen;
+        ++cnt;
+    }
 
-            if ( G_connections[ci].static_res == NPP_NOT_STATIC )
-            {
-                G_connections[ci].clen = G_connections[ci].p_content - G_connections[ci].out_data - NPP_OUT_HEADER_BUFSIZE;
-            }
-            else    /* static resource */
-            {
-                G_connections[ci].clen = M_statics[G_connections[ci].static_res].len;
-                G_connections[ci].out_ctype = M_statics[G_connections[ci].static_res].type;
-            }
+    return cnt;
+}
 
-            /* compress? ------------------------------------------------------------------ */
 
-#ifndef _WIN32  /* in Windows it's just too much headache */
+/* --------------------------------------------------------------------------
+   Is p within large file's mapping (to be sent with sendfile)?
+-------------------------------------------------------------------------- */
+static bool in_map(const static_res_t *st, const void *p)
+{
+    return (st->map && (const char*)p >= st->map && (const char*)p < st->map + st->map_len);
+}
 
-            if ( SHOULD_BE_COMPRESSED(G_connections[ci].clen, G_connections[ci].out_ctype) && NPP_CONN_IS_ACCEPT_DEFLATE(G_connections[ci].flags) && !NPP_UA_IE )
-            {
-                if ( G_connections[ci].static_res==NPP_NOT_STATIC )
-                {
-                    DBG("Compressing content");
 
-                    int ret;
-static              z_stream strm;
-static              bool first=TRUE;
+/* --------------------------------------------------------------------------
+   Room for large file's content read with pread()
+   What's left of the connection's buffer after the header and 206 parts
+-------------------------------------------------------------------------- */
+static char *file_buf(int ci, unsigned *size)
+{
+    unsigned used = NPP_OUT_HEADER_BUFSIZE;
 
-                    if ( first )
-                    {
-                        strm.zalloc = Z_NULL;
-                        strm.zfree = Z_NULL;
-                        strm.opaque = Z_NULL;
+    if ( G_connections[ci].ranges_cnt > 1 )
+    {
+        const npp_range_t *r = &G_connections[ci].ranges[G_connections[ci].ranges_cnt];
+        used += r->hdr_off + r->hdr_len;
+    }
 
-                        ret = deflateInit(&strm, NPP_COMPRESS_LEVEL);
+    *size = G_connections[ci].out_data_allocated - used;
 
-                        if ( ret != Z_OK )
-                        {
-                            ERR("deflateInit failed, ret = %d", ret);
-                            return;
-                        }
+    return G_connections[ci].out_data + used;
+}
 
-                        first = FALSE;
-                    }
 
-                    unsigned max = G_connections[ci].clen;
+/* --------------------------------------------------------------------------
+   Send static resource
+   Header from the connection's buffer, content from where it's cached
+   (or straight from the file) -- nothing is copied, except for large
+   file's content over TLS or without sendfile()
+   Return the last write's result, like the send loops do
+-------------------------------------------------------------------------- */
+static int send_static(int ci, bool secure)
+{
+    const static_res_t *st = &M_statics[G_connections[ci].static_res];
+    struct iovec iov[NPP_MAX_RANGES*2+2];
+    int iovcnt = out_pieces(ci, iov);
+    int bytes=0;
 
-                    ret = deflate_inplace(&strm, (unsigned char*)G_connections[ci].out_data+NPP_OUT_HEADER_BUFSIZE, G_connections[ci].clen, &max);
+    while ( G_conn_hot[ci].data_sent < G_conn_hot[ci].out_len )
+    {
+        /* find where we are */
 
-                    if ( ret == Z_OK )
-                    {
-                        DBG("Compression success, old len=%u, new len=%u", G_connections[ci].clen, max);
-                        G_connections[ci].clen = max;
-#ifdef NPP_HTTP2
-                        if ( G_connections[ci].http_ver[0] == '2' )
-                            PRINT_HTTP2_CONTENT_ENCODING_DEFLATE;
-                        else
-#endif  /* NPP_HTTP2 */
-                            PRINT_HTTP_CONTENT_ENCODING_DEFLATE;
-#ifdef NPP_DEBUG
-                        compressed = TRUE;
-#endif
-                    }
-                    else
-                    {
-                        ERR("deflate_inplace failed, ret = %d", ret);
-                    }
-                }
-                else if ( M_statics[G_connections[ci].static_res].len_deflated )   /* compressed static resource is available */
-                {
-                    G_connections[ci].out_data = M_statics[G_connections[ci].static_res].data_deflated;
-                    G_connections[ci].clen = M_statics[G_connections[ci].static_res].len_deflated;
-#ifdef NPP_HTTP2
-                    if ( G_connections[ci].http_ver[0] == '2' )
-                        PRINT_HTTP2_CONTENT_ENCODING_DEFLATE;
-                    else
-#endif  /* NPP_HTTP2 */
-                        PRINT_HTTP_CONTENT_ENCODING_DEFLATE;
-#ifdef NPP_DEBUG
-                    compressed = TRUE;
-#endif
-                }
-            }
-#endif  /* _WIN32 */
+        unsigned skip = G_conn_hot[ci].data_sent;
+        int first=0;
 
-            /* ---------------------------------------------------------------------------- */
+        while ( skip >= iov[first].iov_len )
+        {
+            skip -= iov[first].iov_len;
+            ++first;
         }
 
-        /* Content-Type */
+        char *p = (char*)iov[first].iov_base + skip;
+        unsigned len = iov[first].iov_len - skip;
 
-        if ( G_connections[ci].clen == 0 )   /* don't set for these */
-        {                   /* this covers 301, 303 and 304 */
+#ifdef __linux__
+        if ( !secure && in_map(st, p) )     /* large file's content */
+        {
+            off_t off = p - st->map;
+            bytes = sendfile(G_conn_hot[ci].fd, st->map_fd, &off, len);     /* 0 if the file has shrunk */
         }
-        else if ( G_connections[ci].ctypestr[0] )    /* custom */
+        else
+#endif
+        if ( in_map(st, p) )    /* large file's content -- through the buffer */
         {
-#ifdef NPP_HTTP2
-            if ( G_connections[ci].http_ver[0] == '2' )
-                PRINT_HTTP2_CONTENT_TYPE(G_connections[ci].ctypestr);
+            unsigned size;
+            char *buf = file_buf(ci, &size);
+
+            if ( len > size ) len = size;   /* SSL_write retries need the same args */
+
+            if ( pread(st->map_fd, buf, len, p - st->map) != (ssize_t)len )
+            {
+                WAR("Couldn't read %u bytes of %s, file may have changed", len, st->name);
+                errno = EIO;    /* tell set_state() to close */
+                bytes = -1;
+                break;
+            }
+#ifdef NPP_HTTPS
+            if ( secure )
+                bytes = SSL_write(G_conn_hot[ci].ssl, buf, len);
             else
 #endif
-                PRINT_HTTP_CONTENT_TYPE(G_connections[ci].ctypestr);
+                bytes = send(G_conn_hot[ci].fd, buf, len, 0);
         }
-        else if ( G_connections[ci].out_ctype != NPP_CONTENT_TYPE_UNSET )
+#ifdef NPP_HTTPS
+        else if ( secure )  /* no writev for SSL -- piece by piece */
         {
-            print_content_type(ci, G_connections[ci].out_ctype);
+            if ( len > NPP_OUT_BUFSIZE ) len = NPP_OUT_BUFSIZE;  /* SSL_write retries need the same args */
+            bytes = SSL_write(G_conn_hot[ci].ssl, p, len);
         }
+#endif  /* NPP_HTTPS */
+        else    /* everything up to the next file piece at once */
+        {
+            struct iovec out[NPP_MAX_RANGES*2+2];
+            struct msghdr msg={0};
+            int i, n=0;
 
-        /* Content-Disposition */
+            out[n].iov_base = p;
+            out[n].iov_len = len;
+            ++n;
 
-        if ( G_connections[ci].cdisp[0] )
-        {
-#ifdef NPP_HTTP2
-            if ( G_connections[ci].http_ver[0] == '2' )
-                PRINT_HTTP2_CONTENT_DISP(G_connections[ci].cdisp);
-            else
+            for ( i=first+1; i<iovcnt && !in_map(st, iov[i].iov_base); ++i )
+                out[n++] = iov[i];
+
+            msg.msg_iov = out;
+            msg.msg_iovlen = n;
+#ifdef MSG_MORE
+            bytes = sendmsg(G_conn_hot[ci].fd, &msg, i<iovcnt?MSG_MORE:0);
+#else
+            bytes = sendmsg(G_conn_hot[ci].fd, &msg, 0);
 #endif
-                PRINT_HTTP_CONTENT_DISP(G_connections[ci].cdisp);
         }
 
-        /* Content-Length */
+        if ( bytes <= 0 )
+            break;
 
-#ifdef NPP_HTTP2
-        if ( G_connections[ci].http_ver[0] == '2' )
-            PRINT_HTTP2_CONTENT_LEN(G_connections[ci].clen);
-        else
-#endif  /* NPP_HTTP2 */
-            PRINT_HTTP_CONTENT_LEN(G_connections[ci].clen);
+        DDBG("ci=%d, sent %d bytes", ci, bytes);
+        G_conn_hot[ci].data_sent += bytes;
+    }
 
-        /* Security */
+    return bytes;
+}
+#endif  /* _WIN32 */
 
-        if ( G_connections[ci].clen > 0 )
-        {
-#ifndef NPP_NO_SAMEORIGIN
-#ifdef NPP_HTTP2
-            if ( G_connections[ci].http_ver[0] == '2' )
-                PRINT_HTTP2_SAMEORIGIN;
-            else
-#endif  /* NPP_HTTP2 */
-                PRINT_HTTP_SAMEORIGIN;
-#endif  /* NPP_NO_SAMEORIGIN */
 
-#ifndef NPP_NO_NOSNIFF
-#ifdef NPP_HTTP2
-            if ( G_connections[ci].http_ver[0] == '2' )
-                PRINT_HTTP2_NOSNIFF;
-            else
-#endif  /* NPP_HTTP2 */
-                PRINT_HTTP_NOSNIFF;
-#endif  /* NPP_NO_NOSNIFF */
-        }
+/* --------------------------------------------------------------------------
+   Parse uppercase Accept-Encoding value
+   Return accepted codecs as (1<<NPP_CODEC_XXX) bits, skip q=0 ones
+-------------------------------------------------------------------------- */
+static char accept_encodings(const char *value)
+{
+    char ret=0;
+    char item[32];
+    const char *p=value;
+    int  c, i;
 
-        /* Connection */
+    while ( *p )
+    {
+        while ( *p==' ' || *p==',' ) ++p;
 
-#ifdef NPP_HTTP2
-        if ( G_connections[ci].http_ver[0] != '2' )
-#endif  /* NPP_HTTP2 */
-            PRINT_HTTP_CONNECTION;
+        i = 0;
 
-        /* Cookie */
+        while ( *p && *p!=',' && i<31 )
+            item[i++] = *p++;
 
-        if ( G_connections[ci].static_res == NPP_NOT_STATIC && (G_connections[ci].status == 200 || G_connections[ci].status == 303) && G_connections[ci].method[0]!='H' )
-        {
-            if ( G_connections[ci].cookie_out_l[0] )         /* logged in cookie has been produced */
-            {
-                if ( G_connections[ci].cookie_out_l_exp[0] )
-                {
-#ifdef NPP_HTTP2
-                    if ( G_connections[ci].http_ver[0] == '2' )
-                        PRINT_HTTP2_COOKIE_L_EXP(ci);    /* with expiration date */
-                    else
-#endif  /* NPP_HTTP2 */
-                        PRINT_HTTP_COOKIE_L_EXP(ci);
-                }
-                else
-                {
-#ifdef NPP_HTTP2
-                    if ( G_connections[ci].http_ver[0] == '2' )
-                        PRINT_HTTP2_COOKIE_L(ci);
-                    else
-#endif  /* NPP_HTTP2 */
-                        PRINT_HTTP_COOKIE_L(ci);
-                }
-            }
+        item[i] = EOS;
 
-            if ( G_connections[ci].cookie_out_a[0] )         /* anonymous cookie has been produced */
-            {
-                if ( G_connections[ci].cookie_out_a_exp[0] )
-                {
-#ifdef NPP_HTTP2
-                    if ( G_connections[ci].http_ver[0] == '2' )
-                        PRINT_HTTP2_COOKIE_A_EXP(ci);    /* with expiration date */
-                    else
-#endif  /* NPP_HTTP2 */
-                        PRINT_HTTP_COOKIE_A_EXP(ci);
-                }
-                else
-                {
-#ifdef NPP_HTTP2
-                    if ( G_connections[ci].http_ver[0] == '2' )
-                        PRINT_HTTP2_COOKIE_A(ci);
-                    else
-#endif  /* NPP_HTTP2 */
-                        PRINT_HTTP_COOKIE_A(ci);
-                }
-            }
-        }
+        while ( *p && *p!=',' ) ++p;    /* too long */
 
-#ifdef NPP_HTTPS
-#ifndef NPP_NO_HSTS
-        if ( NPP_CONN_IS_SECURE(G_connections[ci].flags) )
-            PRINT_HTTP_HSTS;
-#endif
-#endif  /* NPP_HTTPS */
+        const char *q = strstr(item, "Q=");
 
-#ifndef NPP_NO_IDENTITY
-#ifdef NPP_HTTP2
-        if ( G_connections[ci].http_ver[0] == '2' )
-            PRINT_HTTP2_SERVER;
-        else
-#endif  /* NPP_HTTP2 */
-            PRINT_HTTP_SERVER;
-#endif  /* NPP_NO_IDENTITY */
+        if ( q && atof(q+2) <= 0 )
+            continue;
 
-        /* ------------------------------------------------------------- */
-        /* custom headers */
+        for ( i=0; item[i] && item[i]!=';' && item[i]!=' '; ++i );
+        item[i] = EOS;
+
+        if ( 0==strcmp(item, "*") )
+            return (char)((1<<NPP_CODECS)-1);
 
-        if ( G_connections[ci].cust_headers[0] )
+        for ( c=0; c<NPP_CODECS; ++c )
         {
-            HOUT(G_connections[ci].cust_headers);
+            if ( 0==strcmp(item, npp_upper(M_codecs[c])) || (c==NPP_CODEC_GZIP && 0==strcmp(item, "X-GZIP")) )
+                ret |= (1<<c);
         }
+    }
 
-        /* ------------------------------------------------------------- */
+    return ret;
+}
 
-#ifdef NPP_HTTP2
+
+#ifndef _WIN32
+/* --------------------------------------------------------------------------
+   Make sure large payloads have somewhere to go
+-------------------------------------------------------------------------- */
+static void init_payload_spool()
+{
+    char dir[NPP_STATIC_PATH_LEN*2+2];
+
+    if ( !NPP_PAYLOAD_SPOOL_DIR[0] ) return;
+
+    sprintf(dir, "%s/%s", G_appdir, NPP_PAYLOAD_SPOOL_DIR);
+
+    if ( mkdir(dir, 0700) != 0 && errno != EEXIST )
+    {
+        WAR("Couldn't create %s, errno = %d (%s), payloads will be kept in memory", dir, errno, strerror(errno));
+        return;
     }
-#endif
 
-#ifdef NPP_HTTP2
-    if ( G_connections[ci].http_ver[0] != '2' )
-#endif
-        PRINT_HTTP_END_OF_HEADER;
+    M_payload_spool = TRUE;
+}
 
-    /* header length */
 
-    G_connections[ci].out_hlen = G_connections[ci].p_header - out_header;
+/* --------------------------------------------------------------------------
+   Minify and compress whatever's missing in the statics cache
+   Split between processes, each taking its share of the hash range;
+   read_resources() then only maps the results
+-------------------------------------------------------------------------- */
+static void build_statics_cache()
+{
+    char dir[NPP_STATIC_PATH_LEN*2+2];
 
-    DDBG("ci=%d, out_hlen = %u", ci, G_connections[ci].out_hlen);
+    if ( !NPP_STATICS_CACHE_DIR[0] ) return;
 
-    DBG("Response status: %d", G_connections[ci].status);
+    sprintf(dir, "%s/%s", G_appdir, NPP_STATICS_CACHE_DIR);
 
-    DDBG("ci=%d, changing state to CONN_STATE_READY_TO_SEND_RESPONSE", ci);
-    G_connections[ci].state = CONN_STATE_READY_TO_SEND_RESPONSE;
+    if ( mkdir(dir, 0700) != 0 && errno != EEXIST )
+    {
+        WAR("Couldn't create %s, errno = %d (%s), statics won't be cached", dir, errno, strerror(errno));
+        return;
+    }
 
-#ifdef NPP_FD_MON_POLL
-    M_pollfds[G_connections[ci].pi].events = POLLOUT;
-#endif
+    M_statics_cache = TRUE;
 
-#ifdef NPP_FD_MON_EPOLL
-    struct epoll_event ev={0};
+    int procs = sysconf(_SC_NPROCESSORS_ONLN);
 
-    ev.data.fd = G_connections[ci].fd;
-    ev.events = EPOLLOUT | EPOLLET;
-    epoll_ctl(M_epoll_fd, EPOLL_CTL_MOD, ev.data.fd, &ev);
-#endif
+    if ( procs > NPP_LOAD_PROCESSES )
+        procs = NPP_LOAD_PROCESSES;
 
-#ifdef NPP_HTTP2
-    if ( G_connections[ci].http_ver[0] != '2' )
-#endif
-#if NPP_OUT_HEADER_BUFSIZE-1 <= NPP_MAX_LOG_STR_LEN
-        DBG("\nResponse header:\n\n[%s]\n", out_header);
-#else
-        npp_log_long(out_header, G_connections[ci].out_hlen, "\nResponse header");
-#endif  /* NPP_OUT_HEADER_BUFSIZE-1 <= NPP_MAX_LOG_STR_LEN */
+    if ( procs < 2 ) return;    /* read_resources() will do it in line */
 
-    /* ----------------------------------------------------------------- */
-    /* try to send everything at once */
-    /* copy response header just before the content */
+    INF("Building statics cache with %d processes", procs);
 
-    G_connections[ci].out_start = G_connections[ci].out_data + (NPP_OUT_HEADER_BUFSIZE - G_connections[ci].out_hlen);
-    memcpy(G_connections[ci].out_start, out_header, G_connections[ci].out_hlen);
-    G_connections[ci].out_len = G_connections[ci].out_hlen + G_connections[ci].clen;
+    npp_log_flush();
 
-    /* ----------------------------------------------------------------- */
+    pid_t pids[NPP_LOAD_PROCESSES];
+    int   k, started=0;
 
-#ifdef NPP_DEBUG     /* low-level tests */
-    if ( G_logLevel>=LOG_DBG
-            && G_connections[ci].clen > 0
-            && G_connections[ci].method[0]!='H'   /* HEAD */
-            && G_connections[ci].static_res==NPP_NOT_STATIC
-            && !compressed
-            && (G_connections[ci].out_ctype==NPP_CONTENT_TYPE_TEXT || G_connections[ci].out_ctype==NPP_CONTENT_TYPE_JSON) )
-        npp_log_long(G_connections[ci].out_data+NPP_OUT_HEADER_BUFSIZE, G_connections[ci].clen, "Content to send");
-#endif  /* NPP_DEBUG */
+    for ( k=0; k<procs; ++k )
+    {
+        pid_t pid = fork();
 
-    /* ----------------------------------------------------------------- */
+        if ( pid == 0 )     /* child */
+        {
+            G_pid = getpid();
+            G_logLevel = LOG_ERR;
+            M_load_slice = k;
+            M_load_slices = procs;
 
-    G_connections[ci].last_activity = G_now;
-    if ( IS_SESSION ) SESSION.last_activity = G_now;
+            read_files("", 0, "res", STATIC_SOURCE_RES, TRUE, NULL);
+            read_files("", 0, "resmin", STATIC_SOURCE_RESMIN, TRUE, NULL);
+#ifdef NPP_MULTI_HOST
+            int h;
+            for ( h=1; h<G_hosts_cnt; ++h )
+            {
+                if ( G_hosts[h].res[0] )
+                    read_files(G_hosts[h].host, h, G_hosts[h].res, STATIC_SOURCE_RES, TRUE, NULL);
+                if ( G_hosts[h].resmin[0] )
+                    read_files(G_hosts[h].host, h, G_hosts[h].resmin, STATIC_SOURCE_RESMIN, TRUE, NULL);
+            }
+#endif
+            npp_log_flush();
+            _exit(0);
+        }
+        else if ( pid > 0 )
+        {
+            pids[started++] = pid;
+        }
+        else
+        {
+            WAR("fork failed, errno = %d (%s)", errno, strerror(errno));
+            break;
+        }
+    }
 
-    log_proc_time(ci);
+    /* whatever they didn't finish, read_resources() will */
+
+    for ( k=0; k<started; ++k )
+        waitpid(pids[k], NULL, 0);
+
+    DBG("Statics cache OK");
 }
+#endif  /* _WIN32 */
 
 
 /* --------------------------------------------------------------------------
-   Print Content-Type to response header
-   Mirrored npp_lib_set_res_content_type
+   Read all static resources from disk
 -------------------------------------------------------------------------- */
-static void print_content_type(int ci, char type)
+static bool read_resources(bool first_scan)
 {
-    char http_type[256];
+    if ( !read_files("", 0, "res", STATIC_SOURCE_RES, first_scan, NULL) )
+    {
+        ERR("Reading res failed");
+        return FALSE;
+    }
 
-    if ( type == NPP_CONTENT_TYPE_HTML )
-        strcpy(http_type, "text/html; charset=utf-8");
-    else if ( type == NPP_CONTENT_TYPE_CSS )
-        strcpy(http_type, "text/css");
-    else if ( type == NPP_CONTENT_TYPE_JS )
-        strcpy(http_type, "application/javascript");
-    else if ( type == NPP_CONTENT_TYPE_GIF )
-        strcpy(http_type, "image/gif");
-    else if ( type == NPP_CONTENT_TYPE_JPG )
-        strcpy(http_type, "image/jpeg");
-    else if ( type == NPP_CONTENT_TYPE_ICO )
-        strcpy(http_type, "image/x-icon");
-    else if ( type == NPP_CONTENT_TYPE_PNG )
-        strcpy(http_type, "image/png");
-    else if ( type == NPP_CONTENT_TYPE_WOFF2 )
-        strcpy(http_type, "application/font-woff2");
-    else if ( type == NPP_CONTENT_TYPE_SVG )
-        strcpy(http_type, "image/svg+xml");
-    else if ( type == NPP_CONTENT_TYPE_JSON )
-        strcpy(http_type, "application/json");
-    else if ( type == NPP_CONTENT_TYPE_MD )
-        strcpy(http_type, "text/markdown");
-    else if ( type == NPP_CONTENT_TYPE_PDF )
-        strcpy(http_type, "application/pdf");
-    else if ( type == NPP_CONTENT_TYPE_XML )
-        strcpy(http_type, "application/xml");
-    else if ( type == NPP_CONTENT_TYPE_AMPEG )
-        strcpy(http_type, "audio/mpeg");
-    else if ( type == NPP_CONTENT_TYPE_EXE )
-        strcpy(http_type, "application/x-msdownload");
-    else if ( type == NPP_CONTENT_TYPE_ZIP )
-        strcpy(http_type, "application/zip");
-    else if ( type == NPP_CONTENT_TYPE_GZIP )
-        strcpy(http_type, "application/gzip");
-    else if ( type == NPP_CONTENT_TYPE_BMP )
-        strcpy(http_type, "image/bmp");
-    else
-        strcpy(http_type, "text/plain");
+    if ( first_scan )
+        DBG("Reading res OK");
 
-#ifdef NPP_HTTP2
-    if ( G_connections[ci].http_ver[0] == '2' )
-        PRINT_HTTP2_CONTENT_TYPE(http_type);
-    else
-#endif  /* NPP_HTTP2 */
-        PRINT_HTTP_CONTENT_TYPE(http_type);
-}
+    if ( !read_files("", 0, "resmin", STATIC_SOURCE_RESMIN, first_scan, NULL) )
+    {
+        ERR("Reading resmin failed");
+        return FALSE;
+    }
 
+    if ( first_scan )
+        DBG("Reading resmin OK");
 
-/* --------------------------------------------------------------------------
-   Find session index
--------------------------------------------------------------------------- */
-#ifdef NPP_MULTI_HOST
-int npp_eng_find_si(int host_id, const char *sessid)
-{
-    int idx = npp_lib_find_sess_idx_idx(host_id, sessid);
+    if ( !npp_lib_read_snippets("", 0, "snippets", first_scan, NULL) )
+    {
+        ERR("Reading snippets failed");
+        return FALSE;
+    }
 
-    if ( idx != -1 )
-        return G_sessions_idx[idx].si;
+    if ( first_scan )
+        DBG("Reading snippets OK");
+
+
+#ifdef NPP_MULTI_HOST   /* side gigs */
+
+    int i;
+
+    for ( i=1; i<G_hosts_cnt; ++i )
+    {
+        if ( G_hosts[i].res[0] && !read_files(G_hosts[i].host, i, G_hosts[i].res, STATIC_SOURCE_RES, first_scan, NULL) )
+        {
+            ERR("Reading %s's res failed", G_hosts[i].host);
+            return FALSE;
+        }
+
+        if ( first_scan )
+            DBG("Reading %s's res OK", G_hosts[i].host);
+
+        if ( G_hosts[i].resmin[0] && !read_files(G_hosts[i].host, i, G_hosts[i].resmin, STATIC_SOURCE_RESMIN, first_scan, NULL) )
+        {
+            ERR("Reading %s's resmin failed", G_hosts[i].host);
+            return FALSE;
+        }
+
+        if ( first_scan )
+            DBG("Reading %s's resmin OK", G_hosts[i].host);
+
+        if ( G_hosts[i].snippets[0] && !npp_lib_read_snippets(G_hosts[i].host, i, G_hosts[i].snippets, first_scan, NULL) )
+        {
+            ERR("Reading %s's snippets failed", G_hosts[i].host);
+            return FALSE;
+        }
+
+        if ( first_scan )
+            DBG("Reading %s's snippets OK", G_hosts[i].host);
+    }
+
+#endif  /* NPP_MULTI_HOST */
+
+    statics_hash_build();
+
+    qsort(&G_snippets, G_snippets_cnt, sizeof(G_snippets[0]), lib_compare_snippets);
+
+#ifdef NPP_ASYNC
+    if ( M_wi == 0 && !first_scan )     /* for npp_svc processes, init() does it after opening queues */
+        npp_lib_snippets_publish();
+#endif
+
+    return TRUE;
+}
+
+
+#ifndef NPP_DONT_RESCAN_RES
+/* --------------------------------------------------------------------------
+   Watch resource directories, so that only what's changed is re-read
+   If that's not possible, they're periodically rescanned instead
+-------------------------------------------------------------------------- */
+static void watch_resources()
+{
+    M_watching = npp_lib_watch_start()
+            && npp_lib_watch_dir("", 0, "res", STATIC_SOURCE_RES, NULL)
+            && npp_lib_watch_dir("", 0, "resmin", STATIC_SOURCE_RESMIN, NULL)
+            && npp_lib_watch_dir("", 0, "snippets", STATIC_SOURCE_SNIPPETS, NULL);
+
+#ifdef NPP_MULTI_HOST   /* side gigs */
+
+    int i;
+
+    for ( i=1; M_watching && i<G_hosts_cnt; ++i )
+    {
+        M_watching = npp_lib_watch_dir(G_hosts[i].host, i, G_hosts[i].res, STATIC_SOURCE_RES, NULL)
+                && npp_lib_watch_dir(G_hosts[i].host, i, G_hosts[i].resmin, STATIC_SOURCE_RESMIN, NULL)
+                && npp_lib_watch_dir(G_hosts[i].host, i, G_hosts[i].snippets, STATIC_SOURCE_SNIPPETS, NULL);
+    }
+
+#endif  /* NPP_MULTI_HOST */
+
+    if ( M_watching )
+        INF("Watching resource directories for changes");
+    else
+        INF("Resource directories will be rescanned periodically");
+}
+
+
+/* --------------------------------------------------------------------------
+   Update one static resource or subdirectory after a change
+-------------------------------------------------------------------------- */
+static void update_static(const npp_watch_event_t *ev)
+{
+    char namewpath[NPP_STATIC_PATH_LEN*2+2];
+    struct stat fstat;
+    bool exists;
+    int  len, i;
+
+    sprintf(namewpath, "%s/%s/%s", G_appdir, ev->directory, ev->resname);
+
+    exists = (stat(namewpath, &fstat) == 0);
+
+    if ( exists && S_ISDIR(fstat.st_mode) )     /* new directory */
+    {
+        read_files(ev->host, ev->host_id, ev->directory, ev->source, FALSE, ev->resname);
+    }
+    else if ( exists && S_ISREG(fstat.st_mode) )
+    {
+        for ( i=0; i<M_statics_cnt; ++i )
+        {
+            if ( M_statics[i].host_id == ev->host_id && M_statics[i].source == ev->source && 0==strcmp(M_statics[i].name, ev->resname) )
+            {
+                M_statics[i].modified = 0;  /* re-read even if modified within the same second */
+                break;
+            }
+        }
+
+        read_file(ev->host, ev->host_id, ev->source, FALSE, ev->resname, namewpath, &fstat);
+    }
+    else    /* file or the whole subdirectory gone */
+    {
+        len = strlen(ev->resname);
+
+        for ( i=0; i<M_statics_cnt; ++i )
+        {
+            if ( !M_statics[i].name[0] || M_statics[i].host_id != ev->host_id || M_statics[i].source != ev->source ) continue;
+
+            if ( 0==strncmp(M_statics[i].name, ev->resname, len) && (M_statics[i].name[len]==EOS || M_statics[i].name[len]=='/') )
+                remove_static(i);
+        }
+
+        while ( M_statics_cnt && !M_statics[M_statics_cnt-1].name[0] )
+            --M_statics_cnt;
+    }
+}
+
+
+/* --------------------------------------------------------------------------
+   Apply changes reported by the resource directories watch
+   Fall back to the full rescan if some were lost
+-------------------------------------------------------------------------- */
+static void update_resources()
+{
+    npp_watch_event_t ev;
+    bool statics_changed=FALSE;
+
+    while ( npp_lib_watch_next(&ev) )
+    {
+        if ( ev.overflow )
+        {
+            read_resources(FALSE);
+            statics_changed = FALSE;    /* already rebuilt */
+        }
+        else if ( ev.source == STATIC_SOURCE_SNIPPETS )
+        {
+            npp_lib_update_snippets(&ev);
+        }
+        else
+        {
+            update_static(&ev);
+            statics_changed = TRUE;
+        }
+    }
+
+    if ( statics_changed )
+        statics_hash_build();
+
+#ifdef NPP_ASYNC
+    if ( M_wi == 0 )    /* for npp_svc processes */
+        npp_lib_snippets_publish();
+#endif
+}
+#endif  /* NPP_DONT_RESCAN_RES */
+
+
+/* --------------------------------------------------------------------------
+   Content hash for ETag
+   Not cryptographic, only to tell versions apart. It goes through
+   8 bytes at a time so that hashing generated content is cheap.
+-------------------------------------------------------------------------- */
+static void make_etag(char *dest, const char *data, unsigned len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL ^ len;
+    uint64_t w;
+    unsigned i;
+
+    for ( i=0; i+8<=len; i+=8 )
+    {
+        memcpy(&w, data+i, 8);
+        h = (h ^ w) * 0x100000001b3ULL;
+        h ^= h >> 29;
+    }
+
+    for ( ; i<len; ++i )
+        h = (h ^ (unsigned char)data[i]) * 0x100000001b3ULL;
+
+    /* final mix */
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+
+    sprintf(dest, "%x-%016llx", len, (unsigned long long)h);
+}
+
+
+/* --------------------------------------------------------------------------
+   Check If-None-Match against ETag core
+   Weak comparison, also matches encoded variants ("core-gzip")
+   On match, copy the client's tag to G_connections[ci].etag for 304
+-------------------------------------------------------------------------- */
+static bool etag_matches(int ci, const char *core)
+{
+    const char *p=G_connections[ci].if_none_match;
+    int len = strlen(core);
+
+    if ( p[0]=='*' && p[1]==EOS )
+    {
+        sprintf(G_connections[ci].etag, "\"%s\"", core);
+        return TRUE;
+    }
+
+    while ( (p=strchr(p, '"')) )
+    {
+        ++p;
+
+        const char *end = strchr(p, '"');
+
+        if ( !end ) break;
+
+        if ( 0==strncmp(p, core, len) && (p[len]=='"' || p[len]=='-') && end-p+2 <= NPP_ETAG_LEN )
+        {
+            strncpy(G_connections[ci].etag, p-1, end-p+2);
+            G_connections[ci].etag[end-p+2] = EOS;
+            return TRUE;
+        }
+
+        p = end + 1;
+    }
+
+    return FALSE;
+}
+
+
+/* --------------------------------------------------------------------------
+   Append encoding to the response ETag
+   Each representation needs its own strong validator
+-------------------------------------------------------------------------- */
+static void etag_add_codec(int ci, int codec)
+{
+    int len = strlen(G_connections[ci].etag);
+
+    if ( len < 2 ) return;
+
+    sprintf(G_connections[ci].etag+len-1, "-%s\"", M_codecs[codec]);
+}
+
+
+/* --------------------------------------------------------------------------
+   Is the client's copy of a static resource still valid?
+   If-None-Match takes precedence over If-Modified-Since
+-------------------------------------------------------------------------- */
+static bool not_modified(int ci, int st)
+{
+    if ( G_connections[ci].if_none_match[0] )
+        return etag_matches(ci, M_statics[st].etag);
+
+    return (G_connections[ci].if_mod_since >= M_statics[st].modified);
+}
+
+
+#ifndef _WIN32
+/* --------------------------------------------------------------------------
+   Does If-Range (if any) allow a partial response?
+   Strong comparison for ETag, exact match for date
+-------------------------------------------------------------------------- */
+static bool if_range_ok(int ci)
+{
+    const char *v=G_connections[ci].if_range;
+
+    if ( !v[0] ) return TRUE;
+
+    const static_res_t *st = &M_statics[G_connections[ci].static_res];
+
+    if ( v[0] == '"' )
+    {
+        int len = strlen(st->etag);
+        return (0==strncmp(v+1, st->etag, len) && v[len+1]=='"' && v[len+2]==EOS);
+    }
+
+    if ( v[0] == 'W' )  /* weak tags never match here */
+        return FALSE;
+
+    return (time_http2epoch(v) == st->modified);
+}
+
+
+/* --------------------------------------------------------------------------
+   Parse Range against resource length, fill G_connections[ci].ranges
+   Return number of ranges, 0 to ignore the header, -1 if unsatisfiable
+-------------------------------------------------------------------------- */
+static int parse_range(int ci, unsigned len)
+{
+    const char *p=G_connections[ci].range;
+    char     *end;
+    unsigned first, last;
+    int      cnt=0;
+
+    if ( 0 != strncmp(p, "bytes=", 6) )
+        return 0;
+
+    p += 6;
+
+    while ( *p )
+    {
+        while ( *p==' ' || *p==',' ) ++p;
+
+        if ( !*p ) break;
+
+        if ( *p == '-' )    /* suffix -- last n bytes */
+        {
+            if ( !isdigit(p[1]) ) return 0;
+
+            unsigned n = strtoul(p+1, &end, 10);
+
+            if ( n == 0 )
+            {
+                p = end;
+                continue;
+            }
+
+            first = n >= len ? 0 : len - n;
+            last = len - 1;
+        }
+        else if ( isdigit(*p) )
+        {
+            first = strtoul(p, &end, 10);
+
+            if ( *end != '-' ) return 0;
+
+            p = end + 1;
+
+            if ( isdigit(*p) )
+            {
+                last = strtoul(p, &end, 10);
+                if ( last < first ) return 0;
+            }
+            else    /* till the end */
+            {
+                last = len - 1;
+                end = (char*)p;
+            }
+
+            if ( last >= len )
+                last = len - 1;
+        }
+        else
+        {
+            return 0;
+        }
+
+        p = end;
+
+        while ( *p==' ' ) ++p;
+
+        if ( *p && *p!=',' ) return 0;
+
+        if ( first >= len ) continue;   /* unsatisfiable, maybe others are fine */
+
+        if ( cnt == NPP_MAX_RANGES )
+        {
+            DBG("Too many ranges, ignoring Range");
+            return 0;
+        }
+
+        G_connections[ci].ranges[cnt].start = first;
+        G_connections[ci].ranges[cnt].len = last - first + 1;
+        ++cnt;
+    }
+
+    G_connections[ci].ranges_cnt = cnt;
+
+    return cnt ? cnt : -1;
+}
+
+
+/* --------------------------------------------------------------------------
+   Set up 206 response body
+   Single range -- out_body moves to the range start
+   Multiple -- part headers go to the (unused) content buffer
+   and send_static() interleaves them with the ranges
+-------------------------------------------------------------------------- */
+static void range_body(int ci)
+{
+    const static_res_t *st = &M_statics[G_connections[ci].static_res];
+    npp_range_t *r = G_connections[ci].ranges;
+    int cnt = G_connections[ci].ranges_cnt;
+
+    if ( cnt == 1 )
+    {
+        PRINT_HTTP_CONTENT_RANGE(r[0].start, r[0].start+r[0].len-1, st->len);
+        G_connections[ci].out_body += r[0].start;
+        G_connections[ci].clen = r[0].len;
+        return;
+    }
+
+    char *parts = G_connections[ci].out_data + NPP_OUT_HEADER_BUFSIZE;
+    const char *ctype = content_type_str(st->type);
+    unsigned off=0;
+    int i;
+
+    G_connections[ci].clen = 0;
+
+    for ( i=0; i<cnt; ++i )
+    {
+        r[i].hdr_off = off;
+        r[i].hdr_len = sprintf(parts+off, "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %u-%u/%u\r\n\r\n", st->etag, ctype, r[i].start, r[i].start+r[i].len-1, st->len);
+        off += r[i].hdr_len;
+        G_connections[ci].clen += r[i].hdr_len + r[i].len;
+    }
+
+    r[cnt].hdr_off = off;
+    r[cnt].hdr_len = sprintf(parts+off, "\r\n--%s--\r\n", st->etag);
+    G_connections[ci].clen += r[cnt].hdr_len;
+
+    sprintf(G_connections[ci].ctypestr, "multipart/byteranges; boundary=%s", st->etag);
+}
+#endif  /* _WIN32 */
+
+
+/* --------------------------------------------------------------------------
+   Return M_statics array index if URI is on statics' list
+   One hash over host_id+URI, then usually one memcmp
+-------------------------------------------------------------------------- */
+static int is_static_res(int ci)
+{
+#ifdef NPP_MULTI_HOST
+    int host_id = G_connections[ci].host_id;
+#else
+    int host_id = 0;
+#endif
+    int len;
+    unsigned hash = static_hash(host_id, G_connections[ci].cold->uri, &len);
+    unsigned slot = hash % STATICS_HASH_SIZE;
+    int i;
+
+    while ( (i=M_statics_hash_cur[slot]) )
+    {
+        const static_res_t *st = &M_statics[i-1];
+
+        if ( st->hash == hash && st->name_len == len && st->host_id == host_id && 0==memcmp(st->name, G_connections[ci].cold->uri, len) )
+        {
+            if ( not_modified(ci, i-1) )
+                G_connections[ci].status = 304;  /* Not Modified */
+
+            return i-1;
+        }
+
+        slot = (slot + 1) % STATICS_HASH_SIZE;
+    }
+
+    return -1;
+}
+
+
+/* --------------------------------------------------------------------------
+   Main new request processing
+   Request received over current G_connections is already parsed
+-------------------------------------------------------------------------- */
+static void process_req(int ci)
+{
+    int ret=OK;
+
+    DBG("ci=%d, process_req", ci);
+
+    /* ------------------------------------------------------------------------ */
+
+#ifdef NPP_DEBUG
+    if ( NPP_CONN_IS_PAYLOAD(G_conn_hot[ci].flags)
+            && G_connections[ci].in_data
+            && G_connections[ci].in_ctype != NPP_CONTENT_TYPE_MULTIPART
+            && G_connections[ci].in_ctype != NPP_CONTENT_TYPE_OCTET_STREAM )
+        npp_log_long(G_connections[ci].in_data, G_conn_hot[ci].was_read, "\nPayload");
+#endif
+
+    /* ------------------------------------------------------------------------ */
+    /* make room for an outgoing header */
+
+    G_connections[ci].p_content = G_connections[ci].out_data + NPP_OUT_HEADER_BUFSIZE;
+
+    /* ------------------------------------------------------------------------ */
+
+    if ( ci == G_maxConnections )    /* connections pool exhausted */
+    {
+        RES_STATUS(503);
+        render_page_msg(ci, ERR_SERVER_TOOBUSY);
+        RES_DONT_CACHE;
+    }
+
+    /* ------------------------------------------------------------------------ */
+
+    if ( G_connections[ci].status != 200 )
+        return;
+
+    /* ------------------------------------------------------------------------ */
+    /* Generate HTML content before header -- to know its size & type --------- */
+
+    /* ------------------------------------------------------------------------ */
+    /* authorization check / log in from cookies ------------------------------ */
+
+    bool fresh_session=FALSE;
+
+#ifdef NPP_USERS
+
+#ifdef NPP_ALLOW_BEARER_AUTH
+    /* copy bearer token to cookie_in_l */
+
+    if ( !G_connections[ci].cookie_in_l[0] && G_connections[ci].cold->authorization[0] )
+    {
+        char type[8];
+        strncpy(type, npp_upper(G_connections[ci].cold->authorization), 7);
+        type[7] = EOS;
+
+        if ( 0==strcmp(type, "BEARER ") )
+        {
+            strncpy(G_connections[ci].cookie_in_l, G_connections[ci].cold->authorization+7, NPP_SESSID_LEN);
+            G_connections[ci].cookie_in_l[NPP_SESSID_LEN] = EOS;
+        }
+    }
+#endif  /* NPP_ALLOW_BEARER_AUTH */
+
+    /* authenticated requests' checks */
+
+    if ( LOGGED )
+    {
+        DBG("Connection already authenticated, si=%d", G_connections[ci].si);
+    }
+    else if ( G_connections[ci].cookie_in_l[0] )  /* logged in sessid cookie present */
+    {
+        ret = libusr_luses_ok(ci);     /* is it valid? */
+
+        if ( ret == OK )    /* valid sessid -- user logged in */
+            DBG("User logged in from cookie");
+        else if ( ret != ERR_INT_SERVER_ERROR && ret != ERR_SERVER_TOOBUSY )   /* dodged sessid... or session expired */
+            WAR("Invalid ls cookie");
+    }
+
+    /* authorization */
+
+    if ( LOGGED && G_connections[ci].required_auth_level > G_sessions[G_connections[ci].si].auth_level )
+    {
+        WAR("Insufficient user authorization level, returning 404");
+        ret = ERR_NOT_FOUND;
+        RES_DONT_CACHE;
+    }
+    else if ( !LOGGED && G_connections[ci].required_auth_level > AUTH_LEVEL_ANONYMOUS )   /* redirect to login page */
+    {
+        INF("auth_level > AUTH_LEVEL_ANONYMOUS required, redirecting to login");
+
+        ret = ERR_REDIRECTION;
+
+#ifndef NPP_DONT_PASS_QS_ON_LOGIN_REDIRECTION
+        char *qs = strchr(G_connections[ci].cold->uri, '?');
+
+        if ( !strlen(NPP_LOGIN_URI) )   /* login page = landing page */
+            sprintf(G_connections[ci].cold->location, "/%s", qs?qs:"");
+        else
+            sprintf(G_connections[ci].cold->location, "%s%s", NPP_LOGIN_URI, qs?qs:"");
+#else   /* don't pass the query string */
+        if ( !strlen(NPP_LOGIN_URI) )   /* login page = landing page */
+            strcpy(G_connections[ci].cold->location, "/");
+        else
+            strcpy(G_connections[ci].cold->location, NPP_LOGIN_URI);
+#endif  /* NPP_DONT_PASS_QS_ON_LOGIN_REDIRECTION */
+
+    }
+    else
+    {
+        DDBG("Request authorized or authorization not required");
+        ret = OK;
+    }
+
+    /* anonymous session check */
+
+    if ( G_connections[ci].required_auth_level==AUTH_LEVEL_ANONYMOUS && G_connections[ci].method[0]!='H' && !LOGGED )    /* anonymous session required */
+#else   /* NPP_USERS NOT defined */
+    if ( G_connections[ci].required_auth_level==AUTH_LEVEL_ANONYMOUS && G_connections[ci].method[0]!='H' )
+#endif  /* NPP_USERS */
+    {
+        DDBG("At least anonymous session is required");
+
+#ifndef NPP_START_SESSIONS_FOR_BOTS
+
+        DDBG("Don't start session if bot");
+
+        if ( !REQ_BOT )
+        {
+#endif
+            if ( !G_connections[ci].cookie_in_a[0] || !a_session_ok(ci) )       /* valid anonymous sessid cookie not present */
+            {
+                ret = npp_eng_session_start(ci, NULL);
+
+                if ( ret == OK )
+                    fresh_session = TRUE;
+            }
+#ifndef NPP_START_SESSIONS_FOR_BOTS
+        }
+#endif
+    }
+
+    /* ------------------------------------------------------------------------ */
+    /* process request -------------------------------------------------------- */
+
+    if ( ret == OK )
+    {
+        if ( !G_connections[ci].cold->location[0] )    /* if not redirection */
+        {
+#ifdef NPP_SET_TZ
+            if ( REQ("npp_set_tz") && REQ_POST )    /* set time zone for the session */
+            {
+                if ( IS_SESSION && !SESSION.tz_set )
+                    npp_set_tz(ci);
+            }
+            else
+            {
+#endif  /* NPP_SET_TZ */
+#ifdef NPP_ENABLE_RELOAD_CONF
+                if ( NPP_VALID_RELOAD_CONF_REQUEST )
+                {
+                    npp_lib_read_conf(FALSE);
+                }
+                else
+#endif  /* NPP_ENABLE_RELOAD_CONF */
+                {
+                    DBG("Calling npp_app_main...");
+                    npp_app_main(ci);         /* main application called here */
+                }
+#ifdef NPP_SET_TZ
+            }
+#endif
+        }
+    }
+
+    /* ------------------------------------------------------------------------ */
+
+    G_conn_hot[ci].last_activity = G_now;
+    if ( IS_SESSION ) SESSION.last_activity = G_now;
+
+#ifdef NPP_ASYNC
+    if ( G_conn_hot[ci].state == CONN_STATE_WAITING_FOR_ASYNC ) return;
+#endif
+    /* ------------------------------------------------------------------------ */
+
+    if ( G_connections[ci].cold->location[0] || ret == ERR_REDIRECTION )    /* redirection has a priority */
+        G_connections[ci].status = 303;
+    else if ( ret == ERR_INVALID_REQUEST )
+        G_connections[ci].status = 400;
+    else if ( ret == ERR_UNAUTHORIZED )
+        G_connections[ci].status = 401;
+    else if ( ret == ERR_FORBIDDEN )
+        G_connections[ci].status = 403;
+    else if ( ret == ERR_NOT_FOUND )
+        G_connections[ci].status = 404;
+    else if ( ret == ERR_INT_SERVER_ERROR )
+        G_connections[ci].status = 500;
+    else if ( ret == ERR_SERVER_TOOBUSY )
+        G_connections[ci].status = 503;
+
+    if ( ret==ERR_REDIRECTION || G_connections[ci].status==400 || G_connections[ci].status==401 || G_connections[ci].status==403 || G_connections[ci].status==404 || G_connections[ci].status==500 || G_connections[ci].status==503 )
+    {
+        if ( fresh_session )    /* prevent sessions' exhaustion by vulnerability testing bots */
+        {
+#ifdef NPP_USERS
+            if ( !LOGGED ) close_uses(G_connections[ci].si, ci);
+#else
+            close_uses(G_connections[ci].si, ci);
+#endif
+        }
+
+        if ( !NPP_CONN_IS_KEEP_CONTENT(G_conn_hot[ci].flags) )   /* reset out buffer pointer as it could have contained something already */
+        {
+            G_connections[ci].p_content = G_connections[ci].out_data + NPP_OUT_HEADER_BUFSIZE;
+
+            if ( ret == OK )   /* RES_STATUS could be used, show the proper message */
+            {
+                if ( G_connections[ci].status == 400 )
+                    ret = ERR_INVALID_REQUEST;
+                else if ( G_connections[ci].status == 401 )
+                    ret = ERR_UNAUTHORIZED;
+                else if ( G_connections[ci].status == 403 )
+                    ret = ERR_FORBIDDEN;
+                else if ( G_connections[ci].status == 404 )
+                    ret = ERR_NOT_FOUND;
+                else if ( G_connections[ci].status == 500 )
+                    ret = ERR_INT_SERVER_ERROR;
+                else if ( G_connections[ci].status == 503 )
+                    ret = ERR_SERVER_TOOBUSY;
+            }
+
+            render_page_msg(ci, ret);
+        }
+
+        RES_DONT_CACHE;
+    }
+}
+
+
+/* --------------------------------------------------------------------------
+   Generate HTTP response header
+-------------------------------------------------------------------------- */
+static void gen_response_header(int ci)
+{
+#ifdef NPP_DEBUG
+    bool compressed=FALSE;
+#endif
+
+    DBG("ci=%d, gen_response_header", ci);
+
+    if ( G_connections[ci].ws_state == WS_STATE_OPEN || G_connections[ci].ws_state == WS_STATE_CLOSING )
+    {
+        ws_reply(ci);   /* no more HTTP on this connection */
+        return;
+    }
+
+    char out_header[NPP_OUT_HEADER_BUFSIZE];
+    G_connections[ci].p_header = out_header;
+
+    int codec_used=-1;      /* Content-Encoding */
+
+    /* streaming needs chunked encoding, without it collect everything now */
+
+    if ( G_connections[ci].stream )
+    {
+        if ( G_connections[ci].status == 301 || G_connections[ci].status == 303 || G_connections[ci].status == 304 || G_connections[ci].static_res != NPP_NOT_STATIC )
+        {
+            G_connections[ci].stream = NULL;    /* no content anyway */
+        }
+        else if ( G_connections[ci].method[0] == 'H' || 0 != strcmp(G_connections[ci].http_ver, "1.1") )
+        {
+            DBG("ci=%d, can't stream, buffering response", ci);
+            while ( G_connections[ci].stream(ci) );
+            G_connections[ci].stream = NULL;
+        }
+    }
+
+    /* WebSocket only if the request went through */
+
+    if ( G_connections[ci].ws_state == WS_STATE_ACCEPTED && G_connections[ci].status != 200 )
+    {
+        G_connections[ci].ws_state = WS_STATE_NONE;
+        G_connections[ci].p_content = G_connections[ci].out_data + NPP_OUT_HEADER_BUFSIZE;
+    }
+
+    /* revalidation of generated content -- before it gets compressed */
+
+    if ( G_connections[ci].etag_auto && G_connections[ci].status == 200 && G_connections[ci].static_res == NPP_NOT_STATIC && !G_connections[ci].stream && G_connections[ci].sse_group == -1 && !G_connections[ci].ws_state )
+    {
+        char core[NPP_ETAG_CORE_LEN+1];
+
+        make_etag(core, G_connections[ci].out_data+NPP_OUT_HEADER_BUFSIZE, G_connections[ci].p_content - G_connections[ci].out_data - NPP_OUT_HEADER_BUFSIZE);
+
+        if ( G_connections[ci].if_none_match[0] && etag_matches(ci, core) )
+        {
+            DBG("ETag matches, responding with 304");
+            G_connections[ci].status = 304;
+        }
+        else
+        {
+            sprintf(G_connections[ci].etag, "\"%s\"", core);
+        }
+    }
+    else if ( G_connections[ci].static_res != NPP_NOT_STATIC && !G_connections[ci].etag[0] )
+    {
+        G_connections[ci].etag[0] = '"';
+        strcpy(stpcpy(G_connections[ci].etag+1, M_statics[G_connections[ci].static_res].etag), "\"");
+    }
+
+#ifndef _WIN32
+    /* partial content? */
+
+    if ( G_connections[ci].range[0] && G_connections[ci].static_res != NPP_NOT_STATIC && G_connections[ci].status == 200
+#ifdef NPP_HTTP2
+            && G_connections[ci].http_ver[0] != '2'
+#endif
+            && if_range_ok(ci) )
+    {
+        int ranges = parse_range(ci, M_statics[G_connections[ci].static_res].len);
+
+        if ( ranges > 0 )
+            G_connections[ci].status = 206;
+        else if ( ranges < 0 )
+            G_connections[ci].status = 416;
+
+        DBG("Range [%s], ranges = %d", G_connections[ci].range, ranges);
+    }
+#endif  /* _WIN32 */
+
+    if ( G_connections[ci].ws_state == WS_STATE_ACCEPTED )   /* upgrade to WebSocket */
+    {
+        ws_handshake(ci);
+    }
+#ifdef NPP_HTTP2
+    else if ( G_connections[ci].http2_upgrade_in_progress && G_connections[ci].status == 200 )   /* upgrade to HTTP/2 cleartext requested (rare) */
+    {
+        DDBG("Responding with 101");
+
+        PRINT_HTTP_STATUS(101);
+
+        PRINT_HTTP2_UPGRADE_CLEAR;
+    }
+#endif  /* NPP_HTTP2 */
+    else    /* normal response */
+    {
+#ifdef NPP_HTTP2
+        G_connections[ci].http2_upgrade_in_progress = FALSE;
+
+        if ( G_connections[ci].http_ver[0] == '2' )
+            PRINT_HTTP2_STATUS(G_connections[ci].status);
+        else
+
+#endif  /* NPP_HTTP2 */
+
+            PRINT_HTTP_STATUS(G_connections[ci].status);
+
+        /* Date */
+
+#ifdef NPP_HTTP2
+        if ( G_connections[ci].http_ver[0] == '2' )
+            PRINT_HTTP2_DATE;
+        else
+#endif  /* NPP_HTTP2 */
+            PRINT_HTTP_DATE;
+
+        if ( G_connections[ci].status == 301 || G_connections[ci].status == 303 )     /* redirection */
+        {
+            DDBG("Redirecting");
+
+#ifdef NPP_HTTPS
+            if ( NPP_CONN_IS_UPGRADE_TO_HTTPS(G_conn_hot[ci].flags) )    /* Upgrade-Insecure-Requests */
+            {
+#ifdef NPP_HTTP2
+                if ( G_connections[ci].http_ver[0] == '2' )
+                    PRINT_HTTP2_VARY_UIR;
+                else
+#endif  /* NPP_HTTP2 */
+                    PRINT_HTTP_VARY_UIR;
+            }
+#endif  /* NPP_HTTPS */
+
+            if ( G_connections[ci].cold->location[0] )    /* redirection */
+            {
+#ifdef NPP_HTTP2
+                if ( G_connections[ci].http_ver[0] == '2' )
+                    PRINT_HTTP2_LOCATION;
+                else
+#endif  /* NPP_HTTP2 */
+                    PRINT_HTTP_LOCATION;
+            }
+
+            G_connections[ci].clen = 0;
+        }
+        else if ( G_connections[ci].status == 304 )   /* not modified since */
+        {
+            DDBG("Not Modified");
+
+            /*
+               Since the goal of a 304 response is to minimize information transfer
+               when the recipient already has one or more cached representations,
+               a sender SHOULD NOT generate representation metadata other than
+               the above listed fields unless said metadata exists for the purpose
+               of guiding cache updates (e.g., Last-Modified might be useful if
+               the response does not have an ETag field).
+            */
+
+            if ( G_connections[ci].etag[0] )
+            {
+#ifdef NPP_HTTP2
+                if ( G_connections[ci].http_ver[0] == '2' )
+                    PRINT_HTTP2_ETAG(G_connections[ci].etag);
+                else
+#endif  /* NPP_HTTP2 */
+                    PRINT_HTTP_ETAG(G_connections[ci].etag);
+            }
+
+            if ( G_connections[ci].static_res == NPP_NOT_STATIC )    /* generated */
+            {
+                if ( G_connections[ci].modified )
+                {
+#ifdef NPP_HTTP2
+                    if ( G_connections[ci].http_ver[0] == '2' )
+                        PRINT_HTTP2_LAST_MODIFIED(time_epoch2http(G_connections[ci].modified));
+                    else
+#endif  /* NPP_HTTP2 */
+                        PRINT_HTTP_LAST_MODIFIED(time_epoch2http(G_connections[ci].modified));
+                }
+                else
+                {
+#ifdef NPP_HTTP2
+                    if ( G_connections[ci].http_ver[0] == '2' )
+                        PRINT_HTTP2_LAST_MODIFIED(G_last_modified);
+                    else
+#endif  /* NPP_HTTP2 */
+                        PRINT_HTTP_LAST_MODIFIED(G_last_modified);
+                }
+
+                if ( NPP_EXPIRES_GENERATED > 0 )
+                {
+#ifdef NPP_HTTP2
+                    if ( G_connections[ci].http_ver[0] == '2' )
+                        PRINT_HTTP2_EXPIRES_GENERATED;
+                    else
+#endif  /* NPP_HTTP2 */
+                        PRINT_HTTP_EXPIRES_GENERATED;
+                }
+            }
+            else    /* static resource */
+            {
+#ifdef NPP_HTTP2
+                if ( G_connections[ci].http_ver[0] == '2' )
+                    PRINT_HTTP2_LAST_MODIFIED(M_statics[G_connections[ci].static_res].last_modified);
+                else
+#endif  /* NPP_HTTP2 */
+                    PRINT_HTTP_LAST_MODIFIED(M_statics[G_connections[ci].static_res].last_modified);
+
+                if ( NPP_EXPIRES_STATICS > 0 )
+                {
+#ifdef NPP_HTTP2
+                    if ( G_connections[ci].http_ver[0] == '2' )
+                        PRINT_HTTP2_EXPIRES_STATICS;
+                    else
+#endif  /* NPP_HTTP2 */
+                        PRINT_HTTP_EXPIRES_STATICS;
+                }
+            }
+
+            G_connections[ci].clen = 0;
+        }
+        else    /* normal response with content: 2xx, 4xx, 5xx */
+        {
+            DDBG("Normal response");
+
+            if ( NPP_CONN_IS_DONT_CACHE(G_conn_hot[ci].flags) )    /* dynamic content */
+            {
+#ifdef NPP_HTTP2
+                if ( G_connections[ci].http_ver[0] == '2' )
+                {
+                    PRINT_HTTP2_VARY_DYN;
+                    PRINT_HTTP2_NO_CACHE;
+                }
+                else
+#endif  /* NPP_HTTP2 */
+                {
+                    PRINT_HTTP_VARY_DYN;
+                    PRINT_HTTP_NO_CACHE;
+                }
+            }
+            else    /* static content */
+            {
+#ifdef NPP_HTTP2
+                if ( G_connections[ci].http_ver[0] == '2' )
+                    PRINT_HTTP2_VARY_STAT;
+                else
+#endif  /* NPP_HTTP2 */
+                    PRINT_HTTP_VARY_STAT;
+
+                if ( G_connections[ci].static_res == NPP_NOT_STATIC )   /* generated -- moderate caching */
+                {
+                    if ( G_connections[ci].modified )
+                    {
+#ifdef NPP_HTTP2
+                        if ( G_connections[ci].http_ver[0] == '2' )
+                            PRINT_HTTP2_LAST_MODIFIED(time_epoch2http(G_connections[ci].modified));
+                        else
+#endif  /* NPP_HTTP2 */
+                            PRINT_HTTP_LAST_MODIFIED(time_epoch2http(G_connections[ci].modified));
+                    }
+                    else
+                    {
+#ifdef NPP_HTTP2
+                        if ( G_connections[ci].http_ver[0] == '2' )
+                            PRINT_HTTP2_LAST_MODIFIED(G_last_modified);
+                        else
+#endif  /* NPP_HTTP2 */
+                            PRINT_HTTP_LAST_MODIFIED(G_last_modified);
+                    }
+
+                    if ( NPP_EXPIRES_GENERATED > 0 )
+                    {
+#ifdef NPP_HTTP2
+                        if ( G_connections[ci].http_ver[0] == '2' )
+                            PRINT_HTTP2_EXPIRES_GENERATED;
+                        else
+#endif  /* NPP_HTTP2 */
+                            PRINT_HTTP_EXPIRES_GENERATED;
+                    }
+                }
+                else    /* static resource -- aggressive caching */
+                {
+#ifdef NPP_HTTP2
+                    if ( G_connections[ci].http_ver[0] == '2' )
+                        PRINT_HTTP2_LAST_MODIFIED(M_statics[G_connections[ci].static_res].last_modified);
+                    else
+#endif  /* NPP_HTTP2 */
+                        PRINT_HTTP_LAST_MODIFIED(M_statics[G_connections[ci].static_res].last_modified);
+
+                    if ( NPP_EXPIRES_STATICS > 0 )
+                    {
+#ifdef NPP_HTTP2
+                        if ( G_connections[ci].http_ver[0] == '2' )
+                            PRINT_HTTP2_EXPIRES_STATICS;
+                        else
+#endif  /* NPP_HTTP2 */
+                            PRINT_HTTP_EXPIRES_STATICS;
+                    }
+#ifndef _WIN32
+#ifdef NPP_HTTP2
+                    if ( G_connections[ci].http_ver[0] != '2' )
+#endif
+                        PRINT_HTTP_ACCEPT_RANGES;
+#endif  /* _WIN32 */
+                }
+            }
+
+            /* content length and type */
+
+            if ( G_connections[ci].static_res == NPP_NOT_STATIC )
+            {
+                G_connections[ci].clen = G_connections[ci].p_content - G_connections[ci].out_data - NPP_OUT_HEADER_BUFSIZE;
+            }
+            else    /* static resource */
+            {
+                G_connections[ci].clen = M_statics[G_connections[ci].static_res].len;
+                G_connections[ci].out_ctype = M_statics[G_connections[ci].static_res].type;
+#ifndef _WIN32
+                if ( M_statics[G_connections[ci].static_res].map )
+                    G_connections[ci].out_body = M_statics[G_connections[ci].static_res].map;
+                else
+                    G_connections[ci].out_body = M_statics[G_connections[ci].static_res].data + NPP_OUT_HEADER_BUFSIZE;
+
+                if ( G_connections[ci].status == 206 )
+                {
+                    range_body(ci);
+                }
+                else if ( G_connections[ci].status == 416 )
+                {
+                    PRINT_HTTP_CONTENT_RANGE_UNSAT(G_connections[ci].clen);
+                    G_connections[ci].clen = 0;
+                    G_connections[ci].out_body = NULL;
+                }
+#endif
+            }
+
+            /* compress? ------------------------------------------------------------------ */
+
+#ifndef _WIN32  /* in Windows it's just too much headache */
+
+            if ( G_connections[ci].status != 206 && !G_connections[ci].stream && G_connections[ci].sse_group == -1 && SHOULD_BE_COMPRESSED(G_connections[ci].clen, G_connections[ci].out_ctype) && G_connections[ci].accept_enc && !NPP_UA_IE )
+            {
+                if ( G_connections[ci].static_res==NPP_NOT_STATIC )
+                {
+                    /* gzip or deflate, whichever is accepted */
+
+                    int codec = (G_connections[ci].accept_enc & (1<<NPP_CODEC_GZIP)) ? NPP_CODEC_GZIP : NPP_CODEC_DEFLATE;
+#ifdef NPP_HTTP2
+                    if ( G_connections[ci].http_ver[0] == '2' )
+                        codec = NPP_CODEC_DEFLATE;
+#endif
+                    if ( G_connections[ci].clen <= G_compress_treshold )    /* raised under load */
+                    {
+                        ++G_cnts_today.compress_skipped;
+                    }
+                    else if ( G_connections[ci].accept_enc & (1<<codec) )
+                    {
+                        DBG("Compressing content (%s, level %d)", M_codecs[codec], G_compress_level);
+
+                        int ret;
+static                  z_stream strm[2];           /* deflate, gzip */
+static                  bool first[2]={TRUE, TRUE};
+static                  int  level[2];
+
+                        if ( first[codec] )
+                        {
+                            strm[codec].zalloc = Z_NULL;
+                            strm[codec].zfree = Z_NULL;
+                            strm[codec].opaque = Z_NULL;
+
+                            ret = deflateInit2(&strm[codec], G_compress_level, Z_DEFLATED, codec==NPP_CODEC_GZIP?31:15, 8, Z_DEFAULT_STRATEGY);
+
+                            if ( ret != Z_OK )
+                            {
+                                ERR("deflateInit2 failed, ret = %d", ret);
+                                return;
+                            }
+
+                            level[codec] = G_compress_level;
+                            first[codec] = FALSE;
+                        }
+                        else if ( level[codec] != G_compress_level )   /* adapted */
+                        {
+                            deflateReset(&strm[codec]);
+                            deflateParams(&strm[codec], G_compress_level, Z_DEFAULT_STRATEGY);
+                            level[codec] = G_compress_level;
+                        }
+
+                        unsigned max = G_connections[ci].clen;
+                        struct timespec start;
+
+                        clock_gettime(MONOTONIC_CLOCK_NAME, &start);
+
+                        ret = deflate_inplace(&strm[codec], (unsigned char*)G_connections[ci].out_data+NPP_OUT_HEADER_BUFSIZE, G_connections[ci].clen, &max);
+
+                        M_compress_ms += npp_elapsed(&start);
+                        M_compress_bytes += G_connections[ci].clen;
+
+                        if ( ret == Z_OK )
+                        {
+                            DBG("Compression success, old len=%u, new len=%u", G_connections[ci].clen, max);
+                            ++G_cnts_today.compressed;
+                            G_connections[ci].clen = max;
+#ifdef NPP_HTTP2
+                            if ( G_connections[ci].http_ver[0] == '2' )
+                                PRINT_HTTP2_CONTENT_ENCODING_DEFLATE;
+                            else
+#endif  /* NPP_HTTP2 */
+                                PRINT_HTTP_CONTENT_ENCODING(M_codecs[codec]);
+                            codec_used = codec;
+#ifdef NPP_DEBUG
+                            compressed = TRUE;
+#endif
+                        }
+                        else
+                        {
+                            ERR("deflate_inplace failed, ret = %d", ret);
+                        }
+                    }
+                }
+#ifdef NPP_HTTP2
+                else if ( G_connections[ci].http_ver[0] != '2' )    /* frames need the content after the header */
+#else
+                else
+#endif
+                {
+                    /* the best precompressed variant the client accepts */
+
+                    const static_res_t *st = &M_statics[G_connections[ci].static_res];
+                    int c;
+
+                    for ( c=NPP_CODECS-1; c>=0; --c )
+                    {
+                        if ( (G_connections[ci].accept_enc & (1<<c)) && st->len_enc[c] )
+                        {
+                            G_connections[ci].out_body = st->data_enc[c];
+                            G_connections[ci].clen = st->len_enc[c];
+                            PRINT_HTTP_CONTENT_ENCODING(M_codecs[c]);
+                            codec_used = c;
+#ifdef NPP_DEBUG
+                            compressed = TRUE;
+#endif
+                            break;
+                        }
+                    }
+                }
+            }
+#endif  /* _WIN32 */
+
+            /* ---------------------------------------------------------------------------- */
+
+            /* ETag */
+
+            if ( G_connections[ci].etag[0] )
+            {
+                if ( codec_used != -1 )
+                    etag_add_codec(ci, codec_used);
+#ifdef NPP_HTTP2
+                if ( G_connections[ci].http_ver[0] == '2' )
+                    PRINT_HTTP2_ETAG(G_connections[ci].etag);
+                else
+#endif  /* NPP_HTTP2 */
+                    PRINT_HTTP_ETAG(G_connections[ci].etag);
+            }
+        }
+
+        /* Content-Type */
+
+        if ( G_connections[ci].clen == 0 && !G_connections[ci].stream && G_connections[ci].sse_group == -1 )   /* don't set for these */
+        {                   /* this covers 301, 303 and 304 */
+        }
+        else if ( G_connections[ci].ctypestr[0] )    /* custom */
+        {
+#ifdef NPP_HTTP2
+            if ( G_connections[ci].http_ver[0] == '2' )
+                PRINT_HTTP2_CONTENT_TYPE(G_connections[ci].ctypestr);
+            else
+#endif
+                PRINT_HTTP_CONTENT_TYPE(G_connections[ci].ctypestr);
+        }
+        else if ( G_connections[ci].out_ctype != NPP_CONTENT_TYPE_UNSET )
+        {
+            print_content_type(ci, G_connections[ci].out_ctype);
+        }
+
+        /* Content-Disposition */
+
+        if ( G_connections[ci].cdisp[0] )
+        {
+#ifdef NPP_HTTP2
+            if ( G_connections[ci].http_ver[0] == '2' )
+                PRINT_HTTP2_CONTENT_DISP(G_connections[ci].cdisp);
+            else
+#endif
+                PRINT_HTTP_CONTENT_DISP(G_connections[ci].cdisp);
+        }
+
+        /* Content-Length */
+
+#ifdef NPP_HTTP2
+        if ( G_connections[ci].http_ver[0] == '2' )
+            PRINT_HTTP2_CONTENT_LEN(G_connections[ci].clen);
+        else
+#endif  /* NPP_HTTP2 */
+        if ( G_connections[ci].stream )
+            PRINT_HTTP_CHUNKED;
+        else if ( G_connections[ci].sse_group == -1 )   /* event stream ends with the connection */
+            PRINT_HTTP_CONTENT_LEN(G_connections[ci].clen);
+
+        /* Security */
+
+        if ( G_connections[ci].clen > 0 || G_connections[ci].stream || G_connections[ci].sse_group != -1 )
+        {
+#ifndef NPP_NO_SAMEORIGIN
+#ifdef NPP_HTTP2
+            if ( G_connections[ci].http_ver[0] == '2' )
+                PRINT_HTTP2_SAMEORIGIN;
+            else
+#endif  /* NPP_HTTP2 */
+                PRINT_HTTP_SAMEORIGIN;
+#endif  /* NPP_NO_SAMEORIGIN */
+
+#ifndef NPP_NO_NOSNIFF
+#ifdef NPP_HTTP2
+            if ( G_connections[ci].http_ver[0] == '2' )
+                PRINT_HTTP2_NOSNIFF;
+            else
+#endif  /* NPP_HTTP2 */
+                PRINT_HTTP_NOSNIFF;
+#endif  /* NPP_NO_NOSNIFF */
+        }
+
+        /* Connection */
+
+#ifdef NPP_HTTP2
+        if ( G_connections[ci].http_ver[0] != '2' )
+#endif  /* NPP_HTTP2 */
+            PRINT_HTTP_CONNECTION;
+
+        /* Cookie */
+
+        if ( G_connections[ci].static_res == NPP_NOT_STATIC && (G_connections[ci].status == 200 || G_connections[ci].status == 303) && G_connections[ci].method[0]!='H' )
+        {
+            if ( G_connections[ci].cookie_out_l[0] )         /* logged in cookie has been produced */
+            {
+                if ( G_connections[ci].cookie_out_l_exp[0] )
+                {
+#ifdef NPP_HTTP2
+                    if ( G_connections[ci].http_ver[0] == '2' )
+                        PRINT_HTTP2_COOKIE_L_EXP(ci);    /* with expiration date */
+                    else
+#endif  /* NPP_HTTP2 */
+                        PRINT_HTTP_COOKIE_L_EXP(ci);
+                }
+                else
+                {
+#ifdef NPP_HTTP2
+                    if ( G_connections[ci].http_ver[0] == '2' )
+                        PRINT_HTTP2_COOKIE_L(ci);
+                    else
+#endif  /* NPP_HTTP2 */
+                        PRINT_HTTP_COOKIE_L(ci);
+                }
+            }
+
+            if ( G_connections[ci].cookie_out_a[0] )         /* anonymous cookie has been produced */
+            {
+                if ( G_connections[ci].cookie_out_a_exp[0] )
+                {
+#ifdef NPP_HTTP2
+                    if ( G_connections[ci].http_ver[0] == '2' )
+                        PRINT_HTTP2_COOKIE_A_EXP(ci);    /* with expiration date */
+                    else
+#endif  /* NPP_HTTP2 */
+                        PRINT_HTTP_COOKIE_A_EXP(ci);
+                }
+                else
+                {
+#ifdef NPP_HTTP2
+                    if ( G_connections[ci].http_ver[0] == '2' )
+                        PRINT_HTTP2_COOKIE_A(ci);
+                    else
+#endif  /* NPP_HTTP2 */
+                        PRINT_HTTP_COOKIE_A(ci);
+                }
+            }
+        }
+
+#ifdef NPP_HTTPS
+#ifndef NPP_NO_HSTS
+        if ( NPP_CONN_IS_SECURE(G_conn_hot[ci].flags) )
+            PRINT_HTTP_HSTS;
+#endif
+#endif  /* NPP_HTTPS */
+
+#ifndef NPP_NO_IDENTITY
+#ifdef NPP_HTTP2
+        if ( G_connections[ci].http_ver[0] == '2' )
+            PRINT_HTTP2_SERVER;
+        else
+#endif  /* NPP_HTTP2 */
+            PRINT_HTTP_SERVER;
+#endif  /* NPP_NO_IDENTITY */
+
+        /* ------------------------------------------------------------- */
+        /* custom headers */
+
+        if ( G_connections[ci].cold->cust_headers[0] )
+        {
+            HOUT(G_connections[ci].cold->cust_headers);
+        }
+
+        /* ------------------------------------------------------------- */
+    }
+
+#ifdef NPP_HTTP2
+    if ( G_connections[ci].http_ver[0] != '2' )
+#endif
+        PRINT_HTTP_END_OF_HEADER;
+
+    /* what the handler has already written goes as the first chunk */
+
+    if ( G_connections[ci].stream && G_connections[ci].clen )
+    {
+        int len=2;
+
+        G_connections[ci].p_header = hdr_hex(G_connections[ci].p_header, G_connections[ci].clen);
+        HOUT_CONST("\r\n");
+        OUT_BIN("\r\n", len);
+        G_connections[ci].clen += 2;
+    }
+
+    /* header length */
+
+    G_connections[ci].out_hlen = G_connections[ci].p_header - out_header;
+
+    DDBG("ci=%d, out_hlen = %u", ci, G_connections[ci].out_hlen);
+
+    DBG("Response status: %d", G_connections[ci].status);
+
+    DDBG("ci=%d, changing state to CONN_STATE_READY_TO_SEND_RESPONSE", ci);
+    G_conn_hot[ci].state = CONN_STATE_READY_TO_SEND_RESPONSE;
+
+#ifdef NPP_FD_MON_POLL
+    M_pollfds[G_conn_hot[ci].pi].events = POLLOUT;
+#endif
+
+#ifdef NPP_FD_MON_EPOLL
+    struct epoll_event ev={0};
+
+    ev.data.u64 = NPP_EPOLL_DATA(ci);
+    ev.events = EPOLLOUT | EPOLLET;
+    fd_mon_ctl(EPOLL_CTL_MOD, G_conn_hot[ci].fd, &ev);
+#endif
+
+#ifdef NPP_HTTP2
+    if ( G_connections[ci].http_ver[0] != '2' )
+#endif
+#if NPP_OUT_HEADER_BUFSIZE-1 <= NPP_MAX_LOG_STR_LEN
+        DBG("\nResponse header:\n\n[%s]\n", out_header);
+#else
+        npp_log_long(out_header, G_connections[ci].out_hlen, "\nResponse header");
+#endif  /* NPP_OUT_HEADER_BUFSIZE-1 <= NPP_MAX_LOG_STR_LEN */
+
+#ifdef NPP_HTTP2
+    if ( G_connections[ci].http_ver[0] == '2' && G_connections[ci].out_body && !M_statics[G_connections[ci].static_res].map )
+    {   /* frames need the content right after the header */
+        G_connections[ci].out_data = G_connections[ci].out_body - NPP_OUT_HEADER_BUFSIZE;
+        G_connections[ci].out_body = NULL;
+    }
+#endif  /* NPP_HTTP2 */
+
+    /* ----------------------------------------------------------------- */
+    /* try to send everything at once */
+    /* copy response header just before the content */
+
+    G_connections[ci].out_start = G_connections[ci].out_data + (NPP_OUT_HEADER_BUFSIZE - G_connections[ci].out_hlen);
+    memcpy(G_connections[ci].out_start, out_header, G_connections[ci].out_hlen);
+    G_conn_hot[ci].out_len = G_connections[ci].out_hlen + G_connections[ci].clen;
+
+    /* ----------------------------------------------------------------- */
+
+#ifdef NPP_DEBUG     /* low-level tests */
+    if ( G_logLevel>=LOG_DBG
+            && G_connections[ci].clen > 0
+            && G_connections[ci].method[0]!='H'   /* HEAD */
+            && G_connections[ci].static_res==NPP_NOT_STATIC
+            && !compressed
+            && (G_connections[ci].out_ctype==NPP_CONTENT_TYPE_TEXT || G_connections[ci].out_ctype==NPP_CONTENT_TYPE_JSON) )
+        npp_log_long(G_connections[ci].out_data+NPP_OUT_HEADER_BUFSIZE, G_connections[ci].clen, "Content to send");
+#endif  /* NPP_DEBUG */
+
+    /* ----------------------------------------------------------------- */
+
+    G_conn_hot[ci].last_activity = G_now;
+    if ( IS_SESSION ) SESSION.last_activity = G_now;
+
+    log_proc_time(ci);
+}
+
+
+/* --------------------------------------------------------------------------
+   Prebuild constant response header lines
+   Status lines and Content-Type lines, so that the most common
+   ones are just copied
+-------------------------------------------------------------------------- */
+static void hdr_templates_build()
+{
+static const char types[]={NPP_CONTENT_TYPE_TEXT, NPP_CONTENT_TYPE_HTML, NPP_CONTENT_TYPE_CSS, NPP_CONTENT_TYPE_JS, NPP_CONTENT_TYPE_GIF, NPP_CONTENT_TYPE_JPG, NPP_CONTENT_TYPE_ICO, NPP_CONTENT_TYPE_PNG, NPP_CONTENT_TYPE_WOFF2, NPP_CONTENT_TYPE_SVG, NPP_CONTENT_TYPE_JSON, NPP_CONTENT_TYPE_MD, NPP_CONTENT_TYPE_PDF, NPP_CONTENT_TYPE_XML, NPP_CONTENT_TYPE_AMPEG, NPP_CONTENT_TYPE_EXE, NPP_CONTENT_TYPE_ZIP, NPP_CONTENT_TYPE_GZIP, NPP_CONTENT_TYPE_BMP};
+    char line[256];
+    int  i, status;
+
+    for ( i=0; M_http_status[i].status != -1; ++i )
+    {
+        status = M_http_status[i].status;
+
+        if ( status < 100 || status > 599 || M_hdr_status[status-100] ) continue;
+
+        sprintf(line, "HTTP/1.1 %d %s\r\n", status, M_http_status[i].description);
+        M_hdr_status[status-100] = strdup(line);
+    }
+
+    for ( i=0; i<(int)sizeof(types); ++i )
+    {
+        sprintf(line, "Content-Type: %s\r\n", content_type_str(types[i]));
+        M_hdr_ctype[(unsigned char)types[i] & 0x7f] = strdup(line);
+    }
+}
+
+
+/* --------------------------------------------------------------------------
+   Write unsigned integer in decimal
+   Return pointer past the last digit
+-------------------------------------------------------------------------- */
+static char *hdr_uint(char *dest, unsigned val)
+{
+    char buf[10];
+    char *p = buf + sizeof(buf);
+
+    do
+        *--p = '0' + val % 10;
+    while ( (val /= 10) != 0 );
+
+    int len = buf + sizeof(buf) - p;
+
+    memcpy(dest, p, len);
+
+    return dest + len;
+}
+
+
+/* --------------------------------------------------------------------------
+   Write unsigned integer in hex (chunk size)
+   Return pointer past the last digit
+-------------------------------------------------------------------------- */
+static char *hdr_hex(char *dest, unsigned val)
+{
+static const char digits[]="0123456789abcdef";
+    char buf[8];
+    char *p = buf + sizeof(buf);
+
+    do
+        *--p = digits[val & 0xf];
+    while ( (val >>= 4) != 0 );
+
+    int len = buf + sizeof(buf) - p;
+
+    memcpy(dest, p, len);
+
+    return dest + len;
+}
+
+
+/* --------------------------------------------------------------------------
+   Get the next chunk of a streamed response
+   Called when the previous one has been sent, so the client sets the pace
+   and only one chunk at a time is held in memory
+-------------------------------------------------------------------------- */
+static void stream_next(int ci)
+{
+    bool     more;
+    unsigned clen;
+    char     size[16];
+    int      size_len=0, len;
+
+    do  /* until there's something to send */
+    {
+        G_connections[ci].p_content = G_connections[ci].out_data + NPP_OUT_HEADER_BUFSIZE;
+        more = G_connections[ci].stream(ci);
+        clen = G_connections[ci].p_content - G_connections[ci].out_data - NPP_OUT_HEADER_BUFSIZE;
+    }
+    while ( more && clen == 0 );
+
+    if ( clen )
+    {
+        size_len = hdr_hex(size, clen) - size;
+        size[size_len++] = '\r';
+        size[size_len++] = '\n';
+        len = 2;
+        OUT_BIN("\r\n", len);
+    }
+
+    if ( !more )    /* last chunk */
+    {
+        len = 5;
+        OUT_BIN("0\r\n\r\n", len);
+        G_connections[ci].stream = NULL;
+    }
+
+    /* chunk size goes just before the data, where the header was */
+
+    G_connections[ci].out_start = G_connections[ci].out_data + NPP_OUT_HEADER_BUFSIZE - size_len;
+    memcpy(G_connections[ci].out_start, size, size_len);
+
+    G_connections[ci].clen = G_connections[ci].p_content - G_connections[ci].out_start;
+    G_conn_hot[ci].out_len = G_connections[ci].clen;
+    G_conn_hot[ci].data_sent = 0;
+
+    DDBG("ci=%d, next chunk, out_len = %u", ci, G_conn_hot[ci].out_len);
+
+    G_conn_hot[ci].state = CONN_STATE_SENDING_CONTENT;
+
+    /* socket has likely been writable all along -- edge-triggered epoll needs re-arming */
+
+#ifdef NPP_FD_MON_EPOLL
+    struct epoll_event ev={0};
+
+    ev.data.u64 = NPP_EPOLL_DATA(ci);
+    ev.events = EPOLLOUT | EPOLLET;
+    fd_mon_ctl(EPOLL_CTL_MOD, G_conn_hot[ci].fd, &ev);
+#endif
+
+    G_conn_hot[ci].last_activity = G_now;
+}
+
+
+/* --------------------------------------------------------------------------
+   Everything queued has been sent
+   Return TRUE if the response goes on (stream, event stream or WebSocket)
+-------------------------------------------------------------------------- */
+static bool response_continues(int ci)
+{
+    if ( G_connections[ci].stream )
+    {
+        stream_next(ci);
+        return TRUE;
+    }
+
+    if ( G_connections[ci].sse_group != -1 )
+    {
+        sse_idle(ci);
+        return TRUE;
+    }
+
+    if ( G_connections[ci].ws_state != WS_STATE_NONE )
+    {
+        ws_idle(ci);
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+
+/* --------------------------------------------------------------------------
+   Event stream has nothing more to send -- wait for events
+   Only watch for the client going away
+-------------------------------------------------------------------------- */
+static void sse_idle(int ci)
+{
+    if ( G_connections[ci].out_hlen )   /* the header has gone, so the request itself is done */
+    {
+        log_request(ci);
+        G_connections[ci].out_hlen = 0;
+    }
+
+    DDBG("ci=%d, changing state to CONN_STATE_SSE", ci);
+    G_conn_hot[ci].state = CONN_STATE_SSE;
+
+#ifdef NPP_FD_MON_POLL
+    M_pollfds[G_conn_hot[ci].pi].events = POLLIN;
+#endif
+
+#ifdef NPP_FD_MON_EPOLL
+    struct epoll_event ev={0};
+
+    ev.data.u64 = NPP_EPOLL_DATA(ci);
+    ev.events = EPOLLIN | EPOLLET;
+    fd_mon_ctl(EPOLL_CTL_MOD, G_conn_hot[ci].fd, &ev);
+#endif
+}
+
+
+/* --------------------------------------------------------------------------
+   Take event stream off its group's list
+-------------------------------------------------------------------------- */
+static void sse_unlink(int ci)
+{
+    if ( G_connections[ci].sse_prev != -1 )
+        G_connections[G_connections[ci].sse_prev].sse_next = G_connections[ci].sse_next;
+    else
+        M_sse_groups[G_connections[ci].sse_group % NPP_SSE_GROUPS] = G_connections[ci].sse_next;
+
+    if ( G_connections[ci].sse_next != -1 )
+        G_connections[G_connections[ci].sse_next].sse_prev = G_connections[ci].sse_prev;
+
+    G_connections[ci].sse_group = -1;
+}
+
+
+/* --------------------------------------------------------------------------
+   Prepare the output buffer for an event or a WebSocket frame
+   If the previous ones haven't gone yet, the new one is appended
+   off = where the unsent data starts (as the buffer may move),
+   -1 if still in the handler
+   len = what's going to be added -- a client that doesn't keep up
+   with NPP_MAX_PUSH_QUEUED bytes waiting is closed
+   It's only marked here, as we may be in its own WebSocket callback,
+   with its input buffer in use -- close_lagging() does the rest
+-------------------------------------------------------------------------- */
+static bool push_begin(int ci, unsigned len, int *off)
+{
+    if ( ci < 0 || ci > G_maxConnections || (G_connections[ci].sse_group == -1 && G_connections[ci].ws_state == WS_STATE_NONE) || G_conn_hot[ci].state == CONN_STATE_DISCONNECTED )
+        return FALSE;
+
+    if ( G_connections[ci].push_lagging )
+        return FALSE;
+
+    if ( G_conn_hot[ci].state == CONN_STATE_WAITING_FOR_ASYNC && G_connections[ci].ws_reply != -1 )
+        return FALSE;   /* routed message's reply is coming in */
+
+    if ( G_conn_hot[ci].state == CONN_STATE_SSE || G_conn_hot[ci].state == CONN_STATE_WEBSOCKET )   /* start afresh */
+    {
+        G_connections[ci].p_content = G_connections[ci].out_data + NPP_OUT_HEADER_BUFSIZE;
+        G_connections[ci].out_start = G_connections[ci].p_content;
+        G_conn_hot[ci].out_len = 0;
+        G_conn_hot[ci].data_sent = 0;
+    }
+
+    if ( G_conn_hot[ci].state == CONN_STATE_SSE || G_conn_hot[ci].state == CONN_STATE_WEBSOCKET || G_conn_hot[ci].state == CONN_STATE_READY_TO_SEND_RESPONSE || G_conn_hot[ci].state == CONN_STATE_SENDING_CONTENT )
+        *off = G_connections[ci].out_start - G_connections[ci].out_data;
+    else    /* goes with the first response */
+        *off = -1;
+
+#ifdef NPP_OUT_CHECK_REALLOC
+    bool fits = TRUE;
+#else
+    bool fits = (len <= (unsigned)(G_connections[ci].out_data + G_connections[ci].out_data_allocated - G_connections[ci].p_content));
+#endif
+    unsigned queued = *off == -1 ? 0 : G_connections[ci].p_content - G_connections[ci].out_start - G_conn_hot[ci].data_sent;
+
+    if ( queued && (!fits || queued + len > NPP_MAX_PUSH_QUEUED) )
+    {
+        WAR("ci=%d, client doesn't keep up (%u bytes queued), closing", ci, queued);
+        G_connections[ci].push_lagging = TRUE;
+        if ( M_lagging_cnt <= G_maxConnections )    /* otherwise close_old_conn will find it */
+            M_lagging[M_lagging_cnt++] = ci;
+        return FALSE;
+    }
+
+    if ( !fits )
+    {
+        WAR("ci=%d, %u bytes don't fit in the output buffer", ci, len);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+/* --------------------------------------------------------------------------
+   Close connections marked by push_begin()
+   Ones closed meanwhile have had the mark cleared by reset_conn()
+-------------------------------------------------------------------------- */
+static void close_lagging()
+{
+    int i, ci;
+
+    for ( i=0; i<M_lagging_cnt; ++i )
+    {
+        ci = M_lagging[i];
+
+        if ( G_connections[ci].push_lagging && G_conn_hot[ci].state != CONN_STATE_DISCONNECTED )
+            close_connection(ci, TRUE);
+    }
+
+    M_lagging_cnt = 0;
+}
+
+
+/* --------------------------------------------------------------------------
+   Event or frame is in the output buffer -- send it if the socket is idle
+-------------------------------------------------------------------------- */
+static void push_end(int ci, int off)
+{
+    if ( off == -1 ) return;    /* still in the handler */
+
+    G_connections[ci].out_start = G_connections[ci].out_data + off;
+
+    unsigned len = G_connections[ci].p_content - G_connections[ci].out_start;
+
+    if ( G_conn_hot[ci].state == CONN_STATE_READY_TO_SEND_RESPONSE )
+        G_connections[ci].clen += len - G_conn_hot[ci].out_len;
+
+    G_conn_hot[ci].out_len = len;
+
+    if ( G_conn_hot[ci].state != CONN_STATE_SSE && G_conn_hot[ci].state != CONN_STATE_WEBSOCKET ) return;   /* will go with what's already being sent */
+
+    DDBG("ci=%d, changing state to CONN_STATE_SENDING_CONTENT", ci);
+    G_conn_hot[ci].state = CONN_STATE_SENDING_CONTENT;
+
+#ifdef NPP_FD_MON_POLL
+    M_pollfds[G_conn_hot[ci].pi].events = POLLOUT;
+#endif
+
+#ifdef NPP_FD_MON_EPOLL
+    struct epoll_event ev={0};
+
+    ev.data.u64 = NPP_EPOLL_DATA(ci);
+    ev.events = EPOLLOUT | EPOLLET;
+    fd_mon_ctl(EPOLL_CTL_MOD, G_conn_hot[ci].fd, &ev);
+#endif
+
+    G_conn_hot[ci].last_activity = G_now;
+}
+
+
+/* --------------------------------------------------------------------------
+   WebSocket has nothing more to send -- wait for messages
+   Frames that came in the meantime are parsed first
+-------------------------------------------------------------------------- */
+static void ws_idle(int ci)
+{
+    if ( G_connections[ci].ws_state == WS_STATE_CLOSING )
+    {
+        DBG("ci=%d, WebSocket closed", ci);
+        close_connection(ci, TRUE);
+        return;
+    }
+
+    if ( G_connections[ci].out_hlen )   /* the handshake has gone */
+    {
+        log_request(ci);
+        G_connections[ci].out_hlen = 0;
+
+        /* frames could have followed the request straight away */
+
+        G_conn_hot[ci].was_read = 0;
+
+        if ( G_connections[ci].pipe_len )
+        {
+            memmove(G_connections[ci].cold->in, G_connections[ci].cold->in+G_connections[ci].pipe_off, G_connections[ci].pipe_len);
+            G_conn_hot[ci].was_read = G_connections[ci].pipe_len;
+            G_connections[ci].pipe_len = 0;
+        }
+    }
+
+    DDBG("ci=%d, changing state to CONN_STATE_WEBSOCKET", ci);
+    G_conn_hot[ci].state = CONN_STATE_WEBSOCKET;
+
+    if ( G_conn_hot[ci].was_read )
+        ws_parse(ci);
+
+    if ( G_conn_hot[ci].state != CONN_STATE_WEBSOCKET ) return;   /* replying already */
+
+#ifdef NPP_FD_MON_POLL
+    M_pollfds[G_conn_hot[ci].pi].events = POLLIN;
+#endif
+
+#ifdef NPP_FD_MON_EPOLL
+    struct epoll_event ev={0};
+
+    ev.data.u64 = NPP_EPOLL_DATA(ci);
+    ev.events = EPOLLIN | EPOLLET;
+    fd_mon_ctl(EPOLL_CTL_MOD, G_conn_hot[ci].fd, &ev);
+#endif
+}
+
+
+/* --------------------------------------------------------------------------
+   WebSocket handshake response header (RFC 6455)
+-------------------------------------------------------------------------- */
+static void ws_handshake(int ci)
+{
+    char src[NPP_WS_KEY_LEN+sizeof(WS_GUID)];
+    unsigned char digest[20];
+    char accept[32];
+
+    strcpy(stpcpy(src, G_connections[ci].ws_key), WS_GUID);
+    ws_sha1((unsigned char*)src, strlen(src), digest);
+    npp_b64_encode(accept, digest, 20);
+
+    DDBG("Responding with 101");
+
+    PRINT_HTTP_STATUS(101);
+    HOUT_CONST("Upgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: ");
+    HOUT(accept);
+    HOUT_CONST("\r\n");
+
+    if ( G_connections[ci].cold->cust_headers[0] )    /* Sec-WebSocket-Protocol, if any */
+        HOUT(G_connections[ci].cold->cust_headers);
+
+    /* frames sent from the handler follow */
+
+    G_connections[ci].clen = G_connections[ci].p_content - G_connections[ci].out_data - NPP_OUT_HEADER_BUFSIZE;
+    G_connections[ci].status = 101;
+    G_connections[ci].ws_state = WS_STATE_OPEN;
+    G_connections[ci].ws_last_in = G_now;
+}
+
+
+/* --------------------------------------------------------------------------
+   Routed message's reply is in -- send it as a text frame
+   It follows the frames sent to this connection while waiting
+-------------------------------------------------------------------------- */
+static void ws_reply(int ci)
+{
+    G_conn_hot[ci].flags &= ~NPP_CONN_FLAG_PAYLOAD;
+
+    unsigned start = NPP_OUT_HEADER_BUFSIZE;
+    unsigned reply = G_connections[ci].ws_reply == -1 ? G_connections[ci].p_content - G_connections[ci].out_data : G_connections[ci].ws_reply;
+    int      len = G_connections[ci].p_content - G_connections[ci].out_data - reply;
+
+    G_connections[ci].ws_reply = -1;
+
+    DBG("ci=%d, WebSocket reply, status = %d, %d bytes", ci, G_connections[ci].status, len);
+
+    if ( G_connections[ci].ws_state == WS_STATE_CLOSING )    /* nothing goes after close */
+    {
+        G_connections[ci].p_content = G_connections[ci].out_data + reply;
+        len = 0;
+    }
+
+    G_connections[ci].out_start = G_connections[ci].out_data + start;
+
+    if ( len )
+    {
+        char hdr[10];
+        int hlen = ws_frame_hdr((unsigned char*)hdr, WS_OP_TEXT, len);
+
+        if ( reply == start )   /* frame header goes before it, where the HTTP header would */
+        {
+            G_connections[ci].out_start -= hlen;
+            memcpy(G_connections[ci].out_start, hdr, hlen);
+        }
+        else    /* make room */
+        {
+            int room = hlen;
+            OUT_BIN(hdr, room);     /* the buffer may move */
+            memmove(G_connections[ci].out_data+reply+hlen, G_connections[ci].out_data+reply, len);
+            memcpy(G_connections[ci].out_data+reply, hdr, hlen);
+            G_connections[ci].out_start = G_connections[ci].out_data + start;
+        }
+    }
+
+    G_conn_hot[ci].out_len = G_connections[ci].p_content - G_connections[ci].out_start;
+    G_conn_hot[ci].data_sent = 0;
+
+    if ( !G_conn_hot[ci].out_len )
+    {
+        ws_idle(ci);
+        return;
+    }
+
+    DDBG("ci=%d, changing state to CONN_STATE_SENDING_CONTENT", ci);
+    G_conn_hot[ci].state = CONN_STATE_SENDING_CONTENT;
+
+#ifdef NPP_FD_MON_POLL
+    M_pollfds[G_conn_hot[ci].pi].events = POLLOUT;
+#endif
+
+#ifdef NPP_FD_MON_EPOLL
+    struct epoll_event ev={0};
+
+    ev.data.u64 = NPP_EPOLL_DATA(ci);
+    ev.events = EPOLLOUT | EPOLLET;
+    fd_mon_ctl(EPOLL_CTL_MOD, G_conn_hot[ci].fd, &ev);
+#endif
+
+    G_conn_hot[ci].last_activity = G_now;
+}
+
+
+/* --------------------------------------------------------------------------
+   Parse WebSocket frames in the input buffer
+   A message that fits in is unmasked and handed over where it is,
+   fragmented or bigger ones are assembled in ws_msg
+-------------------------------------------------------------------------- */
+static void ws_parse(int ci)
+{
+    unsigned char *in = (unsigned char*)G_connections[ci].cold->in;
+    unsigned char *data, *mask, op, save;
+    unsigned pos=0, avail, hlen, n;
+    unsigned long long plen;
+    bool fin;
+
+    while ( (avail=G_conn_hot[ci].was_read-pos) > 0 && G_connections[ci].ws_state == WS_STATE_OPEN )
+    {
+#ifdef NPP_ASYNC
+        if ( G_connections[ci].service[0] && G_conn_hot[ci].state != CONN_STATE_WEBSOCKET )
+            break;  /* routed ones go one at a time */
+#endif
+        if ( G_connections[ci].ws_frame_left )   /* the rest of the frame going to ws_msg */
+        {
+            n = avail < G_connections[ci].ws_frame_left ? avail : G_connections[ci].ws_frame_left;
+
+            data = (unsigned char*)G_connections[ci].ws_msg + G_connections[ci].ws_msg_len;
+            memcpy(data, in+pos, n);
+            ws_unmask(data, n, G_connections[ci].ws_mask, G_connections[ci].ws_mask_phase);
+
+            G_connections[ci].ws_mask_phase = (G_connections[ci].ws_mask_phase + n) & 3;
+            G_connections[ci].ws_msg_len += n;
+            G_connections[ci].ws_frame_left -= n;
+            pos += n;
+
+            if ( !G_connections[ci].ws_frame_left && G_connections[ci].ws_msg_fin )
+                ws_msg_done(ci);
+
+            continue;
+        }
+
+        /* frame header */
+
+        if ( avail < 2 ) break;
+
+        if ( !(in[pos+1] & 0x80) || (in[pos] & 0x70) )     /* clients must mask, no extensions */
+        {
+            WAR("ci=%d, invalid WebSocket frame", ci);
+            npp_eng_ws_close(ci, 1002);
+            break;
+        }
+
+        fin = (in[pos] & 0x80) != 0;
+        op = in[pos] & 0x0f;
+        plen = in[pos+1] & 0x7f;
+        hlen = 2;
+
+        if ( plen == 126 )
+        {
+            if ( avail < 4 ) break;
+            plen = ((unsigned)in[pos+2] << 8) | in[pos+3];
+            hlen = 4;
+        }
+        else if ( plen == 127 )
+        {
+            if ( avail < 10 ) break;
+            for ( plen=0, n=2; n<10; ++n )
+                plen = (plen << 8) | in[pos+n];
+            hlen = 10;
+        }
+
+        if ( avail < hlen+4 ) break;
+
+        mask = in + pos + hlen;
+        hlen += 4;
+
+        if ( op & 0x08 )    /* control frame -- can come between fragments */
+        {
+            if ( !fin || plen > 125 )
+            {
+                WAR("ci=%d, invalid WebSocket control frame", ci);
+                npp_eng_ws_close(ci, 1002);
+                break;
+            }
+
+            if ( avail < hlen+plen ) break;
+
+            data = in + pos + hlen;
+            ws_unmask(data, plen, mask, 0);
+            pos += hlen + plen;
+
+            ws_control(ci, op, data, plen);
+            continue;
+        }
+
+        if ( op == WS_OP_CONT ? !G_connections[ci].ws_msg_op : (G_connections[ci].ws_msg_op || (op != WS_OP_TEXT && op != WS_OP_BIN)) )
+        {
+            WAR("ci=%d, unexpected WebSocket opcode %d", ci, op);
+            npp_eng_ws_close(ci, 1002);
+            break;
+        }
+
+        if ( plen > NPP_WS_MAX_MESSAGE - G_connections[ci].ws_msg_len )
+        {
+            WAR("ci=%d, WebSocket message too big", ci);
+            npp_eng_ws_close(ci, 1009);
+            break;
+        }
+
+        if ( fin && op != WS_OP_CONT && hlen+plen < NPP_IN_BUFSIZE )   /* whole message fits in */
+        {
+            if ( avail < hlen+plen ) break;     /* wait for the rest */
+
+            data = in + pos + hlen;
+            ws_unmask(data, plen, mask, 0);
+            pos += hlen + plen;
+
+            save = data[plen];  /* the next frame may start there */
+            data[plen] = EOS;
+            ws_message(ci, (char*)data, plen, op==WS_OP_BIN);
+
+            if ( G_conn_hot[ci].state == CONN_STATE_DISCONNECTED )     /* in's gone with it */
+                return;
+
+            data[plen] = save;
+            continue;
+        }
+
+        /* fragment or too big for the buffer -- assemble */
+
+        if ( G_connections[ci].ws_msg_len + plen + 1 > G_connections[ci].ws_msg_allocated )
+        {
+            char *tmp = (char*)realloc(G_connections[ci].ws_msg, G_connections[ci].ws_msg_len+plen+1);
+
+            if ( !tmp )
+            {
+                ERR("Couldn't allocate %llu bytes for WebSocket message", G_connections[ci].ws_msg_len+plen+1);
+                npp_eng_ws_close(ci, 1009);
+                break;
+            }
+
+            G_connections[ci].ws_msg = tmp;
+            G_connections[ci].ws_msg_allocated = G_connections[ci].ws_msg_len + plen + 1;
+        }
+
+        if ( op != WS_OP_CONT )
+            G_connections[ci].ws_msg_op = op;
+
+        memcpy(G_connections[ci].ws_mask, mask, 4);
+        G_connections[ci].ws_mask_phase = 0;
+        G_connections[ci].ws_frame_left = plen;
+        G_connections[ci].ws_msg_fin = fin;
+        pos += hlen;
+
+        if ( !plen && fin )
+            ws_msg_done(ci);
+    }
+
+    if ( G_conn_hot[ci].state == CONN_STATE_DISCONNECTED ) return;
+
+    /* keep the rest for the next time */
+
+    if ( pos )
+    {
+        G_conn_hot[ci].was_read -= pos;
+        memmove(in, in+pos, G_conn_hot[ci].was_read);
+    }
+}
+
+
+/* --------------------------------------------------------------------------
+   Assembled message is complete
+-------------------------------------------------------------------------- */
+static void ws_msg_done(int ci)
+{
+    unsigned len = G_connections[ci].ws_msg_len;
+    bool binary = (G_connections[ci].ws_msg_op == WS_OP_BIN);
+
+    G_connections[ci].ws_msg[len] = EOS;
+    G_connections[ci].ws_msg_len = 0;
+    G_connections[ci].ws_msg_op = 0;
+
+    ws_message(ci, G_connections[ci].ws_msg, len, binary);
+}
+
+
+/* --------------------------------------------------------------------------
+   Hand the message over to the application or to the service
+-------------------------------------------------------------------------- */
+static void ws_message(int ci, char *data, unsigned len, bool binary)
+{
+    DBG("ci=%d, WebSocket message, %u bytes", ci, len);
+
+    if ( !binary && !ws_utf8_valid((unsigned char*)data, len) )
+    {
+        WAR("ci=%d, WebSocket text message isn't valid UTF-8", ci);
+        npp_eng_ws_close(ci, 1007);
+        return;
+    }
+
+#ifdef NPP_ASYNC
+    if ( G_connections[ci].service[0] )     /* WS_ROUTE -- goes as the request payload */
+    {
+        char method[NPP_METHOD_LEN+1];
+        char in_ctype = G_connections[ci].in_ctype;
+
+        strcpy(method, G_connections[ci].method);
+        strcpy(G_connections[ci].method, "WS");
+        G_connections[ci].in_data = data;
+        G_connections[ci].clen = len;
+        G_connections[ci].in_ctype = binary ? NPP_CONTENT_TYPE_OCTET_STREAM : NPP_CONTENT_TYPE_TEXT;
+        G_conn_hot[ci].flags |= NPP_CONN_FLAG_PAYLOAD;
+
+        G_connections[ci].p_content = G_connections[ci].out_data + NPP_OUT_HEADER_BUFSIZE;
+        G_connections[ci].ws_reply = -1;
+        G_connections[ci].status = 200;
+
+        if ( !npp_eng_call_async(ci, G_connections[ci].service, NULL, TRUE, G_ASYNCDefTimeout, 0) )
+            WAR("ci=%d, couldn't route WebSocket message to %s", ci, G_connections[ci].service);
+
+        strcpy(G_connections[ci].method, method);
+        G_connections[ci].in_data = NULL;
+        G_connections[ci].clen = 0;
+        G_connections[ci].in_ctype = in_ctype;
+        G_conn_hot[ci].flags &= ~NPP_CONN_FLAG_PAYLOAD;
+        return;
+    }
+#endif  /* NPP_ASYNC */
+
+    if ( G_connections[ci].ws_cb )
+        G_connections[ci].ws_cb(ci, data, len, binary);
+}
+
+
+/* --------------------------------------------------------------------------
+   Respond to WebSocket control frame
+-------------------------------------------------------------------------- */
+static void ws_control(int ci, unsigned char op, const unsigned char *data, unsigned len)
+{
+    if ( op == WS_OP_PING )
+    {
+        ws_frame(ci, WS_OP_PONG, (const char*)data, len);
+    }
+    else if ( op == WS_OP_CLOSE )   /* echo the status code */
+    {
+        DBG("ci=%d, WebSocket close received", ci);
+
+        int code = len >= 2 ? (data[0] << 8) | data[1] : 1000;
+
+        /* 1005, 1006 and 1015 are never sent, 1016-2999 aren't assigned */
+
+        if ( len == 1 || code < 1000 || code == 1004 || code == 1005 || code == 1006 || (code > 1014 && code < 3000) || code > 4999 )
+        {
+            WAR("ci=%d, invalid WebSocket close code", ci);
+            code = 1002;
+        }
+        else if ( len > 2 && !ws_utf8_valid(data+2, len-2) )   /* reason */
+        {
+            WAR("ci=%d, WebSocket close reason isn't valid UTF-8", ci);
+            code = 1007;
+        }
+
+        npp_eng_ws_close(ci, code);
+    }
+
+    /* pong -- it's been an activity, that's all */
+}
+
+
+/* --------------------------------------------------------------------------
+   Write WebSocket frame header
+   Return its length
+-------------------------------------------------------------------------- */
+static int ws_frame_hdr(unsigned char *hdr, unsigned char op, unsigned len)
+{
+    hdr[0] = 0x80 | op;     /* FIN, never fragmented */
+
+    if ( len < 126 )
+    {
+        hdr[1] = len;
+        return 2;
+    }
+
+    if ( len < 65536 )
+    {
+        hdr[1] = 126;
+        hdr[2] = len >> 8;
+        hdr[3] = len & 0xff;
+        return 4;
+    }
+
+    hdr[1] = 127;
+    hdr[2] = hdr[3] = hdr[4] = hdr[5] = 0;
+    hdr[6] = len >> 24;
+    hdr[7] = (len >> 16) & 0xff;
+    hdr[8] = (len >> 8) & 0xff;
+    hdr[9] = len & 0xff;
+
+    return 10;
+}
+
+
+/* --------------------------------------------------------------------------
+   Queue WebSocket frame (server's frames aren't masked)
+-------------------------------------------------------------------------- */
+static bool ws_frame(int ci, unsigned char op, const char *data, unsigned len)
+{
+    char hdr[10];
+    int off, hlen, dlen=len;
+
+    if ( ci < 0 || ci > G_maxConnections || G_connections[ci].ws_state == WS_STATE_CLOSING )
+        return FALSE;
+
+    if ( !push_begin(ci, len+10, &off) )
+        return FALSE;
+
+    hlen = ws_frame_hdr((unsigned char*)hdr, op, len);
+
+    OUT_BIN(hdr, hlen);
+    OUT_BIN(data, dlen);
+
+    push_end(ci, off);
+
+    return TRUE;
+}
+
+
+/* --------------------------------------------------------------------------
+   Unmask WebSocket payload in place, 32 or 16 bytes at a time
+   phase = payload offset the data starts at (mod 4)
+-------------------------------------------------------------------------- */
+static void ws_unmask(unsigned char *data, unsigned len, const unsigned char *mask, unsigned phase)
+{
+    unsigned char rot[4];
+    uint32_t m;
+    uint64_t m64, v;
+    unsigned i=0;
+
+    for ( ; i<4; ++i )
+        rot[i] = mask[(phase+i) & 3];
+
+    memcpy(&m, rot, 4);
+
+    i = 0;
+
+#if defined(__AVX2__)
+    const __m256i vm = _mm256_set1_epi32((int)m);
+
+    for ( ; len-i >= 32; i+=32 )
+        _mm256_storeu_si256((__m256i*)(data+i), _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(data+i)), vm));
+#elif defined(__SSE2__)
+    const __m128i vm = _mm_set1_epi32((int)m);
+
+    for ( ; len-i >= 16; i+=16 )
+        _mm_storeu_si128((__m128i*)(data+i), _mm_xor_si128(_mm_loadu_si128((const __m128i*)(data+i)), vm));
+#endif
+    /* the tail or no SIMD -- offsets stay multiples of 4 */
+
+    m64 = ((uint64_t)m << 32) | m;
+
+    for ( ; len-i >= 8; i+=8 )
+    {
+        memcpy(&v, data+i, 8);
+        v ^= m64;
+        memcpy(data+i, &v, 8);
+    }
+
+    for ( ; i<len; ++i )
+        data[i] ^= rot[i & 3];
+}
+
+
+/* --------------------------------------------------------------------------
+   Is text message valid UTF-8 (RFC 3629)?
+   No overlong forms, surrogates or code points above U+10FFFF
+-------------------------------------------------------------------------- */
+static bool ws_utf8_valid(const unsigned char *data, unsigned len)
+{
+    unsigned i=0, n;
+    uint64_t v;
+    unsigned char c;
+
+    while ( i < len )
+    {
+        /* ASCII runs 8 bytes at a time */
+
+        if ( len-i >= 8 )
+        {
+            memcpy(&v, data+i, 8);
+
+            if ( !(v & 0x8080808080808080ULL) )
+            {
+                i += 8;
+                continue;
+            }
+        }
+
+        c = data[i];
+
+        if ( c < 0x80 )
+        {
+            ++i;
+            continue;
+        }
+
+        if ( c >= 0xC2 && c <= 0xDF )
+            n = 1;
+        else if ( c >= 0xE0 && c <= 0xEF )
+            n = 2;
+        else if ( c >= 0xF0 && c <= 0xF4 )
+            n = 3;
+        else
+            return FALSE;
+
+        if ( len-i <= n ) return FALSE;
+
+        /* the second byte's range depends on the first one */
+
+        if ( (c == 0xE0 && data[i+1] < 0xA0)        /* overlong */
+                || (c == 0xED && data[i+1] > 0x9F)  /* surrogate */
+                || (c == 0xF0 && data[i+1] < 0x90)  /* overlong */
+                || (c == 0xF4 && data[i+1] > 0x8F) )    /* above U+10FFFF */
+            return FALSE;
+
+        for ( ++i; n; --n, ++i )
+            if ( (data[i] & 0xC0) != 0x80 ) return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+/* --------------------------------------------------------------------------
+   SHA-1, only for Sec-WebSocket-Accept
+-------------------------------------------------------------------------- */
+static void ws_sha1(const unsigned char *src, unsigned len, unsigned char *digest)
+{
+    uint32_t h[5]={0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    uint32_t w[80], a, b, c, d, e, f, k, t;
+    uint64_t bits = (uint64_t)len * 8;
+    unsigned total = ((len + 8) / 64 + 1) * 64;     /* with 0x80 and the length */
+    unsigned done, i, j;
+
+    for ( done=0; done<total; done+=64 )
+    {
+        for ( i=0; i<64; ++i )
+        {
+            j = done + i;
+
+            if ( j < len )
+                t = src[j];
+            else if ( j == len )
+                t = 0x80;
+            else if ( j >= total-8 )
+                t = (bits >> ((total-1-j)*8)) & 0xff;
+            else
+                t = 0;
+
+            if ( i % 4 == 0 )
+                w[i/4] = t << 24;
+            else
+                w[i/4] |= t << ((3 - i%4) * 8);
+        }
+
+        for ( i=16; i<80; ++i )
+        {
+            t = w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16];
+            w[i] = (t << 1) | (t >> 31);
+        }
+
+        a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4];
+
+        for ( i=0; i<80; ++i )
+        {
+            if ( i < 20 )
+            {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            }
+            else if ( i < 40 )
+            {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            }
+            else if ( i < 60 )
+            {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            }
+            else
+            {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+
+            t = ((a << 5) | (a >> 27)) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = (b << 30) | (b >> 2);
+            b = a;
+            a = t;
+        }
+
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+    }
+
+    for ( i=0; i<20; ++i )
+        digest[i] = (h[i/4] >> ((3 - i%4) * 8)) & 0xff;
+}
+
+
+/* --------------------------------------------------------------------------
+   Add HTTP/1 status line
+-------------------------------------------------------------------------- */
+static void http_hdr_status(int ci, int status)
+{
+    if ( status >= 100 && status <= 599 && M_hdr_status[status-100] )
+    {
+        HOUT(M_hdr_status[status-100]);
+    }
+    else    /* not on the list */
+    {
+        HOUT_CONST("HTTP/1.1 ");
+        HOUT_UINT(status);
+        HOUT_CONST(" \r\n");
+    }
+}
+
+
+/* --------------------------------------------------------------------------
+   Add HTTP/1 Date
+-------------------------------------------------------------------------- */
+static void http_hdr_date(int ci)
+{
+    if ( M_hdr_date_time != G_now )
+    {
+        M_hdr_date_len = sprintf(M_hdr_date, "Date: %s\r\n", G_header_date);
+        M_hdr_date_time = G_now;
+    }
+
+    HOUT_BIN(M_hdr_date, M_hdr_date_len);
+}
+
+
+/* --------------------------------------------------------------------------
+   Print Content-Type to response header
+   Mirrored npp_lib_set_res_content_type
+-------------------------------------------------------------------------- */
+static void print_content_type(int ci, char type)
+{
+#ifdef NPP_HTTP2
+    if ( G_connections[ci].http_ver[0] == '2' )
+        PRINT_HTTP2_CONTENT_TYPE(content_type_str(type));
+    else
+#endif  /* NPP_HTTP2 */
+    if ( M_hdr_ctype[(unsigned char)type & 0x7f] )
+        HOUT(M_hdr_ctype[(unsigned char)type & 0x7f]);
+    else
+        PRINT_HTTP_CONTENT_TYPE(content_type_str(type));
+}
+
+
+/* --------------------------------------------------------------------------
+   Return Content-Type string
+-------------------------------------------------------------------------- */
+static const char *content_type_str(char type)
+{
+    if ( type == NPP_CONTENT_TYPE_HTML )
+        return "text/html; charset=utf-8";
+    else if ( type == NPP_CONTENT_TYPE_CSS )
+        return "text/css";
+    else if ( type == NPP_CONTENT_TYPE_JS )
+        return "application/javascript";
+    else if ( type == NPP_CONTENT_TYPE_GIF )
+        return "image/gif";
+    else if ( type == NPP_CONTENT_TYPE_JPG )
+        return "image/jpeg";
+    else if ( type == NPP_CONTENT_TYPE_ICO )
+        return "image/x-icon";
+    else if ( type == NPP_CONTENT_TYPE_PNG )
+        return "image/png";
+    else if ( type == NPP_CONTENT_TYPE_WOFF2 )
+        return "application/font-woff2";
+    else if ( type == NPP_CONTENT_TYPE_SVG )
+        return "image/svg+xml";
+    else if ( type == NPP_CONTENT_TYPE_JSON )
+        return "application/json";
+    else if ( type == NPP_CONTENT_TYPE_MD )
+        return "text/markdown";
+    else if ( type == NPP_CONTENT_TYPE_PDF )
+        return "application/pdf";
+    else if ( type == NPP_CONTENT_TYPE_XML )
+        return "application/xml";
+    else if ( type == NPP_CONTENT_TYPE_AMPEG )
+        return "audio/mpeg";
+    else if ( type == NPP_CONTENT_TYPE_EXE )
+        return "application/x-msdownload";
+    else if ( type == NPP_CONTENT_TYPE_ZIP )
+        return "application/zip";
+    else if ( type == NPP_CONTENT_TYPE_GZIP )
+        return "application/gzip";
+    else if ( type == NPP_CONTENT_TYPE_BMP )
+        return "image/bmp";
+    else
+        return "text/plain";
+}
+
+
+/* --------------------------------------------------------------------------
+   Find session index
+-------------------------------------------------------------------------- */
+#ifdef NPP_MULTI_HOST
+int npp_eng_find_si(int host_id, const char *sessid)
+{
+    int idx = npp_lib_find_sess_idx_idx(host_id, sessid);
+
+    if ( idx != -1 )
+        return G_sessions_idx[idx].si;
+
+    return 0;
+}
+#else
+int npp_eng_find_si(const char *sessid)
+{
+    int idx = npp_lib_find_sess_idx_idx(sessid);
+
+    if ( idx != -1 )
+        return G_sessions_idx[idx].si;
+
+    return 0;
+}
+#endif  /* NPP_MULTI_HOST */
+
+
+/* --------------------------------------------------------------------------
+   Verify IP & User-Agent against sessid in G_sessions (anonymous users)
+   Return true if session exists
+-------------------------------------------------------------------------- */
+static bool a_session_ok(int ci)
+{
+    DBG("a_session_ok");
+
+    if ( IS_SESSION )    /* existing connection */
+    {
+        if ( G_sessions[G_connections[ci].si].sessid[0]
+                && G_sessions[G_connections[ci].si].auth_level<AUTH_LEVEL_AUTHENTICATED
+#ifdef NPP_MULTI_HOST
+                && G_connections[ci].host_id == G_sessions[G_connections[ci].si].host_id
+#endif
+                && 0==strcmp(G_connections[ci].cookie_in_a, G_sessions[G_connections[ci].si].sessid)
+                && 0==strcmp(G_connections[ci].cold->uagent, G_sessions[G_connections[ci].si].uagent) )
+        {
+#ifdef NPP_DEBUG
+            DBG("Anonymous session found, si=%d, sessid [%s] (1)", G_connections[ci].si, G_sessions[G_connections[ci].si].sessid);
+#else
+            DBG("Anonymous session found, si=%d (1)", G_connections[ci].si);
+#endif
+            return TRUE;
+        }
+#ifndef NPP_MULTI_HOST
+        else    /* session was closed */
+        {
+            WAR("si > 0 and no session!");
+            G_connections[ci].si = 0;
+        }
+#endif
+    }
+    else    /* fresh connection */
+    {
+#ifdef NPP_MULTI_HOST
+        int si = npp_eng_find_si(G_connections[ci].host_id, G_connections[ci].cookie_in_a);
+#else
+        int si = npp_eng_find_si(G_connections[ci].cookie_in_a);
+#endif
+        DDBG("npp_eng_find_si = %d", si);
+
+        if ( si != 0 && 0==strcmp(G_connections[ci].cold->uagent, G_sessions[si].uagent) )
+        {
+#ifdef NPP_DEBUG
+            DBG("Anonymous session found, si=%d, sessid [%s] (2)", si, G_sessions[si].sessid);
+#else
+            DBG("Anonymous session found, si=%d (2)", si);
+#endif
+            G_connections[ci].si = si;
+            return TRUE;
+        }
+    }
+
+    /* not found */
+    return FALSE;
+}
+
+
+/* --------------------------------------------------------------------------
+   Close timeouted connections
+   Check at most NPP_HOUSEKEEPING_BUDGET slots, continue from there next time
+-------------------------------------------------------------------------- */
+static void close_old_conn()
+{
+    int     i, checked;
+    time_t  last_allowed;
+
+    last_allowed = G_now - NPP_CONNECTION_TIMEOUT;
+
+    for ( checked=0; G_connections_cnt>0 && checked<G_maxConnections+1 && checked<NPP_HOUSEKEEPING_BUDGET; ++checked )
+    {
+        i = M_hk_next_ci;
+
+        if ( ++M_hk_next_ci > G_maxConnections )
+            M_hk_next_ci = 0;
+
+        if ( G_connections[i].push_lagging && G_conn_hot[i].state != CONN_STATE_DISCONNECTED )
+        {
+            close_connection(i, TRUE);
+        }
+        else if ( G_conn_hot[i].state == CONN_STATE_SSE )     /* exempt, but make sure it's still there */
+        {
+            if ( G_conn_hot[i].last_activity <= G_now - NPP_SSE_HEARTBEAT )
+            {
+                int off;
+
+                if ( push_begin(i, 3, &off) )
+                {
+                    int ci=i, len=3;
+                    OUT_BIN(":\n\n", len);
+                    push_end(i, off);
+                }
+            }
+        }
+        else if ( G_conn_hot[i].state == CONN_STATE_WEBSOCKET )     /* exempt as well, pinged */
+        {
+            if ( G_connections[i].ws_last_in <= G_now - 2*NPP_WS_PING )   /* not even a pong */
+            {
+                DBG("Closing silent WebSocket ci=%d", i);
+                close_connection(i, TRUE);
+            }
+            else if ( G_conn_hot[i].last_activity <= G_now - NPP_WS_PING )
+            {
+                ws_frame(i, WS_OP_PING, "", 0);
+            }
+        }
+        else if ( G_conn_hot[i].state != CONN_STATE_DISCONNECTED && G_conn_hot[i].last_activity < last_allowed )
+        {
+            DBG("Closing timeouted connection ci=%d", i);
+            close_connection(i, TRUE);
+        }
+    }
+}
+
+
+/* --------------------------------------------------------------------------
+   Close timeouted anonymous user sessions
+   Check at most NPP_HOUSEKEEPING_BUDGET slots, continue from there next time
+-------------------------------------------------------------------------- */
+static void uses_close_timeouted()
+{
+    int     i, checked;
+    time_t  last_allowed;
+
+    last_allowed = G_now - NPP_SESSION_TIMEOUT;
+
+    for ( checked=0; G_sessions_cnt>0 && checked<G_maxSessions && checked<NPP_HOUSEKEEPING_BUDGET; ++checked )
+    {
+        i = M_hk_next_si;
+
+        if ( ++M_hk_next_si > G_maxSessions )
+            M_hk_next_si = 1;
+
+        if ( G_sessions[i].sessid[0] && G_sessions[i].auth_level<AUTH_LEVEL_AUTHENTICATED && G_sessions[i].last_activity < last_allowed )
+            close_uses(i, NPP_NOT_CONNECTED);
+    }
+}
+
+
+/* --------------------------------------------------------------------------
+   Close anonymous user session
+-------------------------------------------------------------------------- */
+static void close_uses(int si, int ci)
+{
+#ifdef NPP_DEBUG
+    DBG("Closing anonymous session, si=%d, sessid [%s]", si, G_sessions[si].sessid);
+#else
+    DBG("Closing anonymous session, si=%d", si);
+#endif
+
+    DBG("Calling npp_app_session_done...");
+
+    if ( ci != NPP_NOT_CONNECTED )   /* still connected */
+        npp_app_session_done(ci);
+    else    /* use special temporary G_connections slot to maintain consistency across npp_app_xxx functions */
+    {       /* that use ci for everything -- including getting the session data */
+        G_connections[NPP_CLOSING_SESSION_CI].si = si;
+        npp_app_session_done(NPP_CLOSING_SESSION_CI);
+    }
+
+    /* update sessions index */
+
+#ifdef NPP_MULTI_HOST
+    int sessions_idx_idx = npp_lib_find_sess_idx_idx(G_sessions[si].host_id, G_sessions[si].sessid);
+#else
+    int sessions_idx_idx = npp_lib_find_sess_idx_idx(G_sessions[si].sessid);
+#endif
+
+    if ( sessions_idx_idx == -1 )   /* this should never happen */
+    {
+        ERR("ci=%d, si=%d, sessions_idx_idx == -1", ci, si);
+        DDBG("sessid [%s]", G_sessions[si].sessid);
+    }
+    else    /* session found in G_sessions_idx */
+    {
+#ifdef NPP_MULTI_HOST
+        G_sessions_idx[sessions_idx_idx].host_id = NPP_MAX_HOSTS;
+#endif
+        memset(G_sessions_idx[sessions_idx_idx].sessid, 'z', NPP_SESSID_LEN);
+        G_sessions_idx[sessions_idx_idx].sessid[NPP_SESSID_LEN] = EOS;
+        G_sessions_idx[sessions_idx_idx].si = 0;
+
+        qsort(G_sessions_idx, G_sessions_cnt, sizeof(G_sessions_idx[0]), npp_lib_compare_sess_idx);
+    }
+
+    /* reset session data */
+
+    memset(&G_sessions[si], 0, sizeof(eng_session_data_t));
+    memset(&G_app_session_data[si], 0, sizeof(app_session_data_t));
+
+    G_sessions_cnt--;
+
+    if ( ci != NPP_NOT_CONNECTED )   /* still connected */
+        G_connections[ci].si = 0;
+
+    DBG("%d session(s) remaining", G_sessions_cnt);
+    
+    DDBG("Updating first free si...");
+
+    /* update M_first_free_si & M_highest_used_si */
+
+    DDBG("                   G_sessions_cnt = %d", G_sessions_cnt);
+    DDBG("M_highest_used_si before updating = %d", M_highest_used_si);
+
+    if ( G_sessions_cnt == 0 )   /* it was the last open session */
+    {
+        DDBG("No sessions, setting M_first_free_si=1 and M_highest_used_si=0");
+
+        M_first_free_si = 1;
+
+        if ( M_highest_used_si != 0 )
+            M_highest_used_si = 0;
+    }
+    else if ( si == M_highest_used_si ) /* closing session had the highest spot in G_sessions */
+    {
+        /* loop downwards to find the highest used si */
+
+        DDBG("Looping downwards starting from %d", si-1);
+
+        int i;
+        for ( i=si-1; i>0; i-- )
+        {
+            if ( G_sessions[i].sessid[0] )  /* used */
+            {
+                M_highest_used_si = i;
+                DDBG("M_highest_used_si set to %d", M_highest_used_si);
+                M_first_free_si = i+1;
+                break;
+            }
+        }
+    }
+    else    /* there are sessions with higher indexes than si */
+    {
+        DDBG("Setting M_first_free_si to just released spot");
+
+        M_first_free_si = si;
+
+        DDBG("M_highest_used_si stays where it was");
+    }
+
+    DDBG("  M_first_free_si = %d", M_first_free_si);
+    DDBG("M_highest_used_si = %d\n", M_highest_used_si);
+}
+
+
+/* --------------------------------------------------------------------------
+   Allocate space for the payload
+   Large one goes to an unlinked file in NPP_PAYLOAD_SPOOL_DIR, mapped,
+   so that it doesn't pin RAM and can still be parsed in one piece
+   The file's blocks are allocated upfront -- a sparse one would
+   SIGBUS while receiving if the disk filled up
+   Return OK or HTTP status to respond with
+-------------------------------------------------------------------------- */
+static int payload_alloc(int ci)
+{
+#ifndef _WIN32
+    if ( M_payload_spool && G_connections[ci].clen > NPP_PAYLOAD_SPOOL_THRESHOLD )
+    {
+        char path[NPP_STATIC_PATH_LEN*2+16];
+        int  fd, ret;
+
+        if ( M_payload_spooled + G_connections[ci].clen > NPP_MAX_SPOOLED_TOTAL )
+        {
+            WAR("Spooled payloads would exceed NPP_MAX_SPOOLED_TOTAL, refusing %u bytes", G_connections[ci].clen);
+            return 507;
+        }
+
+        sprintf(path, "%s/%s/npp_XXXXXX", G_appdir, NPP_PAYLOAD_SPOOL_DIR);
+
+        if ( (fd=mkstemp(path)) == -1 )
+        {
+            ERR("Couldn't create %s, errno = %d (%s)", path, errno, strerror(errno));
+            return 500;
+        }
+
+        unlink(path);   /* gone with the mapping */
+
+        if ( (ret=posix_fallocate(fd, 0, G_connections[ci].clen+1)) != 0 )
+        {
+            ERR("Couldn't allocate %u bytes for %s, error = %d (%s)", G_connections[ci].clen+1, path, ret, strerror(ret));
+            close(fd);
+            if ( ret == EFBIG ) return 413;
+            return (ret == ENOSPC || ret == EDQUOT) ? 507 : 500;
+        }
+
+        G_connections[ci].in_data = (char*)mmap(NULL, G_connections[ci].clen+1, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+        close(fd);
+
+        if ( G_connections[ci].in_data == MAP_FAILED )
+        {
+            ERR("Couldn't map %u bytes for payload data, errno = %d (%s)", G_connections[ci].clen+1, errno, strerror(errno));
+            G_connections[ci].in_data = NULL;
+            return 500;
+        }
+
+        G_connections[ci].in_data_spooled = G_connections[ci].clen+1;    /* clen will be the response's */
+        M_payload_spooled += G_connections[ci].in_data_spooled;
+
+        DBG("ci=%d, spooling %u bytes of payload data", ci, G_connections[ci].clen);
+
+        return OK;
+    }
+#endif  /* _WIN32 */
+
+    if ( NULL == (G_connections[ci].in_data=(char*)malloc(G_connections[ci].clen+1)) )
+    {
+        ERR("Couldn't allocate %u bytes for payload data", G_connections[ci].clen);
+        return 500;
+    }
+
+    return OK;
+}
+
+
+/* --------------------------------------------------------------------------
+   Free the payload space
+-------------------------------------------------------------------------- */
+static void payload_free(int ci)
+{
+#ifndef _WIN32
+    if ( G_connections[ci].in_data_spooled )
+    {
+        munmap(G_connections[ci].in_data, G_connections[ci].in_data_spooled);
+        M_payload_spooled -= G_connections[ci].in_data_spooled;
+        G_connections[ci].in_data_spooled = 0;
+    }
+    else
+#endif
+        free(G_connections[ci].in_data);
+
+    G_connections[ci].in_data = NULL;
+}
+
+
+/* --------------------------------------------------------------------------
+   Reset connection after processing request
+-------------------------------------------------------------------------- */
+static void reset_conn(int ci, char new_state)
+{
+#ifdef NPP_DEBUG
+    if ( G_initialized )
+        DBG("ci=%d, reset_conn, fd=%d, new state == %s\n", ci, G_conn_hot[ci].fd, new_state==CONN_STATE_CONNECTED?"CONN_STATE_CONNECTED":"CONN_STATE_DISCONNECTED");
+#endif
+
+    G_conn_hot[ci].state = new_state;
+
+    G_connections[ci].status = 200;
+    G_connections[ci].method[0] = EOS;
+
+    if ( G_connections[ci].in_data )
+        payload_free(ci);
+
+    G_conn_hot[ci].was_read = 0;
+    G_connections[ci].resource[0] = EOS;
+#if NPP_RESOURCE_LEVELS > 1
+    G_connections[ci].req1[0] = EOS;
+#if NPP_RESOURCE_LEVELS > 2
+    G_connections[ci].req2[0] = EOS;
+#if NPP_RESOURCE_LEVELS > 3
+    G_connections[ci].req3[0] = EOS;
+#if NPP_RESOURCE_LEVELS > 4
+    G_connections[ci].req4[0] = EOS;
+#if NPP_RESOURCE_LEVELS > 5
+    G_connections[ci].req5[0] = EOS;
+#endif  /* NPP_RESOURCE_LEVELS > 5 */
+#endif  /* NPP_RESOURCE_LEVELS > 4 */
+#endif  /* NPP_RESOURCE_LEVELS > 3 */
+#endif  /* NPP_RESOURCE_LEVELS > 2 */
+#endif  /* NPP_RESOURCE_LEVELS > 1 */
+    G_connections[ci].id[0] = EOS;
+#ifdef NPP_HTTP2
+//    G_connections[ci].http2_settings[0] = EOS;
+#endif  /* NPP_HTTP2 */
+    G_connections[ci].cold->uagent[0] = EOS;
+    G_connections[ci].ua_type = NPP_UA_TYPE_DSK;
+    G_connections[ci].cold->referer[0] = EOS;
+    G_connections[ci].clen = 0;
+    G_connections[ci].cold->in_cookie[0] = EOS;
+    G_connections[ci].cookie_in_a[0] = EOS;
+    G_connections[ci].cookie_in_l[0] = EOS;
+    G_connections[ci].host[0] = EOS;
+    strcpy(G_connections[ci].app_name, NPP_APP_NAME);
+    G_connections[ci].lang[0] = EOS;
+    G_connections[ci].formats = (char)0;
+    G_connections[ci].if_mod_since = 0;
+    G_connections[ci].if_none_match[0] = EOS;
+    G_connections[ci].range[0] = EOS;
+    G_connections[ci].if_range[0] = EOS;
+    G_connections[ci].ranges_cnt = 0;
+    G_connections[ci].cold->in_ctypestr[0] = EOS;
+    G_connections[ci].in_ctype = NPP_CONTENT_TYPE_UNSET;
+    G_connections[ci].boundary[0] = EOS;
+    G_connections[ci].cold->authorization[0] = EOS;
+    G_connections[ci].required_auth_level = NPP_REQUIRED_AUTH_LEVEL;
+
+    /* what goes out */
+
+    G_connections[ci].cold->cust_headers[0] = EOS;
+    G_connections[ci].cust_headers_len = 0;
+    G_conn_hot[ci].data_sent = 0;
+
+    G_connections[ci].out_data = G_connections[ci].out_data_alloc;
+    G_connections[ci].out_body = NULL;
+    G_connections[ci].stream = NULL;
+
+    if ( G_connections[ci].sse_group != -1 )
+        sse_unlink(ci);
+
+    G_connections[ci].push_lagging = FALSE;
+
+    G_connections[ci].ws_upgrade = FALSE;
+    G_connections[ci].ws_key[0] = EOS;
+    G_connections[ci].ws_v13 = FALSE;
+    G_connections[ci].ws_state = WS_STATE_NONE;
+    G_connections[ci].ws_cb = NULL;
+    G_connections[ci].ws_reply = -1;
+
+    if ( G_connections[ci].ws_msg )
+    {
+        free(G_connections[ci].ws_msg);
+        G_connections[ci].ws_msg = NULL;
+        G_connections[ci].ws_msg_allocated = 0;
+    }
+
+    G_connections[ci].ws_msg_len = 0;
+    G_connections[ci].ws_msg_op = 0;
+    G_connections[ci].ws_frame_left = 0;
+
+    /* don't reset session id for the entire connection life */
+    /* this also means that authenticated connection stays this way until closed or logged out */
+
+    if ( new_state == CONN_STATE_DISCONNECTED )
+    {
+        G_connections[ci].si = 0;
+
+#ifdef NPP_HTTP2
+        G_connections[ci].http2_upgrade_in_progress = FALSE;
+        G_connections[ci].http2_last_stream_id = 1;
+#endif  /* NPP_HTTP2 */
+    }
+
+    static_release(ci);
+    G_connections[ci].out_ctype = NPP_CONTENT_TYPE_HTML;
+    G_connections[ci].ctypestr[0] = EOS;
+    G_connections[ci].cdisp[0] = EOS;
+    G_connections[ci].modified = 0;
+    G_connections[ci].etag_auto = FALSE;
+    G_connections[ci].etag[0] = EOS;
+    G_connections[ci].cookie_out_a[0] = EOS;
+    G_connections[ci].cookie_out_a_exp[0] = EOS;
+    G_connections[ci].cookie_out_l[0] = EOS;
+    G_connections[ci].cookie_out_l_exp[0] = EOS;
+    G_connections[ci].cold->location[0] = EOS;
+#ifdef NPP_MULTI_HOST
+    G_connections[ci].host_normalized[0] = EOS;
+    G_connections[ci].host_id = 0;
+#endif
+
+#ifdef NPP_ASYNC
+    G_connections[ci].service[0] = EOS;
+    G_connections[ci].async_err_code = OK;
+#endif
+
+    /* reset flags */
+
+    if ( NPP_CONN_IS_SECURE(G_conn_hot[ci].flags) )
+        G_conn_hot[ci].flags = NPP_CONN_FLAG_SECURE;
+    else
+        G_conn_hot[ci].flags = (char)0;
+
+    G_connections[ci].accept_enc = 0;
+
+    G_connections[ci].expect100 = FALSE;
+
+    /* last activity */
+
+    if ( new_state == CONN_STATE_CONNECTED )
+    {
+#ifdef NPP_FD_MON_POLL
+        M_pollfds[G_conn_hot[ci].pi].events = POLLIN;
+#endif
+
+#ifdef NPP_FD_MON_EPOLL
+        struct epoll_event ev={0};
+
+        ev.data.u64 = NPP_EPOLL_DATA(ci);
+        ev.events = EPOLLIN | EPOLLET;
+        fd_mon_ctl(EPOLL_CTL_MOD, G_conn_hot[ci].fd, &ev);
+#endif
+        G_conn_hot[ci].last_activity = G_now;
+        if ( IS_SESSION ) SESSION.last_activity = G_now;
+
+        /* next pipelined request -- if complete, it won't be signalled again */
+
+        if ( G_connections[ci].pipe_len )
+        {
+            memmove(G_connections[ci].cold->in, G_connections[ci].cold->in+G_connections[ci].pipe_off, G_connections[ci].pipe_len);
+            G_conn_hot[ci].was_read = G_connections[ci].pipe_len;
+            G_connections[ci].cold->in[G_conn_hot[ci].was_read] = EOS;
+            G_connections[ci].pipe_len = 0;
+
+            skip_empty_lines(ci);
+
+            if ( find_hend(G_connections[ci].cold->in, G_conn_hot[ci].was_read) )
+            {
+                DDBG("ci=%d, changing state to CONN_STATE_READY_FOR_PARSE", ci);
+                G_conn_hot[ci].state = CONN_STATE_READY_FOR_PARSE;
+            }
+        }
+#ifdef NPP_HTTPS
+        /* the rest may be decrypted already, then there won't be any EPOLLIN for it */
+
+        if ( G_conn_hot[ci].state == CONN_STATE_CONNECTED && NPP_CONN_IS_SECURE(G_conn_hot[ci].flags)
+                && G_conn_hot[ci].ssl && SSL_pending(G_conn_hot[ci].ssl) > 0 )
+        {
+            int bytes = ssl_read_in(ci);
+
+            if ( bytes > 0 )
+                set_state(ci, bytes, TRUE);
+        }
+#endif  /* NPP_HTTPS */
+    }
+#ifdef NPP_FD_MON_EPOLL
+//    else
+//        G_connections[ci].epoll_out_ready = FALSE;
+#endif
+
+    if ( new_state == CONN_STATE_DISCONNECTED )
+    {
+        G_conn_hot[ci].fd = 0;
+        G_connections[ci].pipe_len = 0;
+    }
+}
+
+
+#ifdef NPP_BLACKLIST_AUTO_UPDATE
+/* --------------------------------------------------------------------------
+   Check the rules and block IP if matches
+   Return TRUE if blocked
+   It doesn't really change anything security-wise but just saves bandwidth
+-------------------------------------------------------------------------- */
+static bool check_block_ip(int ci, const char *rule, const char *value)
+{
+    if ( G_test ) return FALSE;    /* don't block for tests */
+
+    if ( (rule[0]=='H' && NPP_CONN_IS_PAYLOAD(G_conn_hot[ci].flags) && isdigit(value[0])) /* Host */
+            || (rule[0]=='U' && 0==strcmp(value, "Mozilla/5.0 Jorgee"))     /* User-Agent */
+            || (rule[0]=='R' && 0==strcmp(value, "wp-login.php"))           /* Resource */
+            || (rule[0]=='R' && 0==strcmp(value, "wp-config.php"))          /* Resource */
+            || (rule[0]=='R' && 0==strcmp(value, "administrator"))          /* Resource */
+            || (rule[0]=='R' && 0==strncmp(value, "phpmyadmin", 10))        /* Resource */
+            || (rule[0]=='R' && 0==strncmp(value, "phpMyAdmin", 10))        /* Resource */
+            || (rule[0]=='R' && 0==strcmp(value, "java.php"))               /* Resource */
+            || (rule[0]=='R' && 0==strcmp(value, "logon.php"))              /* Resource */
+            || (rule[0]=='R' && 0==strcmp(value, "log.php"))                /* Resource */
+            || (rule[0]=='R' && 0==strcmp(value, "hell.php"))               /* Resource */
+            || (rule[0]=='R' && 0==strcmp(value, "shell.php"))              /* Resource */
+            || (rule[0]=='R' && 0==strcmp(value, "tty.php"))                /* Resource */
+            || (rule[0]=='R' && 0==strcmp(value, "cmd.php"))                /* Resource */
+            || (rule[0]=='R' && 0==strcmp(value, ".env"))                   /* Resource */
+            || (rule[0]=='R' && strstr(value, "setup.php")) )               /* Resource */
+    {
+        npp_eng_block_ip(G_connections[ci].ip, TRUE);
+        G_conn_hot[ci].flags = G_conn_hot[ci].flags & ~NPP_CONN_FLAG_KEEP_ALIVE;    /* disconnect */
+        return TRUE;
+    }
+
+    return FALSE;
+}
+#endif  /* NPP_BLACKLIST_AUTO_UPDATE */
+
+
+/* --------------------------------------------------------------------------
+   Find authorization level for the requested resource
+-------------------------------------------------------------------------- */
+static char find_auth_level(int ci)
+{
+    int i;
+
+#ifdef NPP_MULTI_HOST
+
+    i = 0;
+
+    while ( M_auth_levels[i].host_id != G_connections[ci].host_id && i<M_auth_levels_cnt ) ++i;
+
+    for ( ; i<M_auth_levels_cnt; ++i )
+    {
+        if ( M_auth_levels[i].host_id != G_connections[ci].host_id )
+            break;
+
+        if ( URI(M_auth_levels[i].path) && M_auth_levels[i].host_id == G_connections[ci].host_id )
+            return M_auth_levels[i].level;
+    }
+
+    return G_hosts[G_connections[ci].host_id].required_auth_level;
+
+#else   /* NOT NPP_MULTI_HOST */
+
+    for ( i=0; i<M_auth_levels_cnt; ++i )
+    {
+        if ( URI(M_auth_levels[i].path) )
+            return M_auth_levels[i].level;
+    }
+
+    return NPP_REQUIRED_AUTH_LEVEL;
+
+#endif  /* NPP_MULTI_HOST */
+}
+
+
+/* --------------------------------------------------------------------------
+   Find the next '\n' between p and end, 32 or 16 bytes at a time
+   Return NULL if there's none
+-------------------------------------------------------------------------- */
+static const char *find_lf(const char *p, const char *end)
+{
+#if defined(__AVX2__)
+    const __m256i lf = _mm256_set1_epi8('\n');
+
+    while ( end - p >= 32 )
+    {
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)p), lf));
+
+        if ( mask )
+            return p + __builtin_ctz(mask);
+
+        p += 32;
+    }
+#elif defined(__SSE2__)
+    const __m128i lf = _mm_set1_epi8('\n');
+
+    while ( end - p >= 16 )
+    {
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), lf));
+
+        if ( mask )
+            return p + __builtin_ctz(mask);
+
+        p += 16;
+    }
+#endif
+    /* the tail or no SIMD */
+
+    return (p < end) ? (const char*)memchr(p, '\n', end-p) : NULL;
+}
+
+
+/* --------------------------------------------------------------------------
+   Find the end of request header (an empty line)
+   Return pointer to its first new line character or NULL
+-------------------------------------------------------------------------- */
+static char *find_hend(char *in, int len)
+{
+    const char *end = in + len;
+    const char *p = in;
+
+    while ( (p=find_lf(p, end)) != NULL )
+    {
+        if ( p+1 < end && p[1] == '\n' )
+            return (char*)p;
+
+        if ( p+2 < end && p[1] == '\r' && p[2] == '\n' )
+            return (char*)((p > in && p[-1] == '\r') ? p-1 : p);
+
+        ++p;
+    }
+
+    return NULL;
+}
+
+
+/* --------------------------------------------------------------------------
+   Case-insensitive FNV-1a of a header field name
+-------------------------------------------------------------------------- */
+static unsigned req_hdr_hash_val(unsigned seed, const char *label)
+{
+    const unsigned char *p=(const unsigned char*)label;
+    unsigned h = seed;
+
+    while ( *p )
+    {
+        h ^= (*p++ | 0x20);     /* letters only matter here, names are verified anyway */
+        h *= 16777619U;
+    }
+
+    return h & (REQ_HDR_HASH_SIZE-1);
+}
+
+
+/* --------------------------------------------------------------------------
+   Build collision-free M_req_hdr_hash
+   Try seeds until every known name gets its own slot
+-------------------------------------------------------------------------- */
+static void req_hdr_hash_build()
+{
+    int i;
+    unsigned slot;
+
+    for ( ;; ++M_req_hdr_seed )
+    {
+        memset(M_req_hdr_hash, 0, sizeof(M_req_hdr_hash));
+
+        for ( i=1; i<REQ_HDR_CNT; ++i )
+        {
+            slot = req_hdr_hash_val(M_req_hdr_seed, M_req_hdr_names[i]);
+
+            if ( M_req_hdr_hash[slot] ) break;     /* collision */
+
+            M_req_hdr_hash[slot] = i;
+        }
+
+        if ( i == REQ_HDR_CNT ) break;
+    }
+
+    DBG("req_hdr_hash_build seed = %u", M_req_hdr_seed);
+}
+
+
+/* --------------------------------------------------------------------------
+   Map request header field name to REQ_HDR_*
+-------------------------------------------------------------------------- */
+static int req_hdr(const char *label)
+{
+    int id = M_req_hdr_hash[req_hdr_hash_val(M_req_hdr_seed, label)];
+
+    if ( id )
+    {
+        const char *n = M_req_hdr_names[id];
+
+        while ( *label && toupper(*label) == *n )
+        {
+            ++label;
+            ++n;
+        }
+
+        if ( *label == EOS && *n == EOS )
+            return id;
+    }
+
+    return REQ_HDR_UNKNOWN;
+}
+
+
+/* --------------------------------------------------------------------------
+   Parse HTTP request
+   Return HTTP status code
+-------------------------------------------------------------------------- */
+static int parse_req(int ci, int len)
+{
+    int  ret=200;
+
+    /* --------------------------------------------
+
+    Shortest valid request:
+
+    GET / HTTP/1.1      15 including \n +
+    Host: 1.1.1.1       14 including \n = 29
+
+    -------------------------------------------- */
+
+    DBG("ci=%d, parse_req", ci);
+
+    G_connections[ci].req = ++G_cnts_today.req;    /* for reporting processing time at the end */
+
+    DBG("\n--------------------------------------------------\n %s  Request %u\n--------------------------------------------------\n", DT_NOW_GMT, G_connections[ci].req);
+
+    if ( len < 14 )  /* ignore any junk */
+    {
+        DDBG("ci=%d, incoming data [%s]", ci, G_connections[ci].cold->in);
+        DBG("request len < 14, ignoring");
+        return 400;   /* Bad Request */
+    }
+
+    /* look for end of header */
+
+    char *p_hend = find_hend(G_connections[ci].cold->in, len);
+
+    if ( !p_hend )
+    {
+        if ( 0 == strncmp(G_connections[ci].cold->in, "GET / HTTP/1.", 13) )   /* temporary solution for good looking partial requests */
+        {
+            strcat(G_connections[ci].cold->in, "\n");  /* for values reading algorithm */
+            p_hend = G_connections[ci].cold->in + len;
+        }
+        else
+        {
+            DBG("Request syntax error, ignoring");
+
+            /* don't confuse log */
+
+            G_connections[ci].method[0] = EOS;
+            G_connections[ci].cold->uri[0] = EOS;
+            strcpy(G_connections[ci].http_ver, "?");
+            G_connections[ci].cold->referer[0] = EOS;
+            G_connections[ci].cold->uagent[0] = EOS;
+
+            return 400;  /* Bad Request */
+        }
+    }
+
+    int hlen = p_hend - G_connections[ci].cold->in;    /* HTTP header length including first of the last new line characters to simplify parsing below */
+
+    DDBG("hlen = %d", hlen);
+
+    npp_log_long(G_connections[ci].cold->in, hlen, "Incoming buffer");     /* NPP_IN_BUFSIZE > NPP_MAX_LOG_STR_LEN! */
+
+    ++hlen;     /* HTTP header length including first of the last new line characters to simplify parsing below */
+
+    /* parse the header -------------------------------------------------------------------------- */
+
+    int i;
+
+    /* the first line is special -- consists of more than one token */
+    /* the very first token is a request method */
+
+    const char *p_sp = (const char*)memchr(G_connections[ci].cold->in, ' ', (hlen < NPP_METHOD_LEN+1 ? hlen : NPP_METHOD_LEN+1));
+
+    if ( !p_sp )
+    {
+        WAR("Method too long, ignoring");
+
+        /* don't confuse log */
+
+        G_connections[ci].method[0] = EOS;
+        G_connections[ci].cold->uri[0] = EOS;
+        strcpy(G_connections[ci].http_ver, "?");
+        G_connections[ci].cold->referer[0] = EOS;
+        G_connections[ci].cold->uagent[0] = EOS;
+
+        return 400;  /* Bad Request */
+    }
+
+    i = p_sp - G_connections[ci].cold->in;
+
+    memcpy(G_connections[ci].method, G_connections[ci].cold->in, i);
+    G_connections[ci].method[i] = EOS;
+
+    /* check against the list of allowed methods */
+
+    if ( 0==strcmp(G_connections[ci].method, "GET") )
+    {
+        G_connections[ci].in_ctype = NPP_CONTENT_TYPE_URLENCODED;
+    }
+    else if ( 0==strcmp(G_connections[ci].method, "POST") || 0==strcmp(G_connections[ci].method, "PUT") || 0==strcmp(G_connections[ci].method, "DELETE") )
+    {
+        G_conn_hot[ci].flags |= NPP_CONN_FLAG_PAYLOAD;
+    }
+    else if ( 0==strcmp(G_connections[ci].method, "OPTIONS") )
+    {
+        /* just go ahead */
+    }
+    else if ( 0==strcmp(G_connections[ci].method, "HEAD") )
+    {
+        /* just go ahead */
+    }
+    else
+    {
+        WAR("Method [%s] not allowed, ignoring", G_connections[ci].method);
+
+        /* don't confuse log */
+
+        G_connections[ci].cold->uri[0] = EOS;
+        strcpy(G_connections[ci].http_ver, "?");
+        G_connections[ci].cold->referer[0] = EOS;
+        G_connections[ci].cold->uagent[0] = EOS;
+
+        return 405;
+    }
+
+    /* only for low-level tests ------------------------------------- */
+//  DBG("method: [%s]", G_connections[ci].method);
+    /* -------------------------------------------------------------- */
+
+    i += 2;     /* skip " /" */
+    int j=0;
+
+    if ( i < hlen )     /* URI */
+    {
+        p_sp = (const char*)memchr(G_connections[ci].cold->in+i, ' ', (hlen-i < NPP_MAX_URI_LEN+1 ? hlen-i : NPP_MAX_URI_LEN+1));
+
+        if ( !p_sp )
+        {
+            if ( hlen-i > NPP_MAX_URI_LEN )
+            {
+                WAR("URI too long, ignoring");
+
+                /* don't confuse log */
+
+                G_connections[ci].cold->uri[0] = EOS;
+                strcpy(G_connections[ci].http_ver, "?");
+                G_connections[ci].cold->referer[0] = EOS;
+                G_connections[ci].cold->uagent[0] = EOS;
+
+                return 414;  /* Request-URI Too Long */
+            }
+
+            p_sp = G_connections[ci].cold->in + hlen;
+        }
+
+        j = p_sp - (G_connections[ci].cold->in+i);
+        memcpy(G_connections[ci].cold->uri, G_connections[ci].cold->in+i, j);
+        i += j;
+    }
+
+    G_connections[ci].cold->uri[j] = EOS;
+
+    /* strip the trailing slash off */
+
+    if ( j && G_connections[ci].cold->uri[j-1] == '/' )
+    {
+        G_connections[ci].cold->uri[j-1] = EOS;
+    }
+
+#ifdef NPP_ROOT_URI
+    /*
+       If i.e. NPP_ROOT_URI: "app"
+       then with URL: example.com/app/something
+       we want G_connections[ci].cold->uri to be "something"
+
+       Initial G_connections[ci].cold->uri: app/something
+       root_uri_len = 3
+    */
+    int root_uri_len = strlen(NPP_ROOT_URI);
+    if ( 0==strncmp(G_connections[ci].cold->uri, NPP_ROOT_URI, root_uri_len) )
+    {
+        char tmp[NPP_MAX_URI_LEN+1];
+        strcpy(tmp, G_connections[ci].cold->uri+root_uri_len+1);
+
+        DDBG("tmp: [%s]", tmp);
+
+        strcpy(G_connections[ci].cold->uri, tmp);
+    }
+#endif  /* NPP_ROOT_URI */
+
+    DDBG("URI: [%s]", G_connections[ci].cold->uri);
+
+    i += 6;   /* skip the space and HTTP/ */
+
+    j = 0;
+    while ( i < hlen && G_connections[ci].cold->in[i] != '\r' && G_connections[ci].cold->in[i] != '\n' )
+    {
+        if ( j < 3 )
+            G_connections[ci].http_ver[j++] = G_connections[ci].cold->in[i];
+        ++i;
+    }
+    G_connections[ci].http_ver[j] = EOS;
+
+    DDBG("http_ver [%s]", G_connections[ci].http_ver);
+
+    /* HTTP/1.1 connections are persistent unless told otherwise */
+
+    if ( ci < G_maxConnections && 0==strcmp(G_connections[ci].http_ver, "1.1") )
+        G_conn_hot[ci].flags |= NPP_CONN_FLAG_KEEP_ALIVE;
+
+    /* -------------------------------------------------------------- */
+    /* parse the rest of the header */
+
+    char label[NPP_MAX_LABEL_LEN+1];
+    char value[NPP_MAX_VALUE_LEN+1];
+    const char *p_end = G_connections[ci].cold->in + hlen;
+    const char *p_line = find_lf(G_connections[ci].cold->in+i, p_end);
+    const char *p_eol, *p_colon, *p_lab, *p_val, *p_vend;
+    int  llen, vlen;
+
+    while ( p_line && ++p_line < p_end )   /* next lines */
+    {
+        if ( !(p_eol=find_lf(p_line, p_end)) )
+            p_eol = p_end;      /* the last one ends with the first of the terminating new line characters */
+
+        p_vend = p_eol;
+
+        if ( p_vend > p_line && *(p_vend-1) == '\r' )
+            --p_vend;
+
+        if ( (p_colon=(const char*)memchr(p_line, ':', p_vend-p_line)) != NULL )
+        {
+            /* label */
+
+            p_lab = p_line;
+
+            while ( p_lab < p_colon && (*p_lab == ' ' || *p_lab == '\t') ) ++p_lab;
+
+            llen = p_colon - p_lab;
+
+            while ( llen && (p_lab[llen-1] == ' ' || p_lab[llen-1] == '\t') ) --llen;
+
+            if ( llen > NPP_MAX_LABEL_LEN )
+            {
+                COPY(label, p_lab, NPP_MAX_LABEL_LEN);
+                WAR("Label [%s] too long, ignoring", label);
+
+                /* don't confuse log */
+
+                G_connections[ci].cold->referer[0] = EOS;
+                G_connections[ci].cold->uagent[0] = EOS;
+
+                return 400;  /* Bad Request */
+            }
+
+            memcpy(label, p_lab, llen);
+            label[llen] = EOS;
+
+            /* value */
+
+            p_val = p_colon + 1;
+
+            while ( p_val < p_vend && (*p_val == ' ' || *p_val == '\t') ) ++p_val;
+
+            vlen = p_vend - p_val;
+
+            while ( vlen && (p_val[vlen-1] == ' ' || p_val[vlen-1] == '\t') ) --vlen;
+
+            if ( vlen == 0 )
+            {
+                WAR("Value of %s is empty!", label);
+            }
+            else
+            {
+                if ( vlen > NPP_MAX_VALUE_LEN-1 )   /* truncate here */
+                {
+                    DBG("Truncating %s's value", label);
+                    vlen = NPP_MAX_VALUE_LEN-1;
+                }
+
+                memcpy(value, p_val, vlen);
+                value[vlen] = EOS;
+
+                if ( (ret=set_http_req_val(ci, label, value)) > 200 ) return ret;
+            }
+        }
+
+        p_line = (p_eol < p_end) ? p_eol : NULL;
+    }
+
+    /* -------------------------------------------------------------- */
+    /* -------------------------------------------------------------- */
+    /* The request headers have been read at this point */
+
+    /* -------------------------------------------------------------- */
+    /* anything past the header and its content is the next pipelined request */
+
+    char *p_body = p_hend + (0==strncmp(p_hend, "\r\n\r\n", 4) ? 4 : 2);
+    int  rest = G_connections[ci].cold->in+len - p_body;
+    int  body_len = NPP_CONN_IS_PAYLOAD(G_conn_hot[ci].flags) ? G_connections[ci].clen : 0;
+
+    if ( rest > body_len )
+    {
+        G_connections[ci].pipe_off = p_body - G_connections[ci].cold->in + body_len;
+        G_connections[ci].pipe_len = rest - body_len;
+        DBG("ci=%d, %u bytes pipelined", ci, G_connections[ci].pipe_len);
+    }
+
+    /* -------------------------------------------------------------- */
+    /* HTTP/2 requires HTTP2-settings to be present */
+
+#ifdef NPP_HTTP2
+
+//    if ( G_connections[ci].status == 101 && !G_connections[ci].http2_settings[0] )
+//        return 400;     /* Bad request */
+
+#endif  /* NPP_HTTP2 */
+
+    /* -------------------------------------------------------------- */
+    /* determine which host has been requested */
+
+#ifdef NPP_MULTI_HOST
+
+    G_connections[ci].host_id = find_host_id(G_connections[ci].host_normalized);
+
+    DBG("host_id = %d", G_connections[ci].host_id);
+
+    G_connections[ci].required_auth_level = G_hosts[G_connections[ci].host_id].required_auth_level;
+
+    DBG("required_auth_level = %d", G_connections[ci].required_auth_level);
+
+#endif  /* NPP_MULTI_HOST */
+
+    /* Serve index if present --------------------------------------- */
+
+#ifndef NPP_DONT_LOOK_FOR_INDEX
+
+    if ( G_connections[ci].cold->uri[0]==EOS && REQ_GET )
+    {
+        DBG("M_index_present = %d", M_index_present);
+
+#ifdef NPP_MULTI_HOST
+        if ( (G_connections[ci].host_id==0 && M_index_present!=-1) || G_hosts[G_connections[ci].host_id].index_present != -1 )
+#else
+        if ( M_index_present != -1 )
+#endif
+        {
+            INF("Serving index.html");
+            strcpy(G_connections[ci].cold->uri, "index.html");
+        }
+    }
+
+#endif  /* NPP_DONT_LOOK_FOR_INDEX */
+
+    /* split URI and resource / id --------------------------------------- */
+
+    if ( G_connections[ci].cold->uri[0] )  /* if not empty */
+    {
+        /* cut the query string off */
+
+        char uri[NPP_MAX_URI_LEN+1];
+        int  uri_i=0;
+        while ( G_connections[ci].cold->uri[uri_i] != EOS && G_connections[ci].cold->uri[uri_i] != '?' )
+        {
+            uri[uri_i] = G_connections[ci].cold->uri[uri_i];
+            ++uri_i;
+        }
+
+        uri[uri_i] = EOS;
+
+        DBG("uri w/o qs [%s]", uri);
+
+        /* -------------------------------------------------------------- */
+        /* tokenize */
+
+        const char slash[]="/";
+        char *token;
+
+        token = strtok(uri, slash);
+
+        /* resource (REQ0) */
+
+        if ( token )
+            COPY(G_connections[ci].resource, token, NPP_MAX_RESOURCE_LEN);
+        else
+            COPY(G_connections[ci].resource, uri, NPP_MAX_RESOURCE_LEN);
+
+#if NPP_RESOURCE_LEVELS > 1
+        /* REQ1 */
+
+        if ( token && (token=strtok(NULL, slash)) )
+        {
+            COPY(G_connections[ci].req1, token, NPP_MAX_RESOURCE_LEN);
+
+#if NPP_RESOURCE_LEVELS > 2
+            /* REQ2 */
+
+            if ( (token=strtok(NULL, slash)) )
+            {
+                COPY(G_connections[ci].req2, token, NPP_MAX_RESOURCE_LEN);
+
+#if NPP_RESOURCE_LEVELS > 3
+                /* REQ3 */
+
+                if ( (token=strtok(NULL, slash)) )
+                {
+                    COPY(G_connections[ci].req3, token, NPP_MAX_RESOURCE_LEN);
+
+#if NPP_RESOURCE_LEVELS > 4
+                    /* REQ4 */
+
+                    if ( (token=strtok(NULL, slash)) )
+                    {
+                        COPY(G_connections[ci].req4, token, NPP_MAX_RESOURCE_LEN);
+
+#if NPP_RESOURCE_LEVELS > 5
+                        /* REQ5 */
+
+                        if ( (token=strtok(NULL, slash)) )
+                        {
+                            COPY(G_connections[ci].req5, token, NPP_MAX_RESOURCE_LEN);
+                        }
+#endif  /* NPP_RESOURCE_LEVELS > 5 */
+                    }
+#endif  /* NPP_RESOURCE_LEVELS > 4 */
+                }
+#endif  /* NPP_RESOURCE_LEVELS > 3 */
+            }
+#endif  /* NPP_RESOURCE_LEVELS > 2 */
+        }
+#endif  /* NPP_RESOURCE_LEVELS > 1 */
+
+        /* -------------------------------------------------------------- */
+        /* REQ_ID for RESTful stuff */
+
+        char *last_slash = strrchr(G_connections[ci].cold->uri, '/');
+
+        if ( last_slash )
+        {
+            ++last_slash;   /* skip '/' */
+
+            uri_i = 0;
+
+            while ( *last_slash && *last_slash != '?' && uri_i < NPP_MAX_RESOURCE_LEN-1 )
+                G_connections[ci].id[uri_i++] = *last_slash++;
+
+            G_connections[ci].id[uri_i] = EOS;
+        }
+
+        /* -------------------------------------------------------------- */
+
+#ifdef NPP_DEBUG
+        DBG("REQ0 [%s]", G_connections[ci].resource);
+#if NPP_RESOURCE_LEVELS > 1
+        DBG("REQ1 [%s]", G_connections[ci].req1);
+#if NPP_RESOURCE_LEVELS > 2
+        DBG("REQ2 [%s]", G_connections[ci].req2);
+#if NPP_RESOURCE_LEVELS > 3
+        DBG("REQ3 [%s]", G_connections[ci].req3);
+#if NPP_RESOURCE_LEVELS > 4
+        DBG("REQ4 [%s]", G_connections[ci].req4);
+#if NPP_RESOURCE_LEVELS > 5
+        DBG("REQ5 [%s]", G_connections[ci].req5);
+#endif  /* NPP_RESOURCE_LEVELS > 5 */
+#endif  /* NPP_RESOURCE_LEVELS > 4 */
+#endif  /* NPP_RESOURCE_LEVELS > 3 */
+#endif  /* NPP_RESOURCE_LEVELS > 2 */
+#endif  /* NPP_RESOURCE_LEVELS > 1 */
+        DBG("REQ_ID [%s]", G_connections[ci].id);
+#endif
+        /* -------------------------------------------------------------- */
+
+        G_connections[ci].static_res = is_static_res(ci);    /* statics --> set the flag!!! */
+        /* now, it may have set G_connections[ci].status to 304 */
+
+        if ( G_connections[ci].static_res != NPP_NOT_STATIC )
+            ++M_statics[G_connections[ci].static_res].conns;    /* until reset_conn() */
+
+#ifdef _WIN32   /* no writev, send it as one piece */
+        if ( G_connections[ci].static_res != NPP_NOT_STATIC )    /* static resource */
+            G_connections[ci].out_data = M_statics[G_connections[ci].static_res].data;
+#endif
+    }
+
+    /* -------------------------------------------------------------- */
+    /* get the required authorization level for this resource */
+
+    if ( G_connections[ci].static_res == NPP_NOT_STATIC )
+    {
+        G_connections[ci].required_auth_level = find_auth_level(ci);
+
+        DDBG("Required authorization level = %d", M_auth_levels[i].level);
+    }
+    else    /* don't do any checks for static resources */
+    {
+        G_connections[ci].required_auth_level = AUTH_LEVEL_NONE;
+    }
+
+    DBG("bot = %s", REQ_BOT?"TRUE":"FALSE");
+
+    /* update request counters -------------------------------------------------- */
+
+    if ( REQ_BOT )
+        ++G_cnts_today.req_bot;
+
+    if ( G_connections[ci].ua_type == NPP_UA_TYPE_MOB )
+        ++G_cnts_today.req_mob;
+    else if ( G_connections[ci].ua_type == NPP_UA_TYPE_TAB )
+        ++G_cnts_today.req_tab;
+    else    /* desktop */
+        ++G_cnts_today.req_dsk;
+
+    /* Block IP? ---------------------------------------------------------------- */
+
+#ifdef NPP_BLACKLIST_AUTO_UPDATE
+        if ( check_block_ip(ci, "Resource", G_connections[ci].resource) )
+            return 404;     /* Forbidden */
+#endif
+
+    /* Redirections table ------------------------------------------------------- */
+    /* (Note this is ignored when G_test=1)
+       "domain" means NPP_APP_DOMAIN
+
+    Test Cases (for HTTPS enabled)
+
+    +-----------------+------+----------------------------+--------------------------+
+    | NPP_DOMAIN_ONLY | HSTS | request                    | result                   |
+    +                 +      +------------------+---------+--------+-----------------+
+    |                 |      | url              | U2HTTPS | status | location        |
+    +-----------------+------+------------------+---------+--------+-----------------+
+    | F               | F    | http://domain    | F       | 200    |                 |
+    +-----------------+------+------------------+---------+--------+-----------------+
+    | F               | F    | http://domain    | T       | 301    | https://domain  |
+    +-----------------+------+------------------+---------+--------+-----------------+
+    | F               | F    | http://1.2.3.4   | F       | 200    |                 |
+    +-----------------+------+------------------+---------+--------+-----------------+
+    | F               | F    | http://1.2.3.4   | T       | 301    | https://1.2.3.4 |
+    +-----------------+------+------------------+---------+--------+-----------------+
+    | F               | F    | https://domain   | F       | 200    |                 |
+    +-----------------+------+------------------+---------+--------+-----------------+
+    | F               | F    | https://domain   | T       | 200    |                 |
+    +-----------------+------+------------------+---------+--------+-----------------+
+    | F               | F    | https://1.2.3.4  | F       | 200    |                 |
+    +-----------------+------+------------------+---------+--------+-----------------+
+    | F               | F    | https://1.2.3.4  | T       | 200    |                 |
+    +-----------------+------+------------------+---------+--------+-----------------+
+    | F               | T    | http://domain    | F       | 301    | https://domain  |
+    +-----------------+------+------------------+---------+--------+-----------------+
+    | F               | T    | http://domain    | T       | 301    | https://domain  |
+    +-----------------+------+------------------+---------+--------+-----------------+
+    | F               | T    | http://1.2.3.4   | F       | 200    | https://1.2.3.4 |
+    +-----------------+------+------------------+---------+--------+-----------------+
+    | F               | T    | http://1.2.3.4   | T       | 200    | https://1.2.3.4 |
+    +-----------------+------+------------------+---------+--------+-----------------+
+    | F               | T    | https://domain   | F       | 200    |                 |
+    +-----------------+------+------------------+---------+--------+-----------------+
+    | F               | T    | https://domain   | T       | 200    |                 |
+    +-----------------+------+------------------+---------+--------+-----------------+
+    | F               | T    | https://1.2.3.4  | F       | 200    |                 |
+    +-----------------+------+------------------+---------+--------+-----------------+
+    | F               | T    | https://1.2.3.4  | T       | 200    |                 |
+    +-----------------+------+------------------+---------+--------+-----------------+
+
+    (NPP_DOMAIN_ONLY enabled)
+
+    +-----------------+------+------------------+---------+--------+-----------------+
+    | T               | F    | http://domain    | F       | 200    |                 |
+    +-----------------+------+------------------+---------+--------+-----------------+
+    | T               | F    | http://domain    | T       | 301    | https://domain  |
+    +-----------------+------+------------------+---------+--------+-----------------+
+    | T               | F    | http://1.2.3.4   | F       | 301    | http://domain   |
+    +-----------------+------+------------------+---------+--------+-----------------+
+    | T               | F    | http://1.2.3.4   | T       | 301    | https://domain  |
+    +-----------------+------+------------------+---------+--------+-----------------+
+    | T               | F    | https://domain   | F       | 200    |                 |
+    +-----------------+------+------------------+---------+--------+-----------------+
+    | T               | F    | https://domain   | T       | 200    |                 |
+    +-----------------+------+------------------+---------+--------+-----------------+
+    | T               | F    | https://1.2.3.4  | F       | 301    | http://domain   |
+    +-----------------+------+------------------+---------+--------+-----------------+
+    | T               | F    | https://1.2.3.4  | T       | 301    | https://domain  |
+    +-----------------+------+------------------+---------+--------+-----------------+
+    | T               | T    | http://domain    | F       | 301    | https://domain  |
+    +-----------------+------+------------------+---------+--------+-----------------+
+    | T               | T    | http://domain    | T       | 301    | https://domain  |
+    +-----------------+------+------------------+---------+--------+-----------------+
+    | T               | T    | http://1.2.3.4   | F       | 301    | https://domain  |
+    +-----------------+------+------------------+---------+--------+-----------------+
+    | T               | T    | http://1.2.3.4   | T       | 301    | https://domain  |
+    +-----------------+------+------------------+---------+--------+-----------------+
+    | T               | T    | https://domain   | F       | 200    |                 |
+    +-----------------+------+------------------+---------+--------+-----------------+
+    | T               | T    | https://domain   | T       | 200    |                 |
+    +-----------------+------+------------------+---------+--------+-----------------+
+    | T               | T    | https://1.2.3.4  | F       | 301    | https://domain  |
+    +-----------------+------+------------------+---------+--------+-----------------+
+    | T               | T    | https://1.2.3.4  | T       | 301    | https://domain  |
+    +-----------------+------+------------------+---------+--------+-----------------+
+    */
 
-    return 0;
-}
+#ifdef NPP_ENABLE_RELOAD_CONF
+    if ( !G_test && !NPP_VALID_RELOAD_CONF_REQUEST )   /* don't redirect if test or npp_reload_conf */
 #else
-int npp_eng_find_si(const char *sessid)
-{
-    int idx = npp_lib_find_sess_idx_idx(sessid);
-
-    if ( idx != -1 )
-        return G_sessions_idx[idx].si;
-
-    return 0;
-}
-#endif  /* NPP_MULTI_HOST */
-
+    if ( !G_test )   /* don't redirect if test */
+#endif
+    {
 
-/* --------------------------------------------------------------------------
-   Verify IP & User-Agent against sessid in G_sessions (anonymous users)
-   Return true if session exists
--------------------------------------------------------------------------- */
-static bool a_session_ok(int ci)
-{
-    DBG("a_session_ok");
+#ifdef NPP_HTTPS
 
-    if ( IS_SESSION )    /* existing connection */
-    {
-        if ( G_sessions[G_connections[ci].si].sessid[0]
-                && G_sessions[G_connections[ci].si].auth_level<AUTH_LEVEL_AUTHENTICATED
-#ifdef NPP_MULTI_HOST
-                && G_connections[ci].host_id == G_sessions[G_connections[ci].si].host_id
-#endif
-                && 0==strcmp(G_connections[ci].cookie_in_a, G_sessions[G_connections[ci].si].sessid)
-                && 0==strcmp(G_connections[ci].uagent, G_sessions[G_connections[ci].si].uagent) )
+#ifdef NPP_HSTS_ON
+        if ( !NPP_CONN_IS_SECURE(G_conn_hot[ci].flags) )
         {
-#ifdef NPP_DEBUG
-            DBG("Anonymous session found, si=%d, sessid [%s] (1)", G_connections[ci].si, G_sessions[G_connections[ci].si].sessid);
+            DDBG("Redirecting due to HSTS");
+#ifdef NPP_DOMAIN_ONLY
+            if ( G_connections[ci].cold->uri[0] )
+                RES_LOCATION("https://%s/%s", NPP_APP_DOMAIN, G_connections[ci].cold->uri);
+            else
+                RES_LOCATION("https://%s", NPP_APP_DOMAIN);
 #else
-            DBG("Anonymous session found, si=%d (1)", G_connections[ci].si);
+            if ( G_connections[ci].cold->uri[0] )
+                RES_LOCATION("https://%s/%s", G_connections[ci].host, G_connections[ci].cold->uri);
+            else
+                RES_LOCATION("https://%s", G_connections[ci].host);
 #endif
-            return TRUE;
-        }
-#ifndef NPP_MULTI_HOST
-        else    /* session was closed */
-        {
-            WAR("si > 0 and no session!");
-            G_connections[ci].si = 0;
+            return 301;
         }
-#endif
-    }
-    else    /* fresh connection */
-    {
-#ifdef NPP_MULTI_HOST
-        int si = npp_eng_find_si(G_connections[ci].host_id, G_connections[ci].cookie_in_a);
-#else
-        int si = npp_eng_find_si(G_connections[ci].cookie_in_a);
-#endif
-        DDBG("npp_eng_find_si = %d", si);
+#endif  /* NPP_HSTS_ON */
 
-        if ( si != 0 && 0==strcmp(G_connections[ci].uagent, G_sessions[si].uagent) )
+        if ( !NPP_CONN_IS_SECURE(G_conn_hot[ci].flags) && NPP_CONN_IS_UPGRADE_TO_HTTPS(G_conn_hot[ci].flags) )
         {
-#ifdef NPP_DEBUG
-            DBG("Anonymous session found, si=%d, sessid [%s] (2)", si, G_sessions[si].sessid);
+            DDBG("Redirecting due to upgrade2https");
+
+#ifdef NPP_DOMAIN_ONLY
+            if ( G_connections[ci].cold->uri[0] )
+                RES_LOCATION("https://%s/%s", NPP_APP_DOMAIN, G_connections[ci].cold->uri);
+            else
+                RES_LOCATION("https://%s", NPP_APP_DOMAIN);
 #else
-            DBG("Anonymous session found, si=%d (2)", si);
+            if ( G_connections[ci].cold->uri[0] )
+                RES_LOCATION("https://%s/%s", G_connections[ci].host, G_connections[ci].cold->uri);
+            else
+                RES_LOCATION("https://%s", G_connections[ci].host);
 #endif
-            G_connections[ci].si = si;
-            return TRUE;
+            return 301;
         }
-    }
 
-    /* not found */
-    return FALSE;
-}
+#ifdef NPP_DOMAIN_ONLY
+        if ( 0 != strcmp(G_connections[ci].host, NPP_APP_DOMAIN) )
+        {
+            DDBG("Redirecting due to NPP_DOMAIN_ONLY");
 
+            if ( G_connections[ci].cold->uri[0] )
+                RES_LOCATION("%s://%s/%s", NPP_PROTOCOL, NPP_APP_DOMAIN, G_connections[ci].cold->uri);
+            else
+                RES_LOCATION("%s://%s", NPP_PROTOCOL, NPP_APP_DOMAIN);
 
-/* --------------------------------------------------------------------------
-   Close timeouted connections
--------------------------------------------------------------------------- */
-static void close_old_conn()
-{
-    int     i;
-    time_t  last_allowed;
+            return 301;
+        }
+#endif  /* NPP_DOMAIN_ONLY */
 
-    last_allowed = G_now - NPP_CONNECTION_TIMEOUT;
+#else   /* not HTTPS */
 
-    for ( i=0; G_connections_cnt>0 && i<NPP_MAX_CONNECTIONS+1; ++i )
-    {
-        if ( G_connections[i].state != CONN_STATE_DISCONNECTED && G_connections[i].last_activity < last_allowed )
+#ifdef NPP_DOMAIN_ONLY
+        if ( 0 != strcmp(G_connections[ci].host, NPP_APP_DOMAIN) )
         {
-            DBG("Closing timeouted connection ci=%d", i);
-            close_connection(i, TRUE);
-        }
-    }
-}
+            DDBG("Redirecting due to NPP_DOMAIN_ONLY");
 
+            if ( G_connections[ci].cold->uri[0] )
+                RES_LOCATION("http://%s/%s", NPP_APP_DOMAIN, G_connections[ci].cold->uri);
+            else
+                RES_LOCATION("http://%s", NPP_APP_DOMAIN);
 
-/* --------------------------------------------------------------------------
-   Close timeouted anonymous user sessions
--------------------------------------------------------------------------- */
-static void uses_close_timeouted()
-{
-    int     i;
-    time_t  last_allowed;
+            return 301;
+        }
+#endif  /* NPP_DOMAIN_ONLY */
 
-    last_allowed = G_now - NPP_SESSION_TIMEOUT;
+#endif  /* NPP_HTTPS */
 
-    for ( i=1; G_sessions_cnt>0 && i<=NPP_MAX_SESSIONS; ++i )
-    {
-        if ( G_sessions[i].sessid[0] && G_sessions[i].auth_level<AUTH_LEVEL_AUTHENTICATED && G_sessions[i].last_activity < last_allowed )
-            close_uses(i, NPP_NOT_CONNECTED);
     }
-}
 
+    /* handle the POST content -------------------------------------------------- */
 
-/* --------------------------------------------------------------------------
-   Close anonymous user session
--------------------------------------------------------------------------- */
-static void close_uses(int si, int ci)
-{
-#ifdef NPP_DEBUG
-    DBG("Closing anonymous session, si=%d, sessid [%s]", si, G_sessions[si].sessid);
-#else
-    DBG("Closing anonymous session, si=%d", si);
-#endif
+    if ( NPP_CONN_IS_PAYLOAD(G_conn_hot[ci].flags) && G_connections[ci].clen > 0 )
+    {
+        /* len = content received with the header, the rest has been pipelined */
 
-    DBG("Calling npp_app_session_done...");
+        len = rest < body_len ? rest : body_len;
 
-    if ( ci != NPP_NOT_CONNECTED )   /* still connected */
-        npp_app_session_done(ci);
-    else    /* use special temporary G_connections slot to maintain consistency across npp_app_xxx functions */
-    {       /* that use ci for everything -- including getting the session data */
-        G_connections[NPP_CLOSING_SESSION_CI].si = si;
-        npp_app_session_done(NPP_CLOSING_SESSION_CI);
-    }
+        if ( len < 0 ) len = 0;     /* partial header */
 
-    /* update sessions index */
+        DDBG("Remaining request length (content) = %d", len);
 
-#ifdef NPP_MULTI_HOST
-    int sessions_idx_idx = npp_lib_find_sess_idx_idx(G_sessions[si].host_id, G_sessions[si].sessid);
-#else
-    int sessions_idx_idx = npp_lib_find_sess_idx_idx(G_sessions[si].sessid);
-#endif
+        /* copy so far received payload data from G_connections[ci].cold->in to G_connections[ci].in_data */
 
-    if ( sessions_idx_idx == -1 )   /* this should never happen */
-    {
-        ERR("ci=%d, si=%d, sessions_idx_idx == -1", ci, si);
-        DDBG("sessid [%s]", G_sessions[si].sessid);
-    }
-    else    /* session found in G_sessions_idx */
-    {
-#ifdef NPP_MULTI_HOST
-        G_sessions_idx[sessions_idx_idx].host_id = NPP_MAX_HOSTS;
-#endif
-        memset(G_sessions_idx[sessions_idx_idx].sessid, 'z', NPP_SESSID_LEN);
-        G_sessions_idx[sessions_idx_idx].sessid[NPP_SESSID_LEN] = EOS;
-        G_sessions_idx[sessions_idx_idx].si = 0;
+        int alloc_status = payload_alloc(ci);
 
-        qsort(G_sessions_idx, G_sessions_cnt, sizeof(G_sessions_idx[0]), npp_lib_compare_sess_idx);
-    }
+        if ( alloc_status != OK )
+        {
+            /* don't ask for the rest, nor take it for the next request */
+            G_connections[ci].expect100 = FALSE;
+            G_conn_hot[ci].flags &= ~NPP_CONN_FLAG_KEEP_ALIVE;
+            return alloc_status;
+        }
 
-    /* reset session data */
+        memcpy(G_connections[ci].in_data, p_body, len);
+        G_conn_hot[ci].was_read = len;    /* if POST then was_read applies to data section only! */
 
-    memset(&G_sessions[si], 0, sizeof(eng_session_data_t));
-    memset(&G_app_session_data[si], 0, sizeof(app_session_data_t));
+        if ( (unsigned)len < G_connections[ci].clen )      /* the whole content not received yet */
+        {                               /* this is the only case when state != received */
+            DBG("The whole content not received yet, len=%d", len);
 
-    G_sessions_cnt--;
+            DDBG("ci=%d, changing state to CONN_STATE_READING_DATA", ci);
+            G_conn_hot[ci].state = CONN_STATE_READING_DATA;
 
-    if ( ci != NPP_NOT_CONNECTED )   /* still connected */
-        G_connections[ci].si = 0;
+            return ret;
+        }
+        else    /* the whole content received with the header at once */
+        {
+            G_connections[ci].in_data[len] = EOS;
+            DBG("Payload received with header");
+        }
+    }
 
-    DBG("%d session(s) remaining", G_sessions_cnt);
-    
-    DDBG("Updating first free si...");
+    if ( G_connections[ci].status == 304 )   /* Not Modified */
+        return 304;
+    else
+        return ret;
+}
 
-    /* update M_first_free_si & M_highest_used_si */
 
-    DDBG("                   G_sessions_cnt = %d", G_sessions_cnt);
-    DDBG("M_highest_used_si before updating = %d", M_highest_used_si);
+#ifdef NPP_HTTP2
+static const uint8_t base64url_dec_table[128] =
+{
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x3E, 0xFF, 0xFF,
+    0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E,
+    0x0F, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xFF, 0xFF, 0xFF, 0xFF, 0x3F,
+    0xFF, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2A, 0x2B, 0x2C, 0x2D, 0x2E, 0x2F, 0x30, 0x31, 0x32, 0x33, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
 
-    if ( G_sessions_cnt == 0 )   /* it was the last open session */
-    {
-        DDBG("No sessions, setting M_first_free_si=1 and M_highest_used_si=0");
 
-        M_first_free_si = 1;
+/* --------------------------------------------------------------------------
+   Decode base64url encoded string
+   Return binary length
+-------------------------------------------------------------------------- */
+static int base64url_decode(unsigned char *dst, const char *src)
+{
+    uint32_t value=0;
+    int c;
+    int i;
+    int n=0;
+    unsigned char *p=dst;
 
-        if ( M_highest_used_si != 0 )
-            M_highest_used_si = 0;
-    }
-    else if ( si == M_highest_used_si ) /* closing session had the highest spot in G_sessions */
+    for ( i=0; src[i]; ++i )
     {
-        /* loop downwards to find the highest used si */
-
-        DDBG("Looping downwards starting from %d", si-1);
+        c = src[i];
 
-        int i;
-        for ( i=si-1; i>0; i-- )
+        if ( c < 128 && base64url_dec_table[c] < 64 )
         {
-            if ( G_sessions[i].sessid[0] )  /* used */
+            value = (value << 6) | base64url_dec_table[c];
+
+            if ( (i%4) == 3 )
             {
-                M_highest_used_si = i;
-                DDBG("M_highest_used_si set to %d", M_highest_used_si);
-                M_first_free_si = i+1;
-                break;
+                if (p != NULL)
+                {
+                    p[n] = (value >> 16) & 0xFF;
+                    p[n+1] = (value >> 8) & 0xFF;
+                    p[n+2] = value & 0xFF;
+                }
+
+                n += 3;
+                value = 0;
             }
         }
+        else
+        {
+            WAR("Invalid base64url character");
+            return 0;
+        }
     }
-    else    /* there are sessions with higher indexes than si */
+
+    /* treat the last block */
+
+    int len = strlen(src);
+
+    if ( (len % 4) == 2 )
     {
-        DDBG("Setting M_first_free_si to just released spot");
+        if ( p != NULL )
+            p[n] = (value >> 4) & 0xFF;
 
-        M_first_free_si = si;
+        ++n;
+    }
+    else if ( (len % 4) == 3 )
+    {
+        if ( p != NULL )
+        {
+            p[n] = (value >> 10) & 0xFF;
+            p[n+1] = (value >> 2) & 0xFF;
+        }
 
-        DDBG("M_highest_used_si stays where it was");
+        n += 2;
     }
 
-    DDBG("  M_first_free_si = %d", M_first_free_si);
-    DDBG("M_highest_used_si = %d\n", M_highest_used_si);
+    return n;
 }
+#endif  /* NPP_HTTP2 */
 
 
 /* --------------------------------------------------------------------------
-   Reset connection after processing request
+   Set request properties read from HTTP request header
+   Caller is responsible for ensuring value length > 0
+   Return HTTP status code
 -------------------------------------------------------------------------- */
-static void reset_conn(int ci, char new_state)
+static int set_http_req_val(int ci, const char *label, const char *value)
 {
-#ifdef NPP_DEBUG
-    if ( G_initialized )
-        DBG("ci=%d, reset_conn, fd=%d, new state == %s\n", ci, G_connections[ci].fd, new_state==CONN_STATE_CONNECTED?"CONN_STATE_CONNECTED":"CONN_STATE_DISCONNECTED");
-#endif
+    char uvalue[NPP_MAX_VALUE_LEN+1];
+    char *p;
+    int  i;
+#ifdef NPP_HTTP2
+    unsigned char http2_settings[4096];
+#endif  /* NPP_HTTP2 */
 
-    G_connections[ci].state = new_state;
+    /* only for low-level tests ------------------------------------- */
+//  DBG("label: [%s], value: [%s]", label, value);
+    /* -------------------------------------------------------------- */
 
-    G_connections[ci].status = 200;
-    G_connections[ci].method[0] = EOS;
+    int hdr = req_hdr(label);
 
-    if ( G_connections[ci].in_data )
+    if ( hdr == REQ_HDR_HOST )
     {
-        free(G_connections[ci].in_data);
-        G_connections[ci].in_data = NULL;
-    }
-
-    G_connections[ci].was_read = 0;
-    G_connections[ci].resource[0] = EOS;
-#if NPP_RESOURCE_LEVELS > 1
-    G_connections[ci].req1[0] = EOS;
-#if NPP_RESOURCE_LEVELS > 2
-    G_connections[ci].req2[0] = EOS;
-#if NPP_RESOURCE_LEVELS > 3
-    G_connections[ci].req3[0] = EOS;
-#if NPP_RESOURCE_LEVELS > 4
-    G_connections[ci].req4[0] = EOS;
-#if NPP_RESOURCE_LEVELS > 5
-    G_connections[ci].req5[0] = EOS;
-#endif  /* NPP_RESOURCE_LEVELS > 5 */
-#endif  /* NPP_RESOURCE_LEVELS > 4 */
-#endif  /* NPP_RESOURCE_LEVELS > 3 */
-#endif  /* NPP_RESOURCE_LEVELS > 2 */
-#endif  /* NPP_RESOURCE_LEVELS > 1 */
-    G_connections[ci].id[0] = EOS;
-#ifdef NPP_HTTP2
-//    G_connections[ci].http2_settings[0] = EOS;
-#endif  /* NPP_HTTP2 */
-    G_connections[ci].uagent[0] = EOS;
-    G_connections[ci].ua_type = NPP_UA_TYPE_DSK;
-    G_connections[ci].referer[0] = EOS;
-    G_connections[ci].clen = 0;
-    G_connections[ci].in_cookie[0] = EOS;
-    G_connections[ci].cookie_in_a[0] = EOS;
-    G_connections[ci].cookie_in_l[0] = EOS;
-    G_connections[ci].host[0] = EOS;
-    strcpy(G_connections[ci].app_name, NPP_APP_NAME);
-    G_connections[ci].lang[0] = EOS;
-    G_connections[ci].formats = (char)0;
-    G_connections[ci].if_mod_since = 0;
-    G_connections[ci].in_ctypestr[0] = EOS;
-    G_connections[ci].in_ctype = NPP_CONTENT_TYPE_UNSET;
-    G_connections[ci].boundary[0] = EOS;
-    G_connections[ci].authorization[0] = EOS;
-    G_connections[ci].required_auth_level = NPP_REQUIRED_AUTH_LEVEL;
+#ifdef NPP_BLACKLIST_AUTO_UPDATE
+#ifdef NPP_ENABLE_RELOAD_CONF
+        if ( !NPP_VALID_RELOAD_CONF_REQUEST && check_block_ip(ci, "Host", value) )
+#else
+        if ( check_block_ip(ci, "Host", value) )
+#endif
+            return 404;     /* Forbidden */
+#endif  /* NPP_BLACKLIST_AUTO_UPDATE */
+        COPY(G_connections[ci].host, value, NPP_MAX_HOST_LEN);
 
-    /* what goes out */
+#ifdef NPP_MULTI_HOST
 
-    G_connections[ci].cust_headers[0] = EOS;
-    G_connections[ci].cust_headers_len = 0;
-    G_connections[ci].data_sent = 0;
+        DDBG("Host before normalization [%s]", G_connections[ci].host);
 
-    G_connections[ci].out_data = G_connections[ci].out_data_alloc;
+        /* normalize for comparisons */
 
-    /* don't reset session id for the entire connection life */
-    /* this also means that authenticated connection stays this way until closed or logged out */
+        /* cut the port off */
 
-    if ( new_state == CONN_STATE_DISCONNECTED )
-    {
-        G_connections[ci].si = 0;
+        i = 0;
+        int dots = 0;
+        int first_dot;
 
-#ifdef NPP_HTTP2
-        G_connections[ci].http2_upgrade_in_progress = FALSE;
-        G_connections[ci].http2_last_stream_id = 1;
-#endif  /* NPP_HTTP2 */
-    }
+        while ( G_connections[ci].host[i] )
+        {
+            if ( G_connections[ci].host[i] == '.' )
+            {
+                if ( !dots )
+                    first_dot = i;
 
-    G_connections[ci].static_res = NPP_NOT_STATIC;
-    G_connections[ci].out_ctype = NPP_CONTENT_TYPE_HTML;
-    G_connections[ci].ctypestr[0] = EOS;
-    G_connections[ci].cdisp[0] = EOS;
-    G_connections[ci].modified = 0;
-    G_connections[ci].cookie_out_a[0] = EOS;
-    G_connections[ci].cookie_out_a_exp[0] = EOS;
-    G_connections[ci].cookie_out_l[0] = EOS;
-    G_connections[ci].cookie_out_l_exp[0] = EOS;
-    G_connections[ci].location[0] = EOS;
-#ifdef NPP_MULTI_HOST
-    G_connections[ci].host_normalized[0] = EOS;
-    G_connections[ci].host_id = 0;
-#endif
+                ++dots;
 
-#ifdef NPP_ASYNC
-    G_connections[ci].service[0] = EOS;
-    G_connections[ci].async_err_code = OK;
-#endif
+                G_connections[ci].host_normalized[i] = '.';
+            }
+            else if ( G_connections[ci].host[i] == ':' )
+            {
+                break;
+            }
+            else
+            {
+                G_connections[ci].host_normalized[i] = toupper(G_connections[ci].host[i]);
+            }
 
-    /* reset flags */
+            ++i;
+        }
 
-    if ( NPP_CONN_IS_SECURE(G_connections[ci].flags) )
-        G_connections[ci].flags = NPP_CONN_FLAG_SECURE;
-    else
-        G_connections[ci].flags = (char)0;
+        G_connections[ci].host_normalized[i] = EOS;
 
-    G_connections[ci].expect100 = FALSE;
+        if ( dots > 1 && !isdigit(G_connections[ci].host_normalized[i-1]) )
+        {
+            DDBG("Need to cut subdomain off [%s]", G_connections[ci].host_normalized);
 
-    /* last activity */
+            i = first_dot + 1;
+            int j=0;
 
-    if ( new_state == CONN_STATE_CONNECTED )
-    {
-#ifdef NPP_FD_MON_POLL
-        M_pollfds[G_connections[ci].pi].events = POLLIN;
-#endif
+            while ( G_connections[ci].host[i] )
+            {
+                if ( G_connections[ci].host[i] == ':' ) break;
 
-#ifdef NPP_FD_MON_EPOLL
-        struct epoll_event ev={0};
+                G_connections[ci].host_normalized[j++] = toupper(G_connections[ci].host[i]);
 
-        ev.data.fd = G_connections[ci].fd;
-        ev.events = EPOLLIN | EPOLLET;
-        epoll_ctl(M_epoll_fd, EPOLL_CTL_MOD, ev.data.fd, &ev);
-#endif
-        G_connections[ci].last_activity = G_now;
-        if ( IS_SESSION ) SESSION.last_activity = G_now;
-    }
-#ifdef NPP_FD_MON_EPOLL
-//    else
-//        G_connections[ci].epoll_out_ready = FALSE;
-#endif
+                ++i;
+            }
 
-    if ( new_state == CONN_STATE_DISCONNECTED )
-    {
-        G_connections[ci].fd = 0;
-    }
-}
+            G_connections[ci].host_normalized[j] = EOS;
+        }
 
+        DDBG("host_normalized [%s]", G_connections[ci].host_normalized);
 
+#endif  /* NPP_MULTI_HOST */
+    }
+    else if ( hdr == REQ_HDR_USER_AGENT )
+    {
 #ifdef NPP_BLACKLIST_AUTO_UPDATE
-/* --------------------------------------------------------------------------
-   Check the rules and block IP if matches
-   Return TRUE if blocked
-   It doesn't really change anything security-wise but just saves bandwidth
--------------------------------------------------------------------------- */
-static bool check_block_ip(int ci, const char *rule, const char *value)
-{
-    if ( G_test ) return FALSE;    /* don't block for tests */
+        if ( check_block_ip(ci, "User-Agent", value) )
+            return 404;     /* Forbidden */
+#endif
+        strcpy(G_connections[ci].cold->uagent, value);
+        strcpy(uvalue, npp_upper(value));
 
-    if ( (rule[0]=='H' && NPP_CONN_IS_PAYLOAD(G_connections[ci].flags) && isdigit(value[0])) /* Host */
-            || (rule[0]=='U' && 0==strcmp(value, "Mozilla/5.0 Jorgee"))     /* User-Agent */
-            || (rule[0]=='R' && 0==strcmp(value, "wp-login.php"))           /* Resource */
-            || (rule[0]=='R' && 0==strcmp(value, "wp-config.php"))          /* Resource */
-            || (rule[0]=='R' && 0==strcmp(value, "administrator"))          /* Resource */
-            || (rule[0]=='R' && 0==strncmp(value, "phpmyadmin", 10))        /* Resource */
-            || (rule[0]=='R' && 0==strncmp(value, "phpMyAdmin", 10))        /* Resource */
-            || (rule[0]=='R' && 0==strcmp(value, "java.php"))               /* Resource */
-            || (rule[0]=='R' && 0==strcmp(value, "logon.php"))              /* Resource */
-            || (rule[0]=='R' && 0==strcmp(value, "log.php"))                /* Resource */
-            || (rule[0]=='R' && 0==strcmp(value, "hell.php"))               /* Resource */
-            || (rule[0]=='R' && 0==strcmp(value, "shell.php"))              /* Resource */
-            || (rule[0]=='R' && 0==strcmp(value, "tty.php"))                /* Resource */
-            || (rule[0]=='R' && 0==strcmp(value, "cmd.php"))                /* Resource */
-            || (rule[0]=='R' && 0==strcmp(value, ".env"))                   /* Resource */
-            || (rule[0]=='R' && strstr(value, "setup.php")) )               /* Resource */
+        if ( strstr(uvalue, "IPAD") || strstr(uvalue, "TABLET") || strstr(uvalue, "KINDLE") || strstr(uvalue, "PLAYBOOK") || strstr(uvalue, "SM-T555") )
+        {
+            G_connections[ci].ua_type = NPP_UA_TYPE_TAB;
+            DBG("ua_type = NPP_UA_TYPE_TAB");
+        }
+        else if ( strstr(uvalue, "ANDROID") || strstr(uvalue, "IPHONE") || strstr(uvalue, "BLACKBERRY") || strstr(uvalue, "MOBILE") || strstr(uvalue, "SYMBIAN") )
+        {
+            G_connections[ci].ua_type = NPP_UA_TYPE_MOB;
+            DBG("ua_type = NPP_UA_TYPE_MOB");
+        }
+        else
+        {
+            DBG("ua_type = NPP_UA_TYPE_DSK");
+        }
+
+#ifndef NPP_DONT_FLAG_BOTS
+        if ( !REQ_BOT &&
+                (strstr(uvalue, "BOT")
+                || strstr(uvalue, "SCAN")
+                || strstr(uvalue, "CRAWLER")
+                || strstr(uvalue, "SPIDER")
+                || strstr(uvalue, "BAIDU")
+                || strstr(uvalue, "ZGRAB")
+                || strstr(uvalue, "DOMAINSONO")
+                || strstr(uvalue, "NETCRAFT")
+                || strstr(uvalue, "CENSYS")
+                || strstr(uvalue, "SURDOTLY")
+                || 0==strncmp(uvalue, "APPENGINE", 9)
+                || 0==strncmp(uvalue, "NETSYSTEMSRESEARCH", 18)
+                || 0==strncmp(uvalue, "CURL", 4)
+                || 0==strncmp(uvalue, "BUBING", 6)
+                || 0==strncmp(uvalue, "PYTHON-REQUESTS", 15)
+                || 0==strncmp(uvalue, "CLOUD MAPPING", 13)
+                || 0==strcmp(uvalue, "TELESPHOREO")
+                || 0==strcmp(uvalue, "MAGIC BROWSER")) )
+        {
+            G_conn_hot[ci].flags |= NPP_CONN_FLAG_BOT;
+        }
+#endif  /* NPP_DONT_FLAG_BOTS */
+    }
+    else if ( hdr == REQ_HDR_CONNECTION )
     {
-        npp_eng_block_ip(G_connections[ci].ip, TRUE);
-        G_connections[ci].flags = G_connections[ci].flags & ~NPP_CONN_FLAG_KEEP_ALIVE;    /* disconnect */
-        return TRUE;
+        if ( ci < G_maxConnections )
+        {
+            strcpy(uvalue, npp_upper(value));
+            if ( 0==strcmp(uvalue, "KEEP-ALIVE") )
+                G_conn_hot[ci].flags |= NPP_CONN_FLAG_KEEP_ALIVE;
+            else if ( 0==strcmp(uvalue, "CLOSE") )
+                G_conn_hot[ci].flags &= ~NPP_CONN_FLAG_KEEP_ALIVE;
+        }
     }
-
-    return FALSE;
-}
-#endif  /* NPP_BLACKLIST_AUTO_UPDATE */
-
-
-/* --------------------------------------------------------------------------
-   Find authorization level for the requested resource
--------------------------------------------------------------------------- */
-static char find_auth_level(int ci)
-{
-    int i;
-
-#ifdef NPP_MULTI_HOST
-
-    i = 0;
-
-    while ( M_auth_levels[i].host_id != G_connections[ci].host_id && i<M_auth_levels_cnt ) ++i;
-
-    for ( ; i<M_auth_levels_cnt; ++i )
+    else if ( hdr == REQ_HDR_COOKIE )
     {
-        if ( M_auth_levels[i].host_id != G_connections[ci].host_id )
-            break;
+        strcpy(G_connections[ci].cold->in_cookie, value);
 
-        if ( URI(M_auth_levels[i].path) && M_auth_levels[i].host_id == G_connections[ci].host_id )
-            return M_auth_levels[i].level;
-    }
+        /* parse authentication data */
 
-    return G_hosts[G_connections[ci].host_id].required_auth_level;
+        if ( strlen(value) < NPP_SESSID_LEN+3 ) return 200;   /* no valid session cookie but request still OK */
 
-#else   /* NOT NPP_MULTI_HOST */
+        /* parse cookies, set anonymous and / or logged in sessid */
 
-    for ( i=0; i<M_auth_levels_cnt; ++i )
+        if ( NULL != (p=(char*)strstr(value, "as=")) )   /* anonymous sessid present? */
+        {
+            p += 3;
+            if ( strlen(p) >= NPP_SESSID_LEN )
+            {
+                strncpy(G_connections[ci].cookie_in_a, p, NPP_SESSID_LEN);
+                G_connections[ci].cookie_in_a[NPP_SESSID_LEN] = EOS;
+            }
+        }
+        if ( NULL != (p=(char*)strstr(value, "ls=")) )   /* logged in sessid present? */
+        {
+            p += 3;
+            if ( strlen(p) >= NPP_SESSID_LEN )
+            {
+                strncpy(G_connections[ci].cookie_in_l, p, NPP_SESSID_LEN);
+                G_connections[ci].cookie_in_l[NPP_SESSID_LEN] = EOS;
+            }
+        }
+    }
+    else if ( hdr == REQ_HDR_REFERER )
     {
-        if ( URI(M_auth_levels[i].path) )
-            return M_auth_levels[i].level;
+        strcpy(G_connections[ci].cold->referer, value);
     }
+    else if ( hdr == REQ_HDR_CONTENT_TYPE )
+    {
+        strcpy(G_connections[ci].cold->in_ctypestr, value);
 
-    return NPP_REQUIRED_AUTH_LEVEL;
+        strcpy(uvalue, npp_upper(value));
 
-#endif  /* NPP_MULTI_HOST */
-}
+        int len = strlen(value);
 
+        if ( len > 15 && 0==strncmp(uvalue, "APPLICATION/JSON", 16) )
+        {
+            G_connections[ci].in_ctype = NPP_CONTENT_TYPE_JSON;
+        }
+        else if ( len > 32 && 0==strncmp(uvalue, "APPLICATION/X-WWW-FORM-URLENCODED", 33) )
+        {
+            G_connections[ci].in_ctype = NPP_CONTENT_TYPE_URLENCODED;
+        }
+        else if ( len > 18 && 0==strncmp(uvalue, "MULTIPART/FORM-DATA", 19) )
+        {
+            G_connections[ci].in_ctype = NPP_CONTENT_TYPE_MULTIPART;
 
-/* --------------------------------------------------------------------------
-   Parse HTTP request
-   Return HTTP status code
--------------------------------------------------------------------------- */
-static int parse_req(int ci, int len)
-{
-    int  ret=200;
+            if ( (p=(char*)strstr(value, "boundary=")) != NULL )
+            {
+                COPY(G_connections[ci].boundary, p+9, NPP_MAX_BOUNDARY_LEN);
+                DBG("boundary: [%s]", G_connections[ci].boundary);
+            }
+        }
+        else if ( len > 23 && 0==strncmp(uvalue, "APPLICATION/OCTET-STREAM", 24) )
+        {
+            G_connections[ci].in_ctype = NPP_CONTENT_TYPE_OCTET_STREAM;
+        }
+    }
+    else if ( hdr == REQ_HDR_AUTHORIZATION )
+    {
+        strcpy(G_connections[ci].cold->authorization, value);
+    }
+#ifndef NPP_DONT_FLAG_BOTS
+    else if ( hdr == REQ_HDR_FROM )
+    {
+        strcpy(uvalue, npp_upper(value));
+        if ( !REQ_BOT && (strstr(uvalue, "GOOGLEBOT") || strstr(uvalue, "BINGBOT") || strstr(uvalue, "YANDEX") || strstr(uvalue, "CRAWLER")) )
+            G_conn_hot[ci].flags |= NPP_CONN_FLAG_BOT;
+    }
+#endif  /* NPP_DONT_FLAG_BOTS */
+    else if ( hdr == REQ_HDR_IF_MODIFIED_SINCE )
+    {
+        G_connections[ci].if_mod_since = time_http2epoch(value);
+    }
+    else if ( hdr == REQ_HDR_IF_NONE_MATCH )
+    {
+        COPY(G_connections[ci].if_none_match, value, NPP_IF_NONE_MATCH_LEN);
+    }
+    else if ( hdr == REQ_HDR_RANGE )
+    {
+        COPY(G_connections[ci].range, value, NPP_RANGE_LEN);
+    }
+    else if ( hdr == REQ_HDR_IF_RANGE )
+    {
+        COPY(G_connections[ci].if_range, value, NPP_ETAG_LEN);
+    }
+    else if ( !NPP_CONN_IS_SECURE(G_conn_hot[ci].flags) && !G_test && hdr == REQ_HDR_UPGRADE_INSECURE_REQUESTS && 0==strcmp(value, "1") )
+    {
+        DBG("Client wants to upgrade to HTTPS");
+        G_conn_hot[ci].flags |= NPP_CONN_FLAG_UPGRADE_TO_HTTPS;
+    }
+    else if ( hdr == REQ_HDR_CONTENT_LENGTH )
+    {
+        sscanf(value, "%u", &G_connections[ci].clen);
+        if ( (!NPP_CONN_IS_PAYLOAD(G_conn_hot[ci].flags) && G_connections[ci].clen >= NPP_IN_BUFSIZE) || (NPP_CONN_IS_PAYLOAD(G_conn_hot[ci].flags) && G_connections[ci].clen >= MAX_PAYLOAD_ACCEPTED-1) )
+        {
+            ERR("Request too long, clen = %u, sending 413", G_connections[ci].clen);
+            return 413;
+        }
+        DBG("G_connections[ci].clen = %u", G_connections[ci].clen);
+    }
+    else if ( hdr == REQ_HDR_ACCEPT_ENCODING )    /* gzip, deflate, br */
+    {
+        strcpy(uvalue, npp_upper(value));
 
-    /* --------------------------------------------
+        G_connections[ci].accept_enc = accept_encodings(uvalue);
 
-    Shortest valid request:
+        if ( G_connections[ci].accept_enc & (1<<NPP_CODEC_DEFLATE) )
+        {
+            G_conn_hot[ci].flags |= NPP_CONN_FLAG_ACCEPT_DEFLATE;
+            DDBG("accept_deflate = TRUE");
+        }
+    }
+    else if ( hdr == REQ_HDR_ACCEPT_LANGUAGE )    /* en-US en-GB pl-PL */
+    {
+        i = 0;
+        while ( value[i] != EOS && value[i] != ',' && value[i] != ';' && i < NPP_LANG_LEN )
+        {
+            G_connections[ci].lang[i] = toupper(value[i]);
+            ++i;
+        }
 
-    GET / HTTP/1.1      15 including \n +
-    Host: 1.1.1.1       14 including \n = 29
+        G_connections[ci].lang[i] = EOS;
 
-    -------------------------------------------- */
+        DBG("G_connections[ci].lang: [%s]", G_connections[ci].lang);
 
-    DBG("ci=%d, parse_req", ci);
+        if ( IS_SESSION && G_connections[ci].lang[0] && strcmp(SESSION.lang, G_connections[ci].lang) != 0 )
+        {
+            DBG("Changing session language to [%s] and setting formats", G_connections[ci].lang);
 
-    G_connections[ci].req = ++G_cnts_today.req;    /* for reporting processing time at the end */
+            npp_lib_set_formats(ci, G_connections[ci].lang);
+            strcpy(SESSION.lang, G_connections[ci].lang);
+        }
 
-    DBG("\n--------------------------------------------------\n %s  Request %u\n--------------------------------------------------\n", DT_NOW_GMT, G_connections[ci].req);
+        if ( !IS_SESSION || SESSION.lang[0]==EOS )    /* session data has priority */
+        {
+            DDBG("No session or no language in session, setting formats");
 
-//  if ( G_connections[ci].state != STATE_SENDING ) /* ignore Range requests for now */
-//      G_connections[ci].state = STATE_RECEIVED;   /* by default */
+            if ( G_connections[ci].lang[0] )
+            {
+                npp_lib_set_formats(ci, G_connections[ci].lang);
+                strcpy(SESSION.lang, G_connections[ci].lang);
+            }
+        }
+    }
+    else if ( hdr == REQ_HDR_UPGRADE )
+    {
+        strcpy(uvalue, npp_upper(value));
 
-    if ( len < 14 )  /* ignore any junk */
+        if ( 0==strcmp(uvalue, "WEBSOCKET") )
+        {
+            DBG("Client wants to switch to WebSocket");
+            G_connections[ci].ws_upgrade = TRUE;
+        }
+#ifdef NPP_HTTP2
+        else if ( strcmp(value, "h2c") == 0 )
+        {
+            INF("Client wants to switch to HTTP/2 (cleartext)");
+            G_connections[ci].http2_upgrade_in_progress = TRUE;
+//            return 101;     /* Switching Protocols */
+        }
+#endif  /* NPP_HTTP2 */
+    }
+    else if ( hdr == REQ_HDR_SEC_WEBSOCKET_KEY )
     {
-        DDBG("ci=%d, incoming data [%s]", ci, G_connections[ci].in);
-        DBG("request len < 14, ignoring");
-        return 400;   /* Bad Request */
+        if ( strlen(value) == NPP_WS_KEY_LEN )
+            strcpy(G_connections[ci].ws_key, value);
     }
+    else if ( hdr == REQ_HDR_SEC_WEBSOCKET_VERSION )
+    {
+        G_connections[ci].ws_v13 = (0==strcmp(value, "13"));
+    }
+#ifdef NPP_HTTP2
+    else if ( hdr == REQ_HDR_HTTP2_SETTINGS )
+    {
+        DDBG("HTTP2-Settings received [%s]", value);
 
-    /* look for end of header */
-
-    char *p_hend = strstr(G_connections[ci].in, "\r\n\r\n");
+        int rem = base64url_decode(http2_settings, value);
+        DDBG("rem = %d", rem);
 
-    if ( !p_hend )
-    {
-        p_hend = strstr(G_connections[ci].in, "\n\n");
+        http2_SETTINGS_pld_t s;
+        p = http2_settings;
+        int read = 0;
 
-        if ( !p_hend )
+        while ( rem >= HTTP2_SETTINGS_PAIR_LEN )
         {
-            if ( 0 == strncmp(G_connections[ci].in, "GET / HTTP/1.", 13) )   /* temporary solution for good looking partial requests */
+            memcpy((char*)&s, p+read, HTTP2_SETTINGS_PAIR_LEN);
+            read += HTTP2_SETTINGS_PAIR_LEN;
+            rem -= HTTP2_SETTINGS_PAIR_LEN;
+
+            /* convert from network byte order to machine */
+
+            s.id = ntohs(s.id);
+            s.value = ntohl(s.value);
+
+            if ( s.id == HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS )
+            {
+                DBG("http2_max_streams = %u", s.value);
+                G_connections[ci].http2_max_streams = s.value;
+            }
+            else if ( s.id == HTTP2_SETTINGS_INITIAL_WINDOW_SIZE )
+            {
+                DBG("http2_wnd_size = %u", s.value);
+                G_connections[ci].http2_wnd_size = s.value;
+            }
+            else if ( s.id == HTTP2_SETTINGS_MAX_FRAME_SIZE )
             {
-                strcat(G_connections[ci].in, "\n");  /* for values reading algorithm */
-                p_hend = G_connections[ci].in + len;
+                DBG("http2_max_frame_size = %u", s.value);
+                G_connections[ci].http2_max_frame_size = s.value;
             }
             else
             {
-                DBG("Request syntax error, ignoring");
-
-                /* don't confuse log */
-
-                G_connections[ci].method[0] = EOS;
-                G_connections[ci].uri[0] = EOS;
-                strcpy(G_connections[ci].http_ver, "?");
-                G_connections[ci].referer[0] = EOS;
-                G_connections[ci].uagent[0] = EOS;
-
-                return 400;  /* Bad Request */
+                DBG("HTTP/2 settings that we ignore:");
+                DBG("id = %hd", s.id);
+                DBG("value = %u", s.value);
             }
         }
     }
+#endif  /* NPP_HTTP2 */
+    else if ( hdr == REQ_HDR_EXPECT )
+    {
+        if ( 0==strcmp(value, "100-continue") )
+            G_connections[ci].expect100 = TRUE;
+    }
+
+    return 200;
+}
+
+
+/* --------------------------------------------------------------------------
+   Dump counters
+-------------------------------------------------------------------------- */
+static void dump_counters()
+{
+    ALWAYS("");
+    ALWAYS("Counters:\n");
+    ALWAYS("            req: %u", G_cnts_today.req);
+    ALWAYS("        req_dsk: %u", G_cnts_today.req_dsk);
+    ALWAYS("        req_tab: %u", G_cnts_today.req_tab);
+    ALWAYS("        req_mob: %u", G_cnts_today.req_mob);
+    ALWAYS("        req_bot: %u", G_cnts_today.req_bot);
+    ALWAYS("         visits: %u", G_cnts_today.visits);
+    ALWAYS("     visits_dsk: %u", G_cnts_today.visits_dsk);
+    ALWAYS("     visits_tab: %u", G_cnts_today.visits_tab);
+    ALWAYS("     visits_mob: %u", G_cnts_today.visits_mob);
+    ALWAYS("        blocked: %u", G_cnts_today.blocked);
+    ALWAYS("        average: %.3lf ms", G_cnts_today.average);
+    ALWAYS("       accepted: %u", G_cnts_today.accepted);
+    ALWAYS(" accepts/wakeup: %.2lf (max %d)", G_cnts_today.accept_wakeups?(double)G_cnts_today.accepted/G_cnts_today.accept_wakeups:0.0, M_accepts_hwm);
+    if ( M_wi == 0 ) ALWAYS("ListenOverflows: %u", G_cnts_today.listen_overflows);
+    ALWAYS("     compressed: %u (skipped %u)", G_cnts_today.compressed, G_cnts_today.compress_skipped);
+    ALWAYS("compress steps : %u cheaper, %u harder (now level %d, threshold %u)", G_cnts_today.compress_cheaper, G_cnts_today.compress_harder, G_compress_level, G_compress_treshold);
+    ALWAYS("connections HWM: %d", G_connections_hwm);
+    ALWAYS("   sessions HWM: %d", G_sessions_hwm);
+    ALWAYS("");
 
-    int hlen = p_hend - G_connections[ci].in;    /* HTTP header length including first of the last new line characters to simplify parsing algorithm in the third 'for' loop below */
+    if ( G_workers > 1 && M_wi == 0 )
+    {
+        npp_counters_t total;
 
-    DDBG("hlen = %d", hlen);
+        workers_counters(&total);
 
-    npp_log_long(G_connections[ci].in, hlen, "Incoming buffer");     /* NPP_IN_BUFSIZE > NPP_MAX_LOG_STR_LEN! */
+        ALWAYS("All %d workers:\n", G_workers);
+        ALWAYS("            req: %u", total.req);
+        ALWAYS("         visits: %u", total.visits);
+        ALWAYS("        blocked: %u", total.blocked);
+        ALWAYS("        average: %.3lf ms", total.average);
+        ALWAYS("       accepted: %u", total.accepted);
+        ALWAYS("");
+    }
+}
 
-    ++hlen;     /* HTTP header length including first of the last new line characters to simplify parsing algorithm in the third 'for' loop below */
 
-    /* parse the header -------------------------------------------------------------------------- */
+/* --------------------------------------------------------------------------
+   Clean up
+-------------------------------------------------------------------------- */
+static void clean_up()
+{
+    M_shutdown = TRUE;
 
-    int i;
+    ALWAYS("");
+    ALWAYS("Cleaning up...\n");
+    npp_log_memory();
 
-    for ( i=0; i<hlen; ++i )    /* the first line is special -- consists of more than one token */
-    {                                   /* the very first token is a request method */
-        if ( isalpha(G_connections[ci].in[i]) )
-        {
-            if ( i < NPP_METHOD_LEN )
-                G_connections[ci].method[i] = G_connections[ci].in[i];
-            else
-            {
-                WAR("Method too long, ignoring");
+#ifdef __linux__
+    if ( M_workers_cnts )   /* final counters for worker 0 */
+        memcpy(&M_workers_cnts[M_wi], &G_cnts_today, sizeof(npp_counters_t));
+#endif
 
-                /* don't confuse log */
+    stop_workers();
+    dump_counters();
 
-                G_connections[ci].method[0] = EOS;
-                G_connections[ci].uri[0] = EOS;
-                strcpy(G_connections[ci].http_ver, "?");
-                G_connections[ci].referer[0] = EOS;
-                G_connections[ci].uagent[0] = EOS;
+    DBG("Calling npp_app_done...");
 
-                return 400;  /* Bad Request */
-            }
-        }
-        else    /* most likely space = end of method */
-        {
-            G_connections[ci].method[i] = EOS;
+    npp_app_done();
 
-            /* check against the list of allowed methods */
+#ifdef NPP_FD_MON_EPOLL
+    if ( M_epoll_fd )
+        close(M_epoll_fd);
+#endif
 
-            if ( 0==strcmp(G_connections[ci].method, "GET") )
-            {
-                G_connections[ci].in_ctype = NPP_CONTENT_TYPE_URLENCODED;
-            }
-            else if ( 0==strcmp(G_connections[ci].method, "POST") || 0==strcmp(G_connections[ci].method, "PUT") || 0==strcmp(G_connections[ci].method, "DELETE") )
-            {
-                G_connections[ci].flags |= NPP_CONN_FLAG_PAYLOAD;
-            }
-            else if ( 0==strcmp(G_connections[ci].method, "OPTIONS") )
-            {
-                /* just go ahead */
-            }
-            else if ( 0==strcmp(G_connections[ci].method, "HEAD") )
-            {
-                /* just go ahead */
-            }
-            else
-            {
-                WAR("Method [%s] not allowed, ignoring", G_connections[ci].method);
+#ifdef NPP_FD_MON_IO_URING
+    if ( M_uring.fd )
+        close(M_uring.fd);
+#endif
 
-                /* don't confuse log */
+    if ( M_wi == 0 && access(M_pidfile, F_OK) != -1 )
+    {
+        DBG("Removing pid file...");
+        remove(M_pidfile);
+    }
 
-                G_connections[ci].uri[0] = EOS;
-                strcpy(G_connections[ci].http_ver, "?");
-                G_connections[ci].referer[0] = EOS;
-                G_connections[ci].uagent[0] = EOS;
 
-                return 405;
-            }
+#ifdef NPP_MYSQL
 
-            break;
-        }
-    }
+#ifdef NPP_USERS
+    libusr_luses_save_csrft();
+#endif
 
-    /* only for low-level tests ------------------------------------- */
-//  DBG("method: [%s]", G_connections[ci].method);
-    /* -------------------------------------------------------------- */
+#endif  /* NPP_MYSQL */
 
-    i += 2;     /* skip " /" */
-    int j=0;
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wunused-value"
+#ifdef NPP_HTTPS
+    SSL_CTX_free(M_ssl_server_ctx);
+    EVP_cleanup();
+#endif
+
 
-    for ( i; i<hlen; ++i )   /* URI */
+#ifdef NPP_ASYNC
+    if (G_queue_req)
     {
+        mq_close(G_queue_req);
+        if ( M_wi == 0 )    /* other workers only share it */
+            mq_unlink(G_req_queue_name);
+    }
+    if (G_queue_res)
+    {
+        mq_close(G_queue_res);
+        mq_unlink(G_res_queue_name);
+    }
+#endif  /* NPP_ASYNC */
 
-#pragma GCC diagnostic pop
+#ifdef _WIN32   /* Windows */
+    if ( M_eng_WSA_initialized )
+        WSACleanup();
+#endif  /* _WIN32 */
 
-        if ( G_connections[ci].in[i] != ' ' && G_connections[ci].in[i] != '\t' )
-        {
-            if ( j < NPP_MAX_URI_LEN )
-                G_connections[ci].uri[j++] = G_connections[ci].in[i];
-            else
-            {
-                WAR("URI too long, ignoring");
+    npp_lib_done();
+}
 
-                /* don't confuse log */
 
-                G_connections[ci].uri[0] = EOS;
-                strcpy(G_connections[ci].http_ver, "?");
-                G_connections[ci].referer[0] = EOS;
-                G_connections[ci].uagent[0] = EOS;
+/* --------------------------------------------------------------------------
+   Fork worker processes (workers in npp.conf)
+   The calling process becomes worker 0
+   Each worker then opens its own listening sockets with SO_REUSEPORT,
+   its own log, async response queue, SHM segment and database connection,
+   and reseeds its random numbers
+-------------------------------------------------------------------------- */
+static bool start_workers()
+{
+#ifdef __linux__
 
-                return 414;  /* Request-URI Too Long */
-            }
-        }
-        else    /* end of URI */
-        {
-            G_connections[ci].uri[j] = EOS;
-            break;
-        }
+    if ( G_workers < 2 )
+    {
+        G_workers = 1;
+        return TRUE;
     }
 
-    /* strip the trailing slash off */
-
-    if ( j && G_connections[ci].uri[j-1] == '/' )
+    if ( G_workers > NPP_MAX_WORKERS )
     {
-        G_connections[ci].uri[j-1] = EOS;
+        WAR("workers = %d, limiting to NPP_MAX_WORKERS (%d)", G_workers, NPP_MAX_WORKERS);
+        G_workers = NPP_MAX_WORKERS;
     }
 
-#ifdef NPP_ROOT_URI
-    /*
-       If i.e. NPP_ROOT_URI: "app"
-       then with URL: example.com/app/something
-       we want G_connections[ci].uri to be "something"
+    M_workers_cnts = (npp_counters_t*)mmap(NULL, sizeof(npp_counters_t)*G_workers, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
 
-       Initial G_connections[ci].uri: app/something
-       root_uri_len = 3
-    */
-    int root_uri_len = strlen(NPP_ROOT_URI);
-    if ( 0==strncmp(G_connections[ci].uri, NPP_ROOT_URI, root_uri_len) )
+    if ( M_workers_cnts == MAP_FAILED )
     {
-        char tmp[NPP_MAX_URI_LEN+1];
-        strcpy(tmp, G_connections[ci].uri+root_uri_len+1);
-
-        DDBG("tmp: [%s]", tmp);
-
-        strcpy(G_connections[ci].uri, tmp);
+        ERR("mmap failed, errno = %d (%s)", errno, strerror(errno));
+        M_workers_cnts = NULL;
+        return FALSE;
     }
-#endif  /* NPP_ROOT_URI */
 
-    DDBG("URI: [%s]", G_connections[ci].uri);
+    memset(M_workers_cnts, 0, sizeof(npp_counters_t)*G_workers);
 
-    i += 6;   /* skip the space and HTTP/ */
+    ALWAYS("Starting %d workers...", G_workers);
 
-    j = 0;
-    while ( i < hlen && G_connections[ci].in[i] != '\r' && G_connections[ci].in[i] != '\n' )
-    {
-        if ( j < 3 )
-            G_connections[ci].http_ver[j++] = G_connections[ci].in[i];
-        ++i;
-    }
-    G_connections[ci].http_ver[j] = EOS;
+    npp_log_flush();    /* don't duplicate buffered log lines */
 
-    DDBG("http_ver [%s]", G_connections[ci].http_ver);
+#ifdef NPP_MYSQL
+    npp_close_db();     /* a connection can't be shared -- everyone opens its own after fork */
+#endif
 
-    /* -------------------------------------------------------------- */
-    /* parse the rest of the header */
+    int   wi;
+    pid_t pid;
 
-    char now_label=TRUE;
-    char now_value=FALSE;
-    char was_cr=FALSE;
-    char label[NPP_MAX_LABEL_LEN+1];
-    char value[NPP_MAX_VALUE_LEN+1];
+    for ( wi=1; wi<G_workers; ++wi )
+    {
+        if ( (pid=fork()) < 0 )
+        {
+            ERR("fork failed, errno = %d (%s)", errno, strerror(errno));
+            return FALSE;
+        }
+        else if ( pid > 0 )     /* worker 0 */
+        {
+            M_workers_pids[wi] = pid;
+            continue;
+        }
 
-    while ( i < hlen && G_connections[ci].in[i] != '\n' ) ++i;
+        /* new worker */
 
-    j = 0;
+        M_wi = wi;
+        G_pid = getpid();
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wunused-value"
+        prctl(PR_SET_PDEATHSIG, SIGTERM);   /* don't outlive worker 0 */
 
-    for ( i; i<hlen; ++i )   /* next lines */
-    {
+        /* don't generate the same session ids and tokens as the others */
 
-#pragma GCC diagnostic pop
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        srand((unsigned)G_pid * 2654435761U ^ (unsigned)ts.tv_nsec);
+        npp_lib_init_random_numbers();
 
-        if ( !now_value && (G_connections[ci].in[i] == ' ' || G_connections[ci].in[i] == '\t') )  /* omit whitespaces */
-            continue;
+        sprintf(M_log_prefix, "w%d", M_wi);
 
-        if ( G_connections[ci].in[i] == '\n' && was_cr )
-        {
-            was_cr = FALSE;
-            continue;   /* value has already been saved in a previous loop go */
-        }
+        npp_log_finish();
 
-        if ( G_connections[ci].in[i] == '\r' )
-            was_cr = TRUE;
+        if ( !npp_log_start(M_log_prefix, G_test, FALSE) )
+            return FALSE;
 
-        if ( G_connections[ci].in[i] == '\r' || G_connections[ci].in[i] == '\n' ) /* end of value. Caution: \n only if continue above is in place! */
-        {
-            if ( now_value )
-            {
-                value[j] = EOS;
-                now_value = FALSE;
-                if ( j == 0 )
-                    WAR("Value of %s is empty!", label);
-                else
-                    if ( (ret=set_http_req_val(ci, label, value+1)) > 200 ) return ret;
-            }
-            now_label = TRUE;
-            j = 0;
-        }
-        else if ( now_label && G_connections[ci].in[i] == ':' )   /* end of label, start of value */
-        {
-            label[j] = EOS;
-            now_label = FALSE;
-            now_value = TRUE;
-            j = 0;
-        }
-        else if ( now_label )   /* label */
-        {
-            if ( j < NPP_MAX_LABEL_LEN )
-                label[j++] = G_connections[ci].in[i];
-            else
-            {
-                label[j] = EOS;
-                WAR("Label [%s] too long, ignoring", label);
+        ALWAYS_T("Worker %d started, pid = %d", M_wi, G_pid);
 
-                /* don't confuse log */
+#ifdef NPP_ASYNC
+        /* responses must come back to this worker */
 
-                G_connections[ci].referer[0] = EOS;
-                G_connections[ci].uagent[0] = EOS;
+        mq_close(G_queue_res);
 
-                return 400;  /* Bad Request */
-            }
-        }
-        else if ( now_value )   /* value */
-        {
-            value[j++] = G_connections[ci].in[i];
+        sprintf(G_res_queue_name+strlen(G_res_queue_name), "_w%d", M_wi);
 
-            if ( j == NPP_MAX_VALUE_LEN )   /* truncate here */
-            {
-                DBG("Truncating %s's value", label);
-                value[j] = EOS;
+        mq_unlink(G_res_queue_name);
 
-                DDBG("value: [%s]", value);
+        struct mq_attr attr={0};
 
-                if ( (ret=set_http_req_val(ci, label, value+1)) > 200 ) return ret;
-                now_value = FALSE;
-            }
-        }
-    }
+        attr.mq_maxmsg = NPP_ASYNC_MQ_MAXMSG;
+        attr.mq_msgsize = NPP_ASYNC_RES_MSG_SIZE;
 
-    /* -------------------------------------------------------------- */
-    /* -------------------------------------------------------------- */
-    /* The request headers have been read at this point */
+        G_queue_res = mq_open(G_res_queue_name, O_RDONLY | O_CREAT | O_NONBLOCK, 0600, &attr);
 
-    /* -------------------------------------------------------------- */
-    /* HTTP/2 requires HTTP2-settings to be present */
+        if ( G_queue_res < 0 )
+        {
+            ERR("mq_open for res failed, errno = %d (%s)", errno, strerror(errno));
+            G_queue_res = 0;
+            return FALSE;
+        }
 
-#ifdef NPP_HTTP2
+        INF("mq_open of %s OK", G_res_queue_name);
+#endif  /* NPP_ASYNC */
 
-//    if ( G_connections[ci].status == 101 && !G_connections[ci].http2_settings[0] )
-//        return 400;     /* Bad request */
+        break;
+    }
 
-#endif  /* NPP_HTTP2 */
+#ifdef NPP_MYSQL
+    if ( !npp_open_db() )
+    {
+        ERR("npp_open_db failed");
+        return FALSE;
+    }
+#endif
 
-    /* -------------------------------------------------------------- */
-    /* determine which host has been requested */
+#else   /* not Linux */
 
-#ifdef NPP_MULTI_HOST
+    if ( G_workers > 1 )
+        WAR("workers > 1 requires Linux, running single process");
 
-    G_connections[ci].host_id = find_host_id(G_connections[ci].host_normalized);
+    G_workers = 1;
 
-    DBG("host_id = %d", G_connections[ci].host_id);
+#endif  /* __linux__ */
 
-    G_connections[ci].required_auth_level = G_hosts[G_connections[ci].host_id].required_auth_level;
+    return TRUE;
+}
 
-    DBG("required_auth_level = %d", G_connections[ci].required_auth_level);
 
-#endif  /* NPP_MULTI_HOST */
+/* --------------------------------------------------------------------------
+   Stop worker processes (worker 0 only)
+-------------------------------------------------------------------------- */
+static void stop_workers()
+{
+#ifdef __linux__
 
-    /* Serve index if present --------------------------------------- */
+    if ( M_wi != 0 ) return;
 
-#ifndef NPP_DONT_LOOK_FOR_INDEX
+    int wi, running=0, tries=0;
 
-    if ( G_connections[ci].uri[0]==EOS && REQ_GET )
+    for ( wi=1; wi<G_workers; ++wi )
     {
-        DBG("M_index_present = %d", M_index_present);
-
-#ifdef NPP_MULTI_HOST
-        if ( (G_connections[ci].host_id==0 && M_index_present!=-1) || G_hosts[G_connections[ci].host_id].index_present != -1 )
-#else
-        if ( M_index_present != -1 )
-#endif
-        {
-            INF("Serving index.html");
-            strcpy(G_connections[ci].uri, "index.html");
-        }
+        if ( M_workers_pids[wi] > 0 && kill(M_workers_pids[wi], SIGTERM) == 0 )
+            ++running;
     }
 
-#endif  /* NPP_DONT_LOOK_FOR_INDEX */
+    if ( !running ) return;
 
-    /* split URI and resource / id --------------------------------------- */
+    INF("Waiting for %d worker(s) to finish...", running);
 
-    if ( G_connections[ci].uri[0] )  /* if not empty */
+    while ( running && tries++ < 30 )
     {
-        /* cut the query string off */
-
-        char uri[NPP_MAX_URI_LEN+1];
-        int  uri_i=0;
-        while ( G_connections[ci].uri[uri_i] != EOS && G_connections[ci].uri[uri_i] != '?' )
+        for ( wi=1; wi<G_workers; ++wi )
         {
-            uri[uri_i] = G_connections[ci].uri[uri_i];
-            ++uri_i;
+            if ( M_workers_pids[wi] > 0 && waitpid(M_workers_pids[wi], NULL, WNOHANG) != 0 )
+            {
+                M_workers_pids[wi] = 0;
+                --running;
+            }
         }
 
-        uri[uri_i] = EOS;
-
-        DBG("uri w/o qs [%s]", uri);
-
-        /* -------------------------------------------------------------- */
-        /* tokenize */
-
-        const char slash[]="/";
-        char *token;
-
-        token = strtok(uri, slash);
+        if ( running ) msleep(100);
+    }
 
-        /* resource (REQ0) */
+    if ( running )
+        WAR("%d worker(s) still running", running);
 
-        if ( token )
-            COPY(G_connections[ci].resource, token, NPP_MAX_RESOURCE_LEN);
-        else
-            COPY(G_connections[ci].resource, uri, NPP_MAX_RESOURCE_LEN);
+#endif  /* __linux__ */
+}
 
-#if NPP_RESOURCE_LEVELS > 1
-        /* REQ1 */
 
-        if ( token && (token=strtok(NULL, slash)) )
-        {
-            COPY(G_connections[ci].req1, token, NPP_MAX_RESOURCE_LEN);
+/* --------------------------------------------------------------------------
+   Sum counters from all workers
+-------------------------------------------------------------------------- */
+static void workers_counters(npp_counters_t *total)
+{
+    memset(total, 0, sizeof(npp_counters_t));
 
-#if NPP_RESOURCE_LEVELS > 2
-            /* REQ2 */
+#ifdef __linux__
 
-            if ( (token=strtok(NULL, slash)) )
-            {
-                COPY(G_connections[ci].req2, token, NPP_MAX_RESOURCE_LEN);
+    if ( !M_workers_cnts ) return;
 
-#if NPP_RESOURCE_LEVELS > 3
-                /* REQ3 */
+    int wi;
 
-                if ( (token=strtok(NULL, slash)) )
-                {
-                    COPY(G_connections[ci].req3, token, NPP_MAX_RESOURCE_LEN);
+    for ( wi=0; wi<G_workers; ++wi )
+    {
+        total->req += M_workers_cnts[wi].req;
+        total->req_dsk += M_workers_cnts[wi].req_dsk;
+        total->req_tab += M_workers_cnts[wi].req_tab;
+        total->req_mob += M_workers_cnts[wi].req_mob;
+        total->req_bot += M_workers_cnts[wi].req_bot;
+        total->visits += M_workers_cnts[wi].visits;
+        total->visits_dsk += M_workers_cnts[wi].visits_dsk;
+        total->visits_tab += M_workers_cnts[wi].visits_tab;
+        total->visits_mob += M_workers_cnts[wi].visits_mob;
+        total->blocked += M_workers_cnts[wi].blocked;
+        total->accepted += M_workers_cnts[wi].accepted;
+        total->accept_wakeups += M_workers_cnts[wi].accept_wakeups;
+        total->compressed += M_workers_cnts[wi].compressed;
+        total->compress_skipped += M_workers_cnts[wi].compress_skipped;
+        total->compress_cheaper += M_workers_cnts[wi].compress_cheaper;
+        total->compress_harder += M_workers_cnts[wi].compress_harder;
+        total->elapsed += M_workers_cnts[wi].elapsed;
+    }
 
-#if NPP_RESOURCE_LEVELS > 4
-                    /* REQ4 */
+    if ( total->req )
+        total->average = total->elapsed / total->req;
 
-                    if ( (token=strtok(NULL, slash)) )
-                    {
-                        COPY(G_connections[ci].req4, token, NPP_MAX_RESOURCE_LEN);
+#endif  /* __linux__ */
+}
 
-#if NPP_RESOURCE_LEVELS > 5
-                        /* REQ5 */
 
-                        if ( (token=strtok(NULL, slash)) )
-                        {
-                            COPY(G_connections[ci].req5, token, NPP_MAX_RESOURCE_LEN);
-                        }
-#endif  /* NPP_RESOURCE_LEVELS > 5 */
-                    }
-#endif  /* NPP_RESOURCE_LEVELS > 4 */
-                }
-#endif  /* NPP_RESOURCE_LEVELS > 3 */
-            }
-#endif  /* NPP_RESOURCE_LEVELS > 2 */
-        }
-#endif  /* NPP_RESOURCE_LEVELS > 1 */
+#ifdef __linux__
+/* --------------------------------------------------------------------------
+   Attach classic BPF program to the SO_REUSEPORT group
+   It picks the socket by client IP address, so that the same client
+   always lands on the same worker and finds its session there
+   Sockets join the group in random order but the mapping stays stable
+-------------------------------------------------------------------------- */
+static void attach_reuseport_prog(int fd)
+{
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+
+    struct sock_filter code[] = {
+        { BPF_LD  | BPF_B   | BPF_ABS, 0, 0, (unsigned)SKF_NET_OFF },      /* A = first byte of IP header */
+        { BPF_ALU | BPF_RSH | BPF_K,   0, 0, 4 },                          /* A = IP version */
+        { BPF_JMP | BPF_JEQ | BPF_K,   0, 2, 4 },                          /* IPv4? */
+        { BPF_LD  | BPF_W   | BPF_ABS, 0, 0, (unsigned)SKF_NET_OFF+12 },   /* A = IPv4 source address */
+        { BPF_JMP | BPF_JA,            0, 0, 1 },
+        { BPF_LD  | BPF_W   | BPF_ABS, 0, 0, (unsigned)SKF_NET_OFF+20 },   /* A = last word of IPv6 source address */
+        { BPF_ALU | BPF_MOD | BPF_K,   0, 0, (unsigned)G_workers },
+        { BPF_RET | BPF_A,             0, 0, 0 }
+    };
 
-        /* -------------------------------------------------------------- */
-        /* REQ_ID for RESTful stuff */
+    struct sock_fprog prog = { sizeof(code)/sizeof(code[0]), code };
 
-        char *last_slash = strrchr(G_connections[ci].uri, '/');
+    if ( setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) != 0 )
+        WAR("SO_ATTACH_REUSEPORT_CBPF failed, errno = %d (%s), sessions may not stick to workers", errno, strerror(errno));
 
-        if ( last_slash )
-        {
-            ++last_slash;   /* skip '/' */
+#else
+    WAR("No SO_ATTACH_REUSEPORT_CBPF, sessions may not stick to workers");
+#endif  /* SO_ATTACH_REUSEPORT_CBPF */
+}
+#endif  /* __linux__ */
 
-            uri_i = 0;
 
-            while ( *last_slash && *last_slash != '?' && uri_i < NPP_MAX_RESOURCE_LEN-1 )
-                G_connections[ci].id[uri_i++] = *last_slash++;
+#ifdef NPP_FD_MON_IO_URING
+/* --------------------------------------------------------------------------
+   Give a buffer (back) to the kernel
+-------------------------------------------------------------------------- */
+static void uring_buf_put(int bid)
+{
+    struct io_uring_buf *buf = &M_uring.br[M_uring.br_tail & (NPP_URING_BUFS-1)];
 
-            G_connections[ci].id[uri_i] = EOS;
-        }
+    buf->addr = (uint64_t)(uintptr_t)(M_uring.bufs + (size_t)bid * NPP_URING_BUF_SIZE);
+    buf->len = NPP_URING_BUF_SIZE;
+    buf->bid = (unsigned short)bid;
 
-        /* -------------------------------------------------------------- */
+    __atomic_store_n(&((struct io_uring_buf_ring*)M_uring.br)->tail, ++M_uring.br_tail, __ATOMIC_RELEASE);
 
-#ifdef NPP_DEBUG
-        DBG("REQ0 [%s]", G_connections[ci].resource);
-#if NPP_RESOURCE_LEVELS > 1
-        DBG("REQ1 [%s]", G_connections[ci].req1);
-#if NPP_RESOURCE_LEVELS > 2
-        DBG("REQ2 [%s]", G_connections[ci].req2);
-#if NPP_RESOURCE_LEVELS > 3
-        DBG("REQ3 [%s]", G_connections[ci].req3);
-#if NPP_RESOURCE_LEVELS > 4
-        DBG("REQ4 [%s]", G_connections[ci].req4);
-#if NPP_RESOURCE_LEVELS > 5
-        DBG("REQ5 [%s]", G_connections[ci].req5);
-#endif  /* NPP_RESOURCE_LEVELS > 5 */
-#endif  /* NPP_RESOURCE_LEVELS > 4 */
-#endif  /* NPP_RESOURCE_LEVELS > 3 */
-#endif  /* NPP_RESOURCE_LEVELS > 2 */
-#endif  /* NPP_RESOURCE_LEVELS > 1 */
-        DBG("REQ_ID [%s]", G_connections[ci].id);
-#endif
-        /* -------------------------------------------------------------- */
+    ++M_uring.bufs_free;
+}
 
-        G_connections[ci].static_res = is_static_res(ci);    /* statics --> set the flag!!! */
-        /* now, it may have set G_connections[ci].status to 304 */
 
-        if ( G_connections[ci].static_res != NPP_NOT_STATIC )    /* static resource */
-            G_connections[ci].out_data = M_statics[G_connections[ci].static_res].data;
-    }
+/* --------------------------------------------------------------------------
+   Set up io_uring
+   Requires kernel 6.0+ (multishot accept and provided buffer rings
+   came with 5.19, multishot recv with 6.0)
+-------------------------------------------------------------------------- */
+static bool uring_init()
+{
+    struct io_uring_params params={0};
 
-    /* -------------------------------------------------------------- */
-    /* get the required authorization level for this resource */
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = NPP_URING_CQ_ENTRIES;
 
-    if ( G_connections[ci].static_res == NPP_NOT_STATIC )
-    {
-        G_connections[ci].required_auth_level = find_auth_level(ci);
+    int fd = (int)syscall(__NR_io_uring_setup, NPP_URING_ENTRIES, &params);
 
-        DDBG("Required authorization level = %d", M_auth_levels[i].level);
-    }
-    else    /* don't do any checks for static resources */
+    if ( fd < 0 )
     {
-        G_connections[ci].required_auth_level = AUTH_LEVEL_NONE;
+        WAR("io_uring_setup failed, errno = %d (%s)", errno, strerror(errno));
+        return FALSE;
     }
 
-    /* ignore Range requests for now -------------------------------------------- */
+    /* the opcodes we submit */
 
-/*  if ( G_connections[ci].state == STATE_SENDING )
-    {
-        DBG("state == STATE_SENDING, this request will be ignored");
-        return 200;
-    } */
+    static const int ops[]={IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL, IORING_OP_ACCEPT, IORING_OP_RECV};
 
-    DBG("bot = %s", REQ_BOT?"TRUE":"FALSE");
+    struct io_uring_probe *probe = (struct io_uring_probe*)calloc(1, sizeof(struct io_uring_probe) + 256*sizeof(struct io_uring_probe_op));
 
-    /* update request counters -------------------------------------------------- */
+    if ( !probe )
+    {
+        close(fd);
+        return FALSE;
+    }
 
-    if ( REQ_BOT )
-        ++G_cnts_today.req_bot;
+    bool supported = ((int)syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0
+                        && (params.features & IORING_FEAT_EXT_ARG));
 
-    if ( G_connections[ci].ua_type == NPP_UA_TYPE_MOB )
-        ++G_cnts_today.req_mob;
-    else if ( G_connections[ci].ua_type == NPP_UA_TYPE_TAB )
-        ++G_cnts_today.req_tab;
-    else    /* desktop */
-        ++G_cnts_today.req_dsk;
+    int i;
 
-    /* Block IP? ---------------------------------------------------------------- */
+    for ( i=0; supported && i<(int)(sizeof(ops)/sizeof(ops[0])); ++i )
+    {
+        if ( ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED) )
+        {
+            WAR("io_uring opcode %d not supported", ops[i]);
+            supported = FALSE;
+        }
+    }
 
-#ifdef NPP_BLACKLIST_AUTO_UPDATE
-        if ( check_block_ip(ci, "Resource", G_connections[ci].resource) )
-            return 404;     /* Forbidden */
-#endif
+    free(probe);
 
-    /* Redirections table ------------------------------------------------------- */
-    /* (Note this is ignored when G_test=1)
-       "domain" means NPP_APP_DOMAIN
+    /* multishot flags of accept and recv can't be probed, only the release tells */
 
-    Test Cases (for HTTPS enabled)
+    if ( supported )
+    {
+        struct utsname un;
+        int major=0;
 
-    +-----------------+------+----------------------------+--------------------------+
-    | NPP_DOMAIN_ONLY | HSTS | request                    | result                   |
-    +                 +      +------------------+---------+--------+-----------------+
-    |                 |      | url              | U2HTTPS | status | location        |
-    +-----------------+------+------------------+---------+--------+-----------------+
-    | F               | F    | http://domain    | F       | 200    |                 |
-    +-----------------+------+------------------+---------+--------+-----------------+
-    | F               | F    | http://domain    | T       | 301    | https://domain  |
-    +-----------------+------+------------------+---------+--------+-----------------+
-    | F               | F    | http://1.2.3.4   | F       | 200    |                 |
-    +-----------------+------+------------------+---------+--------+-----------------+
-    | F               | F    | http://1.2.3.4   | T       | 301    | https://1.2.3.4 |
-    +-----------------+------+------------------+---------+--------+-----------------+
-    | F               | F    | https://domain   | F       | 200    |                 |
-    +-----------------+------+------------------+---------+--------+-----------------+
-    | F               | F    | https://domain   | T       | 200    |                 |
-    +-----------------+------+------------------+---------+--------+-----------------+
-    | F               | F    | https://1.2.3.4  | F       | 200    |                 |
-    +-----------------+------+------------------+---------+--------+-----------------+
-    | F               | F    | https://1.2.3.4  | T       | 200    |                 |
-    +-----------------+------+------------------+---------+--------+-----------------+
-    | F               | T    | http://domain    | F       | 301    | https://domain  |
-    +-----------------+------+------------------+---------+--------+-----------------+
-    | F               | T    | http://domain    | T       | 301    | https://domain  |
-    +-----------------+------+------------------+---------+--------+-----------------+
-    | F               | T    | http://1.2.3.4   | F       | 200    | https://1.2.3.4 |
-    +-----------------+------+------------------+---------+--------+-----------------+
-    | F               | T    | http://1.2.3.4   | T       | 200    | https://1.2.3.4 |
-    +-----------------+------+------------------+---------+--------+-----------------+
-    | F               | T    | https://domain   | F       | 200    |                 |
-    +-----------------+------+------------------+---------+--------+-----------------+
-    | F               | T    | https://domain   | T       | 200    |                 |
-    +-----------------+------+------------------+---------+--------+-----------------+
-    | F               | T    | https://1.2.3.4  | F       | 200    |                 |
-    +-----------------+------+------------------+---------+--------+-----------------+
-    | F               | T    | https://1.2.3.4  | T       | 200    |                 |
-    +-----------------+------+------------------+---------+--------+-----------------+
+        if ( uname(&un) == 0 )
+            sscanf(un.release, "%d", &major);
 
-    (NPP_DOMAIN_ONLY enabled)
+        if ( major < 6 )
+        {
+            WAR("No multishot recv before kernel 6.0");
+            supported = FALSE;
+        }
+    }
 
-    +-----------------+------+------------------+---------+--------+-----------------+
-    | T               | F    | http://domain    | F       | 200    |                 |
-    +-----------------+------+------------------+---------+--------+-----------------+
-    | T               | F    | http://domain    | T       | 301    | https://domain  |
-    +-----------------+------+------------------+---------+--------+-----------------+
-    | T               | F    | http://1.2.3.4   | F       | 301    | http://domain   |
-    +-----------------+------+------------------+---------+--------+-----------------+
-    | T               | F    | http://1.2.3.4   | T       | 301    | https://domain  |
-    +-----------------+------+------------------+---------+--------+-----------------+
-    | T               | F    | https://domain   | F       | 200    |                 |
-    +-----------------+------+------------------+---------+--------+-----------------+
-    | T               | F    | https://domain   | T       | 200    |                 |
-    +-----------------+------+------------------+---------+--------+-----------------+
-    | T               | F    | https://1.2.3.4  | F       | 301    | http://domain   |
-    +-----------------+------+------------------+---------+--------+-----------------+
-    | T               | F    | https://1.2.3.4  | T       | 301    | https://domain  |
-    +-----------------+------+------------------+---------+--------+-----------------+
-    | T               | T    | http://domain    | F       | 301    | https://domain  |
-    +-----------------+------+------------------+---------+--------+-----------------+
-    | T               | T    | http://domain    | T       | 301    | https://domain  |
-    +-----------------+------+------------------+---------+--------+-----------------+
-    | T               | T    | http://1.2.3.4   | F       | 301    | https://domain  |
-    +-----------------+------+------------------+---------+--------+-----------------+
-    | T               | T    | http://1.2.3.4   | T       | 301    | https://domain  |
-    +-----------------+------+------------------+---------+--------+-----------------+
-    | T               | T    | https://domain   | F       | 200    |                 |
-    +-----------------+------+------------------+---------+--------+-----------------+
-    | T               | T    | https://domain   | T       | 200    |                 |
-    +-----------------+------+------------------+---------+--------+-----------------+
-    | T               | T    | https://1.2.3.4  | F       | 301    | https://domain  |
-    +-----------------+------+------------------+---------+--------+-----------------+
-    | T               | T    | https://1.2.3.4  | T       | 301    | https://domain  |
-    +-----------------+------+------------------+---------+--------+-----------------+
-    */
+    if ( !supported )
+    {
+        WAR("Kernel too old for io_uring socket handling");
+        close(fd);
+        return FALSE;
+    }
 
-#ifdef NPP_ENABLE_RELOAD_CONF
-    if ( !G_test && !NPP_VALID_RELOAD_CONF_REQUEST )   /* don't redirect if test or npp_reload_conf */
-#else
-    if ( !G_test )   /* don't redirect if test */
-#endif
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    if ( params.features & IORING_FEAT_SINGLE_MMAP )
     {
+        if ( cq_size > sq_size ) sq_size = cq_size;
+        cq_size = sq_size;
+    }
 
-#ifdef NPP_HTTPS
+    char *sq = (char*)mmap(NULL, sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    char *cq = sq;
 
-#ifdef NPP_HSTS_ON
-        if ( !NPP_CONN_IS_SECURE(G_connections[ci].flags) )
-        {
-            DDBG("Redirecting due to HSTS");
-#ifdef NPP_DOMAIN_ONLY
-            if ( G_connections[ci].uri[0] )
-                RES_LOCATION("https://%s/%s", NPP_APP_DOMAIN, G_connections[ci].uri);
-            else
-                RES_LOCATION("https://%s", NPP_APP_DOMAIN);
-#else
-            if ( G_connections[ci].uri[0] )
-                RES_LOCATION("https://%s/%s", G_connections[ci].host, G_connections[ci].uri);
-            else
-                RES_LOCATION("https://%s", G_connections[ci].host);
-#endif
-            return 301;
-        }
-#endif  /* NPP_HSTS_ON */
+    if ( sq != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP) )
+        cq = (char*)mmap(NULL, cq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
 
-        if ( !NPP_CONN_IS_SECURE(G_connections[ci].flags) && NPP_CONN_IS_UPGRADE_TO_HTTPS(G_connections[ci].flags) )
-        {
-            DDBG("Redirecting due to upgrade2https");
+    struct io_uring_sqe *sqes = (struct io_uring_sqe*)mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
 
-#ifdef NPP_DOMAIN_ONLY
-            if ( G_connections[ci].uri[0] )
-                RES_LOCATION("https://%s/%s", NPP_APP_DOMAIN, G_connections[ci].uri);
-            else
-                RES_LOCATION("https://%s", NPP_APP_DOMAIN);
-#else
-            if ( G_connections[ci].uri[0] )
-                RES_LOCATION("https://%s/%s", G_connections[ci].host, G_connections[ci].uri);
-            else
-                RES_LOCATION("https://%s", G_connections[ci].host);
-#endif
-            return 301;
-        }
+    /* provided buffers */
 
-#ifdef NPP_DOMAIN_ONLY
-        if ( 0 != strcmp(G_connections[ci].host, NPP_APP_DOMAIN) )
-        {
-            DDBG("Redirecting due to NPP_DOMAIN_ONLY");
+    M_uring.br = (struct io_uring_buf*)mmap(NULL, NPP_URING_BUFS * sizeof(struct io_uring_buf), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    M_uring.bufs = (char*)mmap(NULL, (size_t)NPP_URING_BUFS * NPP_URING_BUF_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
 
-            if ( G_connections[ci].uri[0] )
-                RES_LOCATION("%s://%s/%s", NPP_PROTOCOL, NPP_APP_DOMAIN, G_connections[ci].uri);
-            else
-                RES_LOCATION("%s://%s", NPP_PROTOCOL, NPP_APP_DOMAIN);
+    if ( sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED || (void*)M_uring.br == MAP_FAILED || M_uring.bufs == MAP_FAILED )
+    {
+        WAR("io_uring mmap failed, errno = %d (%s)", errno, strerror(errno));
+        close(fd);
+        return FALSE;
+    }
 
-            return 301;
-        }
-#endif  /* NPP_DOMAIN_ONLY */
+    struct io_uring_buf_reg reg={0};
 
-#else   /* not HTTPS */
+    reg.ring_addr = (uint64_t)(uintptr_t)M_uring.br;
+    reg.ring_entries = NPP_URING_BUFS;
+    reg.bgid = NPP_URING_BGID;
 
-#ifdef NPP_DOMAIN_ONLY
-        if ( 0 != strcmp(G_connections[ci].host, NPP_APP_DOMAIN) )
-        {
-            DDBG("Redirecting due to NPP_DOMAIN_ONLY");
+    if ( syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0 )
+    {
+        WAR("IORING_REGISTER_PBUF_RING failed, errno = %d (%s)", errno, strerror(errno));
+        close(fd);
+        return FALSE;
+    }
 
-            if ( G_connections[ci].uri[0] )
-                RES_LOCATION("http://%s/%s", NPP_APP_DOMAIN, G_connections[ci].uri);
-            else
-                RES_LOCATION("http://%s", NPP_APP_DOMAIN);
+    M_uring.sq_head = (unsigned*)(sq + params.sq_off.head);
+    M_uring.sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    M_uring.sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    M_uring.sq_array = (unsigned*)(sq + params.sq_off.array);
+    M_uring.sqes = sqes;
+    M_uring.cq_head = (unsigned*)(cq + params.cq_off.head);
+    M_uring.cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    M_uring.cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    M_uring.cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    M_uring.sq_entries = params.sq_entries;
 
-            return 301;
-        }
-#endif  /* NPP_DOMAIN_ONLY */
+    M_uring.fd = fd;
+
+    for ( i=0; i<NPP_URING_BUFS; ++i )
+        uring_buf_put(i);
+
+    return TRUE;
+}
 
-#endif  /* NPP_HTTPS */
 
+/* --------------------------------------------------------------------------
+   Submit queued SQEs and optionally wait for at least one completion
+-------------------------------------------------------------------------- */
+static int uring_enter(bool wait, int timeout)
+{
+    struct __kernel_timespec     ts;
+    struct io_uring_getevents_arg arg={0};
+    unsigned flags=0;
+    void     *parg=NULL;
+    size_t   argsz=0;
+
+    if ( wait )
+    {
+        flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        parg = &arg;
+        argsz = sizeof(arg);
     }
 
-    /* handle the POST content -------------------------------------------------- */
+    int ret = (int)syscall(__NR_io_uring_enter, M_uring.fd, M_uring.sq_pending, wait?1:0, flags, parg, argsz);
 
-    if ( NPP_CONN_IS_PAYLOAD(G_connections[ci].flags) && G_connections[ci].clen > 0 )
-    {
-        /* i = number of request characters read so far */
+    /* the kernel moves sq_head as it consumes SQEs */
 
-        /* p_hend will now point to the content */
+    M_uring.sq_pending = *M_uring.sq_tail - __atomic_load_n(M_uring.sq_head, __ATOMIC_ACQUIRE);
 
-        if ( 0==strncmp(p_hend, "\r\n\r\n", 4) )
-            p_hend += 4;
-        else    /* was "\n\n" */
-            p_hend += 2;
+    if ( ret < 0 && (errno == ETIME || errno == EBUSY || errno == EINTR) )
+        return 0;
 
-        len = G_connections[ci].in+len - p_hend;   /* remaining request length -- likely a content */
+    return ret;
+}
 
-        DDBG("Remaining request length (content) = %d", len);
 
-        if ( (unsigned)len > G_connections[ci].clen )
-            return 400;     /* Bad Request */
+/* --------------------------------------------------------------------------
+   Get the next free SQE
+   It's published right away which is fine as long as the kernel only
+   reads SQ in io_uring_enter (no SQPOLL)
+-------------------------------------------------------------------------- */
+static struct io_uring_sqe *uring_get_sqe()
+{
+    unsigned tail = *M_uring.sq_tail;
 
-        /* copy so far received payload data from G_connections[ci].in to G_connections[ci].in_data */
+    if ( tail - __atomic_load_n(M_uring.sq_head, __ATOMIC_ACQUIRE) >= M_uring.sq_entries )
+    {
+        /* SQ full -- submit what we have */
 
-        if ( NULL == (G_connections[ci].in_data=(char*)malloc(G_connections[ci].clen+1)) )
+        if ( uring_enter(FALSE, 0) < 0 || tail - __atomic_load_n(M_uring.sq_head, __ATOMIC_ACQUIRE) >= M_uring.sq_entries )
         {
-            ERR("Couldn't allocate %u bytes for payload data", G_connections[ci].clen);
-            return 500;     /* Internal Sever Error */
+            ERR("io_uring SQ full");
+            return NULL;
         }
+    }
 
-        memcpy(G_connections[ci].in_data, p_hend, len);
-        G_connections[ci].was_read = len;    /* if POST then was_read applies to data section only! */
+    unsigned idx = tail & *M_uring.sq_mask;
 
-        if ( (unsigned)len < G_connections[ci].clen )      /* the whole content not received yet */
-        {                               /* this is the only case when state != received */
-            DBG("The whole content not received yet, len=%d", len);
+    struct io_uring_sqe *sqe = &M_uring.sqes[idx];
 
-            DDBG("ci=%d, changing state to CONN_STATE_READING_DATA", ci);
-            G_connections[ci].state = CONN_STATE_READING_DATA;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
 
-            return ret;
-        }
-        else    /* the whole content received with the header at once */
-        {
-            G_connections[ci].in_data[len] = EOS;
-            DBG("Payload received with header");
-        }
-    }
+    M_uring.sq_array[idx] = idx;
 
-    if ( G_connections[ci].status == 304 )   /* Not Modified */
-        return 304;
-    else
-        return ret;
-}
+    __atomic_store_n(M_uring.sq_tail, tail+1, __ATOMIC_RELEASE);
 
+    ++M_uring.sq_pending;
 
-#ifdef NPP_HTTP2
-static const uint8_t base64url_dec_table[128] =
-{
-    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x3E, 0xFF, 0xFF,
-    0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-    0xFF, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E,
-    0x0F, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xFF, 0xFF, 0xFF, 0xFF, 0x3F,
-    0xFF, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
-    0x29, 0x2A, 0x2B, 0x2C, 0x2D, 0x2E, 0x2F, 0x30, 0x31, 0x32, 0x33, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
-};
+    return sqe;
+}
 
 
 /* --------------------------------------------------------------------------
-   Decode base64url encoded string
-   Return binary length
+   New user_data for slot
 -------------------------------------------------------------------------- */
-static int base64url_decode(unsigned char *dst, const char *src)
+static uint64_t uring_ud(int slot, int kind)
 {
-    uint32_t value=0;
-    int c;
-    int i;
-    int n=0;
-    unsigned char *p=dst;
+    if ( ++M_uring.gen == 0 ) ++M_uring.gen;    /* 0 would make NPP_URING_UD_IGNORE */
 
-    for ( i=0; src[i]; ++i )
-    {
-        c = src[i];
+    return ((uint64_t)M_uring.gen << 32) | ((unsigned)kind << 30) | (unsigned)slot;
+}
 
-        if ( c < 128 && base64url_dec_table[c] < 64 )
-        {
-            value = (value << 6) | base64url_dec_table[c];
 
-            if ( (i%4) == 3 )
-            {
-                if (p != NULL)
-                {
-                    p[n] = (value >> 16) & 0xFF;
-                    p[n+1] = (value >> 8) & 0xFF;
-                    p[n+2] = value & 0xFF;
-                }
+/* --------------------------------------------------------------------------
+   Queue cancel of whatever ud is
+-------------------------------------------------------------------------- */
+static void uring_cancel(uint64_t ud)
+{
+    struct io_uring_sqe *sqe;
 
-                n += 3;
-                value = 0;
-            }
-        }
-        else
-        {
-            WAR("Invalid base64url character");
-            return 0;
-        }
-    }
+    if ( !(sqe=uring_get_sqe()) ) return;
 
-    /* treat the last block */
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = ud;
+    sqe->user_data = NPP_URING_UD_IGNORE;
+}
 
-    int len = strlen(src);
 
-    if ( (len % 4) == 2 )
-    {
-        if ( p != NULL )
-            p[n] = (value >> 4) & 0xFF;
+/* --------------------------------------------------------------------------
+   Flag slot for the next uring_wait
+-------------------------------------------------------------------------- */
+static void uring_todo(int slot, unsigned flag)
+{
+    M_uring_slots[slot].flags |= flag;
 
-        ++n;
-    }
-    else if ( (len % 4) == 3 )
+    if ( !(M_uring_slots[slot].flags & NPP_URING_F_LISTED) )
     {
-        if ( p != NULL )
-        {
-            p[n] = (value >> 10) & 0xFF;
-            p[n+1] = (value >> 2) & 0xFF;
-        }
-
-        n += 2;
+        M_uring_slots[slot].flags |= NPP_URING_F_LISTED;
+        M_uring_todo[M_uring_todo_cnt++] = slot;
     }
+}
 
-    return n;
+
+/* --------------------------------------------------------------------------
+   Map epoll_event.data to slot
+-------------------------------------------------------------------------- */
+static int uring_slot(uint64_t data)
+{
+    if ( data == NPP_EPOLL_DATA_LISTENING )
+        return G_maxConnections+1;
+#ifdef NPP_HTTPS
+    else if ( data == NPP_EPOLL_DATA_LISTENING_SEC )
+        return G_maxConnections+2;
+#endif
+    else if ( NPP_EPOLL_DATA_CI(data) < 0 || NPP_EPOLL_DATA_CI(data) > G_maxConnections )
+        return -1;
+
+    return NPP_EPOLL_DATA_CI(data);
 }
-#endif  /* NPP_HTTP2 */
 
 
 /* --------------------------------------------------------------------------
-   Set request properties read from HTTP request header
-   Caller is responsible for ensuring value length > 0
-   Return HTTP status code
+   Queue multishot POLL_ADD
 -------------------------------------------------------------------------- */
-static int set_http_req_val(int ci, const char *label, const char *value)
+static bool uring_poll_add(int slot, unsigned events)
 {
-    char ulabel[NPP_MAX_LABEL_LEN+1];
-    char uvalue[NPP_MAX_VALUE_LEN+1];
-    char *p;
-    int  i;
-#ifdef NPP_HTTP2
-    unsigned char http2_settings[4096];
-#endif  /* NPP_HTTP2 */
+    struct io_uring_sqe *sqe;
 
-    /* only for low-level tests ------------------------------------- */
-//  DBG("label: [%s], value: [%s]", label, value);
-    /* -------------------------------------------------------------- */
+    if ( !(sqe=uring_get_sqe()) ) return FALSE;
 
-    strcpy(ulabel, npp_upper(label));
+    uring_slot_t *s = &M_uring_slots[slot];
 
-    if ( 0==strcmp(ulabel, "HOST") )
-    {
-#ifdef NPP_BLACKLIST_AUTO_UPDATE
-#ifdef NPP_ENABLE_RELOAD_CONF
-        if ( !NPP_VALID_RELOAD_CONF_REQUEST && check_block_ip(ci, "Host", value) )
+    s->poll_ud = uring_ud(slot, NPP_URING_UD_POLL);
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = s->fd;
+#if __BYTE_ORDER == __BIG_ENDIAN
+    sqe->poll32_events = (events << 16) | (events >> 16);
 #else
-        if ( check_block_ip(ci, "Host", value) )
+    sqe->poll32_events = events;
 #endif
-            return 404;     /* Forbidden */
-#endif  /* NPP_BLACKLIST_AUTO_UPDATE */
-        COPY(G_connections[ci].host, value, NPP_MAX_HOST_LEN);
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = s->poll_ud;
 
-#ifdef NPP_MULTI_HOST
+    return TRUE;
+}
 
-        DDBG("Host before normalization [%s]", G_connections[ci].host);
 
-        /* normalize for comparisons */
+/* --------------------------------------------------------------------------
+   Queue multishot recv into provided buffers
+-------------------------------------------------------------------------- */
+static bool uring_recv_arm(int slot)
+{
+    struct io_uring_sqe *sqe;
 
-        /* cut the port off */
+    if ( !(sqe=uring_get_sqe()) ) return FALSE;
 
-        i = 0;
-        int dots = 0;
-        int first_dot;
+    uring_slot_t *s = &M_uring_slots[slot];
 
-        while ( G_connections[ci].host[i] )
-        {
-            if ( G_connections[ci].host[i] == '.' )
-            {
-                if ( !dots )
-                    first_dot = i;
+    s->recv_ud = uring_ud(slot, NPP_URING_UD_RECV);
+    s->flags &= ~(NPP_URING_F_PAUSED | NPP_URING_F_REARM);
 
-                ++dots;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = s->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = NPP_URING_BGID;
+    sqe->user_data = s->recv_ud;
 
-                G_connections[ci].host_normalized[i] = '.';
-            }
-            else if ( G_connections[ci].host[i] == ':' )
-            {
-                break;
-            }
-            else
-            {
-                G_connections[ci].host_normalized[i] = toupper(G_connections[ci].host[i]);
-            }
+    return TRUE;
+}
 
-            ++i;
-        }
 
-        G_connections[ci].host_normalized[i] = EOS;
+/* --------------------------------------------------------------------------
+   Queue multishot accept
+-------------------------------------------------------------------------- */
+static bool uring_accept_arm(int slot)
+{
+    struct io_uring_sqe *sqe;
 
-        if ( dots > 1 && !isdigit(G_connections[ci].host_normalized[i-1]) )
-        {
-            DDBG("Need to cut subdomain off [%s]", G_connections[ci].host_normalized);
+    if ( !(sqe=uring_get_sqe()) ) return FALSE;
 
-            i = first_dot + 1;
-            int j=0;
+    uring_slot_t *s = &M_uring_slots[slot];
 
-            while ( G_connections[ci].host[i] )
-            {
-                if ( G_connections[ci].host[i] == ':' ) break;
+    s->recv_ud = uring_ud(slot, NPP_URING_UD_ACCEPT);
+    s->flags &= ~NPP_URING_F_PAUSED;
 
-                G_connections[ci].host_normalized[j++] = toupper(G_connections[ci].host[i]);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = s->fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = s->recv_ud;
 
-                ++i;
-            }
+    return TRUE;
+}
 
-            G_connections[ci].host_normalized[j] = EOS;
-        }
 
-        DDBG("host_normalized [%s]", G_connections[ci].host_normalized);
+/* --------------------------------------------------------------------------
+   Stop everything for slot and give its buffers back
+-------------------------------------------------------------------------- */
+static void uring_release(int slot)
+{
+    uring_slot_t *s = &M_uring_slots[slot];
 
-#endif  /* NPP_MULTI_HOST */
+    if ( s->poll_ud )
+        uring_cancel(s->poll_ud);
+
+    if ( s->recv_ud )
+        uring_cancel(s->recv_ud);
+
+    while ( s->head != -1 )
+    {
+        int bid = s->head;
+        s->head = M_uring_buf_next[bid];
+        uring_buf_put(bid);
     }
-    else if ( 0==strcmp(ulabel, "USER-AGENT") )
+
+    s->poll_ud = 0;     /* whatever comes from them from now on is stale */
+    s->recv_ud = 0;
+    s->events = 0;
+    s->tail = -1;
+    s->off = 0;
+    s->cnt = 0;
+    s->res = 0;
+    s->flags &= NPP_URING_F_LISTED;     /* uring_wait will drop it */
+}
+
+
+/* --------------------------------------------------------------------------
+   recv equivalent for plain connections
+-------------------------------------------------------------------------- */
+static int uring_recv(int ci, char *buf, unsigned len)
+{
+    uring_slot_t *s = &M_uring_slots[ci];
+    unsigned copied=0;
+
+    if ( !len ) return 0;   /* as recv */
+
+    while ( copied < len && s->head != -1 )
     {
-#ifdef NPP_BLACKLIST_AUTO_UPDATE
-        if ( check_block_ip(ci, "User-Agent", value) )
-            return 404;     /* Forbidden */
-#endif
-        strcpy(G_connections[ci].uagent, value);
-        strcpy(uvalue, npp_upper(value));
+        int bid = s->head;
+        unsigned n = M_uring_buf_len[bid] - s->off;
 
-        if ( strstr(uvalue, "IPAD") || strstr(uvalue, "TABLET") || strstr(uvalue, "KINDLE") || strstr(uvalue, "PLAYBOOK") || strstr(uvalue, "SM-T555") )
-        {
-            G_connections[ci].ua_type = NPP_UA_TYPE_TAB;
-            DBG("ua_type = NPP_UA_TYPE_TAB");
-        }
-        else if ( strstr(uvalue, "ANDROID") || strstr(uvalue, "IPHONE") || strstr(uvalue, "BLACKBERRY") || strstr(uvalue, "MOBILE") || strstr(uvalue, "SYMBIAN") )
-        {
-            G_connections[ci].ua_type = NPP_UA_TYPE_MOB;
-            DBG("ua_type = NPP_UA_TYPE_MOB");
-        }
-        else
-        {
-            DBG("ua_type = NPP_UA_TYPE_DSK");
-        }
+        if ( n > len - copied )
+            n = len - copied;
 
-#ifndef NPP_DONT_FLAG_BOTS
-        if ( !REQ_BOT &&
-                (strstr(uvalue, "BOT")
-                || strstr(uvalue, "SCAN")
-                || strstr(uvalue, "CRAWLER")
-                || strstr(uvalue, "SPIDER")
-                || strstr(uvalue, "BAIDU")
-                || strstr(uvalue, "ZGRAB")
-                || strstr(uvalue, "DOMAINSONO")
-                || strstr(uvalue, "NETCRAFT")
-                || strstr(uvalue, "CENSYS")
-                || strstr(uvalue, "SURDOTLY")
-                || 0==strncmp(uvalue, "APPENGINE", 9)
-                || 0==strncmp(uvalue, "NETSYSTEMSRESEARCH", 18)
-                || 0==strncmp(uvalue, "CURL", 4)
-                || 0==strncmp(uvalue, "BUBING", 6)
-                || 0==strncmp(uvalue, "PYTHON-REQUESTS", 15)
-                || 0==strncmp(uvalue, "CLOUD MAPPING", 13)
-                || 0==strcmp(uvalue, "TELESPHOREO")
-                || 0==strcmp(uvalue, "MAGIC BROWSER")) )
+        memcpy(buf+copied, M_uring.bufs + (size_t)bid * NPP_URING_BUF_SIZE + s->off, n);
+
+        copied += n;
+        s->off += n;
+
+        if ( s->off == M_uring_buf_len[bid] )   /* all read */
         {
-            G_connections[ci].flags |= NPP_CONN_FLAG_BOT;
+            s->head = M_uring_buf_next[bid];
+            if ( s->head == -1 ) s->tail = -1;
+            s->off = 0;
+            --s->cnt;
+            uring_buf_put(bid);
         }
-#endif  /* NPP_DONT_FLAG_BOTS */
     }
-    else if ( 0==strcmp(ulabel, "CONNECTION") )
+
+    if ( (s->flags & NPP_URING_F_PAUSED) && !s->recv_ud && s->cnt <= NPP_URING_CONN_BUFS/2 )
+        uring_recv_arm(ci);
+
+    if ( copied )
+        return (int)copied;
+
+    if ( s->res == NPP_URING_EOF )
+        return 0;
+
+    errno = s->res < 0 ? -s->res : EAGAIN;
+
+    return -1;
+}
+
+
+/* --------------------------------------------------------------------------
+   Take the next fd accepted by the ring
+-------------------------------------------------------------------------- */
+static int uring_accepted(bool secure)
+{
+    int slot = G_maxConnections + 1 + (secure?1:0);
+    uring_slot_t *s = &M_uring_slots[slot];
+    uring_accq_t *q = &M_uring_accq[slot-G_maxConnections-1];
+
+    if ( q->head == q->tail )
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    int fd = q->fds[q->head++ % NPP_URING_ACCQ_SIZE];
+
+    if ( (s->flags & NPP_URING_F_PAUSED) && !s->recv_ud && q->tail-q->head <= NPP_URING_ACCQ_SIZE/4 )
+        uring_accept_arm(slot);
+
+    return fd;
+}
+
+
+/* --------------------------------------------------------------------------
+   epoll_ctl equivalent
+   Nothing is submitted here, it goes with the next uring_wait
+-------------------------------------------------------------------------- */
+static int uring_ctl(int op, int fd, struct epoll_event *ev)
+{
+    int slot = uring_slot(ev->data.u64);
+
+    if ( slot < 0 )
     {
-        if ( ci < NPP_MAX_CONNECTIONS )
-        {
-            strcpy(uvalue, npp_upper(value));
-            if ( 0==strcmp(uvalue, "KEEP-ALIVE") )
-                G_connections[ci].flags |= NPP_CONN_FLAG_KEEP_ALIVE;
-        }
+        errno = EINVAL;
+        return -1;
     }
-    else if ( 0==strcmp(ulabel, "COOKIE") )
+
+    uring_slot_t *s = &M_uring_slots[slot];
+
+    if ( op == EPOLL_CTL_DEL )
     {
-        strcpy(G_connections[ci].in_cookie, value);
+        uring_release(slot);
+        return 0;
+    }
 
-        /* parse authentication data */
+    s->data = ev->data.u64;
+    s->events = ev->events;
 
-        if ( strlen(value) < NPP_SESSID_LEN+3 ) return 200;   /* no valid session cookie but request still OK */
+    if ( op == EPOLL_CTL_ADD )
+    {
+        s->fd = fd;
 
-        /* parse cookies, set anonymous and / or logged in sessid */
+        if ( slot > G_maxConnections )     /* listening */
+            return uring_accept_arm(slot) ? 0 : -1;
 
-        if ( NULL != (p=(char*)strstr(value, "as=")) )   /* anonymous sessid present? */
-        {
-            p += 3;
-            if ( strlen(p) >= NPP_SESSID_LEN )
-            {
-                strncpy(G_connections[ci].cookie_in_a, p, NPP_SESSID_LEN);
-                G_connections[ci].cookie_in_a[NPP_SESSID_LEN] = EOS;
-            }
-        }
-        if ( NULL != (p=(char*)strstr(value, "ls=")) )   /* logged in sessid present? */
+        if ( !NPP_CONN_IS_SECURE(G_conn_hot[slot].flags) )
         {
-            p += 3;
-            if ( strlen(p) >= NPP_SESSID_LEN )
-            {
-                strncpy(G_connections[ci].cookie_in_l, p, NPP_SESSID_LEN);
-                G_connections[ci].cookie_in_l[NPP_SESSID_LEN] = EOS;
-            }
+            s->flags |= NPP_URING_F_PLAIN;
+
+            if ( !uring_recv_arm(slot) )
+                return -1;
         }
     }
-    else if ( 0==strcmp(ulabel, "REFERER") )
+
+    if ( !(s->flags & NPP_URING_F_PLAIN) )     /* TLS -- replace the poll */
     {
-        strcpy(G_connections[ci].referer, value);
+        if ( s->poll_ud )
+            uring_cancel(s->poll_ud);
+
+        return uring_poll_add(slot, s->events) ? 0 : -1;
     }
-    else if ( 0==strcmp(ulabel, "CONTENT-TYPE") )
+
+    /* try writing straight away, even with a poll already there --
+       it won't fire again while the socket stays writable */
+
+    if ( s->events & EPOLLOUT )
+        uring_todo(slot, NPP_URING_F_READY);
+    else if ( s->poll_ud )
     {
-        strcpy(G_connections[ci].in_ctypestr, value);
+        uring_cancel(s->poll_ud);
+        s->poll_ud = 0;
+    }
 
-        strcpy(uvalue, npp_upper(value));
+    if ( (s->events & EPOLLIN) && (s->cnt || s->res) )     /* like epoll, report what's already there */
+        uring_todo(slot, NPP_URING_F_READY);
 
-        int len = strlen(value);
+    return 0;
+}
 
-        if ( len > 15 && 0==strncmp(uvalue, "APPLICATION/JSON", 16) )
-        {
-            G_connections[ci].in_ctype = NPP_CONTENT_TYPE_JSON;
-        }
-        else if ( len > 32 && 0==strncmp(uvalue, "APPLICATION/X-WWW-FORM-URLENCODED", 33) )
-        {
-            G_connections[ci].in_ctype = NPP_CONTENT_TYPE_URLENCODED;
-        }
-        else if ( len > 18 && 0==strncmp(uvalue, "MULTIPART/FORM-DATA", 19) )
-        {
-            G_connections[ci].in_ctype = NPP_CONTENT_TYPE_MULTIPART;
 
-            if ( (p=(char*)strstr(value, "boundary=")) != NULL )
-            {
-                COPY(G_connections[ci].boundary, p+9, NPP_MAX_BOUNDARY_LEN);
-                DBG("boundary: [%s]", G_connections[ci].boundary);
-            }
-        }
-        else if ( len > 23 && 0==strncmp(uvalue, "APPLICATION/OCTET-STREAM", 24) )
+/* --------------------------------------------------------------------------
+   Multishot recv completion
+-------------------------------------------------------------------------- */
+static void uring_on_recv(int slot, uint64_t ud, int res, unsigned flags)
+{
+    uring_slot_t *s = &M_uring_slots[slot];
+
+    if ( s->recv_ud != ud )     /* connection is gone */
+    {
+        if ( flags & IORING_CQE_F_BUFFER )
+            uring_buf_put(flags >> IORING_CQE_BUFFER_SHIFT);
+        return;
+    }
+
+    if ( res > 0 )
+    {
+        int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+
+        M_uring_buf_len[bid] = res;
+        M_uring_buf_next[bid] = -1;
+
+        if ( s->tail == -1 )
+            s->head = bid;
+        else
+            M_uring_buf_next[s->tail] = bid;
+
+        s->tail = bid;
+        ++s->cnt;
+
+        uring_todo(slot, NPP_URING_F_READY);
+
+        /* the peer keeps sending but we don't read -- leave the rest in the socket */
+
+        if ( s->cnt >= NPP_URING_CONN_BUFS && !(s->flags & NPP_URING_F_PAUSED) && (flags & IORING_CQE_F_MORE) )
         {
-            G_connections[ci].in_ctype = NPP_CONTENT_TYPE_OCTET_STREAM;
+            uring_cancel(ud);
+            s->flags |= NPP_URING_F_PAUSED;
         }
     }
-    else if ( 0==strcmp(ulabel, "AUTHORIZATION") )
+
+    if ( flags & IORING_CQE_F_MORE )
+        return;
+
+    /* this recv is over */
+
+    s->recv_ud = 0;
+
+    if ( res == 0 )
+    {
+        s->res = NPP_URING_EOF;
+        uring_todo(slot, NPP_URING_F_READY);
+    }
+    else if ( res == -ENOBUFS )
     {
-        strcpy(G_connections[ci].authorization, value);
+        uring_todo(slot, NPP_URING_F_REARM);
     }
-#ifndef NPP_DONT_FLAG_BOTS
-    else if ( 0==strcmp(ulabel, "FROM") )
+    else if ( res == -ECANCELED )
     {
-        strcpy(uvalue, npp_upper(value));
-        if ( !REQ_BOT && (strstr(uvalue, "GOOGLEBOT") || strstr(uvalue, "BINGBOT") || strstr(uvalue, "YANDEX") || strstr(uvalue, "CRAWLER")) )
-            G_connections[ci].flags |= NPP_CONN_FLAG_BOT;
+        if ( (s->flags & NPP_URING_F_PAUSED) && s->cnt <= NPP_URING_CONN_BUFS/2 )   /* already read */
+            uring_recv_arm(slot);
     }
-#endif  /* NPP_DONT_FLAG_BOTS */
-    else if ( 0==strcmp(ulabel, "IF-MODIFIED-SINCE") )
+    else if ( res < 0 )
     {
-        G_connections[ci].if_mod_since = time_http2epoch(value);
+        s->res = res;
+        uring_todo(slot, NPP_URING_F_READY);
     }
-    else if ( !NPP_CONN_IS_SECURE(G_connections[ci].flags) && !G_test && 0==strcmp(ulabel, "UPGRADE-INSECURE-REQUESTS") && 0==strcmp(value, "1") )
+    else if ( !(s->flags & NPP_URING_F_PAUSED) )   /* stopped on its own (CQ overflow) */
     {
-        DBG("Client wants to upgrade to HTTPS");
-        G_connections[ci].flags |= NPP_CONN_FLAG_UPGRADE_TO_HTTPS;
+        uring_recv_arm(slot);
     }
-    else if ( 0==strcmp(ulabel, "CONTENT-LENGTH") )
+}
+
+
+/* --------------------------------------------------------------------------
+   Multishot accept completion
+-------------------------------------------------------------------------- */
+static void uring_on_accept(int slot, uint64_t ud, int res, unsigned flags)
+{
+    uring_slot_t *s = &M_uring_slots[slot];
+    uring_accq_t *q = &M_uring_accq[slot-G_maxConnections-1];
+
+    if ( s->recv_ud != ud )
     {
-        sscanf(value, "%u", &G_connections[ci].clen);
-        if ( (!NPP_CONN_IS_PAYLOAD(G_connections[ci].flags) && G_connections[ci].clen >= NPP_IN_BUFSIZE) || (NPP_CONN_IS_PAYLOAD(G_connections[ci].flags) && G_connections[ci].clen >= NPP_MAX_PAYLOAD_SIZE-1) )
-        {
-            ERR("Request too long, clen = %u, sending 413", G_connections[ci].clen);
-            return 413;
-        }
-        DBG("G_connections[ci].clen = %u", G_connections[ci].clen);
+        if ( res >= 0 ) close(res);
+        return;
     }
-    else if ( 0==strcmp(ulabel, "ACCEPT-ENCODING") )    /* gzip, deflate, br */
+
+    if ( res >= 0 )
     {
-        strcpy(uvalue, npp_upper(value));
+        if ( q->tail-q->head < NPP_URING_ACCQ_SIZE )
+            q->fds[q->tail++ % NPP_URING_ACCQ_SIZE] = res;
+        else    /* what listen backlog overflow would do */
+            close(res);
 
-        if ( strstr(uvalue, "DEFLATE") )
+        if ( q->tail-q->head >= NPP_URING_ACCQ_SIZE/4*3 && !(s->flags & NPP_URING_F_PAUSED) && (flags & IORING_CQE_F_MORE) )
         {
-            G_connections[ci].flags |= NPP_CONN_FLAG_ACCEPT_DEFLATE;
-            DDBG("accept_deflate = TRUE");
+            uring_cancel(ud);
+            s->flags |= NPP_URING_F_PAUSED;
         }
     }
-    else if ( 0==strcmp(ulabel, "ACCEPT-LANGUAGE") )    /* en-US en-GB pl-PL */
+    else if ( res != -ECANCELED )
     {
-        i = 0;
-        while ( value[i] != EOS && value[i] != ',' && value[i] != ';' && i < NPP_LANG_LEN )
-        {
-            G_connections[ci].lang[i] = toupper(value[i]);
-            ++i;
-        }
+        ERR("io_uring accept failed, res = %d (%s)", res, strerror(-res));
+    }
 
-        G_connections[ci].lang[i] = EOS;
+    if ( flags & IORING_CQE_F_MORE )
+        return;
 
-        DBG("G_connections[ci].lang: [%s]", G_connections[ci].lang);
+    s->recv_ud = 0;
 
-        if ( IS_SESSION && G_connections[ci].lang[0] && strcmp(SESSION.lang, G_connections[ci].lang) != 0 )
-        {
-            DBG("Changing session language to [%s] and setting formats", G_connections[ci].lang);
+    if ( !(s->flags & NPP_URING_F_PAUSED) || q->tail-q->head <= NPP_URING_ACCQ_SIZE/4 )
+        uring_accept_arm(slot);
+}
 
-            npp_lib_set_formats(ci, G_connections[ci].lang);
-            strcpy(SESSION.lang, G_connections[ci].lang);
-        }
 
-        if ( !IS_SESSION || SESSION.lang[0]==EOS )    /* session data has priority */
+/* --------------------------------------------------------------------------
+   epoll_wait equivalent, fills M_epollevs
+   Submitting changes and waiting is a single io_uring_enter
+-------------------------------------------------------------------------- */
+static int uring_wait(int timeout)
+{
+    int  max=G_maxConnections+NPP_LISTENING_FDS+1;
+    int  cnt=0;
+    bool wait=TRUE;
+    int  i, j;
+
+    /* -------------------------------------------- */
+    /* before submitting */
+
+    for ( i=0; i<M_uring_todo_cnt; ++i )
+    {
+        int slot = M_uring_todo[i];
+        uring_slot_t *s = &M_uring_slots[slot];
+
+        if ( s->flags & NPP_URING_F_OUT_TRIED )     /* still wants to write -- needs a real poll now */
         {
-            DDBG("No session or no language in session, setting formats");
+            s->flags &= ~NPP_URING_F_OUT_TRIED;
 
-            if ( G_connections[ci].lang[0] )
-            {
-                npp_lib_set_formats(ci, G_connections[ci].lang);
-                strcpy(SESSION.lang, G_connections[ci].lang);
-            }
+            if ( (s->events & EPOLLOUT) && !s->poll_ud )
+                uring_poll_add(slot, EPOLLOUT | EPOLLET);
         }
-    }
-#ifdef NPP_HTTP2
-    else if ( 0==strcmp(ulabel, "UPGRADE") )
-    {
-        if ( strcmp(value, "h2c") == 0 )
+
+        if ( s->flags & NPP_URING_F_IN_TRIED )      /* not all read */
         {
-            INF("Client wants to switch to HTTP/2 (cleartext)");
-            G_connections[ci].http2_upgrade_in_progress = TRUE;
-//            return 101;     /* Switching Protocols */
+            s->flags &= ~NPP_URING_F_IN_TRIED;
+
+            if ( (s->events & EPOLLIN) && (s->cnt || s->res) )
+                s->flags |= NPP_URING_F_READY;
         }
-    }
-    else if ( 0==strcmp(ulabel, "HTTP2-SETTINGS") )
-    {
-        DDBG("HTTP2-Settings received [%s]", value);
 
-        int rem = base64url_decode(http2_settings, value);
-        DDBG("rem = %d", rem);
+        if ( (s->flags & NPP_URING_F_REARM) && M_uring.bufs_free )
+            uring_recv_arm(slot);
 
-        http2_SETTINGS_pld_t s;
-        p = http2_settings;
-        int read = 0;
+        if ( s->flags & NPP_URING_F_READY )
+            wait = FALSE;
+    }
 
-        while ( rem >= HTTP2_SETTINGS_PAIR_LEN )
-        {
-            memcpy((char*)&s, p+read, HTTP2_SETTINGS_PAIR_LEN);
-            read += HTTP2_SETTINGS_PAIR_LEN;
-            rem -= HTTP2_SETTINGS_PAIR_LEN;
+    for ( i=0; i<NPP_LISTENING_FDS; ++i )
+        if ( M_uring_accq[i].head != M_uring_accq[i].tail )
+            wait = FALSE;
 
-            /* convert from network byte order to machine */
+    if ( (wait || M_uring.sq_pending) && uring_enter(wait, timeout) < 0 )
+        return -1;
 
-            s.id = ntohs(s.id);
-            s.value = ntohl(s.value);
+    /* -------------------------------------------- */
+    /* completions */
 
-            if ( s.id == HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS )
-            {
-                DBG("http2_max_streams = %u", s.value);
-                G_connections[ci].http2_max_streams = s.value;
-            }
-            else if ( s.id == HTTP2_SETTINGS_INITIAL_WINDOW_SIZE )
-            {
-                DBG("http2_wnd_size = %u", s.value);
-                G_connections[ci].http2_wnd_size = s.value;
-            }
-            else if ( s.id == HTTP2_SETTINGS_MAX_FRAME_SIZE )
-            {
-                DBG("http2_max_frame_size = %u", s.value);
-                G_connections[ci].http2_max_frame_size = s.value;
-            }
-            else
-            {
-                DBG("HTTP/2 settings that we ignore:");
-                DBG("id = %hd", s.id);
-                DBG("value = %u", s.value);
-            }
-        }
-    }
-#endif  /* NPP_HTTP2 */
-    else if ( 0==strcmp(ulabel, "EXPECT") )
+    unsigned head = *M_uring.cq_head;
+    unsigned tail = __atomic_load_n(M_uring.cq_tail, __ATOMIC_ACQUIRE);
+
+    while ( head != tail && cnt < max )
     {
-        if ( 0==strcmp(value, "100-continue") )
-            G_connections[ci].expect100 = TRUE;
-    }
+        struct io_uring_cqe *cqe = &M_uring.cqes[head & *M_uring.cq_mask];
 
-    return 200;
-}
+        uint64_t ud = cqe->user_data;
+        int      res = cqe->res;
+        unsigned flags = cqe->flags;
 
+        ++head;
 
-/* --------------------------------------------------------------------------
-   Dump counters
--------------------------------------------------------------------------- */
-static void dump_counters()
-{
-    ALWAYS("");
-    ALWAYS("Counters:\n");
-    ALWAYS("            req: %u", G_cnts_today.req);
-    ALWAYS("        req_dsk: %u", G_cnts_today.req_dsk);
-    ALWAYS("        req_tab: %u", G_cnts_today.req_tab);
-    ALWAYS("        req_mob: %u", G_cnts_today.req_mob);
-    ALWAYS("        req_bot: %u", G_cnts_today.req_bot);
-    ALWAYS("         visits: %u", G_cnts_today.visits);
-    ALWAYS("     visits_dsk: %u", G_cnts_today.visits_dsk);
-    ALWAYS("     visits_tab: %u", G_cnts_today.visits_tab);
-    ALWAYS("     visits_mob: %u", G_cnts_today.visits_mob);
-    ALWAYS("        blocked: %u", G_cnts_today.blocked);
-    ALWAYS("        average: %.3lf ms", G_cnts_today.average);
-    ALWAYS("connections HWM: %d", G_connections_hwm);
-    ALWAYS("   sessions HWM: %d", G_sessions_hwm);
-    ALWAYS("");
-}
+        if ( flags & IORING_CQE_F_BUFFER )
+            --M_uring.bufs_free;
 
+        if ( ud == NPP_URING_UD_IGNORE ) continue;
 
-/* --------------------------------------------------------------------------
-   Clean up
--------------------------------------------------------------------------- */
-static void clean_up()
-{
-    M_shutdown = TRUE;
+        int slot = NPP_URING_UD_SLOT(ud);
 
-    ALWAYS("");
-    ALWAYS("Cleaning up...\n");
-    npp_log_memory();
-    dump_counters();
+        if ( slot >= NPP_URING_SLOTS ) continue;
+
+        if ( NPP_URING_UD_KIND(ud) == NPP_URING_UD_RECV )
+        {
+            uring_on_recv(slot, ud, res, flags);
+            continue;
+        }
+        else if ( NPP_URING_UD_KIND(ud) == NPP_URING_UD_ACCEPT )
+        {
+            uring_on_accept(slot, ud, res, flags);
+            continue;
+        }
+
+        uring_slot_t *s = &M_uring_slots[slot];
+
+        if ( s->poll_ud != ud ) continue;     /* removed or replaced */
+
+        if ( !(flags & IORING_CQE_F_MORE) )     /* poll finished -- re-arm */
+        {
+            s->poll_ud = 0;
+
+            if ( res >= 0 || res == -ECANCELED )
+                uring_poll_add(slot, (s->flags & NPP_URING_F_PLAIN) ? (EPOLLOUT | EPOLLET) : s->events);
+            else
+                ERR("io_uring poll failed, res = %d (%s)", res, strerror(-res));
+        }
 
-    DBG("Calling npp_app_done...");
+        if ( res <= 0 ) continue;
 
-    npp_app_done();
+        M_epollevs[cnt].events = res;
+        M_epollevs[cnt].data.u64 = s->data;
+        ++cnt;
+    }
 
-#ifdef NPP_FD_MON_EPOLL
-    if ( M_epoll_fd )
-        close(M_epoll_fd);
-#endif
+    __atomic_store_n(M_uring.cq_head, head, __ATOMIC_RELEASE);
+
+    /* -------------------------------------------- */
+    /* plain connections */
 
-    if ( access(M_pidfile, F_OK) != -1 )
+    for ( i=0, j=0; i<M_uring_todo_cnt; ++i )
     {
-        DBG("Removing pid file...");
-        remove(M_pidfile);
+        int slot = M_uring_todo[i];
+        uring_slot_t *s = &M_uring_slots[slot];
+
+        if ( (s->flags & NPP_URING_F_READY) && cnt < max )
+        {
+            s->flags &= ~NPP_URING_F_READY;
+
+            if ( (s->events & EPOLLIN) && (s->cnt || s->res) )
+            {
+                M_epollevs[cnt].events = EPOLLIN;
+                M_epollevs[cnt].data.u64 = s->data;
+                ++cnt;
+                s->flags |= NPP_URING_F_IN_TRIED;
+            }
+            else if ( s->events & EPOLLOUT )
+            {
+                M_epollevs[cnt].events = EPOLLOUT;
+                M_epollevs[cnt].data.u64 = s->data;
+                ++cnt;
+                s->flags |= NPP_URING_F_OUT_TRIED;
+            }
+        }
+
+        if ( s->flags & (NPP_URING_F_READY | NPP_URING_F_IN_TRIED | NPP_URING_F_OUT_TRIED | NPP_URING_F_REARM) )
+            M_uring_todo[j++] = slot;
+        else
+            s->flags &= ~NPP_URING_F_LISTED;
     }
 
+    M_uring_todo_cnt = j;
 
-#ifdef NPP_MYSQL
+    /* -------------------------------------------- */
+    /* listening sockets -- level-triggered */
 
-#ifdef NPP_USERS
-    libusr_luses_save_csrft();
-#endif
+    for ( i=0; i<NPP_LISTENING_FDS && cnt < max; ++i )
+    {
+        if ( M_uring_accq[i].head != M_uring_accq[i].tail )
+        {
+            M_epollevs[cnt].events = EPOLLIN;
+            M_epollevs[cnt].data.u64 = M_uring_slots[G_maxConnections+1+i].data;
+            ++cnt;
+        }
+    }
 
-#endif  /* NPP_MYSQL */
+    return cnt;
+}
+#endif  /* NPP_FD_MON_IO_URING */
 
 
-#ifdef NPP_HTTPS
-    SSL_CTX_free(M_ssl_server_ctx);
-    EVP_cleanup();
+#ifdef NPP_FD_MON_EPOLL
+/* --------------------------------------------------------------------------
+   Add, modify or remove socket from the monitored set
+   ev->data.u64 must be NPP_EPOLL_DATA(ci) or NPP_EPOLL_DATA_LISTENING*
+-------------------------------------------------------------------------- */
+static int fd_mon_ctl(int op, int fd, struct epoll_event *ev)
+{
+#ifdef NPP_FD_MON_IO_URING
+    if ( M_uring.fd )
+        return uring_ctl(op, fd, ev);
 #endif
 
+    return epoll_ctl(M_epoll_fd, op, fd, ev);
+}
 
-#ifdef NPP_ASYNC
-    if (G_queue_req)
-    {
-        mq_close(G_queue_req);
-        mq_unlink(G_req_queue_name);
-    }
-    if (G_queue_res)
-    {
-        mq_close(G_queue_res);
-        mq_unlink(G_res_queue_name);
-    }
-#endif  /* NPP_ASYNC */
 
-#ifdef _WIN32   /* Windows */
-    if ( M_eng_WSA_initialized )
-        WSACleanup();
-#endif  /* _WIN32 */
+/* --------------------------------------------------------------------------
+   Wait for socket events to M_epollevs
+-------------------------------------------------------------------------- */
+static int fd_mon_wait(int timeout)
+{
+#ifdef NPP_FD_MON_IO_URING
+    if ( M_uring.fd )
+        return uring_wait(timeout);
+#endif
 
-    npp_lib_done();
+    return epoll_wait(M_epoll_fd, M_epollevs, M_epollfds_cnt, timeout);
 }
+#endif  /* NPP_FD_MON_EPOLL */
 
 
 /* --------------------------------------------------------------------------
@@ -7202,7 +11979,7 @@ static void find_first_free_si()
 {
     int i;
 
-    for ( i=1; i<=NPP_MAX_SESSIONS; ++i )
+    for ( i=1; i<=G_maxSessions; ++i )
     {
         if ( G_sessions[i].sessid[0] == EOS )
         {
@@ -7284,7 +12061,7 @@ int npp_eng_session_start(int ci, const char *sessid)
 {
     DBG("npp_eng_session_start");
 
-    if ( G_sessions_cnt == NPP_MAX_SESSIONS )
+    if ( G_sessions_cnt == G_maxSessions )
     {
         WAR("User sessions exhausted");
         return ERR_SERVER_TOOBUSY;
@@ -7321,8 +12098,8 @@ int npp_eng_session_start(int ci, const char *sessid)
 #endif
     strcpy(SESSION.sessid, new_sessid);
     strcpy(SESSION.ip, G_connections[ci].ip);
-    strcpy(SESSION.uagent, G_connections[ci].uagent);
-    strcpy(SESSION.referer, G_connections[ci].referer);
+    strcpy(SESSION.uagent, G_connections[ci].cold->uagent);
+    strcpy(SESSION.referer, G_connections[ci].cold->referer);
     strcpy(SESSION.lang, G_connections[ci].lang);
     SESSION.formats = G_connections[ci].formats;
 
@@ -7373,7 +12150,7 @@ int npp_eng_session_start(int ci, const char *sessid)
     /* -------------------------------------------- */
     /* update M_first_free_si */
 
-    if ( M_highest_used_si < NPP_MAX_SESSIONS )
+    if ( M_highest_used_si < G_maxSessions )
         M_first_free_si = M_highest_used_si + 1;
     else
         find_first_free_si();
@@ -7417,7 +12194,7 @@ void npp_eng_session_downgrade_by_uid(int user_id, int ci)
 
     if ( ci > -1 )  /* keep the current session */
     {
-        for ( i=1; G_sessions_cnt>0 && i<=NPP_MAX_SESSIONS; ++i )
+        for ( i=1; G_sessions_cnt>0 && i<=G_maxSessions; ++i )
         {
             if ( G_sessions[i].sessid[0] && G_sessions[i].auth_level>AUTH_LEVEL_ANONYMOUS && G_sessions[i].user_id==user_id && 0!=strcmp(G_sessions[i].sessid, SESSION.sessid) )
                 libusr_luses_downgrade(i, NPP_NOT_CONNECTED, FALSE);
@@ -7425,7 +12202,7 @@ void npp_eng_session_downgrade_by_uid(int user_id, int ci)
     }
     else    /* all sessions */
     {
-        for ( i=1; G_sessions_cnt>0 && i<=NPP_MAX_SESSIONS; ++i )
+        for ( i=1; G_sessions_cnt>0 && i<=G_maxSessions; ++i )
         {
             if ( G_sessions[i].sessid[0] && G_sessions[i].auth_level>AUTH_LEVEL_ANONYMOUS && G_sessions[i].user_id==user_id )
                 libusr_luses_downgrade(i, NPP_NOT_CONNECTED, FALSE);
@@ -7450,6 +12227,7 @@ bool npp_eng_call_async(int ci, const char *service, const char *data, bool want
 
     req.hdr.call_id = ++M_last_call_id;
     req.hdr.ci = ci;
+    req.hdr.wi = M_wi;
 
     if ( service )
         strcpy(req.hdr.service, service);
@@ -7460,7 +12238,7 @@ bool npp_eng_call_async(int ci, const char *service, const char *data, bool want
 
     strcpy(req.hdr.ip, G_connections[ci].ip);
     strcpy(req.hdr.method, G_connections[ci].method);
-    strcpy(req.hdr.uri, G_connections[ci].uri);
+    strcpy(req.hdr.uri, G_connections[ci].cold->uri);
     strcpy(req.hdr.resource, G_connections[ci].resource);
 #if NPP_RESOURCE_LEVELS > 1
     strcpy(req.hdr.req1, G_connections[ci].req1);
@@ -7478,11 +12256,11 @@ bool npp_eng_call_async(int ci, const char *service, const char *data, bool want
 #endif  /* NPP_RESOURCE_LEVELS > 2 */
 #endif  /* NPP_RESOURCE_LEVELS > 1 */
     strcpy(req.hdr.id, G_connections[ci].id);
-    strcpy(req.hdr.uagent, G_connections[ci].uagent);
+    strcpy(req.hdr.uagent, G_connections[ci].cold->uagent);
     req.hdr.ua_type = G_connections[ci].ua_type;
-    strcpy(req.hdr.referer, G_connections[ci].referer);
+    strcpy(req.hdr.referer, G_connections[ci].cold->referer);
     req.hdr.clen = G_connections[ci].clen;
-    strcpy(req.hdr.in_cookie, G_connections[ci].in_cookie);
+    strcpy(req.hdr.in_cookie, G_connections[ci].cold->in_cookie);
     strcpy(req.hdr.host, G_connections[ci].host);
 #ifdef NPP_MULTI_HOST
     strcpy(req.hdr.host_normalized, G_connections[ci].host_normalized);
@@ -7493,7 +12271,7 @@ bool npp_eng_call_async(int ci, const char *service, const char *data, bool want
     req.hdr.in_ctype = G_connections[ci].in_ctype;
     strcpy(req.hdr.boundary, G_connections[ci].boundary);
     req.hdr.status = G_connections[ci].status;
-    strcpy(req.hdr.cust_headers, G_connections[ci].cust_headers);
+    strcpy(req.hdr.cust_headers, G_connections[ci].cold->cust_headers);
     req.hdr.cust_headers_len = G_connections[ci].cust_headers_len;
     req.hdr.out_ctype = G_connections[ci].out_ctype;
     strcpy(req.hdr.ctypestr, G_connections[ci].ctypestr);
@@ -7502,9 +12280,9 @@ bool npp_eng_call_async(int ci, const char *service, const char *data, bool want
     strcpy(req.hdr.cookie_out_a_exp, G_connections[ci].cookie_out_a_exp);
     strcpy(req.hdr.cookie_out_l, G_connections[ci].cookie_out_l);
     strcpy(req.hdr.cookie_out_l_exp, G_connections[ci].cookie_out_l_exp);
-    strcpy(req.hdr.location, G_connections[ci].location);
+    strcpy(req.hdr.location, G_connections[ci].cold->location);
     req.hdr.si = G_connections[ci].si;
-    req.hdr.flags = G_connections[ci].flags;
+    req.hdr.flags = G_conn_hot[ci].flags;
 
     if ( want_response )
         req.hdr.async_flags = NPP_ASYNC_FLAG_WANT_RESPONSE;
@@ -7514,7 +12292,7 @@ bool npp_eng_call_async(int ci, const char *service, const char *data, bool want
     /* For POST, the payload can be in the data space of the message,
        or -- if it's bigger -- in the shared memory */
 
-    if ( NPP_CONN_IS_PAYLOAD(G_connections[ci].flags) && G_connections[ci].clen > 0 )
+    if ( NPP_CONN_IS_PAYLOAD(G_conn_hot[ci].flags) && G_connections[ci].clen > 0 )
     {
         if ( G_connections[ci].clen < G_async_req_data_size )
         {
@@ -7526,9 +12304,15 @@ bool npp_eng_call_async(int ci, const char *service, const char *data, bool want
         {
             DBG("Payload requires SHM");
 
+            if ( G_connections[ci].clen >= NPP_MAX_PAYLOAD_SIZE-1 )    /* spooled */
+            {
+                ERR("Payload too big for npp_svc (%u bytes), NPP_MAX_PAYLOAD_SIZE = %u", G_connections[ci].clen, NPP_MAX_PAYLOAD_SIZE);
+                return FALSE;
+            }
+
             if ( !M_async_shm )
             {
-                if ( (M_async_shm=npp_lib_shm_create(NPP_MAX_PAYLOAD_SIZE, 0)) == NULL )
+                if ( (M_async_shm=npp_lib_shm_create(NPP_MAX_PAYLOAD_SIZE, M_wi)) == NULL )
                 {
                     ERR("Couldn't create SHM");
                     return FALSE;
@@ -7628,18 +12412,18 @@ bool npp_eng_call_async(int ci, const char *service, const char *data, bool want
             /* set request state */
 
             DDBG("ci=%d, changing state to CONN_STATE_WAITING_FOR_ASYNC", ci);
-            G_connections[ci].state = CONN_STATE_WAITING_FOR_ASYNC;
+            G_conn_hot[ci].state = CONN_STATE_WAITING_FOR_ASYNC;
 
 #ifdef NPP_FD_MON_POLL
-            M_pollfds[G_connections[ci].pi].events = POLLOUT;
+            M_pollfds[G_conn_hot[ci].pi].events = POLLOUT;
 #endif
 
 #ifdef NPP_FD_MON_EPOLL
             struct epoll_event ev={0};
 
-            ev.data.fd = G_connections[ci].fd;
+            ev.data.u64 = NPP_EPOLL_DATA(ci);
             ev.events = EPOLLOUT | EPOLLET;
-            epoll_ctl(M_epoll_fd, EPOLL_CTL_MOD, ev.data.fd, &ev);
+            fd_mon_ctl(EPOLL_CTL_MOD, G_conn_hot[ci].fd, &ev);
 #endif
         }
         else
@@ -7690,46 +12474,46 @@ void npp_add_to_static_res(const char *host, const char *name, const char *src)
 {
 #endif
 
-    if ( M_statics_cnt > NPP_MAX_STATICS-1 )
-    {
-        WAR("M_statics_cnt at max (%d)!", NPP_MAX_STATICS);
-        return;
-    }
+    int i=static_slot();
+
+    if ( i == -1 ) return;
 
     if ( host && host[0] )
-        strcpy(M_statics[M_statics_cnt].host, npp_upper(host));
+        strcpy(M_statics[i].host, npp_upper(host));
     else
-        M_statics[M_statics_cnt].host[0] = EOS;
+        M_statics[i].host[0] = EOS;
 
 #ifdef NPP_MULTI_HOST
-    M_statics[M_statics_cnt].host_id = find_host_id(M_statics[M_statics_cnt].host);
+    M_statics[i].host_id = find_host_id(M_statics[i].host);
 #else
-    M_statics[M_statics_cnt].host_id = 0;
+    M_statics[i].host_id = 0;
 #endif
 
-    strcpy(M_statics[M_statics_cnt].name, name);
+    strcpy(M_statics[i].name, name);
 
-    M_statics[M_statics_cnt].len = strlen(src);   /* internal are text based */
+    M_statics[i].len = strlen(src);   /* internal are text based */
 
-    if ( NULL == (M_statics[M_statics_cnt].data=(char*)malloc(M_statics[M_statics_cnt].len+1+NPP_OUT_HEADER_BUFSIZE)) )
+    if ( NULL == (M_statics[i].data=(char*)malloc(M_statics[i].len+1+NPP_OUT_HEADER_BUFSIZE)) )
     {
-        ERR("Couldn't allocate %u bytes for %s", M_statics[M_statics_cnt].len+1+NPP_OUT_HEADER_BUFSIZE, M_statics[M_statics_cnt].name);
+        ERR("Couldn't allocate %u bytes for %s", M_statics[i].len+1+NPP_OUT_HEADER_BUFSIZE, M_statics[i].name);
+        M_statics[i].name[0] = EOS;
         return;
     }
 
-    strcpy(M_statics[M_statics_cnt].data+NPP_OUT_HEADER_BUFSIZE, src);
+    strcpy(M_statics[i].data+NPP_OUT_HEADER_BUFSIZE, src);
 
-    M_statics[M_statics_cnt].type = npp_lib_get_res_type(M_statics[M_statics_cnt].name);
-    M_statics[M_statics_cnt].modified = G_now;
-    M_statics[M_statics_cnt].source = STATIC_SOURCE_INTERNAL;
+    M_statics[i].type = npp_lib_get_res_type(M_statics[i].name);
+    M_statics[i].modified = G_now;
+    make_etag(M_statics[i].etag, M_statics[i].data+NPP_OUT_HEADER_BUFSIZE, M_statics[i].len);
+    M_statics[i].source = STATIC_SOURCE_INTERNAL;
 
-    if ( 0==strcmp(M_statics[M_statics_cnt].name, "index.html") )
+    if ( 0==strcmp(M_statics[i].name, "index.html") )
     {
-        if ( M_statics[M_statics_cnt].host_id == 0 )
-            M_index_present = M_statics_cnt;
+        if ( M_statics[i].host_id == 0 )
+            M_index_present = i;
 #ifdef NPP_MULTI_HOST
         else
-            G_hosts[M_statics[M_statics_cnt].host_id].index_present = M_statics_cnt;
+            G_hosts[M_statics[i].host_id].index_present = i;
 #endif
     }
 
@@ -7737,53 +12521,22 @@ void npp_add_to_static_res(const char *host, const char *name, const char *src)
 
 #ifndef _WIN32
 
-    if ( SHOULD_BE_COMPRESSED(M_statics[M_statics_cnt].len, M_statics[M_statics_cnt].type) && M_statics[M_statics_cnt].source != STATIC_SOURCE_SNIPPETS )
+    if ( SHOULD_BE_COMPRESSED(M_statics[i].len, M_statics[i].type) && M_statics[i].source != STATIC_SOURCE_SNIPPETS
+            && !compress_static(i) )
     {
-        char *data_tmp;
-
-        if ( NULL == (data_tmp=(char*)malloc(M_statics[M_statics_cnt].len)) )
-        {
-            ERR("Couldn't allocate %u bytes for %s", M_statics[M_statics_cnt].len, M_statics[M_statics_cnt].name);
-            return;
-        }
-
-        int deflated_len = deflate_data((unsigned char*)data_tmp, (unsigned char*)M_statics[M_statics_cnt].data+NPP_OUT_HEADER_BUFSIZE, M_statics[M_statics_cnt].len);
-
-        if ( deflated_len == -1 )
-        {
-            WAR("Couldn't compress %s", M_statics[M_statics_cnt].name);
-
-            if ( M_statics[M_statics_cnt].data_deflated )
-            {
-                free(M_statics[M_statics_cnt].data_deflated);
-                M_statics[M_statics_cnt].data_deflated = NULL;
-            }
-
-            M_statics[M_statics_cnt].len_deflated = 0;
-        }
-        else
-        {
-            if ( NULL == (M_statics[M_statics_cnt].data_deflated=(char*)malloc(deflated_len+NPP_OUT_HEADER_BUFSIZE)) )
-            {
-                ERR("Couldn't allocate %u bytes for deflated %s", deflated_len+NPP_OUT_HEADER_BUFSIZE, M_statics[M_statics_cnt].name);
-                free(data_tmp);
-                return;
-            }
-
-            memcpy(M_statics[M_statics_cnt].data_deflated+NPP_OUT_HEADER_BUFSIZE, data_tmp, deflated_len);
-            M_statics[M_statics_cnt].len_deflated = deflated_len;
-        }
-
-        free(data_tmp);
+        free_static_data(i);
+        M_statics[i].name[0] = EOS;
+        return;
     }
 
 #endif  /* _WIN32 */
 
-    INF("%s (%u bytes)", M_statics[M_statics_cnt].name, M_statics[M_statics_cnt].len);
+    INF("%s (%u bytes)", M_statics[i].name, M_statics[i].len);
 
-    ++M_statics_cnt;
+    if ( i == M_statics_cnt )
+        ++M_statics_cnt;
 
-    qsort(&M_statics, M_statics_cnt, sizeof(M_statics[0]), compare_statics);
+    statics_hash_build();
 }
 
 
@@ -7874,7 +12627,7 @@ bool npp_eng_is_uri(int ci, const char *uri)
     if ( *(u+len-1) == '*' )
     {
         len--;
-        return (0==strncmp(G_connections[ci].uri, u, len));
+        return (0==strncmp(G_connections[ci].cold->uri, u, len));
     }
     else if ( len > 4
                         && *(u+len-4)=='{'
@@ -7883,25 +12636,25 @@ bool npp_eng_is_uri(int ci, const char *uri)
                         && *(u+len-1)=='}' )
     {
         len -= 4;
-        return (0==strncmp(G_connections[ci].uri, u, len));
+        return (0==strncmp(G_connections[ci].cold->uri, u, len));
     }
 
     /* ------------------------------------------------------------------- */
     /* no wildcard ==> exact match is required, but excluding query string */
 
-    char *q = strchr(G_connections[ci].uri, '?');
+    char *q = strchr(G_connections[ci].cold->uri, '?');
 
     if ( !q )
-        return (0==strcmp(G_connections[ci].uri, u));
+        return (0==strcmp(G_connections[ci].cold->uri, u));
 
     /* there's a query string */
 
-    int req_len = q - G_connections[ci].uri;
+    int req_len = q - G_connections[ci].cold->uri;
 
     if ( req_len != len )
         return FALSE;
 
-    return (0==strncmp(G_connections[ci].uri, u, len));
+    return (0==strncmp(G_connections[ci].cold->uri, u, len));
 }
 
 
@@ -7981,6 +12734,80 @@ void npp_eng_out_check_realloc_bin(int ci, const char *data, int len)
 }
 
 
+/* --------------------------------------------------------------------------
+   Write formatted string straight to output buffer
+   Resize it and format again only if it didn't fit
+-------------------------------------------------------------------------- */
+void npp_eng_out_fmt(int ci, const char *fmt, ...)
+{
+    va_list  plist;
+    unsigned used = G_connections[ci].p_content - G_connections[ci].out_data;
+    unsigned available = G_connections[ci].out_data_allocated - used;
+    int      len;
+
+    va_start(plist, fmt);
+    len = vsnprintf(G_connections[ci].p_content, available, fmt, plist);
+    va_end(plist);
+
+    if ( len < 0 ) return;
+
+    if ( (unsigned)len >= available )   /* didn't fit */
+    {
+#ifdef NPP_OUT_CHECK_REALLOC
+        unsigned size = G_connections[ci].out_data_allocated * 2;
+
+        while ( size - used <= (unsigned)len )
+            size *= 2;
+
+        char *tmp = (char*)realloc(G_connections[ci].out_data_alloc, size);
+        if ( !tmp )
+        {
+            ERR("Couldn't reallocate output buffer for ci=%d, tried %u bytes", ci, size);
+            if ( available )    /* drop the truncated part, p_content is past the end when full */
+                *G_connections[ci].p_content = EOS;
+            return;
+        }
+        G_connections[ci].out_data_alloc = tmp;
+        G_connections[ci].out_data = G_connections[ci].out_data_alloc;
+        G_connections[ci].out_data_allocated = size;
+        G_connections[ci].p_content = G_connections[ci].out_data + used;
+        INF("Reallocated output buffer for ci=%d, new size = %u bytes", ci, G_connections[ci].out_data_allocated);
+
+        va_start(plist, fmt);
+        vsnprintf(G_connections[ci].p_content, size - used, fmt, plist);
+        va_end(plist);
+#else
+        if ( !available ) return;   /* full already */
+        len = available - 1;    /* let's keep only what fit. WARNING: no UTF-8 checking is done here! */
+#endif  /* NPP_OUT_CHECK_REALLOC */
+    }
+
+    G_connections[ci].p_content += len;
+}
+
+
+/* --------------------------------------------------------------------------
+   Write integer to output buffer
+-------------------------------------------------------------------------- */
+void npp_eng_out_int(int ci, long long val)
+{
+    char buf[24];
+    char *p = buf + sizeof(buf);
+    unsigned long long u = val < 0 ? -(unsigned long long)val : val;
+
+    *--p = EOS;
+
+    do
+        *--p = '0' + u % 10;
+    while ( (u /= 10) != 0 );
+
+    if ( val < 0 )
+        *--p = '-';
+
+    OUTSS(p);
+}
+
+
 /* --------------------------------------------------------------------------
    Return request header value
 -------------------------------------------------------------------------- */
@@ -7993,17 +12820,17 @@ static char value[NPP_MAX_VALUE_LEN+1];
 
     if ( 0==strcmp(uheader, "CONTENT-TYPE") )
     {
-        strcpy(value, G_connections[ci].in_ctypestr);
+        strcpy(value, G_connections[ci].cold->in_ctypestr);
         return value;
     }
     else if ( 0==strcmp(uheader, "AUTHORIZATION") )
     {
-        strcpy(value, G_connections[ci].authorization);
+        strcpy(value, G_connections[ci].cold->authorization);
         return value;
     }
     else if ( 0==strcmp(uheader, "COOKIE") )
     {
-        strcpy(value, G_connections[ci].in_cookie);
+        strcpy(value, G_connections[ci].cold->in_cookie);
         return value;
     }
     else
@@ -8013,6 +12840,243 @@ static char value[NPP_MAX_VALUE_LEN+1];
 }
 
 
+/* --------------------------------------------------------------------------
+   Turn the current response into an event stream (Server-Sent Events)
+   Connection stays open, exempt from NPP_CONNECTION_TIMEOUT,
+   and gets events from SSE_SEND / SSE_SEND_GROUP
+-------------------------------------------------------------------------- */
+bool npp_eng_sse_start(int ci, int group)
+{
+#ifdef NPP_HTTP2
+    if ( G_connections[ci].http_ver[0] == '2' )
+    {
+        WAR("Event stream over HTTP/2 is not supported");
+        return FALSE;
+    }
+#endif
+    if ( group < 0 ) group = 0;
+
+    if ( G_connections[ci].sse_group != -1 )
+        sse_unlink(ci);
+
+    /* add to the group's list */
+
+    G_connections[ci].sse_group = group;
+    G_connections[ci].sse_prev = -1;
+    G_connections[ci].sse_next = M_sse_groups[group % NPP_SSE_GROUPS];
+
+    if ( G_connections[ci].sse_next != -1 )
+        G_connections[G_connections[ci].sse_next].sse_prev = ci;
+
+    M_sse_groups[group % NPP_SSE_GROUPS] = ci;
+
+    strcpy(G_connections[ci].ctypestr, "text/event-stream");
+    G_conn_hot[ci].flags |= NPP_CONN_FLAG_DONT_CACHE;
+    G_conn_hot[ci].flags &= ~NPP_CONN_FLAG_KEEP_ALIVE;     /* ends with the connection */
+
+    DBG("ci=%d, event stream, group = %d", ci, group);
+
+    return TRUE;
+}
+
+
+/* --------------------------------------------------------------------------
+   Send event to the event stream
+   Multi-line data goes as multiple data: lines
+   (LF, CR or CRLF end a line, as for the client)
+-------------------------------------------------------------------------- */
+bool npp_eng_sse_send(int ci, const char *event, const char *data)
+{
+    int  off, len;
+    unsigned total;
+    const char *p, *nl;
+
+    if ( !data ) data = "";
+
+    if ( event && event[strcspn(event, "\r\n")] )
+    {
+        WAR("ci=%d, line break in event name", ci);
+        return FALSE;
+    }
+
+    /* what's going out */
+
+    total = (event && event[0] ? 8 + strlen(event) : 0) + 2;
+
+    for ( p=data; ; p=nl+1 )
+    {
+        len = strcspn(p, "\r\n");
+        total += 7 + len;
+        nl = p + len;
+        if ( !*nl ) break;
+        if ( nl[0] == '\r' && nl[1] == '\n' ) ++nl;
+    }
+
+    if ( !push_begin(ci, total, &off) )
+        return FALSE;
+
+    if ( event && event[0] )
+    {
+        len = 7;
+        OUT_BIN("event: ", len);
+        len = strlen(event);
+        OUT_BIN(event, len);
+        len = 1;
+        OUT_BIN("\n", len);
+    }
+
+    for ( p=data; ; p=nl+1 )
+    {
+        len = 6;
+        OUT_BIN("data: ", len);
+
+        len = strcspn(p, "\r\n");
+        nl = p + len;
+
+        OUT_BIN(p, len);
+
+        if ( !*nl ) break;
+
+        len = 1;
+        OUT_BIN("\n", len);
+
+        if ( nl[0] == '\r' && nl[1] == '\n' ) ++nl;
+    }
+
+    len = 2;
+    OUT_BIN("\n\n", len);
+
+    push_end(ci, off);
+
+    return TRUE;
+}
+
+
+/* --------------------------------------------------------------------------
+   Send event to all event streams in the group
+   Return number of connections
+-------------------------------------------------------------------------- */
+int npp_eng_sse_send_group(int group, const char *event, const char *data)
+{
+    int ci, next, cnt=0;
+
+    if ( group < 0 ) group = 0;
+
+    for ( ci=M_sse_groups[group % NPP_SSE_GROUPS]; ci != -1; ci=next )
+    {
+        next = G_connections[ci].sse_next;  /* slow one may get closed */
+
+        if ( G_connections[ci].sse_group == group && npp_eng_sse_send(ci, event, data) )
+            ++cnt;
+    }
+
+    return cnt;
+}
+
+
+/* --------------------------------------------------------------------------
+   Accept WebSocket upgrade request (REQ_WS)
+   callback gets every message, unless it's routed (WS_ROUTE)
+   Only frames (WS_SEND) can follow in this response
+-------------------------------------------------------------------------- */
+bool npp_eng_ws_accept(int ci, void (*callback)(int ci, const char *data, unsigned len, bool binary))
+{
+    if ( !REQ_WS || !REQ_GET || 0 != strcmp(G_connections[ci].http_ver, "1.1") )
+    {
+        WAR("Not a WebSocket upgrade request");
+        return FALSE;
+    }
+
+    if ( !G_connections[ci].ws_v13 )
+    {
+        WAR("Unsupported WebSocket version");
+        G_connections[ci].status = 426;
+        return FALSE;
+    }
+
+    G_connections[ci].ws_state = WS_STATE_ACCEPTED;
+    G_connections[ci].ws_cb = callback;
+
+    G_connections[ci].p_content = G_connections[ci].out_data + NPP_OUT_HEADER_BUFSIZE;
+    G_conn_hot[ci].flags &= ~NPP_CONN_FLAG_KEEP_ALIVE;     /* ends with the connection */
+
+    DBG("ci=%d, WebSocket accepted", ci);
+
+    return TRUE;
+}
+
+
+/* --------------------------------------------------------------------------
+   Route WebSocket messages to npp_svc service
+   The message is REQ_DATA there and whatever it renders comes back
+   as a text frame; one message is processed at a time
+-------------------------------------------------------------------------- */
+bool npp_eng_ws_route(int ci, const char *service)
+{
+#ifdef NPP_ASYNC
+    if ( G_connections[ci].ws_state == WS_STATE_NONE || strlen(service) > NPP_SVC_NAME_LEN )
+        return FALSE;
+
+    strcpy(G_connections[ci].service, service);
+
+    return TRUE;
+#else
+    WAR("WS_ROUTE requires NPP_ASYNC");
+    return FALSE;
+#endif  /* NPP_ASYNC */
+}
+
+
+/* --------------------------------------------------------------------------
+   Send WebSocket message
+-------------------------------------------------------------------------- */
+bool npp_eng_ws_send(int ci, const char *data, unsigned len, bool binary)
+{
+    return ws_frame(ci, binary?WS_OP_BIN:WS_OP_TEXT, data, len);
+}
+
+
+/* --------------------------------------------------------------------------
+   Send WebSocket message to all open WebSockets
+   Return number of connections
+-------------------------------------------------------------------------- */
+int npp_eng_ws_send_all(const char *data, unsigned len, bool binary)
+{
+    int ci, cnt=0;
+
+    for ( ci=0; ci<=G_maxConnections; ++ci )
+    {
+        if ( G_connections[ci].ws_state == WS_STATE_OPEN && G_conn_hot[ci].state != CONN_STATE_DISCONNECTED && npp_eng_ws_send(ci, data, len, binary) )
+            ++cnt;
+    }
+
+    return cnt;
+}
+
+
+/* --------------------------------------------------------------------------
+   Close WebSocket
+   Connection goes when the close frame has been sent
+-------------------------------------------------------------------------- */
+bool npp_eng_ws_close(int ci, int code)
+{
+    char payload[2];
+
+    if ( ci < 0 || ci > G_maxConnections || G_connections[ci].ws_state != WS_STATE_OPEN )
+        return FALSE;
+
+    payload[0] = (code >> 8) & 0xff;
+    payload[1] = code & 0xff;
+
+    if ( !ws_frame(ci, WS_OP_CLOSE, payload, 2) )
+        return FALSE;
+
+    G_connections[ci].ws_state = WS_STATE_CLOSING;
+
+    return TRUE;
+}
+
+
 /* --------------------------------------------------------------------------
    HTTP calls -- pass request header value from the original request
 -------------------------------------------------------------------------- */
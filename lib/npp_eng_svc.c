@@ -57,9 +57,17 @@ async_res_t G_svc_res;
 char        *G_svc_out_data=NULL;
 #endif
 char        *G_svc_p_content=NULL;
-npp_connection_t G_connections[NPP_MAX_CONNECTIONS+2]={0};  /* request details */
-eng_session_data_t G_sessions[NPP_MAX_SESSIONS+1]={0};      /* sessions -- they start from 1 */
-app_session_data_t G_app_session_data[NPP_MAX_SESSIONS+1]={0}; /* app session data, using the same index (si) */
+int         G_maxConnections=NPP_MAX_CONNECTIONS;
+int         G_maxSessions=NPP_MAX_SESSIONS;
+static npp_connection_t M_connections[NPP_MAX_CONNECTIONS+2]={0};
+static eng_session_data_t M_sessions[NPP_MAX_SESSIONS+1]={0};
+static app_session_data_t M_app_session_data[NPP_MAX_SESSIONS+1]={0};
+static npp_conn_hot_t M_conn_hot[NPP_MAX_CONNECTIONS+2]={0};
+static npp_conn_cold_t M_conn_cold[2]={0};                  /* slot 0 and NPP_CLOSING_SESSION_CI */
+npp_connection_t *G_connections=M_connections;              /* request details */
+npp_conn_hot_t *G_conn_hot=M_conn_hot;
+eng_session_data_t *G_sessions=M_sessions;                  /* sessions -- they start from 1 */
+app_session_data_t *G_app_session_data=M_app_session_data;  /* app session data, using the same index (si) */
 
 /* counters */
 
@@ -80,17 +88,26 @@ char        G_last_modified[32]="";         /* response header field with server
 
 static char *M_pidfile;                     /* pid file name */
 #ifdef NPP_ASYNC    /* suppress warning */
-static char *M_async_shm=NULL;
+static char *M_async_shm[NPP_MAX_WORKERS]={NULL};   /* one segment per npp_app worker */
+static mqd_t M_queue_res_w[NPP_MAX_WORKERS]={0};    /* npp_app workers' response queues (worker 0 uses G_queue_res) */
 #endif  /* NPP_ASYNC */
 #ifdef NPP_OUT_CHECK_REALLOC
 static unsigned M_out_data_allocated;
 #endif
+static bool M_watching=FALSE;               /* snippets directories watched for changes? */
+static bool M_snippets_shared=FALSE;        /* snippets mapped from npp_app's store? */
 
 
 /* prototypes */
 
+static bool read_snippets(bool first_scan);
+static void watch_snippets(void);
+static void update_snippets(void);
 static void sigdisp(int sig);
 static void clean_up(void);
+#ifdef NPP_ASYNC
+static mqd_t worker_res_queue(int wi);
+#endif
 
 
 
@@ -143,6 +160,9 @@ int main(int argc, char *argv[])
 
     /* init dummy G_connections structure ----------------------------------------- */
 
+    G_connections[0].cold = &M_conn_cold[0];
+    G_connections[NPP_CLOSING_SESSION_CI].cold = &M_conn_cold[1];
+
     COPY(G_connections[0].host, NPP_APP_DOMAIN, NPP_MAX_HOST_LEN);
     COPY(G_connections[0].app_name, NPP_APP_NAME, NPP_APP_NAME_LEN);
 
@@ -171,34 +191,6 @@ int main(int argc, char *argv[])
 #endif  /* NPP_OUT_CHECK_REALLOC */
 
 
-    /* load snippets ----------------------------------------------------- */
-
-    if ( !npp_lib_read_snippets("", 0, "snippets", TRUE, NULL) )
-    {
-        ERR("npp_lib_read_snippets() failed");
-        npp_lib_done();
-        return EXIT_FAILURE;
-    }
-
-#ifdef NPP_MULTI_HOST   /* side gigs */
-
-    int i;
-
-    for ( i=1; i<G_hosts_cnt; ++i )
-    {
-        if ( G_hosts[i].snippets[0] && !npp_lib_read_snippets(G_hosts[i].host, i, G_hosts[i].snippets, TRUE, NULL) )
-        {
-            ERR("reading %s's snippets failed", G_hosts[i].host);
-            npp_lib_done();
-            return EXIT_FAILURE;
-        }
-    }
-
-#endif  /* NPP_MULTI_HOST */
-
-    qsort(&G_snippets, G_snippets_cnt, sizeof(G_snippets[0]), lib_compare_snippets);
-
-
     /* open queues ------------------------------------------------------- */
 
 #ifdef NPP_ASYNC_ID
@@ -251,6 +243,23 @@ int main(int argc, char *argv[])
 
     INF("mq_open of %s OK", G_res_queue_name);
 
+    /* load snippets ----------------------------------------------------- */
+
+    if ( npp_lib_snippets_attach() )    /* already there, published by npp_app */
+    {
+        M_snippets_shared = TRUE;
+    }
+    else
+    {
+        if ( !read_snippets(TRUE) )
+        {
+            clean_up();
+            return EXIT_FAILURE;
+        }
+
+        watch_snippets();
+    }
+
     /* ------------------------------------------------------------------- */
 
     if ( !npp_svc_init() )
@@ -305,30 +314,18 @@ int main(int argc, char *argv[])
 
                 npp_lib_init_random_numbers();
 
-                if ( !npp_lib_read_snippets("", 0, "snippets", FALSE, NULL) )
+                if ( !M_snippets_shared && !M_watching && !read_snippets(FALSE) )
                 {
-                    ERR("npp_lib_read_snippets() failed");
                     clean_up();
                     return EXIT_FAILURE;
                 }
-
-#ifdef NPP_MULTI_HOST   /* side gigs */
-
-                for ( i=1; i<G_hosts_cnt; ++i )
-                {
-                    if ( G_hosts[i].snippets[0] && !npp_lib_read_snippets(G_hosts[i].host, i, G_hosts[i].snippets, TRUE, NULL) )
-                    {
-                        ERR("reading %s's snippets failed", G_hosts[i].host);
-                        npp_lib_done();
-                        return EXIT_FAILURE;
-                    }
-                }
-
-#endif  /* NPP_MULTI_HOST */
-
-                qsort(&G_snippets, G_snippets_cnt, sizeof(G_snippets[0]), lib_compare_snippets);
             }
 
+            if ( M_snippets_shared )    /* switch to the newer generation */
+                npp_lib_snippets_refresh();
+            else if ( M_watching )      /* only what's changed since the last call */
+                update_snippets();
+
             DBG_T("Message received");
 
             if ( G_logLevel > LOG_INF )
@@ -346,7 +343,7 @@ int main(int argc, char *argv[])
 
             strcpy(G_connections[0].ip, G_svc_req.hdr.ip);
             strcpy(G_connections[0].method, G_svc_req.hdr.method);
-            strcpy(G_connections[0].uri, G_svc_req.hdr.uri);
+            strcpy(G_connections[0].cold->uri, G_svc_req.hdr.uri);
             strcpy(G_connections[0].resource, G_svc_req.hdr.resource);
 #if NPP_RESOURCE_LEVELS > 1
             strcpy(G_connections[0].req1, G_svc_req.hdr.req1);
@@ -364,11 +361,11 @@ int main(int argc, char *argv[])
 #endif  /* NPP_RESOURCE_LEVELS > 2 */
 #endif  /* NPP_RESOURCE_LEVELS > 1 */
             strcpy(G_connections[0].id, G_svc_req.hdr.id);
-            strcpy(G_connections[0].uagent, G_svc_req.hdr.uagent);
+            strcpy(G_connections[0].cold->uagent, G_svc_req.hdr.uagent);
             G_connections[0].ua_type = G_svc_req.hdr.ua_type;
-            strcpy(G_connections[0].referer, G_svc_req.hdr.referer);
+            strcpy(G_connections[0].cold->referer, G_svc_req.hdr.referer);
             G_connections[0].clen = G_svc_req.hdr.clen;
-            strcpy(G_connections[0].in_cookie, G_svc_req.hdr.in_cookie);
+            strcpy(G_connections[0].cold->in_cookie, G_svc_req.hdr.in_cookie);
             strcpy(G_connections[0].host, G_svc_req.hdr.host);
 #ifdef NPP_MULTI_HOST
             strcpy(G_connections[0].host_normalized, G_svc_req.hdr.host_normalized);
@@ -379,7 +376,7 @@ int main(int argc, char *argv[])
             G_connections[0].in_ctype = G_svc_req.hdr.in_ctype;
             strcpy(G_connections[0].boundary, G_svc_req.hdr.boundary);
             G_connections[0].status = G_svc_req.hdr.status;
-            strcpy(G_connections[0].cust_headers, G_svc_req.hdr.cust_headers);
+            strcpy(G_connections[0].cold->cust_headers, G_svc_req.hdr.cust_headers);
             G_connections[0].cust_headers_len = G_svc_req.hdr.cust_headers_len;
             G_connections[0].out_ctype = G_svc_req.hdr.out_ctype;
             strcpy(G_connections[0].ctypestr, G_svc_req.hdr.ctypestr);
@@ -388,9 +385,9 @@ int main(int argc, char *argv[])
             strcpy(G_connections[0].cookie_out_a_exp, G_svc_req.hdr.cookie_out_a_exp);
             strcpy(G_connections[0].cookie_out_l, G_svc_req.hdr.cookie_out_l);
             strcpy(G_connections[0].cookie_out_l_exp, G_svc_req.hdr.cookie_out_l_exp);
-            strcpy(G_connections[0].location, G_svc_req.hdr.location);
+            strcpy(G_connections[0].cold->location, G_svc_req.hdr.location);
             G_svc_si = G_svc_req.hdr.si;    /* original si */
-            G_connections[0].flags = G_svc_req.hdr.flags;
+            G_conn_hot[0].flags = G_svc_req.hdr.flags;
 
             /* For POST, the payload can be in the data space of the message,
                or -- if it's bigger -- in the shared memory */
@@ -416,19 +413,27 @@ int main(int argc, char *argv[])
                         INF("Reallocated in_data, new size = %u bytes", G_svc_req.hdr.clen+1);
                     }
 
-                    if ( !M_async_shm )
+                    int wi = G_svc_req.hdr.wi;
+
+                    if ( wi < 0 || wi >= NPP_MAX_WORKERS )
                     {
-                        if ( (M_async_shm=npp_lib_shm_create(NPP_MAX_PAYLOAD_SIZE, 0)) == NULL )
+                        ERR("Invalid worker index (%d)", wi);
+                        continue;
+                    }
+
+                    if ( !M_async_shm[wi] )
+                    {
+                        if ( (M_async_shm[wi]=npp_lib_shm_create(NPP_MAX_PAYLOAD_SIZE, wi)) == NULL )
                         {
                             ERR("Couldn't attach to SHM");
                             continue;
                         }
                     }
 
-                    memcpy(G_connections[0].in_data, M_async_shm, G_svc_req.hdr.clen+1);
+                    memcpy(G_connections[0].in_data, M_async_shm[wi], G_svc_req.hdr.clen+1);
 
                     /* mark it as free */
-                    M_async_shm[NPP_MAX_PAYLOAD_SIZE-1] = 0;
+                    M_async_shm[wi][NPP_MAX_PAYLOAD_SIZE-1] = 0;
                 }
             }
 
@@ -484,7 +489,7 @@ int main(int argc, char *argv[])
                 G_svc_res.hdr.err_code = G_error_code;
 
                 G_svc_res.hdr.status = G_connections[0].status;
-                strcpy(G_svc_res.hdr.cust_headers, G_connections[0].cust_headers);
+                strcpy(G_svc_res.hdr.cust_headers, G_connections[0].cold->cust_headers);
                 G_svc_res.hdr.cust_headers_len = G_connections[0].cust_headers_len;
                 G_svc_res.hdr.out_ctype = G_connections[0].out_ctype;
                 strcpy(G_svc_res.hdr.ctypestr, G_connections[0].ctypestr);
@@ -493,13 +498,13 @@ int main(int argc, char *argv[])
                 strcpy(G_svc_res.hdr.cookie_out_a_exp, G_connections[0].cookie_out_a_exp);
                 strcpy(G_svc_res.hdr.cookie_out_l, G_connections[0].cookie_out_l);
                 strcpy(G_svc_res.hdr.cookie_out_l_exp, G_connections[0].cookie_out_l_exp);
-                strcpy(G_svc_res.hdr.location, G_connections[0].location);
+                strcpy(G_svc_res.hdr.location, G_connections[0].cold->location);
 
                 G_svc_res.hdr.call_http_status = G_call_http_status;
                 G_svc_res.hdr.call_http_req_cnt = G_call_http_req_cnt;  /* only for this async call */
                 G_svc_res.hdr.call_http_elapsed = G_call_http_elapsed;  /* only for this async call */
 
-                G_svc_res.hdr.flags = G_connections[0].flags;
+                G_svc_res.hdr.flags = G_conn_hot[0].flags;
 
                 /* user session */
 
@@ -507,6 +512,10 @@ int main(int argc, char *argv[])
 #ifdef NPP_ASYNC_INCLUDE_SESSION_DATA
                 memcpy(&G_svc_res.hdr.app_session_data, &G_app_session_data[1], sizeof(app_session_data_t));
 #endif
+                /* send it back to the npp_app worker that asked */
+
+                mqd_t queue_res = worker_res_queue(G_svc_req.hdr.wi);
+
                 /* data */
 
                 unsigned data_len, chunk_num=0, data_sent;
@@ -555,7 +564,7 @@ int main(int argc, char *argv[])
 
                 DBG("Sending 0-th chunk, chunk data length = %d", G_svc_res.len);
 
-                if ( mq_send(G_queue_res, (char*)&G_svc_res, NPP_ASYNC_RES_MSG_SIZE, 0) != 0 )
+                if ( mq_send(queue_res, (char*)&G_svc_res, NPP_ASYNC_RES_MSG_SIZE, 0) != 0 )
                     ERR("mq_send failed, errno = %d (%s)", errno, strerror(errno));
 
                 data_sent = G_svc_res.len;
@@ -583,7 +592,7 @@ int main(int argc, char *argv[])
 
                     DBG("Sending %u-th chunk, chunk data length = %d", chunk_num, resd.len);
 
-                    if ( mq_send(G_queue_res, (char*)&resd, NPP_ASYNC_RES_MSG_SIZE, 0) != 0 )
+                    if ( mq_send(queue_res, (char*)&resd, NPP_ASYNC_RES_MSG_SIZE, 0) != 0 )
                         ERR("mq_send failed, errno = %d (%s)", errno, strerror(errno));
 
                     data_sent += resd.len;
@@ -649,8 +658,8 @@ int npp_eng_session_start(int ci, const char *sessid)
 
     strcpy(SESSION.sessid, new_sessid);
     strcpy(SESSION.ip, G_connections[ci].ip);
-    strcpy(SESSION.uagent, G_connections[ci].uagent);
-    strcpy(SESSION.referer, G_connections[ci].referer);
+    strcpy(SESSION.uagent, G_connections[ci].cold->uagent);
+    strcpy(SESSION.referer, G_connections[ci].cold->referer);
     strcpy(SESSION.lang, G_connections[ci].lang);
     SESSION.formats = G_connections[ci].formats;
 
@@ -754,6 +763,156 @@ void npp_svc_out_check_realloc_bin(const char *data, int len)
 }
 
 
+/* --------------------------------------------------------------------------
+   Write formatted string straight to output buffer
+   Resize it and format again only if it didn't fit
+-------------------------------------------------------------------------- */
+void npp_svc_out_fmt(const char *fmt, ...)
+{
+    va_list  plist;
+#ifdef NPP_OUT_CHECK_REALLOC
+    unsigned used = G_svc_p_content - G_svc_out_data;
+    unsigned available = M_out_data_allocated - used;
+#else
+    unsigned used = G_svc_p_content - G_svc_res.data;
+    unsigned available = G_async_res_data_size - used;
+#endif
+    int      len;
+
+    va_start(plist, fmt);
+    len = vsnprintf(G_svc_p_content, available, fmt, plist);
+    va_end(plist);
+
+    if ( len < 0 ) return;
+
+    if ( (unsigned)len >= available )   /* didn't fit */
+    {
+#ifdef NPP_OUT_CHECK_REALLOC
+        unsigned size = M_out_data_allocated * 2;
+
+        while ( size - used <= (unsigned)len )
+            size *= 2;
+
+        char *tmp = (char*)realloc(G_svc_out_data, size);
+        if ( !tmp )
+        {
+            ERR("Couldn't reallocate output buffer, tried %u bytes", size);
+            if ( available )    /* drop the truncated part, G_svc_p_content is past the end when full */
+                *G_svc_p_content = EOS;
+            return;
+        }
+        G_svc_out_data = tmp;
+        M_out_data_allocated = size;
+        G_svc_p_content = G_svc_out_data + used;
+        INF("Reallocated output buffer, new size = %u bytes", M_out_data_allocated);
+
+        va_start(plist, fmt);
+        vsnprintf(G_svc_p_content, size - used, fmt, plist);
+        va_end(plist);
+#else
+        if ( !available ) return;   /* full already */
+        len = available - 1;    /* let's keep only what fit. WARNING: no UTF-8 checking is done here! */
+#endif  /* NPP_OUT_CHECK_REALLOC */
+    }
+
+    G_svc_p_content += len;
+}
+
+
+/* --------------------------------------------------------------------------
+   Write integer to output buffer
+-------------------------------------------------------------------------- */
+void npp_svc_out_int(long long val)
+{
+    char buf[24];
+    char *p = buf + sizeof(buf);
+    unsigned long long u = val < 0 ? -(unsigned long long)val : val;
+
+    *--p = EOS;
+
+    do
+        *--p = '0' + u % 10;
+    while ( (u /= 10) != 0 );
+
+    if ( val < 0 )
+        *--p = '-';
+
+    OUTSS(p);
+}
+
+
+/* --------------------------------------------------------------------------
+   Read snippets from disk, side gigs' too
+-------------------------------------------------------------------------- */
+static bool read_snippets(bool first_scan)
+{
+    if ( !npp_lib_read_snippets("", 0, "snippets", first_scan, NULL) )
+    {
+        ERR("npp_lib_read_snippets() failed");
+        return FALSE;
+    }
+
+#ifdef NPP_MULTI_HOST   /* side gigs */
+
+    int i;
+
+    for ( i=1; i<G_hosts_cnt; ++i )
+    {
+        if ( G_hosts[i].snippets[0] && !npp_lib_read_snippets(G_hosts[i].host, i, G_hosts[i].snippets, first_scan, NULL) )
+        {
+            ERR("reading %s's snippets failed", G_hosts[i].host);
+            return FALSE;
+        }
+    }
+
+#endif  /* NPP_MULTI_HOST */
+
+    qsort(&G_snippets, G_snippets_cnt, sizeof(G_snippets[0]), lib_compare_snippets);
+
+    return TRUE;
+}
+
+
+/* --------------------------------------------------------------------------
+   Watch snippets directories, so that only what's changed is re-read
+   If that's not possible, they're rescanned once a day instead
+-------------------------------------------------------------------------- */
+static void watch_snippets()
+{
+    M_watching = npp_lib_watch_start() && npp_lib_watch_dir("", 0, "snippets", STATIC_SOURCE_SNIPPETS, NULL);
+
+#ifdef NPP_MULTI_HOST   /* side gigs */
+
+    int i;
+
+    for ( i=1; M_watching && i<G_hosts_cnt; ++i )
+        M_watching = npp_lib_watch_dir(G_hosts[i].host, i, G_hosts[i].snippets, STATIC_SOURCE_SNIPPETS, NULL);
+
+#endif  /* NPP_MULTI_HOST */
+
+    if ( M_watching )
+        INF("Watching snippets directories for changes");
+}
+
+
+/* --------------------------------------------------------------------------
+   Apply changes reported by the snippets directories watch
+   Fall back to the full rescan if some were lost
+-------------------------------------------------------------------------- */
+static void update_snippets()
+{
+    npp_watch_event_t ev;
+
+    while ( npp_lib_watch_next(&ev) )
+    {
+        if ( ev.overflow )
+            read_snippets(FALSE);
+        else
+            npp_lib_update_snippets(&ev);
+    }
+}
+
+
 /* --------------------------------------------------------------------------
    Signal response
 -------------------------------------------------------------------------- */
@@ -797,7 +956,54 @@ static void clean_up()
         mq_unlink(G_res_queue_name);
     }
 
+    int wi;
+
+    for ( wi=1; wi<NPP_MAX_WORKERS; ++wi )
+    {
+        if ( M_queue_res_w[wi] > 0 )
+            mq_close(M_queue_res_w[wi]);
+    }
+
 #endif  /* NPP_ASYNC */
 
     npp_lib_done();
 }
+
+
+#ifdef NPP_ASYNC
+/* --------------------------------------------------------------------------
+   Return response queue of the npp_app worker
+   Other than worker 0 are opened on first use
+-------------------------------------------------------------------------- */
+static mqd_t worker_res_queue(int wi)
+{
+    if ( wi == 0 ) return G_queue_res;
+
+    if ( wi < 0 || wi >= NPP_MAX_WORKERS )
+    {
+        ERR("Invalid worker index (%d)", wi);
+        return (mqd_t)-1;
+    }
+
+    if ( M_queue_res_w[wi] > 0 ) return M_queue_res_w[wi];
+
+    char name[300];
+
+    sprintf(name, "%s_w%d", G_res_queue_name, wi);
+
+    DBG("Opening worker's response queue [%s]", name);
+
+    M_queue_res_w[wi] = mq_open(name, O_WRONLY, NULL, NULL);
+
+    if ( M_queue_res_w[wi] < 0 )
+    {
+        ERR("mq_open for %s failed, errno = %d (%s)", name, errno, strerror(errno));
+        M_queue_res_w[wi] = 0;
+        return (mqd_t)-1;
+    }
+
+    INF("mq_open of %s OK", name);
+
+    return M_queue_res_w[wi];
+}
+#endif  /* NPP_ASYNC */
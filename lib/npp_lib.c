@@ -37,6 +37,11 @@
 #include <locale.h>
 #endif
 
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#endif
+
 
 
 /* globals (see npp.h for comments) */
@@ -74,7 +79,12 @@ npp_host_t  G_hosts[NPP_MAX_HOSTS]={{"", "res", "resmin", "snippets", NPP_REQUIR
 int         G_hosts_cnt=1;
 #endif
 
-sessions_idx_t G_sessions_idx[NPP_MAX_SESSIONS]={0};
+#ifdef NPP_APP
+sessions_idx_t *G_sessions_idx=NULL;        /* allocated by the engine (maxSessions) */
+#else
+static sessions_idx_t M_sessions_idx[NPP_MAX_SESSIONS]={0};
+sessions_idx_t *G_sessions_idx=M_sessions_idx;
+#endif
 
 #if __GNUC__ < 6
 #pragma GCC diagnostic push
@@ -120,6 +130,22 @@ static char M_md_list_type;
 static int  M_shmid[NPP_MAX_SHM_SEGMENTS]={0}; /* SHM id-s */
 #endif
 
+#ifdef __linux__
+static int  M_watch_fd=-1;              /* inotify instance */
+static npp_watch_t M_watches[NPP_MAX_WATCHES]={0};
+static int  M_watches_cnt=0;
+static char M_watch_buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+static int  M_watch_len=0;              /* bytes read into M_watch_buf */
+static int  M_watch_pos=0;              /* next event in M_watch_buf */
+#endif
+
+static unsigned M_snippets_gen=0;       /* G_snippets changes */
+#if defined NPP_ASYNC && defined __linux__
+static unsigned M_snippets_published=UINT_MAX; /* M_snippets_gen in the shared store */
+static char *M_snippets_store=NULL;     /* mapped shared store (npp_svc) */
+static unsigned M_snippets_store_size=0;
+#endif
+
 #if __GNUC__ < 6
 #pragma GCC diagnostic pop  /* end of -Wmissing-braces */
 #endif
@@ -2085,6 +2111,147 @@ static int get_snippet_idx(const char *name)
 #endif  /* NPP_MULTI_HOST */
 
 
+/* --------------------------------------------------------------------------
+   Remove snippet whose file is gone
+   It goes to the end after sorting, then G_snippets_cnt needs decreasing
+-------------------------------------------------------------------------- */
+static void remove_snippet(int i)
+{
+    INF("Removing %s from snippets", G_snippets[i].name);
+
+#ifdef NPP_MULTI_HOST
+    G_snippets[i].host[0] = EOS;
+    G_snippets[i].host_id = NPP_MAX_HOSTS;
+#endif  /* NPP_MULTI_HOST */
+
+    memset(G_snippets[i].name, 'z', NPP_STATIC_PATH_LEN);
+    G_snippets[i].name[NPP_STATIC_PATH_LEN] = EOS;
+
+    free(G_snippets[i].data);
+    G_snippets[i].data = NULL;
+    G_snippets[i].len = 0;
+
+    ++M_snippets_gen;
+}
+
+
+/* --------------------------------------------------------------------------
+   Read one snippet file
+-------------------------------------------------------------------------- */
+static bool read_snippet(const char *host, int host_id, bool first_scan, const char *resname, const char *namewpath, const struct stat *fstat)
+{
+    int     i;
+    FILE    *fd;
+
+    /* already read? */
+
+    bool reread = FALSE;
+
+    if ( !first_scan )
+    {
+#ifdef NPP_MULTI_HOST
+        i = get_snippet_idx(host_id, resname);
+#else
+        i = get_snippet_idx(resname);
+#endif
+        if ( i != -1 )  /* already read */
+        {
+//            DDBG("%s already read", resname);
+
+            if ( G_snippets[i].modified == fstat->st_mtime )
+            {
+//                DDBG("Not modified");
+                return TRUE;    /* not modified */
+            }
+            else
+            {
+                INF("%s has been modified", resname);
+                reread = TRUE;
+            }
+        }
+    }
+
+    if ( !reread )  /* first time on the list */
+    {
+        i = G_snippets_cnt;
+
+        /* host -- already uppercase */
+
+        strcpy(G_snippets[i].host, host);
+        G_snippets[i].host_id = host_id;
+
+        /* file name */
+
+        strcpy(G_snippets[i].name, resname);
+    }
+
+    /* last modified */
+
+    G_snippets[i].modified = fstat->st_mtime;
+
+    /* size and content */
+
+#ifdef _WIN32   /* Windows */
+    if ( NULL == (fd=fopen(namewpath, "rb")) )
+#else
+    if ( NULL == (fd=fopen(namewpath, "r")) )
+#endif  /* _WIN32 */
+        ERR("Couldn't open %s", namewpath);
+    else
+    {
+        fseek(fd, 0, SEEK_END);     /* determine the file size */
+        G_snippets[i].len = ftell(fd);
+        rewind(fd);
+
+        /* allocate the final destination */
+
+        if ( reread )
+        {
+            free(G_snippets[i].data);
+            G_snippets[i].data = NULL;
+        }
+
+        G_snippets[i].data = (char*)malloc(G_snippets[i].len+1);
+
+        if ( NULL == G_snippets[i].data )
+        {
+            ERR("Couldn't allocate %u bytes for %s", G_snippets[i].len+1, G_snippets[i].name);
+            fclose(fd);
+            return FALSE;
+        }
+
+        if ( fread(G_snippets[i].data, G_snippets[i].len, 1, fd) != 1 )
+        {
+            ERR("Couldn't read from %s", G_snippets[i].name);
+            fclose(fd);
+            return FALSE;
+        }
+
+        fclose(fd);
+
+        *(G_snippets[i].data+G_snippets[i].len) = EOS;
+
+        /* log file info ----------------------------------- */
+
+        if ( G_logLevel > LOG_INF )
+        {
+            G_ptm = gmtime(&G_snippets[i].modified);
+            char mod_time[128];
+            sprintf(mod_time, "%d-%02d-%02d %02d:%02d:%02d", G_ptm->tm_year+1900, G_ptm->tm_mon+1, G_ptm->tm_mday, G_ptm->tm_hour, G_ptm->tm_min, G_ptm->tm_sec);
+            G_ptm = gmtime(&G_now);     /* set it back */
+            DBG("%s %s\t\t%u bytes", npp_add_spaces(G_snippets[i].name, 28), mod_time, G_snippets[i].len);
+        }
+
+        if ( !reread )
+            ++G_snippets_cnt;
+
+        ++M_snippets_gen;
+    }
+
+    return TRUE;
+}
+
+
 /* --------------------------------------------------------------------------
    Read snippets from disk
    Unlike res or resmin, snippets need to be available
@@ -2100,7 +2267,6 @@ bool npp_lib_read_snippets(const char *host, int host_id, const char *directory,
     char    fullpath[NPP_STATIC_PATH_LEN*2];
     DIR     *dir;
     struct dirent *dirent;
-    FILE    *fd;
     struct stat fstat;
 
     if ( directory == NULL || directory[0] == EOS ) return TRUE;
@@ -2181,20 +2347,7 @@ bool npp_lib_read_snippets(const char *host, int host_id, const char *directory,
 
             if ( !npp_file_exists(fullpath) )
             {
-                INF("Removing %s from snippets", G_snippets[i].name);
-
-#ifdef NPP_MULTI_HOST
-                G_snippets[i].host[0] = EOS;
-                G_snippets[i].host_id = NPP_MAX_HOSTS;
-#endif  /* NPP_MULTI_HOST */
-
-                memset(G_snippets[i].name, 'z', NPP_STATIC_PATH_LEN);
-                G_snippets[i].name[NPP_STATIC_PATH_LEN] = EOS;
-
-                free(G_snippets[i].data);
-                G_snippets[i].data = NULL;
-                G_snippets[i].len = 0;
-
+                remove_snippet(i);
                 ++removed;
             }
         }
@@ -2269,123 +2422,521 @@ bool npp_lib_read_snippets(const char *host, int host_id, const char *directory,
             continue;
         }
 
-        /* ------------------------------------------------------------------- */
-        /* already read? */
+        if ( !read_snippet(host, host_id, first_scan, resname, namewpath, &fstat) )
+        {
+            closedir(dir);
+            return FALSE;
+        }
+    }
 
-        bool reread = FALSE;
+    closedir(dir);
 
-        if ( !first_scan )
-        {
+    if ( first_scan && !path )
+    {
+        DBG("");
+        DBG("G_snippets_cnt = %d", G_snippets_cnt);
+        DBG("");
+    }
+
+    return TRUE;
+}
+
+
+/* --------------------------------------------------------------------------
+   Update one snippet or subdirectory after a change
+-------------------------------------------------------------------------- */
+bool npp_lib_update_snippets(const npp_watch_event_t *ev)
+{
+    char namewpath[NPP_STATIC_PATH_LEN*2+2];
+    struct stat fstat;
+    bool exists;
+    int  len, i, removed=0;
+
+    sprintf(namewpath, "%s/%s/%s", G_appdir, ev->directory, ev->resname);
+
+    exists = (stat(namewpath, &fstat) == 0);
+
+    if ( exists && S_ISDIR(fstat.st_mode) )     /* new directory */
+    {
+        if ( !npp_lib_read_snippets(ev->host, ev->host_id, ev->directory, FALSE, ev->resname) )
+            return FALSE;
+    }
+    else if ( exists && S_ISREG(fstat.st_mode) )
+    {
 #ifdef NPP_MULTI_HOST
-            i = get_snippet_idx(host_id, resname);
+        i = get_snippet_idx(ev->host_id, ev->resname);
 #else
-            i = get_snippet_idx(resname);
+        i = get_snippet_idx(ev->resname);
 #endif
-            if ( i != -1 )  /* already read */
-            {
-//                DDBG("%s already read", resname);
+        if ( i != -1 )
+            G_snippets[i].modified = 0;     /* re-read even if modified within the same second */
 
-                if ( G_snippets[i].modified == fstat.st_mtime )
-                {
-//                    DDBG("Not modified");
-                    continue;   /* skip to the next file */
-                }
-                else
-                {
-                    INF("%s has been modified", resname);
-                    reread = TRUE;
-                }
+        if ( !read_snippet(ev->host, ev->host_id, FALSE, ev->resname, namewpath, &fstat) )
+            return FALSE;
+    }
+    else    /* file or the whole subdirectory gone */
+    {
+        len = strlen(ev->resname);
+
+        for ( i=0; i<G_snippets_cnt; ++i )
+        {
+            if ( G_snippets[i].host_id != ev->host_id ) continue;
+
+            if ( 0==strncmp(G_snippets[i].name, ev->resname, len) && (G_snippets[i].name[len]==EOS || G_snippets[i].name[len]=='/') )
+            {
+                remove_snippet(i);
+                ++removed;
             }
         }
+    }
 
-        if ( !reread )  /* first time on the list */
-        {
-            i = G_snippets_cnt;
+    qsort(&G_snippets, G_snippets_cnt, sizeof(G_snippets[0]), lib_compare_snippets);
 
-            /* host -- already uppercase */
+    G_snippets_cnt -= removed;
 
-            strcpy(G_snippets[i].host, host);
-            G_snippets[i].host_id = host_id;
+    return TRUE;
+}
 
-            /* file name */
 
-            strcpy(G_snippets[i].name, resname);
-        }
+#ifdef __linux__
+/* --------------------------------------------------------------------------
+   Find watch by its descriptor (-1 = free slot)
+-------------------------------------------------------------------------- */
+static int watch_idx(int wd)
+{
+    int i;
 
-        /* last modified */
+    for ( i=0; i<M_watches_cnt; ++i )
+    {
+        if ( M_watches[i].wd == wd )
+            return i;
+    }
 
-        G_snippets[i].modified = fstat.st_mtime;
+    return -1;
+}
+#endif  /* __linux__ */
 
-        /* size and content */
 
-#ifdef _WIN32   /* Windows */
-        if ( NULL == (fd=fopen(namewpath, "rb")) )
+/* --------------------------------------------------------------------------
+   Start watching resource directories for changes (inotify)
+   Return FALSE where it's not available
+-------------------------------------------------------------------------- */
+bool npp_lib_watch_start()
+{
+#ifdef __linux__
+
+    if ( (M_watch_fd=inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1 )
+    {
+        WAR("inotify_init1 failed, errno = %d (%s)", errno, strerror(errno));
+        return FALSE;
+    }
+
+    M_watches_cnt = 0;
+    M_watch_len = 0;
+    M_watch_pos = 0;
+
+    return TRUE;
+
 #else
-        if ( NULL == (fd=fopen(namewpath, "r")) )
-#endif  /* _WIN32 */
-            ERR("Couldn't open %s", namewpath);
-        else
+
+    return FALSE;
+
+#endif  /* __linux__ */
+}
+
+
+/* --------------------------------------------------------------------------
+   Watch resource directory and its subdirectories
+   path is a relative path under directory
+   Return FALSE if any of them couldn't be watched
+-------------------------------------------------------------------------- */
+bool npp_lib_watch_dir(const char *host, int host_id, const char *directory, char source, const char *path)
+{
+#ifdef __linux__
+
+    char    dirpath[NPP_STATIC_PATH_LEN*2+2];
+    char    subpath[NPP_STATIC_PATH_LEN+1];
+    char    namewpath[NPP_STATIC_PATH_LEN*3+3];
+    DIR     *dir;
+    struct dirent *dirent;
+    struct stat fstat;
+    int     wd, i;
+    bool    ret=TRUE;
+
+    if ( M_watch_fd == -1 ) return FALSE;
+
+    if ( directory == NULL || directory[0] == EOS || G_appdir[0] == EOS ) return TRUE;
+
+    if ( !path )
+        sprintf(dirpath, "%s/%s", G_appdir, directory);
+    else
+        sprintf(dirpath, "%s/%s/%s", G_appdir, directory, path);
+
+    if ( (wd=inotify_add_watch(M_watch_fd, dirpath, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_CREATE | IN_ONLYDIR)) == -1 )
+    {
+        if ( errno == ENOENT )  /* no such directory, nothing to watch */
+            return TRUE;
+
+        WAR("inotify_add_watch for %s failed, errno = %d (%s)", dirpath, errno, strerror(errno));
+        return FALSE;
+    }
+
+    if ( (i=watch_idx(wd)) == -1 && (i=watch_idx(-1)) == -1 )
+    {
+        if ( M_watches_cnt == NPP_MAX_WATCHES )
         {
-            fseek(fd, 0, SEEK_END);     /* determine the file size */
-            G_snippets[i].len = ftell(fd);
-            rewind(fd);
+            WAR("M_watches_cnt at max (%d)!", NPP_MAX_WATCHES);
+            inotify_rm_watch(M_watch_fd, wd);
+            return FALSE;
+        }
+
+        i = M_watches_cnt++;
+    }
+
+    M_watches[i].wd = wd;
+    strcpy(M_watches[i].host, host);
+    M_watches[i].host_id = host_id;
+    strcpy(M_watches[i].directory, directory);
+    M_watches[i].source = source;
+    strcpy(M_watches[i].path, path?path:"");
+
+    DDBG("Watching %s", dirpath);
+
+    /* subdirectories */
+
+    if ( (dir=opendir(dirpath)) == NULL )
+        return TRUE;
+
+    while ( (dirent=readdir(dir)) )
+    {
+        if ( dirent->d_name[0] == '.' )   /* skip ".", ".." and hidden ones */
+            continue;
+
+        if ( !path )
+            strcpy(subpath, dirent->d_name);
+        else
+            sprintf(subpath, "%s/%s", path, dirent->d_name);
+
+        sprintf(namewpath, "%s/%s", dirpath, dirent->d_name);
+
+        if ( stat(namewpath, &fstat) == 0 && S_ISDIR(fstat.st_mode) && !npp_lib_watch_dir(host, host_id, directory, source, subpath) )
+            ret = FALSE;
+    }
+
+    closedir(dir);
 
-            /* allocate the final destination */
+    return ret;
+
+#else
 
-            if ( reread )
+    return FALSE;
+
+#endif  /* __linux__ */
+}
+
+
+/* --------------------------------------------------------------------------
+   Get the next change in watched directories, without blocking
+   Files are reported when they're closed after writing, moved or deleted,
+   subdirectories when they're created, moved or deleted
+   Return FALSE if there's nothing more
+-------------------------------------------------------------------------- */
+bool npp_lib_watch_next(npp_watch_event_t *ev)
+{
+#ifdef __linux__
+
+    const struct inotify_event *ie;
+    int  i, len;
+
+    if ( M_watch_fd == -1 ) return FALSE;
+
+    while ( TRUE )
+    {
+        if ( M_watch_pos >= M_watch_len )
+        {
+            M_watch_pos = 0;
+
+            if ( (M_watch_len=read(M_watch_fd, M_watch_buf, sizeof(M_watch_buf))) <= 0 )
             {
-                free(G_snippets[i].data);
-                G_snippets[i].data = NULL;
+                M_watch_len = 0;
+                return FALSE;   /* EAGAIN -- nothing more */
             }
+        }
+
+        ie = (const struct inotify_event*)(M_watch_buf + M_watch_pos);
+        M_watch_pos += sizeof(struct inotify_event) + ie->len;
+
+        if ( ie->mask & IN_Q_OVERFLOW )
+        {
+            WAR("inotify queue overflow");
+            ev->overflow = TRUE;
+            return TRUE;
+        }
 
-            G_snippets[i].data = (char*)malloc(G_snippets[i].len+1);
+        if ( (i=watch_idx(ie->wd)) == -1 )
+            continue;
+
+        if ( ie->mask & IN_IGNORED )    /* directory deleted or unwatched */
+        {
+            M_watches[i].wd = -1;
+            continue;
+        }
+
+        if ( !ie->len || ie->name[0] == '.' )   /* hidden files, editors' temporary ones */
+            continue;
+
+        if ( !(ie->mask & IN_ISDIR) && (ie->mask & IN_CREATE) )  /* wait until it's written */
+            continue;
+
+        strcpy(ev->host, M_watches[i].host);
+        ev->host_id = M_watches[i].host_id;
+        strcpy(ev->directory, M_watches[i].directory);
+        ev->source = M_watches[i].source;
+
+        if ( M_watches[i].path[0] )
+            sprintf(ev->resname, "%s/%s", M_watches[i].path, ie->name);
+        else
+            strcpy(ev->resname, ie->name);
+
+        ev->overflow = FALSE;
 
-            if ( NULL == G_snippets[i].data )
+        if ( ie->mask & IN_ISDIR )
+        {
+            if ( ie->mask & (IN_CREATE | IN_MOVED_TO) )
             {
-                ERR("Couldn't allocate %u bytes for %s", G_snippets[i].len+1, G_snippets[i].name);
-                fclose(fd);
-                closedir(dir);
-                return FALSE;
+                npp_lib_watch_dir(ev->host, ev->host_id, ev->directory, ev->source, ev->resname);
             }
-
-            if ( fread(G_snippets[i].data, G_snippets[i].len, 1, fd) != 1 )
+            else if ( ie->mask & IN_MOVED_FROM )    /* deleted ones are unwatched by the kernel */
             {
-                ERR("Couldn't read from %s", G_snippets[i].name);
-                fclose(fd);
-                closedir(dir);
-                return FALSE;
+                len = strlen(ev->resname);
+
+                for ( i=0; i<M_watches_cnt; ++i )
+                {
+                    if ( M_watches[i].wd != -1 && M_watches[i].host_id == ev->host_id && M_watches[i].source == ev->source
+                            && 0==strncmp(M_watches[i].path, ev->resname, len) && (M_watches[i].path[len]==EOS || M_watches[i].path[len]=='/') )
+                        inotify_rm_watch(M_watch_fd, M_watches[i].wd);
+                }
             }
+        }
 
-            fclose(fd);
+        return TRUE;
+    }
 
-            *(G_snippets[i].data+G_snippets[i].len) = EOS;
+#else
 
-            /* log file info ----------------------------------- */
+    return FALSE;
 
-            if ( G_logLevel > LOG_INF )
-            {
-                G_ptm = gmtime(&G_snippets[i].modified);
-                char mod_time[128];
-                sprintf(mod_time, "%d-%02d-%02d %02d:%02d:%02d", G_ptm->tm_year+1900, G_ptm->tm_mon+1, G_ptm->tm_mday, G_ptm->tm_hour, G_ptm->tm_min, G_ptm->tm_sec);
-                G_ptm = gmtime(&G_now);     /* set it back */
-                DBG("%s %s\t\t%u bytes", npp_add_spaces(G_snippets[i].name, 28), mod_time, G_snippets[i].len);
-            }
+#endif  /* __linux__ */
+}
+
+
+#if defined NPP_ASYNC && defined __linux__
+/* --------------------------------------------------------------------------
+   Shared snippets store path
+   The name follows the request queue's, so that it's per application
+-------------------------------------------------------------------------- */
+static void snippets_store_path(char *path)
+{
+    sprintf(path, "/dev/shm%s_snippets", G_req_queue_name);
+}
+#endif  /* NPP_ASYNC && __linux__ */
+
+
+/* --------------------------------------------------------------------------
+   Publish snippets for npp_svc processes (npp_app)
+   The new generation is written aside and renamed over the current one,
+   which is then marked stale for its readers to switch
+   Does nothing if snippets haven't changed since the last time
+-------------------------------------------------------------------------- */
+bool npp_lib_snippets_publish()
+{
+#if defined NPP_ASYNC && defined __linux__
+
+    char     path[512];
+    char     tmp[520];
+    unsigned size, off;
+    int      fd, old_fd, i;
+    char     *store;
+
+    if ( M_snippets_gen == M_snippets_published ) return TRUE;
+
+    snippets_store_path(path);
+    sprintf(tmp, "%s.tmp", path);
+
+    size = sizeof(npp_snippets_store_t) + G_snippets_cnt * (sizeof(snippet_t) + sizeof(unsigned));
+
+    for ( i=0; i<G_snippets_cnt; ++i )
+        size += G_snippets[i].len + 1;
 
-            if ( !reread )
-                ++G_snippets_cnt;
+    if ( (fd=open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) == -1 )
+    {
+        ERR("Couldn't create %s, errno = %d (%s)", tmp, errno, strerror(errno));
+        return FALSE;
+    }
+
+    if ( ftruncate(fd, size) != 0 )
+    {
+        ERR("ftruncate of %s failed, errno = %d (%s)", tmp, errno, strerror(errno));
+        close(fd);
+        unlink(tmp);
+        return FALSE;
+    }
+
+    store = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    close(fd);
+
+    if ( store == MAP_FAILED )
+    {
+        ERR("Couldn't mmap %u bytes of %s, errno = %d (%s)", size, tmp, errno, strerror(errno));
+        unlink(tmp);
+        return FALSE;
+    }
+
+    npp_snippets_store_t *hdr = (npp_snippets_store_t*)store;
+    snippet_t *entries = (snippet_t*)(store + sizeof(npp_snippets_store_t));
+    unsigned *offsets = (unsigned*)(entries + G_snippets_cnt);
+
+    hdr->stale = 0;
+    hdr->generation = M_snippets_gen;
+    hdr->cnt = G_snippets_cnt;
+    hdr->size = size;
+
+    off = (char*)(offsets + G_snippets_cnt) - store;
+
+    for ( i=0; i<G_snippets_cnt; ++i )
+    {
+        entries[i] = G_snippets[i];
+        entries[i].data = NULL;
+        offsets[i] = off;
+        memcpy(store+off, G_snippets[i].data, G_snippets[i].len);
+        store[off+G_snippets[i].len] = EOS;
+        off += G_snippets[i].len + 1;
+    }
+
+    munmap(store, size);
+
+    /* generation swap */
+
+    old_fd = open(path, O_RDWR | O_CLOEXEC);
+
+    if ( rename(tmp, path) != 0 )
+    {
+        ERR("Couldn't rename %s, errno = %d (%s)", tmp, errno, strerror(errno));
+        if ( old_fd != -1 ) close(old_fd);
+        unlink(tmp);
+        return FALSE;
+    }
+
+    if ( old_fd != -1 )
+    {
+        npp_snippets_store_t *old = (npp_snippets_store_t*)mmap(NULL, sizeof(npp_snippets_store_t), PROT_READ | PROT_WRITE, MAP_SHARED, old_fd, 0);
+
+        if ( old != MAP_FAILED )
+        {
+            old->stale = 1;
+            munmap(old, sizeof(npp_snippets_store_t));
         }
+
+        close(old_fd);
     }
 
-    closedir(dir);
+    M_snippets_published = M_snippets_gen;
 
-    if ( first_scan && !path )
+    INF("%d snippets published to %s (%u bytes)", G_snippets_cnt, path, size);
+
+    return TRUE;
+
+#else
+
+    return FALSE;
+
+#endif  /* NPP_ASYNC && __linux__ */
+}
+
+
+/* --------------------------------------------------------------------------
+   Map snippets published by npp_app instead of reading them (npp_svc)
+   G_snippets content points to the store
+   Return FALSE if there's none
+-------------------------------------------------------------------------- */
+bool npp_lib_snippets_attach()
+{
+#if defined NPP_ASYNC && defined __linux__
+
+    char     path[512];
+    struct stat st;
+    int      fd, i;
+    char     *store;
+
+    snippets_store_path(path);
+
+    if ( (fd=open(path, O_RDONLY | O_CLOEXEC)) == -1 )
+        return FALSE;
+
+    if ( fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(npp_snippets_store_t) )
     {
-        DBG("");
-        DBG("G_snippets_cnt = %d", G_snippets_cnt);
-        DBG("");
+        close(fd);
+        return FALSE;
     }
 
+    store = (char*)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+    close(fd);
+
+    if ( store == MAP_FAILED )
+    {
+        ERR("Couldn't mmap %s, errno = %d (%s)", path, errno, strerror(errno));
+        return FALSE;
+    }
+
+    const npp_snippets_store_t *hdr = (npp_snippets_store_t*)store;
+
+    if ( hdr->size != (unsigned)st.st_size || hdr->cnt > NPP_MAX_SNIPPETS )
+    {
+        WAR("%s is invalid", path);
+        munmap(store, st.st_size);
+        return FALSE;
+    }
+
+    const snippet_t *entries = (snippet_t*)(store + sizeof(npp_snippets_store_t));
+    const unsigned *offsets = (unsigned*)(entries + hdr->cnt);
+
+    for ( i=0; i<hdr->cnt; ++i )
+    {
+        G_snippets[i] = entries[i];
+        G_snippets[i].data = store + offsets[i];
+    }
+
+    G_snippets_cnt = hdr->cnt;
+
+    if ( M_snippets_store )     /* previous generation */
+        munmap(M_snippets_store, M_snippets_store_size);
+
+    M_snippets_store = store;
+    M_snippets_store_size = hdr->size;
+
+    INF("%d snippets attached from %s, generation %u", G_snippets_cnt, path, hdr->generation);
+
     return TRUE;
+
+#else
+
+    return FALSE;
+
+#endif  /* NPP_ASYNC && __linux__ */
+}
+
+
+/* --------------------------------------------------------------------------
+   Switch to the newer snippets generation if there's one (npp_svc)
+-------------------------------------------------------------------------- */
+void npp_lib_snippets_refresh()
+{
+#if defined NPP_ASYNC && defined __linux__
+    if ( M_snippets_store && ((volatile npp_snippets_store_t*)M_snippets_store)->stale )
+        npp_lib_snippets_attach();
+#endif
 }
 
 
@@ -3065,7 +3616,7 @@ static bool get_qs_param_raw(int ci, const char *name, char *retbuf, size_t maxl
 
     DDBG("get_qs_param_raw: name [%s]", name);
 
-    if ( NPP_CONN_IS_PAYLOAD(G_connections[ci].flags) )
+    if ( NPP_CONN_IS_PAYLOAD(G_conn_hot[ci].flags) )
     {
         if ( G_connections[ci].in_ctype == NPP_CONTENT_TYPE_JSON )
         {
@@ -3086,7 +3637,7 @@ static bool get_qs_param_raw(int ci, const char *name, char *retbuf, size_t maxl
     }
     else    /* GET */
     {
-        qs = strchr(G_connections[ci].uri, '?');
+        qs = strchr(G_connections[ci].cold->uri, '?');
     }
 
     if ( qs == NULL )
@@ -3095,11 +3646,11 @@ static bool get_qs_param_raw(int ci, const char *name, char *retbuf, size_t maxl
         return FALSE;
     }
 
-    if ( !NPP_CONN_IS_PAYLOAD(G_connections[ci].flags) )   /* GET */
+    if ( !NPP_CONN_IS_PAYLOAD(G_conn_hot[ci].flags) )   /* GET */
     {
         ++qs;      /* skip the question mark */
-        end = qs + (strlen(G_connections[ci].uri) - (qs-G_connections[ci].uri));
-        DDBG("get_qs_param_raw: qs len = %d", strlen(G_connections[ci].uri) - (qs-G_connections[ci].uri));
+        end = qs + (strlen(G_connections[ci].cold->uri) - (qs-G_connections[ci].cold->uri));
+        DDBG("get_qs_param_raw: qs len = %d", strlen(G_connections[ci].cold->uri) - (qs-G_connections[ci].cold->uri));
     }
 
     int fnamelen = strlen(name);
@@ -3618,10 +4169,10 @@ bool npp_lib_res_header(int ci, const char *hdr, const char *val)
         return FALSE;
     }
 
-    strcat(G_connections[ci].cust_headers, hdr);
-    strcat(G_connections[ci].cust_headers, ": ");
-    strcat(G_connections[ci].cust_headers, val);
-    strcat(G_connections[ci].cust_headers, "\r\n");
+    strcat(G_connections[ci].cold->cust_headers, hdr);
+    strcat(G_connections[ci].cold->cust_headers, ": ");
+    strcat(G_connections[ci].cold->cust_headers, val);
+    strcat(G_connections[ci].cold->cust_headers, "\r\n");
 
     G_connections[ci].cust_headers_len += all;
 
@@ -3656,7 +4207,7 @@ bool npp_lib_get_cookie(int ci, const char *key, char *value)
 
     sprintf(nkey, "%s=", key);
 
-    v = strstr(G_connections[ci].in_cookie, nkey);
+    v = strstr(G_connections[ci].cold->in_cookie, nkey);
 
     if ( !v ) return FALSE;
 
@@ -3781,7 +4332,7 @@ void npp_lib_set_res_location(int ci, const char *str, ...)
     va_list plist;
 
     va_start(plist, str);
-    vsprintf(G_connections[ci].location, str, plist);
+    vsprintf(G_connections[ci].cold->location, str, plist);
     va_end(plist);
 }
 
@@ -3843,6 +4394,10 @@ static void format_counters(int ci, counters_fmt_t *s, npp_counters_t *n)
     strcpy(s->visits_mob, INT(n->visits_mob));
     strcpy(s->blocked, INT(n->blocked));
     strcpy(s->average, AMT(n->average));
+    strcpy(s->compressed, INT(n->compressed));
+    strcpy(s->compress_skipped, INT(n->compress_skipped));
+    strcpy(s->compress_cheaper, INT(n->compress_cheaper));
+    strcpy(s->compress_harder, INT(n->compress_harder));
 }
 
 
@@ -4138,6 +4693,8 @@ void npp_admin_info(int ci, int users, admin_info_t ai[], int ai_cnt, bool heade
         OUT("<tr><td class=r><b>%s</b></td><td class=r>%s</td><td class=r>%s</td><td class=r>%s</td><td class=r><b>%s</b></td><td class=r>%s</td><td class=r>%s</td><td class=r>%s</td><td class=r><b>%s</b></td><td class=r>%s</td><td class=r>%s</td><td class=r>%s</td></tr>", b.visits, b.visits_dsk, b.visits_tab, b.visits_mob, y.visits, y.visits_dsk, y.visits_tab, y.visits_mob, t.visits, t.visits_dsk, t.visits_tab, t.visits_mob);
         OUT("<tr><td>attempts blocked</td><td colspan=4 class=r>%s</td><td colspan=4 class=r>%s</td><td colspan=4 class=r>%s</td></tr>", b.blocked, y.blocked, t.blocked);
         OUT("<tr><td>average</td><td colspan=4 class=r>%s ms</td><td colspan=4 class=r>%s ms</td><td colspan=4 class=r>%s ms</td></tr>", b.average, y.average, t.average);
+        OUT("<tr><td>compressed (skipped)</td><td colspan=4 class=r>%s (%s)</td><td colspan=4 class=r>%s (%s)</td><td colspan=4 class=r>%s (%s)</td></tr>", b.compressed, b.compress_skipped, y.compressed, y.compress_skipped, t.compressed, t.compress_skipped);
+        OUT("<tr><td>compression cheaper / harder</td><td colspan=4 class=r>%s / %s</td><td colspan=4 class=r>%s / %s</td><td colspan=4 class=r>%s / %s</td></tr>", b.compress_cheaper, b.compress_harder, y.compress_cheaper, y.compress_harder, t.compress_cheaper, t.compress_harder);
     }
     else    /* mobile -- 2 days' stats */
     {
@@ -4149,10 +4706,22 @@ void npp_admin_info(int ci, int users, admin_info_t ai[], int ai_cnt, bool heade
         OUT("<tr><td class=r><b>%s</b></td><td class=r>%s</td><td class=r>%s</td><td class=r>%s</td><td class=r><b>%s</b></td><td class=r>%s</td><td class=r>%s</td><td class=r>%s</td></tr>", y.visits, y.visits_dsk, y.visits_tab, y.visits_mob, t.visits, t.visits_dsk, t.visits_tab, t.visits_mob);
         OUT("<tr><td>attempts blocked</td><td colspan=4 class=r>%s</td><td colspan=4 class=r>%s</td></tr>", y.blocked, t.blocked);
         OUT("<tr><td>average</td><td colspan=4 class=r>%s ms</td><td colspan=4 class=r>%s ms</td></tr>", y.average, t.average);
+        OUT("<tr><td>compressed (skipped)</td><td colspan=4 class=r>%s (%s)</td><td colspan=4 class=r>%s (%s)</td></tr>", y.compressed, y.compress_skipped, t.compressed, t.compress_skipped);
+        OUT("<tr><td>compression cheaper / harder</td><td colspan=4 class=r>%s / %s</td><td colspan=4 class=r>%s / %s</td></tr>", y.compress_cheaper, y.compress_harder, t.compress_cheaper, t.compress_harder);
     }
 
     OUT("</table>");
 
+#ifdef NPP_APP
+    char loop_busy[64];
+    char compress_cost[64];
+
+    strcpy(loop_busy, AMT(G_loop_busy));
+    strcpy(compress_cost, AMT(G_compress_cost));
+
+    OUT("<p>Compression: level %d, threshold %s bytes, event loop %s%% busy, deflate %s ns/byte</p>", G_compress_level, INT(G_compress_treshold), loop_busy, compress_cost);
+#endif
+
     /* ------------------------------------------------------------------- */
     /* IP blacklist */
 
@@ -9669,6 +10238,10 @@ void npp_lib_read_conf(bool first)
 #ifdef NPP_APP
         G_httpPort = 80;
         G_httpsPort = 443;
+        G_workers = 1;
+        G_listenBacklog = SOMAXCONN;
+        G_maxConnections = NPP_MAX_CONNECTIONS;
+        G_maxSessions = NPP_MAX_SESSIONS;
         G_cipherList[0] = EOS;
         G_certFile[0] = EOS;
         G_certChainFile[0] = EOS;
@@ -9782,20 +10355,47 @@ void npp_lib_read_conf(bool first)
         {
             npp_read_param_int("httpPort", &G_httpPort);
             npp_read_param_int("httpsPort", &G_httpsPort);
+            npp_read_param_int("workers", &G_workers);
+            npp_read_param_int("listenBacklog", &G_listenBacklog);
+            npp_read_param_int("maxConnections", &G_maxConnections);
+            npp_read_param_int("maxSessions", &G_maxSessions);
         }
         else    /* can't change it online */
         {
             int tmp_httpPort=G_httpPort;
             int tmp_httpsPort=G_httpsPort;
+            int tmp_workers=G_workers;
+            int tmp_listenBacklog=G_listenBacklog;
+            int tmp_maxConnections=G_maxConnections;
+            int tmp_maxSessions=G_maxSessions;
 
             npp_read_param_int("httpPort", &tmp_httpPort);
             npp_read_param_int("httpsPort", &tmp_httpsPort);
+            npp_read_param_int("workers", &tmp_workers);
+            npp_read_param_int("listenBacklog", &tmp_listenBacklog);
+            npp_read_param_int("maxConnections", &tmp_maxConnections);
+            npp_read_param_int("maxSessions", &tmp_maxSessions);
 
             if ( tmp_httpPort != G_httpPort
                     || tmp_httpsPort != G_httpsPort )
             {
                 WAR("Changing listening ports requires server restart");
             }
+
+            if ( tmp_workers != G_workers )
+            {
+                WAR("Changing workers requires server restart");
+            }
+
+            if ( tmp_listenBacklog != G_listenBacklog )
+            {
+                WAR("Changing listenBacklog requires server restart");
+            }
+
+            if ( tmp_maxConnections != G_maxConnections || tmp_maxSessions != G_maxSessions )
+            {
+                WAR("Changing maxConnections or maxSessions requires server restart");
+            }
         }
 
         /* -------------------------------------------------- */
@@ -178,6 +178,9 @@
 #define NPP_MAX_SHM_SEGMENTS            100
 
 
+#define NPP_MAX_WATCHES                 1000    /* resource directories (including subdirectories) watched for changes */
+
+
 #define NPP_IS_THIS_TRUE(c)             (c=='t' || c=='T' || c=='1')
 
 
@@ -602,6 +605,38 @@ typedef struct {
 } call_http_header_t;
 
 
+/* resource directories watch */
+
+typedef struct {
+    int     wd;                                 /* inotify watch descriptor, -1 = free slot */
+    char    host[NPP_MAX_HOST_LEN+1];
+    int     host_id;
+    char    directory[256];
+    char    source;                             /* STATIC_SOURCE_XXX */
+    char    path[NPP_STATIC_PATH_LEN+1];        /* subdirectory, relative to directory */
+} npp_watch_t;
+
+typedef struct {
+    char    host[NPP_MAX_HOST_LEN+1];
+    int     host_id;
+    char    directory[256];
+    char    source;
+    char    resname[NPP_STATIC_PATH_LEN+1];     /* file or subdirectory changed, relative to directory */
+    bool    overflow;                           /* events lost, everything needs to be rescanned */
+} npp_watch_event_t;
+
+
+/* snippets shared between npp_app and npp_svc processes */
+/* followed by cnt snippet_t, cnt content offsets and the content */
+
+typedef struct {
+    char     stale;                             /* a newer generation has been published */
+    unsigned generation;
+    int      cnt;
+    unsigned size;                              /* whole store */
+} npp_snippets_store_t;
+
+
 
 /* --------------------------------------------------------------------------
    prototypes
@@ -1041,6 +1076,13 @@ extern "C" {
     bool npp_csrft_ok(int ci);
     int  lib_compare_snippets(const void *a, const void *b);
     bool npp_lib_read_snippets(const char *host, int host_id, const char *directory, bool first_scan, const char *path);
+    bool npp_lib_update_snippets(const npp_watch_event_t *ev);
+    bool npp_lib_watch_start(void);
+    bool npp_lib_watch_dir(const char *host, int host_id, const char *directory, char source, const char *path);
+    bool npp_lib_watch_next(npp_watch_event_t *ev);
+    bool npp_lib_snippets_publish(void);
+    bool npp_lib_snippets_attach(void);
+    void npp_lib_snippets_refresh(void);
     char *npp_get_snippet(int ci, const char *name);
     unsigned npp_get_snippet_len(int ci, const char *name);
 
@@ -1249,12 +1291,13 @@ void NPP_CPP_STRINGS_STRM(const std::string& str, Args&& ... args)
 #ifndef NPP_CLIENT  /* web app only */
 
 extern "C" {
-extern npp_connection_t G_connections[NPP_MAX_CONNECTIONS+2];
+extern npp_connection_t *G_connections;
+extern npp_conn_hot_t *G_conn_hot;
 
 #ifdef NPP_SVC
-void npp_svc_out_check_realloc(const char *str);
+void npp_svc_out_fmt(const char *fmt, ...);
 #else
-void npp_eng_out_check_realloc(int ci, const char *str);
+void npp_eng_out_fmt(int ci, const char *fmt, ...);
 #endif
 }   /* extern "C" */
 
@@ -1266,11 +1309,9 @@ template<typename... Args>
 void NPP_CPP_STRINGS_OUT(int ci, const std::string& str, Args&& ... args)
 {
 #ifdef NPP_SVC
-    std::snprintf(G_tmp, NPP_TMP_STR_LEN, str.c_str(), cnv_variadic_arg(std::forward<Args>(args))...);
-    npp_svc_out_check_realloc(G_tmp);
+    npp_svc_out_fmt(str.c_str(), cnv_variadic_arg(std::forward<Args>(args))...);
 #else   /* NPP_APP */
-    std::snprintf(G_tmp, NPP_TMP_STR_LEN, str.c_str(), cnv_variadic_arg(std::forward<Args>(args))...);
-    npp_eng_out_check_realloc(ci, G_tmp);
+    npp_eng_out_fmt(ci, str.c_str(), cnv_variadic_arg(std::forward<Args>(args))...);
 #endif  /* NPP_SVC */
 }
 
@@ -1281,7 +1322,7 @@ void NPP_CPP_STRINGS_OUT(int ci, const std::string& str, Args&& ... args)
 template<typename... Args>
 void npp_lib_set_res_location(int ci, const std::string& str, Args&& ... args)
 {
-    std::snprintf(G_connections[ci].location, NPP_MAX_URI_LEN, str.c_str(), cnv_variadic_arg(std::forward<Args>(args))...);
+    std::snprintf(G_connections[ci].cold->location, NPP_MAX_URI_LEN, str.c_str(), cnv_variadic_arg(std::forward<Args>(args))...);
 }
 
 
@@ -253,7 +253,7 @@ int libusr_luses_ok(int ci)
                 && G_connections[ci].host_id == G_sessions[G_connections[ci].si].host_id
 #endif
                 && 0==strcmp(G_connections[ci].cookie_in_l, G_sessions[G_connections[ci].si].sessid)
-                && 0==strcmp(G_connections[ci].uagent, G_sessions[G_connections[ci].si].uagent) )
+                && 0==strcmp(G_connections[ci].cold->uagent, G_sessions[G_connections[ci].si].uagent) )
         {
 #ifdef NPP_DEBUG
             DBG("Authenticated session found in cache, si=%d, sessid [%s] (1)", G_connections[ci].si, G_sessions[G_connections[ci].si].sessid);
@@ -277,7 +277,7 @@ int libusr_luses_ok(int ci)
         DDBG("npp_eng_find_si = %d", si);
 
         if ( si != 0
-                && 0==strcmp(G_connections[ci].uagent, G_sessions[si].uagent)
+                && 0==strcmp(G_connections[ci].cold->uagent, G_sessions[si].uagent)
                 && G_sessions[si].auth_level>AUTH_LEVEL_ANONYMOUS )
         {
 #ifdef NPP_DEBUG
@@ -373,7 +373,7 @@ static Cusers_logins ul;
         /* verify uagent */
 
         char sanuagent[NPP_DB_UAGENT_LEN+1];
-        npp_lib_escape_for_sql(sanuagent, G_connections[ci].uagent, NPP_DB_UAGENT_LEN);
+        npp_lib_escape_for_sql(sanuagent, G_connections[ci].cold->uagent, NPP_DB_UAGENT_LEN);
 
         if ( 0 != strcmp(sanuagent, ul.uagent) )
         {
@@ -492,7 +492,7 @@ void libusr_luses_close_timeouted()
 
     last_allowed = G_now - NPP_AUTH_SESSION_TIMEOUT;
 
-    for ( i=1; G_sessions_cnt>0 && i<=NPP_MAX_SESSIONS; ++i )
+    for ( i=1; G_sessions_cnt>0 && i<=G_maxSessions; ++i )
     {
         if ( G_sessions[i].sessid[0] && G_sessions[i].auth_level>AUTH_LEVEL_ANONYMOUS && G_sessions[i].last_activity < last_allowed )
             libusr_luses_downgrade(i, NPP_NOT_CONNECTED, FALSE);
@@ -515,7 +515,7 @@ void libusr_luses_save_csrft()
     {
 static Cusers_logins ul;
 
-        for ( i=1; sessions>0 && i<=NPP_MAX_SESSIONS; ++i )
+        for ( i=1; sessions>0 && i<=G_maxSessions; ++i )
         {
             if ( G_sessions[i].sessid[0] && G_sessions[i].auth_level>AUTH_LEVEL_ANONYMOUS )
             {
@@ -1531,7 +1531,7 @@ static bool first=TRUE;
 #endif
 
         char sanuagent[NPP_DB_UAGENT_LEN+1];
-        npp_lib_escape_for_sql(sanuagent, G_connections[ci].uagent, NPP_DB_UAGENT_LEN);
+        npp_lib_escape_for_sql(sanuagent, G_connections[ci].cold->uagent, NPP_DB_UAGENT_LEN);
 
 static Cusers_logins ul;
 
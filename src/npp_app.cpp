@@ -124,6 +124,9 @@ void npp_app_main(int ci)
 /* --------------------------------------------------------------------------------
    Called when application starts
    ------------------------------
+   With workers > 1 it runs once, before the worker processes
+   are forked -- they all inherit whatever it sets up
+   ------------------------------
    Return true if everything OK
    ------------------------------
    Returning false will stop booting process,
@@ -27,8 +27,10 @@
 
 #define NPP_HTTPS
 #define NPP_NO_HSTS
+//#define NPP_BROTLI
 
 //#define NPP_FD_MON_LINUX_POLL
+//#define NPP_FD_MON_LINUX_IO_URING
 //#define NPP_DEBUG
 
 